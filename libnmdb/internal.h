@@ -0,0 +1,181 @@
+
+#ifndef _INTERNAL_H
+#define _INTERNAL_H
+
+/* Different connection types. Used internally to differentiate between the
+ * different protocols in struct nmdb_srv. */
+#define TIPC_CONN 1
+#define TCP_CONN 2
+#define UDP_CONN 3
+#define SCTP_CONN 4
+#define UNIX_CONN 5
+#define SHM_CONN 6
+
+/* Request IDs are 28 bits long, and each server has its own sequence. */
+#define ID_MASK 0x0FFFFFFF
+
+/* Number of buckets in the hash table of pending requests. */
+#define PENDING_BUCKETS 256
+
+/* Size of the buffers used to receive replies, a bit over the usual max
+ * packet size (64kb). Replies carrying big values, which can only come over
+ * TCP and SCTP, are received in bigger buffers allocated on demand. */
+#define REPLY_BUF_SIZE (68 * 1024)
+
+/* For a given buffer, how much into it should the generic library code write
+ * the message contents. */
+#define TIPC_MSG_OFFSET 0
+#define TCP_MSG_OFFSET 4
+#define UDP_MSG_OFFSET 0
+#define SCTP_MSG_OFFSET 0
+#define UNIX_MSG_OFFSET 0
+#define SHM_MSG_OFFSET 0
+
+/* Defined to 0 or 1 at libnmdb build time according the build configuration,
+ * not to be used externally. */
+#define ENABLE_TIPC 0
+#define ENABLE_TCP 1
+#define ENABLE_UDP 1
+#define ENABLE_SCTP 0
+#define ENABLE_UNIX 1
+#define ENABLE_SHM 1
+
+/* Functions used internally but shared among the different files. */
+int compare_servers(const void *s1, const void *s2);
+ssize_t srecv(int fd, unsigned char *buf, size_t count, int flags);
+ssize_t ssend(int fd, const unsigned char *buf, size_t count, int flags);
+
+
+/*
+ * Server and connection internal types.
+ */
+
+#include <sys/types.h>		/* socket defines */
+#include <sys/socket.h>		/* socklen_t */
+#include <stdint.h>		/* uint32_t and friends */
+#include <poll.h>		/* struct pollfd */
+
+#if ENABLE_TIPC
+#include <linux/tipc.h>		/* struct sockaddr_tipc */
+#endif
+
+#if (ENABLE_TCP || ENABLE_UDP || ENABLE_SCTP)
+#include <netinet/in.h>		/* struct sockaddr_in */
+#endif
+
+#if (ENABLE_UNIX || ENABLE_SHM)
+#include <sys/un.h>		/* struct sockaddr_un */
+#endif
+
+/* A message waiting to be sent, in non-blocking mode. */
+struct nmdb_msg {
+	unsigned char *buf;
+	size_t len;
+	size_t sent;
+	struct nmdb_msg *next;
+};
+
+/* A connection to an nmdb server. */
+struct nmdb_srv {
+	int fd;
+	int type;
+	uint32_t next_id;
+
+	/* Used in non-blocking mode: the messages that couldn't be sent yet,
+	 * and the buffer for the replies, which is rsize bytes long and has
+	 * rlen bytes in it, the first rstart of which were already
+	 * processed. */
+	struct nmdb_msg *outq, *outq_last;
+	unsigned char *rbuf;
+	size_t rsize, rstart, rlen;
+
+	/* Buffer for the replies that don't fit in the usual ones; see
+	 * srv_big_buf(). */
+	unsigned char *bigbuf;
+	size_t bigsize;
+	union {
+
+#if ENABLE_TIPC
+		struct {
+			unsigned int port;
+			struct sockaddr_tipc srvsa;
+			socklen_t srvlen;
+		} tipc;
+#endif
+
+#if (ENABLE_TCP || ENABLE_UDP || ENABLE_SCTP)
+		struct {
+			struct sockaddr_in srvsa;
+			socklen_t srvlen;
+		} in;
+#endif
+
+#if ENABLE_UNIX
+		struct {
+			struct sockaddr_un srvsa;
+		} un;
+#endif
+
+#if ENABLE_SHM
+		struct {
+			struct sockaddr_un srvsa;
+			struct shm_area *area;
+			unsigned int spin_usec;
+		} shm;
+#endif
+
+	} info;
+};
+
+/* A request that was sent and may be waiting for its reply. Servers are
+ * identified by their fd, because the server array can be reordered. */
+struct nmdb_req {
+	uint32_t id;
+	int fd;
+	unsigned int request;
+	int done;
+	ssize_t result;
+
+	/* where to store the value (for gets) or the new value (for
+	 * increments), and the version of the value (for gets with
+	 * version) */
+	unsigned char *val;
+	size_t vsize;
+	int64_t *newval;
+	uint64_t *version;
+
+	/* called when the request is completed */
+	void (*cb)(struct nmdb_req *req, void *arg);
+	void *cb_arg;
+
+	struct nmdb_req *next;
+};
+
+/* A connection to one or many nmdb servers. */
+struct nmdb_conn {
+	unsigned int nservers;
+	struct nmdb_srv *servers;
+
+	/* requests waiting for a reply, hashed by ID */
+	struct nmdb_req *pending[PENDING_BUCKETS];
+	unsigned int npending;
+
+	/* buffer for the replies of pending requests */
+	unsigned char *rbuf;
+
+	/* used by nmdb_poll() */
+	struct pollfd *pfds;
+	unsigned int npfds;
+
+	/* set by nmdb_set_nonblock() */
+	int nonblock;
+};
+
+/* Initializes the state of a new server, used by the nmdb_add_*_server()
+ * functions. */
+void init_srv_state(struct nmdb_srv *srv);
+unsigned char *srv_big_buf(struct nmdb_srv *srv, size_t size);
+
+
+#endif
+
@@ -6,6 +6,8 @@
 #include <arpa/inet.h>		/* htonls() and friends */
 #include <string.h>		/* memcpy() */
 #include <unistd.h>		/* close() */
+#include <fcntl.h>		/* fcntl() */
+#include <errno.h>		/* errno */
 
 #include "nmdb.h"
 #include "internal.h"
@@ -14,6 +16,8 @@
 #include "tcp.h"
 #include "udp.h"
 #include "sctp.h"
+#include "unix.h"
+#include "shm.h"
 #include "netutils.h"
 
 
@@ -22,6 +26,9 @@
  * the internal net-const.h */
 #define NMDB_CACHE_ONLY 1
 #define NMDB_SYNC 2
+#define NMDB_BINARY 4
+#define NMDB_ASYNC 8
+#define NMDB_VALUES 16
 
 
 /* Compares two servers by their connection identifiers. It is used internally
@@ -74,6 +81,16 @@ int compare_servers(const void *s1, const void *s2)
 		}
 	}
 #endif
+#if ENABLE_UNIX
+	if (srv1->type == UNIX_CONN)
+		return strcmp(srv1->info.un.srvsa.sun_path,
+				srv2->info.un.srvsa.sun_path);
+#endif
+#if ENABLE_SHM
+	if (srv1->type == SHM_CONN)
+		return strcmp(srv1->info.shm.srvsa.sun_path,
+				srv2->info.shm.srvsa.sun_path);
+#endif
 
 	/* We should never get here */
 	return 0;
@@ -138,16 +155,76 @@ nmdb_t *nmdb_init(void)
 	db->servers = NULL;
 	db->nservers = 0;
 
+	memset(db->pending, 0, sizeof(db->pending));
+	db->npending = 0;
+	db->rbuf = NULL;
+	db->pfds = NULL;
+	db->npfds = 0;
+	db->nonblock = 0;
+
 	return db;
 }
 
+/* Initializes the state of a new server. */
+void init_srv_state(struct nmdb_srv *srv)
+{
+	srv->next_id = 1;
+	srv->outq = srv->outq_last = NULL;
+	srv->rbuf = NULL;
+	srv->rsize = srv->rstart = srv->rlen = 0;
+	srv->bigbuf = NULL;
+	srv->bigsize = 0;
+}
+
+/* Returns the server's buffer for big replies, making sure it's at least
+ * size bytes long. The contents are not preserved. Returns NULL if there was
+ * not enough memory. */
+unsigned char *srv_big_buf(struct nmdb_srv *srv, size_t size)
+{
+	if (srv->bigsize < size) {
+		free(srv->bigbuf);
+		srv->bigbuf = malloc(size);
+		srv->bigsize = srv->bigbuf ? size : 0;
+	}
+
+	return srv->bigbuf;
+}
+
+/* Frees the messages queued to be sent to the given server. */
+static void free_outq(struct nmdb_srv *srv)
+{
+	struct nmdb_msg *msg;
+
+	while (srv->outq != NULL) {
+		msg = srv->outq;
+		srv->outq = msg->next;
+		free(msg->buf);
+		free(msg);
+	}
+	srv->outq_last = NULL;
+}
+
+static int fail_pending(nmdb_t *db, int fd);
+
 /* Frees a nmdb_t structure created with nmdb_init(). */
 int nmdb_free(nmdb_t *db)
 {
+	/* requests still waiting for a reply are failed, the caller must
+	 * free them anyway */
+	fail_pending(db, -1);
+	free(db->rbuf);
+	free(db->pfds);
+
 	if (db->servers != NULL) {
 		int i;
-		for (i = 0; i < db->nservers; i++)
+		for (i = 0; i < db->nservers; i++) {
+			if (db->servers[i].type == SHM_CONN)
+				shm_srv_free(db->servers + i);
 			close(db->servers[i].fd);
+			free_outq(db->servers + i);
+			free(db->servers[i].rbuf);
+			free(db->servers[i].bigbuf);
+		}
 		free(db->servers);
 	}
 	free(db);
@@ -170,14 +247,18 @@ static int srv_send(struct nmdb_srv *srv,
 			return udp_srv_send(srv, buf, bsize);
 		case SCTP_CONN:
 			return sctp_srv_send(srv, buf, bsize);
+		case UNIX_CONN:
+			return unix_srv_send(srv, buf, bsize);
+		case SHM_CONN:
+			return shm_srv_send(srv, buf, bsize);
 		default:
 			return 0;
 	}
 }
 
-/* Gets a reply from the given server. */
-static uint32_t get_rep(struct nmdb_srv *srv,
-		unsigned char *buf, size_t bsize,
+/* Gets a reply from the given server, storing its ID in id. */
+static uint32_t srv_get_rep(struct nmdb_srv *srv,
+		unsigned char *buf, size_t bsize, uint32_t *id,
 		unsigned char **payload, size_t *psize)
 {
 	if (srv == NULL)
@@ -185,16 +266,71 @@ static uint32_t get_rep(struct nmdb_srv *srv,
 
 	switch (srv->type) {
 		case TIPC_CONN:
-			return tipc_get_rep(srv, buf, bsize, payload, psize);
+			return tipc_get_rep(srv, buf, bsize, id, payload,
+					psize);
 		case TCP_CONN:
-			return tcp_get_rep(srv, buf, bsize, payload, psize);
+			return tcp_get_rep(srv, buf, bsize, id, payload, psize);
 		case UDP_CONN:
-			return udp_get_rep(srv, buf, bsize, payload, psize);
+			return udp_get_rep(srv, buf, bsize, id, payload, psize);
 		case SCTP_CONN:
-			return sctp_get_rep(srv, buf, bsize, payload, psize);
+			return sctp_get_rep(srv, buf, bsize, id, payload,
+					psize);
+		case UNIX_CONN:
+			return unix_get_rep(srv, buf, bsize, id, payload,
+					psize);
+		case SHM_CONN:
+			return shm_get_rep(srv, buf, bsize, id, payload,
+					psize);
 		default:
-			return 0;
+			return -1;
+	}
+}
+
+/* Tries to send (the rest of) a message to the given server without
+ * blocking, sent being the number of bytes that were already sent. Returns
+ * how many bytes were sent so far, or -1 on error. */
+static ssize_t srv_send_nb(struct nmdb_srv *srv,
+		unsigned char *buf, size_t bsize, size_t sent)
+{
+	if (srv->type == TCP_CONN)
+		return tcp_srv_send_nb(srv, buf, bsize, sent);
+
+	/* the other protocols are message oriented, and the socket is
+	 * non-blocking, so the message is either entirely sent or not at
+	 * all */
+	errno = 0;
+	if (srv_send(srv, buf, bsize))
+		return bsize;
+	else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return 0;
+	return -1;
+}
+
+/* Gets a reply from the given server without blocking, using the server's
+ * reply buffer. Returns 0 if there is no complete reply available. */
+static uint32_t srv_get_rep_nb(struct nmdb_srv *srv, uint32_t *id,
+		unsigned char **payload, size_t *psize)
+{
+	uint32_t reply;
+
+	if (srv->rbuf == NULL) {
+		srv->rbuf = malloc(REPLY_BUF_SIZE);
+		if (srv->rbuf == NULL)
+			return -1;
+		srv->rsize = REPLY_BUF_SIZE;
 	}
+
+	if (srv->type == TCP_CONN)
+		return tcp_get_rep_nb(srv, id, payload, psize);
+	else if (srv->type == SHM_CONN)
+		return shm_get_rep_nb(srv, id, payload, psize);
+
+	errno = 0;
+	reply = srv_get_rep(srv, srv->rbuf, REPLY_BUF_SIZE, id, payload,
+			psize);
+	if (reply == (uint32_t) -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	return reply;
 }
 
 /* When a packet arrives, the message it contains begins on a
@@ -214,6 +350,10 @@ static int srv_get_msg_offset(struct nmdb_srv *srv)
 			return UDP_MSG_OFFSET;
 		case SCTP_CONN:
 			return SCTP_MSG_OFFSET;
+		case UNIX_CONN:
+			return UNIX_MSG_OFFSET;
+		case SHM_CONN:
+			return SHM_MSG_OFFSET;
 		default:
 			return 0;
 	}
@@ -252,10 +392,29 @@ static struct nmdb_srv *select_srv(nmdb_t *db,
 	return &(db->servers[n]);
 }
 
-/* Creates a new buffer for packets. */
+/* Returns a new request ID for the given server. */
+static uint32_t new_id(struct nmdb_srv *srv)
+{
+	uint32_t id;
+
+	if (srv == NULL)
+		return 0;
+
+	/* 0 is never used, so it can't match a stale reply from an
+	 * uninitialized request */
+	id = srv->next_id;
+	srv->next_id = (srv->next_id + 1) & ID_MASK;
+	if (srv->next_id == 0)
+		srv->next_id = 1;
+
+	return id;
+}
+
+/* Creates a new buffer for packets, with a new request ID that is stored in
+ * id. */
 static unsigned char *new_packet(struct nmdb_srv *srv, unsigned int request,
 		unsigned short flags, size_t *bufsize, size_t *payload_offset,
-		ssize_t payload_size)
+		ssize_t payload_size, uint32_t *id)
 {
 	unsigned char *buf, *p;
 	unsigned int moff = srv_get_msg_offset(srv);
@@ -264,7 +423,7 @@ static unsigned char *new_packet(struct nmdb_srv *srv, unsigned int request,
 		/* Because our callers will reuse the buffer to get the reply,
 		 * and we don't know how big it will be, we just alloc a bit
 		 * over the max packet (64kb) */
-		*bufsize = 68 * 1024;
+		*bufsize = REPLY_BUF_SIZE;
 	} else {
 		/* 8 is the size of the common header */
 		*bufsize = moff + 8 + payload_size;
@@ -275,7 +434,8 @@ static unsigned char *new_packet(struct nmdb_srv *srv, unsigned int request,
 
 	p = buf + moff;
 
-	* (uint32_t *) p = htonl( (PROTO_VER << 28) | ID_CODE );
+	*id = new_id(srv);
+	* (uint32_t *) p = htonl( (PROTO_VER << 28) | *id );
 	* ((uint16_t *) p + 2) = htons(request);
 	* ((uint16_t *) p + 3) = htons(flags);
 
@@ -322,251 +482,722 @@ static size_t append_3v(unsigned char *buf,
 }
 
 
-/* Functions to perform a get. */
-static ssize_t do_get(nmdb_t *db,
-		const unsigned char *key, size_t ksize,
-		unsigned char *val, size_t vsize, unsigned short flags)
+/*
+ * Request tracking.
+ *
+ * Every request gets an ID from its server's sequence, and is kept in the
+ * pending table until its reply arrives. Replies can come in any order, so
+ * whenever we read one we look up the request it belongs to and complete it.
+ * The synchronous functions are just a request that is waited for right
+ * away, so they can be freely mixed with the asynchronous ones.
+ */
+
+/* Returns the server with the given fd, or NULL if there is none. */
+static struct nmdb_srv *find_srv(nmdb_t *db, int fd)
 {
-	ssize_t rv, t;
-	unsigned char *buf, *p;
-	size_t bufsize, reqsize, payload_offset, psize = 0;
-	uint32_t reply;
-	struct nmdb_srv *srv;
-
-	flags = flags & NMDB_CACHE_ONLY;
-
-	srv = select_srv(db, key, ksize);
-	buf = new_packet(srv, REQ_GET, flags, &bufsize, &payload_offset, -1);
-	if (buf == NULL)
-		return -1;
-	reqsize = payload_offset;
-	reqsize += append_1v(buf + payload_offset, key, ksize);
-
-	t = srv_send(srv, buf, reqsize);
-	if (t <= 0) {
-		rv = -2;
-		goto exit;
-	}
+	unsigned int i;
 
-	reply = get_rep(srv, buf, bufsize, &p, &psize);
+	for (i = 0; i < db->nservers; i++)
+		if (db->servers[i].fd == fd)
+			return db->servers + i;
+	return NULL;
+}
 
-	if (reply == REP_CACHE_MISS || reply == REP_NOTIN) {
-		rv = -1;
-		goto exit;
-	} else if (reply == REP_ERR) {
-		rv = -2;
-		goto exit;
-	} else if (reply != REP_OK && reply != REP_CACHE_HIT) {
-		/* invalid response */
-		rv = -2;
-		goto exit;
-	}
+static void init_req(struct nmdb_req *req, struct nmdb_srv *srv,
+		unsigned int request, unsigned char *val, size_t vsize,
+		int64_t *newval)
+{
+	req->id = 0;
+	req->fd = srv != NULL ? srv->fd : -1;
+	req->request = request;
+	req->done = 0;
+	req->result = 0;
+	req->val = val;
+	req->vsize = vsize;
+	req->newval = newval;
+	req->version = NULL;
+	req->cb = NULL;
+	req->cb_arg = NULL;
+	req->next = NULL;
+}
 
-	/* we've got an answer (either REP_OK or REP_CACHE_HIT) */
-	rv = * (uint32_t *) p;
-	rv = ntohl(rv);
-	if (rv > (psize - 4) || rv > vsize) {
-		/* the value is too big for the packet size, or it is too big
-		 * to fit in the buffer we were given */
-		rv = -2;
-		goto exit;
-	}
-	memcpy(val, p + 4, rv);
+static void add_pending(nmdb_t *db, struct nmdb_req *req)
+{
+	struct nmdb_req **bucket;
 
-exit:
-	free(buf);
-	return rv;
+	bucket = db->pending + (req->id % PENDING_BUCKETS);
+	req->next = *bucket;
+	*bucket = req;
+	db->npending++;
 }
 
-ssize_t nmdb_get(nmdb_t *db, const unsigned char *key, size_t ksize,
-		unsigned char *val, size_t vsize)
+/* Removes the request with the given server and ID from the pending table,
+ * and returns it; returns NULL if there is none. */
+static struct nmdb_req *take_pending(nmdb_t *db, int fd, uint32_t id)
 {
-	return do_get(db, key, ksize, val, vsize, 0);
+	struct nmdb_req **p, *req;
+
+	for (p = db->pending + (id % PENDING_BUCKETS); *p; p = &(*p)->next) {
+		if ((*p)->id == id && (*p)->fd == fd) {
+			req = *p;
+			*p = req->next;
+			req->next = NULL;
+			db->npending--;
+			return req;
+		}
+	}
+
+	return NULL;
 }
 
-ssize_t nmdb_cache_get(nmdb_t *db, const unsigned char *key, size_t ksize,
-		unsigned char *val, size_t vsize)
+/* Completes a request with the given reply, which is -1 if it couldn't be
+ * sent or its reply couldn't be read. The results are the ones documented
+ * for the synchronous functions. */
+static void complete_req(struct nmdb_req *req, uint32_t reply,
+		const unsigned char *p, size_t psize)
 {
-	return do_get(db, key, ksize, val, vsize, NMDB_CACHE_ONLY);
-}
+	ssize_t rv;
+
+	switch (req->request) {
+		case REQ_GET:
+			if (reply == REP_CACHE_MISS || reply == REP_NOTIN) {
+				rv = -1;
+				break;
+			} else if ((reply != REP_OK && reply != REP_CACHE_HIT)
+					|| psize < 4) {
+				/* REP_ERR or invalid response */
+				rv = -2;
+				break;
+			}
 
+			rv = ntohl(* (uint32_t *) p);
+			if ((size_t) rv > psize - 4 || (size_t) rv > req->vsize) {
+				/* the value is too big for the packet size,
+				 * or it is too big to fit in the buffer we
+				 * were given */
+				rv = -2;
+				break;
+			}
+			memcpy(req->val, p + 4, rv);
+			break;
 
-/* Functions to perform a set. */
-static int do_set(nmdb_t *db, const unsigned char *key, size_t ksize,
-		const unsigned char *val, size_t vsize,
-		unsigned short flags)
-{
-	ssize_t rv, t;
-	unsigned char *buf;
-	size_t bufsize, payload_offset, reqsize;
-	uint32_t reply;
-	struct nmdb_srv *srv;
+		case REQ_GETS:
+			if (reply == REP_CACHE_MISS || reply == REP_NOTIN) {
+				rv = -1;
+				break;
+			} else if ((reply != REP_OK && reply != REP_CACHE_HIT)
+					|| psize < 4 + sizeof(uint64_t)) {
+				rv = -2;
+				break;
+			}
 
-	flags = flags & (NMDB_CACHE_ONLY | NMDB_SYNC);
+			/* like REQ_GET, but the value comes after the version
+			 * token */
+			rv = ntohl(* (uint32_t *) p);
+			if ((size_t) rv > psize - 4
+					|| (size_t) rv < sizeof(uint64_t)
+					|| (size_t) rv - sizeof(uint64_t)
+						> req->vsize) {
+				rv = -2;
+				break;
+			}
+			rv -= sizeof(uint64_t);
+			if (req->version != NULL) {
+				memcpy(req->version, p + 4, sizeof(uint64_t));
+				*req->version = ntohll(*req->version);
+			}
+			memcpy(req->val, p + 4 + sizeof(uint64_t), rv);
+			break;
 
-	srv = select_srv(db, key, ksize);
+		case REQ_SET:
+			rv = reply == REP_OK ? 1 : -1;
+			break;
 
-	buf = new_packet(srv, REQ_SET, flags, &bufsize, &payload_offset,
-			4 * 2 + ksize + vsize);
-	if (buf == NULL)
-		return -1;
-	reqsize = payload_offset;
-	reqsize += append_2v(buf + payload_offset, key, ksize, val, vsize);
+		case REQ_DEL:
+			if (reply == REP_OK)
+				rv = 1;
+			else if (reply == REP_NOTIN)
+				rv = 0;
+			else
+				rv = -1;
+			break;
 
-	t = srv_send(srv, buf, reqsize);
-	if (t <= 0) {
-		rv = -1;
-		goto exit;
-	}
+		case REQ_CAS:
+		case REQ_CAS_VERSION:
+		case REQ_INCR:
+		case REQ_APPEND:
+		case REQ_PREPEND:
+			if (reply == REP_OK)
+				rv = 2;
+			else if (reply == REP_NOMATCH)
+				rv = 1;
+			else if (reply == REP_NOTIN)
+				rv = 0;
+			else
+				rv = -1;
 
-	reply = get_rep(srv, buf, bufsize, NULL, NULL);
+			/* asynchronous increments don't get the new value */
+			if (rv == 2 && req->newval != NULL
+					&& psize == 4 + sizeof(int64_t)) {
+				/* skip the 4 bytes of length */
+				*req->newval = ntohll(* (int64_t *) (p + 4));
+			}
+			break;
 
-	if (reply == REP_OK) {
-		rv = 1;
-		goto exit;
+		default:
+			rv = -1;
+			break;
 	}
 
-	/* REP_ERR or invalid response */
-	rv = -1;
-
-exit:
-	free(buf);
-	return rv;
+	req->result = rv;
+	req->done = 1;
 
+	/* this must be the last thing we do, as the callback can free the
+	 * request */
+	if (req->cb != NULL)
+		req->cb(req, req->cb_arg);
 }
 
-int nmdb_set(nmdb_t *db, const unsigned char *key, size_t ksize,
-		const unsigned char *val, size_t vsize)
+/* Fails all the pending requests sent to the server with the given fd; used
+ * when we can't read its replies anymore. Returns how many were failed. */
+static int fail_pending(nmdb_t *db, int fd)
 {
-	return do_set(db, key, ksize, val, vsize, 0);
-}
+	int n = 0;
+	unsigned int i;
+	struct nmdb_req **p, *req;
+
+	for (i = 0; i < PENDING_BUCKETS; i++) {
+		p = db->pending + i;
+		while (*p != NULL) {
+			if (fd != -1 && (*p)->fd != fd) {
+				p = &(*p)->next;
+				continue;
+			}
 
-int nmdb_set_sync(nmdb_t *db, const unsigned char *key, size_t ksize,
-		const unsigned char *val, size_t vsize)
-{
-	return do_set(db, key, ksize, val, vsize, NMDB_SYNC);
+			req = *p;
+			*p = req->next;
+			req->next = NULL;
+			db->npending--;
+			complete_req(req, -1, NULL, 0);
+			n++;
+		}
+	}
+
+	return n;
 }
 
-int nmdb_cache_set(nmdb_t *db, const unsigned char *key, size_t ksize,
-		const unsigned char *val, size_t vsize)
+/* Sends the queued messages of the given server, as much as possible
+ * without blocking. Returns 1 if the queue was emptied, 0 if not, or -1 on
+ * error, in which case the server's pending requests are failed. */
+static int flush_srv(nmdb_t *db, struct nmdb_srv *srv)
 {
-	return do_set(db, key, ksize, val, vsize, NMDB_CACHE_ONLY);
-}
+	ssize_t t;
+	struct nmdb_msg *msg;
+
+	while (srv->outq != NULL) {
+		msg = srv->outq;
+		t = srv_send_nb(srv, msg->buf, msg->len, msg->sent);
+		if (t < 0) {
+			free_outq(srv);
+			fail_pending(db, srv->fd);
+			return -1;
+		}
 
+		msg->sent = t;
+		if (msg->sent < msg->len)
+			return 0;
 
-/* Functions to perform a del. */
-static int do_del(nmdb_t *db, const unsigned char *key, size_t ksize,
-		unsigned short flags)
-{
-	ssize_t rv, t;
-	unsigned char *buf;
-	size_t bufsize, payload_offset, reqsize;
-	uint32_t reply;
-	struct nmdb_srv *srv;
+		srv->outq = msg->next;
+		if (srv->outq == NULL)
+			srv->outq_last = NULL;
+		free(msg->buf);
+		free(msg);
+	}
 
-	flags = flags & (NMDB_CACHE_ONLY | NMDB_SYNC);
+	return 1;
+}
 
-	srv = select_srv(db, key, ksize);
+/* Sends a packet to the given server. In non-blocking mode, what can't be
+ * sent right away is copied to the server's queue, and sent when the socket
+ * allows it. Returns 1 on success, or 0 on error. */
+static int send_packet(nmdb_t *db, struct nmdb_srv *srv,
+		unsigned char *buf, size_t bsize)
+{
+	ssize_t sent = 0;
+	struct nmdb_msg *msg;
 
-	buf = new_packet(srv, REQ_DEL, flags, &bufsize, &payload_offset,
-			4 + ksize);
-	if (buf == NULL)
-		return -1;
-	reqsize = payload_offset;
-	reqsize += append_1v(buf + payload_offset, key, ksize);
+	if (!db->nonblock || srv == NULL)
+		return srv_send(srv, buf, bsize);
 
-	t = srv_send(srv, buf, reqsize);
-	if (t <= 0) {
-		rv = -1;
-		goto exit;
+	/* The queue entry is allocated before sending anything: if we ran
+	 * out of memory after sending part of the message, the rest of the
+	 * stream would be out of sync */
+	msg = malloc(sizeof(struct nmdb_msg));
+	if (msg == NULL)
+		return 0;
+	msg->buf = malloc(bsize);
+	if (msg->buf == NULL) {
+		free(msg);
+		return 0;
 	}
 
-	reply = get_rep(srv, buf, bufsize, NULL, NULL);
-
-	if (reply == REP_OK) {
-		rv = 1;
-		goto exit;
-	} else if (reply == REP_NOTIN) {
-		rv = 0;
-		goto exit;
+	/* if there are messages queued, this one has to wait its turn */
+	if (srv->outq == NULL) {
+		sent = srv_send_nb(srv, buf, bsize, 0);
+		if (sent < 0 || sent == bsize) {
+			free(msg->buf);
+			free(msg);
+			return sent < 0 ? 0 : 1;
+		}
 	}
 
-	/* REP_ERR or invalid response */
-	rv = -1;
+	memcpy(msg->buf, buf, bsize);
+	msg->len = bsize;
+	msg->sent = sent;
+	msg->next = NULL;
 
-exit:
-	free(buf);
-	return rv;
+	if (srv->outq_last == NULL)
+		srv->outq = msg;
+	else
+		srv->outq_last->next = msg;
+	srv->outq_last = msg;
 
+	return 1;
 }
 
-int nmdb_del(nmdb_t *db, const unsigned char *key, size_t ksize)
+/* Sends the packet of a request to the given server and frees it. If it
+ * can't be sent the request fails right away, otherwise it's added to the
+ * pending ones. */
+static void send_req(nmdb_t *db, struct nmdb_srv *srv, struct nmdb_req *req,
+		unsigned char *buf, size_t bsize)
 {
-	return do_del(db, key, ksize, 0);
-}
+	ssize_t t;
 
-int nmdb_del_sync(nmdb_t *db, const unsigned char *key, size_t ksize)
-{
-	return do_del(db, key, ksize, NMDB_SYNC);
+	t = send_packet(db, srv, buf, bsize);
+	free(buf);
+
+	if (t <= 0)
+		complete_req(req, -1, NULL, 0);
+	else
+		add_pending(db, req);
 }
 
-int nmdb_cache_del(nmdb_t *db, const unsigned char *key, size_t ksize)
+/* Returns the connection's reply buffer, allocating it if needed. */
+static unsigned char *get_rbuf(nmdb_t *db)
 {
-	return do_del(db, key, ksize, NMDB_CACHE_ONLY);
+	if (db->rbuf == NULL)
+		db->rbuf = malloc(REPLY_BUF_SIZE);
+	return db->rbuf;
 }
 
-
-/* Functions to perform a CAS. */
-static int do_cas(nmdb_t *db, const unsigned char *key, size_t ksize,
-		const unsigned char *oldval, size_t ovsize,
-		const unsigned char *newval, size_t nvsize,
-		unsigned short flags)
+/* Reads replies from the given server and completes the pending requests
+ * they belong to: a single one in blocking mode (plus the ones that were
+ * already received along with it over TCP, which poll() would not tell us
+ * about), or all the available ones in non-blocking mode. Replies that don't
+ * belong to any request (like the ones of requests freed before completion)
+ * are ignored. Returns the number of requests that were completed, or -1 on
+ * error. */
+static int read_rep(nmdb_t *db, struct nmdb_srv *srv)
 {
-	ssize_t rv, t;
-	unsigned char *buf;
-	size_t bufsize, payload_offset, reqsize;
-	uint32_t reply;
-	struct nmdb_srv *srv;
+	int n = 0;
+	uint32_t reply, id;
+	unsigned char *p;
+	size_t psize = 0;
+	struct nmdb_req *req;
+
+	do {
+		if (db->nonblock) {
+			reply = srv_get_rep_nb(srv, &id, &p, &psize);
+			if (reply == 0)
+				break;
+		} else {
+			if (get_rbuf(db) == NULL)
+				return -1;
+			reply = srv_get_rep(srv, db->rbuf, REPLY_BUF_SIZE, &id,
+					&p, &psize);
+		}
 
-	flags = flags & NMDB_CACHE_ONLY;
+		if (reply == (uint32_t) -1) {
+			fail_pending(db, srv->fd);
+			return -1;
+		}
 
-	srv = select_srv(db, key, ksize);
+		req = take_pending(db, srv->fd, id);
+		if (req != NULL) {
+			complete_req(req, reply, p, psize);
+			n++;
+		}
+	} while (db->nonblock || (srv->type == TCP_CONN && tcp_has_rep(srv)));
 
-	buf = new_packet(srv, REQ_CAS, flags, &bufsize, &payload_offset,
-			4 * 3 + ksize + ovsize + nvsize);
-	if (buf == NULL)
-		return -1;
-	reqsize = payload_offset;
-	reqsize += append_3v(buf + payload_offset, key, ksize, oldval, ovsize,
-			newval, nvsize);
+	return n;
+}
 
-	t = srv_send(srv, buf, reqsize);
-	if (t <= 0) {
-		rv = -1;
-		goto exit;
+/* Handles the given poll() events of a server: sends the queued messages if
+ * it's writable, and reads the replies if it's readable. Returns the number
+ * of requests completed, or -1 on error. */
+static int handle_srv(nmdb_t *db, struct nmdb_srv *srv, short revents)
+{
+	if ((revents & POLLOUT) && srv->outq != NULL) {
+		if (flush_srv(db, srv) < 0)
+			return -1;
 	}
 
-	reply = get_rep(srv, buf, bufsize, NULL, NULL);
+	if (revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL))
+		return read_rep(db, srv);
 
-	if (reply == REP_OK) {
-		rv = 2;
-		goto exit;
-	} else if (reply == REP_NOMATCH) {
-		rv = 1;
-		goto exit;
-	} else if (reply == REP_NOTIN) {
-		rv = 0;
-		goto exit;
-	}
+	return 0;
+}
 
-	/* REP_ERR or invalid response */
-	rv = -1;
+/* Waits until there is something to read from the given server, sending its
+ * queued messages in the meantime. Used in non-blocking mode. Returns -1 on
+ * error, in which case the server's pending requests are failed. */
+static int wait_srv(nmdb_t *db, struct nmdb_srv *srv)
+{
+	int rv;
+	struct pollfd pfd;
+
+	pfd.fd = srv->fd;
+	for (;;) {
+		/* replies over shared memory don't always make the socket
+		 * readable, see shm_srv_sleep() */
+		if (srv->type == SHM_CONN && shm_srv_sleep(srv))
+			return 1;
 
-exit:
-	free(buf);
-	return rv;
+		pfd.events = POLLIN;
+		if (srv->outq != NULL)
+			pfd.events |= POLLOUT;
 
-}
+		rv = poll(&pfd, 1, -1);
+		if (rv < 0 && errno != EINTR) {
+			fail_pending(db, srv->fd);
+			return -1;
+		} else if (rv <= 0) {
+			continue;
+		}
+
+		if ((pfd.revents & POLLOUT) && flush_srv(db, srv) < 0)
+			return -1;
+
+		if (pfd.revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL))
+			return 1;
+	}
+}
+
+/* Waits until the given request is completed, and returns its result. */
+static ssize_t wait_req(nmdb_t *db, struct nmdb_req *req)
+{
+	struct nmdb_srv *srv;
+
+	while (!req->done) {
+		srv = find_srv(db, req->fd);
+		if (srv == NULL) {
+			take_pending(db, req->fd, req->id);
+			complete_req(req, -1, NULL, 0);
+			break;
+		}
+
+		if (db->nonblock && wait_srv(db, srv) < 0)
+			continue;
+		read_rep(db, srv);
+	}
+
+	return req->result;
+}
+
+/* Gets the reply to the request with the given ID from the given server, for
+ * the requests that are not tracked in the pending table. Replies to pending
+ * requests that arrive in the meantime are processed. */
+static uint32_t get_rep(nmdb_t *db, struct nmdb_srv *srv, uint32_t id,
+		unsigned char *buf, size_t bsize,
+		unsigned char **payload, size_t *psize)
+{
+	uint32_t reply, rid;
+	unsigned char *p;
+	size_t ps = 0;
+	struct nmdb_req *req;
+
+	for (;;) {
+		if (db->nonblock) {
+			/* the payload will be in the server's buffer, which
+			 * is fine because it's left alone until the next
+			 * read */
+			reply = srv_get_rep_nb(srv, &rid, &p, &ps);
+			if (reply == 0) {
+				if (wait_srv(db, srv) < 0)
+					return -1;
+				continue;
+			}
+		} else {
+			reply = srv_get_rep(srv, buf, bsize, &rid, &p, &ps);
+		}
+
+		if (reply == (uint32_t) -1) {
+			fail_pending(db, srv->fd);
+			return -1;
+		}
+
+		if (rid == id)
+			break;
+
+		req = take_pending(db, srv->fd, rid);
+		if (req != NULL)
+			complete_req(req, reply, p, ps);
+	}
+
+	if (payload != NULL) {
+		*payload = p;
+		*psize = ps;
+	}
+	return reply;
+}
+
+
+/* Functions to perform a get. */
+static void send_get(nmdb_t *db, struct nmdb_req *req,
+		const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize, unsigned short flags)
+{
+	unsigned char *buf;
+	size_t bufsize, payload_offset, reqsize;
+	struct nmdb_srv *srv;
+
+	flags = flags & NMDB_CACHE_ONLY;
+
+	srv = select_srv(db, key, ksize);
+	init_req(req, srv, REQ_GET, val, vsize, NULL);
+
+	buf = new_packet(srv, REQ_GET, flags, &bufsize, &payload_offset,
+			4 + ksize, &req->id);
+	if (buf == NULL) {
+		complete_req(req, -1, NULL, 0);
+		return;
+	}
+	reqsize = payload_offset;
+	reqsize += append_1v(buf + payload_offset, key, ksize);
+
+	send_req(db, srv, req, buf, reqsize);
+}
+
+static ssize_t do_get(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize, unsigned short flags)
+{
+	struct nmdb_req req;
+
+	send_get(db, &req, key, ksize, val, vsize, flags);
+	return wait_req(db, &req);
+}
+
+ssize_t nmdb_get(nmdb_t *db, const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize)
+{
+	return do_get(db, key, ksize, val, vsize, 0);
+}
+
+ssize_t nmdb_cache_get(nmdb_t *db, const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize)
+{
+	return do_get(db, key, ksize, val, vsize, NMDB_CACHE_ONLY);
+}
+
+
+/* Functions to perform a get with the value's version. */
+static void send_gets(nmdb_t *db, struct nmdb_req *req,
+		const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize, uint64_t *version,
+		unsigned short flags)
+{
+	unsigned char *buf;
+	size_t bufsize, payload_offset, reqsize;
+	struct nmdb_srv *srv;
+
+	flags = flags & NMDB_CACHE_ONLY;
+
+	srv = select_srv(db, key, ksize);
+	init_req(req, srv, REQ_GETS, val, vsize, NULL);
+	req->version = version;
+
+	buf = new_packet(srv, REQ_GETS, flags, &bufsize, &payload_offset,
+			4 + ksize, &req->id);
+	if (buf == NULL) {
+		complete_req(req, -1, NULL, 0);
+		return;
+	}
+	reqsize = payload_offset;
+	reqsize += append_1v(buf + payload_offset, key, ksize);
+
+	send_req(db, srv, req, buf, reqsize);
+}
+
+static ssize_t do_gets(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize, uint64_t *version,
+		unsigned short flags)
+{
+	struct nmdb_req req;
+
+	send_gets(db, &req, key, ksize, val, vsize, version, flags);
+	return wait_req(db, &req);
+}
+
+ssize_t nmdb_gets(nmdb_t *db, const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize, uint64_t *version)
+{
+	return do_gets(db, key, ksize, val, vsize, version, 0);
+}
+
+ssize_t nmdb_cache_gets(nmdb_t *db, const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize, uint64_t *version)
+{
+	return do_gets(db, key, ksize, val, vsize, version, NMDB_CACHE_ONLY);
+}
+
+
+/* Functions to perform a set. */
+static void send_set(nmdb_t *db, struct nmdb_req *req,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize,
+		unsigned short flags)
+{
+	unsigned char *buf;
+	size_t bufsize, payload_offset, reqsize;
+	struct nmdb_srv *srv;
+
+	flags = flags & (NMDB_CACHE_ONLY | NMDB_SYNC);
+
+	srv = select_srv(db, key, ksize);
+	init_req(req, srv, REQ_SET, NULL, 0, NULL);
+
+	buf = new_packet(srv, REQ_SET, flags, &bufsize, &payload_offset,
+			4 * 2 + ksize + vsize, &req->id);
+	if (buf == NULL) {
+		complete_req(req, -1, NULL, 0);
+		return;
+	}
+	reqsize = payload_offset;
+	reqsize += append_2v(buf + payload_offset, key, ksize, val, vsize);
+
+	send_req(db, srv, req, buf, reqsize);
+}
+
+static int do_set(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize,
+		unsigned short flags)
+{
+	struct nmdb_req req;
+
+	send_set(db, &req, key, ksize, val, vsize, flags);
+	return wait_req(db, &req);
+}
+
+int nmdb_set(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize)
+{
+	return do_set(db, key, ksize, val, vsize, 0);
+}
+
+int nmdb_set_sync(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize)
+{
+	return do_set(db, key, ksize, val, vsize, NMDB_SYNC);
+}
+
+int nmdb_cache_set(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize)
+{
+	return do_set(db, key, ksize, val, vsize, NMDB_CACHE_ONLY);
+}
+
+
+/* Functions to perform a del. */
+static void send_del(nmdb_t *db, struct nmdb_req *req,
+		const unsigned char *key, size_t ksize, unsigned short flags)
+{
+	unsigned char *buf;
+	size_t bufsize, payload_offset, reqsize;
+	struct nmdb_srv *srv;
+
+	flags = flags & (NMDB_CACHE_ONLY | NMDB_SYNC);
+
+	srv = select_srv(db, key, ksize);
+	init_req(req, srv, REQ_DEL, NULL, 0, NULL);
+
+	buf = new_packet(srv, REQ_DEL, flags, &bufsize, &payload_offset,
+			4 + ksize, &req->id);
+	if (buf == NULL) {
+		complete_req(req, -1, NULL, 0);
+		return;
+	}
+	reqsize = payload_offset;
+	reqsize += append_1v(buf + payload_offset, key, ksize);
+
+	send_req(db, srv, req, buf, reqsize);
+}
+
+static int do_del(nmdb_t *db, const unsigned char *key, size_t ksize,
+		unsigned short flags)
+{
+	struct nmdb_req req;
+
+	send_del(db, &req, key, ksize, flags);
+	return wait_req(db, &req);
+}
+
+int nmdb_del(nmdb_t *db, const unsigned char *key, size_t ksize)
+{
+	return do_del(db, key, ksize, 0);
+}
+
+int nmdb_del_sync(nmdb_t *db, const unsigned char *key, size_t ksize)
+{
+	return do_del(db, key, ksize, NMDB_SYNC);
+}
+
+int nmdb_cache_del(nmdb_t *db, const unsigned char *key, size_t ksize)
+{
+	return do_del(db, key, ksize, NMDB_CACHE_ONLY);
+}
+
+
+/* Functions to perform a CAS. */
+static void send_cas(nmdb_t *db, struct nmdb_req *req,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *oldval, size_t ovsize,
+		const unsigned char *newval, size_t nvsize,
+		unsigned short flags)
+{
+	unsigned char *buf;
+	size_t bufsize, payload_offset, reqsize;
+	struct nmdb_srv *srv;
+
+	flags = flags & NMDB_CACHE_ONLY;
+
+	srv = select_srv(db, key, ksize);
+	init_req(req, srv, REQ_CAS, NULL, 0, NULL);
+
+	buf = new_packet(srv, REQ_CAS, flags, &bufsize, &payload_offset,
+			4 * 3 + ksize + ovsize + nvsize, &req->id);
+	if (buf == NULL) {
+		complete_req(req, -1, NULL, 0);
+		return;
+	}
+	reqsize = payload_offset;
+	reqsize += append_3v(buf + payload_offset, key, ksize, oldval, ovsize,
+			newval, nvsize);
+
+	send_req(db, srv, req, buf, reqsize);
+}
+
+static int do_cas(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *oldval, size_t ovsize,
+		const unsigned char *newval, size_t nvsize,
+		unsigned short flags)
+{
+	struct nmdb_req req;
+
+	send_cas(db, &req, key, ksize, oldval, ovsize, newval, nvsize, flags);
+	return wait_req(db, &req);
+}
 
 int nmdb_cas(nmdb_t *db, const unsigned char *key, size_t ksize,
 		const unsigned char *oldval, size_t ovsize,
@@ -584,76 +1215,907 @@ int nmdb_cache_cas(nmdb_t *db, const unsigned char *key, size_t ksize,
 }
 
 
-/* Functions to perform an atomic increment. */
-static int do_incr(nmdb_t *db, const unsigned char *key, size_t ksize,
-		int64_t increment, int64_t *newval, unsigned short flags)
+/* Functions to perform a CAS using the version of the old value. */
+static void send_cas_version(nmdb_t *db, struct nmdb_req *req,
+		const unsigned char *key, size_t ksize, uint64_t version,
+		const unsigned char *newval, size_t nvsize,
+		unsigned short flags)
 {
-	ssize_t rv, t;
-	unsigned char *buf, *payload;
-	size_t bufsize, payload_offset, reqsize, psize;
-	uint32_t reply;
+	unsigned char *buf;
+	size_t bufsize, payload_offset, reqsize;
+	uint32_t t;
 	struct nmdb_srv *srv;
 
 	flags = flags & NMDB_CACHE_ONLY;
 
 	srv = select_srv(db, key, ksize);
+	init_req(req, srv, REQ_CAS_VERSION, NULL, 0, NULL);
+
+	buf = new_packet(srv, REQ_CAS_VERSION, flags, &bufsize,
+			&payload_offset,
+			4 * 2 + sizeof(version) + ksize + nvsize, &req->id);
+	if (buf == NULL) {
+		complete_req(req, -1, NULL, 0);
+		return;
+	}
+	reqsize = payload_offset;
 
-	increment = htonll(increment);
+	t = htonl(ksize);
+	memcpy(buf + reqsize, &t, 4);
+	t = htonl(nvsize);
+	memcpy(buf + reqsize + 4, &t, 4);
+	version = htonll(version);
+	memcpy(buf + reqsize + 8, &version, sizeof(version));
+	reqsize += 4 * 2 + sizeof(version);
 
-	buf = new_packet(srv, REQ_INCR, flags, &bufsize, &payload_offset,
-			4 + ksize + sizeof(int64_t));
-	if (buf == NULL)
-		return -1;
-	reqsize = payload_offset;
-	reqsize += append_1v(buf + payload_offset, key, ksize);
-	memcpy(buf + reqsize, &increment, sizeof(int64_t));
-	reqsize += sizeof(int64_t);
+	memcpy(buf + reqsize, key, ksize);
+	memcpy(buf + reqsize + ksize, newval, nvsize);
+	reqsize += ksize + nvsize;
+
+	send_req(db, srv, req, buf, reqsize);
+}
+
+static int do_cas_version(nmdb_t *db, const unsigned char *key,
+		size_t ksize, uint64_t version,
+		const unsigned char *newval, size_t nvsize,
+		unsigned short flags)
+{
+	struct nmdb_req req;
+
+	send_cas_version(db, &req, key, ksize, version, newval, nvsize, flags);
+	return wait_req(db, &req);
+}
+
+int nmdb_cas_version(nmdb_t *db, const unsigned char *key, size_t ksize,
+		uint64_t version, const unsigned char *newval, size_t nvsize)
+{
+	return do_cas_version(db, key, ksize, version, newval, nvsize, 0);
+}
+
+int nmdb_cache_cas_version(nmdb_t *db, const unsigned char *key,
+		size_t ksize, uint64_t version,
+		const unsigned char *newval, size_t nvsize)
+{
+	return do_cas_version(db, key, ksize, version, newval, nvsize,
+			NMDB_CACHE_ONLY);
+}
+
+
+/* Functions to perform an atomic increment. */
+static void send_incr(nmdb_t *db, struct nmdb_req *req,
+		const unsigned char *key, size_t ksize,
+		int64_t increment, int64_t *newval, unsigned short flags)
+{
+	unsigned char *buf;
+	size_t bufsize, payload_offset, reqsize;
+	struct nmdb_srv *srv;
+
+	flags = flags & (NMDB_CACHE_ONLY | NMDB_BINARY | NMDB_ASYNC);
+
+	srv = select_srv(db, key, ksize);
+	init_req(req, srv, REQ_INCR, NULL, 0, newval);
+
+	increment = htonll(increment);
+
+	buf = new_packet(srv, REQ_INCR, flags, &bufsize, &payload_offset,
+			4 + ksize + sizeof(int64_t), &req->id);
+	if (buf == NULL) {
+		complete_req(req, -1, NULL, 0);
+		return;
+	}
+	reqsize = payload_offset;
+	reqsize += append_1v(buf + payload_offset, key, ksize);
+	memcpy(buf + reqsize, &increment, sizeof(int64_t));
+	reqsize += sizeof(int64_t);
+
+	send_req(db, srv, req, buf, reqsize);
+}
+
+static int do_incr(nmdb_t *db, const unsigned char *key, size_t ksize,
+		int64_t increment, int64_t *newval, unsigned short flags)
+{
+	struct nmdb_req req;
+
+	send_incr(db, &req, key, ksize, increment, newval, flags);
+	return wait_req(db, &req);
+}
+
+int nmdb_incr(nmdb_t *db, const unsigned char *key, size_t ksize,
+		int64_t increment, int64_t *newval)
+{
+	return do_incr(db, key, ksize, increment, newval, 0);
+}
+
+int nmdb_cache_incr(nmdb_t *db, const unsigned char *key, size_t ksize,
+		int64_t increment, int64_t *newval)
+{
+	return do_incr(db, key, ksize, increment, newval, NMDB_CACHE_ONLY);
+}
+
+int nmdb_incr_bin(nmdb_t *db, const unsigned char *key, size_t ksize,
+		int64_t increment, int64_t *newval)
+{
+	return do_incr(db, key, ksize, increment, newval, NMDB_BINARY);
+}
+
+int nmdb_cache_incr_bin(nmdb_t *db, const unsigned char *key, size_t ksize,
+		int64_t increment, int64_t *newval)
+{
+	return do_incr(db, key, ksize, increment, newval,
+			NMDB_CACHE_ONLY | NMDB_BINARY);
+}
+
+int nmdb_incr_async(nmdb_t *db, const unsigned char *key, size_t ksize,
+		int64_t increment)
+{
+	return do_incr(db, key, ksize, increment, NULL, NMDB_ASYNC);
+}
+
+int nmdb_incr_bin_async(nmdb_t *db, const unsigned char *key, size_t ksize,
+		int64_t increment)
+{
+	return do_incr(db, key, ksize, increment, NULL,
+			NMDB_BINARY | NMDB_ASYNC);
+}
+
+
+/* Functions to append or prepend to a value. */
+static void send_append(nmdb_t *db, struct nmdb_req *req,
+		unsigned int request, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize, unsigned short flags)
+{
+	unsigned char *buf;
+	size_t bufsize, payload_offset, reqsize;
+	struct nmdb_srv *srv;
+
+	flags = flags & (NMDB_CACHE_ONLY | NMDB_ASYNC);
+
+	srv = select_srv(db, key, ksize);
+	init_req(req, srv, request, NULL, 0, NULL);
+
+	buf = new_packet(srv, request, flags, &bufsize, &payload_offset,
+			4 * 2 + ksize + dsize, &req->id);
+	if (buf == NULL) {
+		complete_req(req, -1, NULL, 0);
+		return;
+	}
+	reqsize = payload_offset;
+	reqsize += append_2v(buf + payload_offset, key, ksize, data, dsize);
+
+	send_req(db, srv, req, buf, reqsize);
+}
+
+static int do_append(nmdb_t *db, unsigned int request,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize, unsigned short flags)
+{
+	struct nmdb_req req;
+
+	send_append(db, &req, request, key, ksize, data, dsize, flags);
+	return wait_req(db, &req);
+}
+
+int nmdb_append(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize)
+{
+	return do_append(db, REQ_APPEND, key, ksize, data, dsize, 0);
+}
+
+int nmdb_cache_append(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize)
+{
+	return do_append(db, REQ_APPEND, key, ksize, data, dsize,
+			NMDB_CACHE_ONLY);
+}
+
+int nmdb_append_async(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize)
+{
+	return do_append(db, REQ_APPEND, key, ksize, data, dsize,
+			NMDB_ASYNC);
+}
+
+int nmdb_prepend(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize)
+{
+	return do_append(db, REQ_PREPEND, key, ksize, data, dsize, 0);
+}
+
+int nmdb_cache_prepend(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize)
+{
+	return do_append(db, REQ_PREPEND, key, ksize, data, dsize,
+			NMDB_CACHE_ONLY);
+}
+
+int nmdb_prepend_async(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize)
+{
+	return do_append(db, REQ_PREPEND, key, ksize, data, dsize,
+			NMDB_ASYNC);
+}
+
+
+/* Asynchronous API. The requests are sent right away, and their results are
+ * stored in the nmdb_req_t when the replies arrive, which happens when the
+ * application calls nmdb_poll() or nmdb_wait(), or while it waits for
+ * another request. */
+
+nmdb_req_t *nmdb_submit_get(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_get(db, req, key, ksize, val, vsize, 0);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_cache_get(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_get(db, req, key, ksize, val, vsize, NMDB_CACHE_ONLY);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_set(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_set(db, req, key, ksize, val, vsize, 0);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_set_sync(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_set(db, req, key, ksize, val, vsize, NMDB_SYNC);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_cache_set(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_set(db, req, key, ksize, val, vsize, NMDB_CACHE_ONLY);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_del(nmdb_t *db,
+		const unsigned char *key, size_t ksize)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_del(db, req, key, ksize, 0);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_del_sync(nmdb_t *db,
+		const unsigned char *key, size_t ksize)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_del(db, req, key, ksize, NMDB_SYNC);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_cache_del(nmdb_t *db,
+		const unsigned char *key, size_t ksize)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_del(db, req, key, ksize, NMDB_CACHE_ONLY);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_cas(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *oldval, size_t ovsize,
+		const unsigned char *newval, size_t nvsize)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_cas(db, req, key, ksize, oldval, ovsize, newval, nvsize,
+				0);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_incr(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		int64_t increment, int64_t *newval)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_incr(db, req, key, ksize, increment, newval, 0);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_incr_bin(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		int64_t increment, int64_t *newval)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_incr(db, req, key, ksize, increment, newval,
+				NMDB_BINARY);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_gets(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize, uint64_t *version)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_gets(db, req, key, ksize, val, vsize, version, 0);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_cas_version(nmdb_t *db,
+		const unsigned char *key, size_t ksize, uint64_t version,
+		const unsigned char *newval, size_t nvsize)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_cas_version(db, req, key, ksize, version, newval, nvsize,
+				0);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_append(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_append(db, req, REQ_APPEND, key, ksize, data, dsize, 0);
+	return req;
+}
+
+nmdb_req_t *nmdb_submit_prepend(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize)
+{
+	struct nmdb_req *req;
+
+	req = malloc(sizeof(struct nmdb_req));
+	if (req != NULL)
+		send_append(db, req, REQ_PREPEND, key, ksize, data, dsize, 0);
+	return req;
+}
+
+int nmdb_poll(nmdb_t *db, int timeout)
+{
+	int rv, ndone, nready;
+	unsigned int i;
+	struct pollfd *pfds;
+
+	if (db->npending == 0)
+		return 0;
+
+	if (db->npfds < db->nservers) {
+		pfds = realloc(db->pfds, sizeof(struct pollfd) * db->nservers);
+		if (pfds == NULL)
+			return -1;
+		db->pfds = pfds;
+		db->npfds = db->nservers;
+	}
+
+	for (i = 0; i < db->nservers; i++)
+		db->pfds[i].fd = db->servers[i].fd;
+
+	/* Once something has arrived, we keep reading until there is nothing
+	 * else ready, without waiting any further */
+	ndone = 0;
+	while (db->npending > 0) {
+		/* the queues change as we go, so the events have to be
+		 * rebuilt every time */
+		nready = 0;
+		for (i = 0; i < db->nservers; i++) {
+			db->pfds[i].events = POLLIN;
+			if (db->servers[i].outq != NULL)
+				db->pfds[i].events |= POLLOUT;
+
+			/* replies over shared memory may be there without
+			 * the socket being readable, see shm_srv_sleep() */
+			if (db->servers[i].type == SHM_CONN
+					&& db->pfds[i].fd >= 0
+					&& shm_srv_sleep(db->servers + i))
+				nready++;
+		}
+
+		rv = poll(db->pfds, db->nservers, nready ? 0 : timeout);
+		if (rv < 0 && ndone == 0)
+			return -1;
+		else if (rv < 0 || (rv == 0 && nready == 0))
+			break;
+
+		for (i = 0; i < db->nservers; i++) {
+			if (nready && db->servers[i].type == SHM_CONN
+					&& db->pfds[i].fd >= 0
+					&& shm_srv_sleep(db->servers + i))
+				db->pfds[i].revents |= POLLIN;
+			if (db->pfds[i].revents == 0)
+				continue;
+
+			/* on errors the server's requests are failed, so
+			 * we stop watching it */
+			rv = handle_srv(db, db->servers + i,
+					db->pfds[i].revents);
+			if (rv < 0)
+				db->pfds[i].fd = -1;
+			else
+				ndone += rv;
+		}
+
+		timeout = 0;
+	}
+
+	return ndone;
+}
+
+int nmdb_set_nonblock(nmdb_t *db)
+{
+	int i, flags;
+
+	for (i = 0; i < db->nservers; i++) {
+		flags = fcntl(db->servers[i].fd, F_GETFL, 0);
+		if (flags < 0)
+			return 0;
+		if (fcntl(db->servers[i].fd, F_SETFL, flags | O_NONBLOCK) < 0)
+			return 0;
+	}
+
+	db->nonblock = 1;
+	return 1;
+}
+
+int nmdb_fds(nmdb_t *db, int *fds, int *events, int n)
+{
+	int i;
+
+	for (i = 0; i < db->nservers && i < n; i++) {
+		/* if there are replies over shared memory already, the
+		 * socket may not become readable for them unless we ask */
+		if (db->servers[i].type == SHM_CONN
+				&& shm_srv_sleep(db->servers + i))
+			shm_srv_kick(db->servers + i);
+
+		fds[i] = db->servers[i].fd;
+		events[i] = NMDB_EV_READ;
+		if (db->servers[i].outq != NULL)
+			events[i] |= NMDB_EV_WRITE;
+	}
+
+	return db->nservers;
+}
+
+int nmdb_handle_fd(nmdb_t *db, int fd, int events)
+{
+	short revents = 0;
+	struct nmdb_srv *srv;
+
+	srv = find_srv(db, fd);
+	if (srv == NULL)
+		return -1;
+
+	if (events & NMDB_EV_READ)
+		revents |= POLLIN;
+	if (events & NMDB_EV_WRITE)
+		revents |= POLLOUT;
+
+	return handle_srv(db, srv, revents);
+}
+
+ssize_t nmdb_wait(nmdb_t *db, nmdb_req_t *req)
+{
+	return wait_req(db, req);
+}
+
+int nmdb_req_done(const nmdb_req_t *req)
+{
+	return req->done;
+}
+
+ssize_t nmdb_req_result(const nmdb_req_t *req)
+{
+	return req->result;
+}
+
+void nmdb_req_set_callback(nmdb_req_t *req, nmdb_callback_t cb, void *arg)
+{
+	req->cb = cb;
+	req->cb_arg = arg;
+
+	/* it may have completed already, for example if it could not be
+	 * sent */
+	if (req->done && cb != NULL)
+		cb(req, arg);
+}
+
+void nmdb_req_free(nmdb_t *db, nmdb_req_t *req)
+{
+	if (!req->done)
+		take_pending(db, req->fd, req->id);
+	free(req);
+}
+
+
+/* Functions to perform a multi-get. */
+
+/* Max. size of a multi-get or multi-set request payload, as the server won't
+ * accept messages bigger than 64kb */
+#define MULTI_MAX_PAYLOAD (64 * 1024 - 64)
+
+/* Value size the server uses for values too big to fit in a reply */
+#define MGET_TOOBIG 0xFFFFFFFF
+
+/* Sends a multi-get with some of the keys, which must all belong to srv, and
+ * processes the replies. idx has the position in the caller's arrays of each
+ * of the n keys to get. Values that were too big to be sent are marked with
+ * -3 in results. */
+static int mget_batch(nmdb_t *db, struct nmdb_srv *srv, unsigned short flags,
+		size_t n, const size_t *idx,
+		const unsigned char **keys, const size_t *ksizes,
+		unsigned char **vals, const size_t *vsizes,
+		ssize_t *results)
+{
+	int rv;
+	ssize_t t;
+	unsigned char *buf, *p, *end;
+	size_t bufsize, payload_offset, reqsize, psize, i, k;
+	uint32_t id, reply, ndone, nvals, ri, vsize;
+
+	buf = new_packet(srv, REQ_MGET, flags, &bufsize, &payload_offset, -1,
+			&id);
+	if (buf == NULL)
+		return -1;
+
+	reqsize = payload_offset;
+	* (uint32_t *) (buf + reqsize) = htonl(n);
+	reqsize += 4;
+	for (i = 0; i < n; i++)
+		reqsize += append_1v(buf + reqsize, keys[idx[i]],
+				ksizes[idx[i]]);
+
+	t = send_packet(db, srv, buf, reqsize);
+	if (t <= 0) {
+		rv = -1;
+		goto exit;
+	}
+
+	/* The results come in one or more replies, each accounting for some
+	 * of the keys; only the ones that were found come with a value */
+	ndone = 0;
+	while (ndone < n) {
+		psize = 0;
+		reply = get_rep(db, srv, id, buf, bufsize, &p, &psize);
+		if (reply != REP_OK || psize < 4 + 4 + 4) {
+			rv = -1;
+			goto exit;
+		}
+
+		/* skip the 4 bytes of length */
+		end = p + psize;
+		ndone += ntohl(* (uint32_t *) (p + 4));
+		nvals = ntohl(* (uint32_t *) (p + 8));
+		p += 12;
+
+		for (; nvals > 0; nvals--) {
+			if (end - p < 8) {
+				rv = -1;
+				goto exit;
+			}
+			ri = ntohl(* (uint32_t *) p);
+			vsize = ntohl(* (uint32_t *) (p + 4));
+			p += 8;
+
+			if (ri >= n) {
+				rv = -1;
+				goto exit;
+			}
+			k = idx[ri];
+
+			if (vsize == MGET_TOOBIG) {
+				results[k] = -3;
+				continue;
+			}
+
+			if (vsize > (size_t) (end - p)) {
+				rv = -1;
+				goto exit;
+			}
+
+			if (vsize > vsizes[k]) {
+				results[k] = -2;
+			} else {
+				memcpy(vals[k], p, vsize);
+				results[k] = vsize;
+			}
+			p += vsize;
+		}
+	}
+
+	rv = 1;
+
+exit:
+	free(buf);
+	return rv;
+}
+
+static int do_mget(nmdb_t *db, size_t nkeys,
+		const unsigned char **keys, const size_t *ksizes,
+		unsigned char **vals, const size_t *vsizes,
+		ssize_t *results, unsigned short flags)
+{
+	int rv, found;
+	size_t *srvnum, *idx, n, psize, k, s;
+
+	flags = flags & NMDB_CACHE_ONLY;
+
+	if (db->nservers == 0)
+		return -1;
+	if (nkeys == 0)
+		return 0;
+
+	srvnum = malloc(sizeof(size_t) * nkeys);
+	idx = malloc(sizeof(size_t) * nkeys);
+	if (srvnum == NULL || idx == NULL) {
+		rv = -1;
+		goto exit;
+	}
+
+	for (k = 0; k < nkeys; k++) {
+		srvnum[k] = select_srv(db, keys[k], ksizes[k]) - db->servers;
+		results[k] = -1;
+	}
+
+	/* Send one request per server, or more if the keys don't fit in a
+	 * single message */
+	for (s = 0; s < db->nservers; s++) {
+		n = 0;
+		psize = 4;
+		for (k = 0; k < nkeys; k++) {
+			if (srvnum[k] != s)
+				continue;
+
+			if (4 + 4 + ksizes[k] > MULTI_MAX_PAYLOAD) {
+				results[k] = -2;
+				continue;
+			}
+
+			if (psize + 4 + ksizes[k] > MULTI_MAX_PAYLOAD) {
+				rv = mget_batch(db, db->servers + s, flags,
+					n, idx, keys, ksizes, vals, vsizes,
+					results);
+				if (rv < 0)
+					goto exit;
+				n = 0;
+				psize = 4;
+			}
+
+			idx[n] = k;
+			n++;
+			psize += 4 + ksizes[k];
+		}
+
+		if (n > 0) {
+			rv = mget_batch(db, db->servers + s, flags,
+					n, idx, keys, ksizes, vals, vsizes,
+					results);
+			if (rv < 0)
+				goto exit;
+		}
+	}
+
+	/* Values too big to fit in a multi-get reply are fetched one by one,
+	 * which should be very rare */
+	found = 0;
+	for (k = 0; k < nkeys; k++) {
+		if (results[k] == -3)
+			results[k] = do_get(db, keys[k], ksizes[k],
+					vals[k], vsizes[k], flags);
+		if (results[k] >= 0)
+			found++;
+	}
+
+	rv = found;
+
+exit:
+	free(srvnum);
+	free(idx);
+	return rv;
+}
+
+int nmdb_mget(nmdb_t *db, size_t nkeys,
+		const unsigned char **keys, const size_t *ksizes,
+		unsigned char **vals, const size_t *vsizes,
+		ssize_t *results)
+{
+	return do_mget(db, nkeys, keys, ksizes, vals, vsizes, results, 0);
+}
+
+int nmdb_cache_mget(nmdb_t *db, size_t nkeys,
+		const unsigned char **keys, const size_t *ksizes,
+		unsigned char **vals, const size_t *vsizes,
+		ssize_t *results)
+{
+	return do_mget(db, nkeys, keys, ksizes, vals, vsizes, results,
+			NMDB_CACHE_ONLY);
+}
+
+
+/* Functions to perform a multi-set. */
+
+/* Sends a multi-set with some of the pairs, which must all belong to srv.
+ * idx has the position in the caller's arrays of each of the n pairs, and
+ * psize is the size of the payload. */
+static int mset_batch(nmdb_t *db, struct nmdb_srv *srv, unsigned short flags,
+		size_t n, const size_t *idx, size_t psize,
+		const unsigned char **keys, const size_t *ksizes,
+		const unsigned char **vals, const size_t *vsizes)
+{
+	int rv;
+	ssize_t t;
+	unsigned char *buf;
+	size_t bufsize, payload_offset, reqsize, i;
+	uint32_t id, reply;
+
+	buf = new_packet(srv, REQ_MSET, flags, &bufsize, &payload_offset,
+			psize, &id);
+	if (buf == NULL)
+		return -1;
+
+	reqsize = payload_offset;
+	* (uint32_t *) (buf + reqsize) = htonl(n);
+	reqsize += 4;
+	for (i = 0; i < n; i++)
+		reqsize += append_2v(buf + reqsize,
+				keys[idx[i]], ksizes[idx[i]],
+				vals[idx[i]], vsizes[idx[i]]);
+
+	t = send_packet(db, srv, buf, reqsize);
+	if (t <= 0) {
+		rv = -1;
+		goto exit;
+	}
+
+	reply = get_rep(db, srv, id, buf, bufsize, NULL, NULL);
+	if (reply == REP_OK)
+		rv = 1;
+	else
+		rv = -1;
+
+exit:
+	free(buf);
+	return rv;
+}
+
+static int do_mset(nmdb_t *db, size_t npairs,
+		const unsigned char **keys, const size_t *ksizes,
+		const unsigned char **vals, const size_t *vsizes,
+		unsigned short flags)
+{
+	int rv;
+	size_t *srvnum, *idx, n, psize, k, s;
+
+	flags = flags & (NMDB_CACHE_ONLY | NMDB_SYNC);
+
+	if (db->nservers == 0)
+		return -1;
+	if (npairs == 0)
+		return 1;
 
-	t = srv_send(srv, buf, reqsize);
-	if (t <= 0) {
+	srvnum = malloc(sizeof(size_t) * npairs);
+	idx = malloc(sizeof(size_t) * npairs);
+	if (srvnum == NULL || idx == NULL) {
 		rv = -1;
 		goto exit;
 	}
 
-	psize = sizeof(int64_t);
-	reply = get_rep(srv, buf, bufsize, &payload, &psize);
+	for (k = 0; k < npairs; k++)
+		srvnum[k] = select_srv(db, keys[k], ksizes[k]) - db->servers;
+
+	/* Like do_mget(), send one request per server, or more if the pairs
+	 * don't fit in a single message. Pairs that are too big to fit even
+	 * on their own are sent with a regular set. */
+	rv = 1;
+	for (s = 0; s < db->nservers && rv > 0; s++) {
+		n = 0;
+		psize = 4;
+		for (k = 0; k < npairs && rv > 0; k++) {
+			if (srvnum[k] != s)
+				continue;
+
+			if (4 + 8 + ksizes[k] + vsizes[k] > MULTI_MAX_PAYLOAD) {
+				rv = do_set(db, keys[k], ksizes[k],
+						vals[k], vsizes[k], flags);
+				continue;
+			}
 
-	switch (reply) {
-		case REP_OK:
-			rv = 2;
-			if (newval != NULL && psize == sizeof(int64_t) + 4) {
-				/* skip the 4 bytes of length */
-				*newval = *((int64_t *) (payload + 4));
-				*newval = ntohll(*newval);
+			if (psize + 8 + ksizes[k] + vsizes[k] >
+					MULTI_MAX_PAYLOAD) {
+				rv = mset_batch(db, db->servers + s, flags,
+						n, idx, psize, keys, ksizes,
+						vals, vsizes);
+				n = 0;
+				psize = 4;
 			}
-			break;
-		case REP_NOMATCH:
-			rv = 1;
-			break;
-		case REP_NOTIN:
-			rv = 0;
-			break;
-		default:
-			rv = -1;
-			break;
+
+			idx[n] = k;
+			n++;
+			psize += 8 + ksizes[k] + vsizes[k];
+		}
+
+		if (n > 0 && rv > 0)
+			rv = mset_batch(db, db->servers + s, flags, n, idx,
+					psize, keys, ksizes, vals, vsizes);
 	}
 
 exit:
-	free(buf);
+	free(srvnum);
+	free(idx);
 	return rv;
+}
 
+int nmdb_mset(nmdb_t *db, size_t npairs,
+		const unsigned char **keys, const size_t *ksizes,
+		const unsigned char **vals, const size_t *vsizes)
+{
+	return do_mset(db, npairs, keys, ksizes, vals, vsizes, 0);
 }
 
-int nmdb_incr(nmdb_t *db, const unsigned char *key, size_t ksize,
-		int64_t increment, int64_t *newval)
+int nmdb_mset_sync(nmdb_t *db, size_t npairs,
+		const unsigned char **keys, const size_t *ksizes,
+		const unsigned char **vals, const size_t *vsizes)
 {
-	return do_incr(db, key, ksize, increment, newval, 0);
+	return do_mset(db, npairs, keys, ksizes, vals, vsizes, NMDB_SYNC);
 }
 
-int nmdb_cache_incr(nmdb_t *db, const unsigned char *key, size_t ksize,
-		int64_t increment, int64_t *newval)
+int nmdb_cache_mset(nmdb_t *db, size_t npairs,
+		const unsigned char **keys, const size_t *ksizes,
+		const unsigned char **vals, const size_t *vsizes)
 {
-	return do_incr(db, key, ksize, increment, newval, NMDB_CACHE_ONLY);
+	return do_mset(db, npairs, keys, ksizes, vals, vsizes,
+			NMDB_CACHE_ONLY);
 }
 
 
@@ -662,7 +2124,7 @@ ssize_t nmdb_firstkey(nmdb_t *db, unsigned char *key, size_t ksize)
 	ssize_t rv, t;
 	unsigned char *buf, *p;
 	size_t bufsize, payload_offset, psize = 0;
-	uint32_t reply;
+	uint32_t id, reply;
 	struct nmdb_srv *srv;
 
 	if (db->nservers != 1) {
@@ -670,17 +2132,18 @@ ssize_t nmdb_firstkey(nmdb_t *db, unsigned char *key, size_t ksize)
 	}
 	srv = &(db->servers[0]);
 
-	buf = new_packet(srv, REQ_FIRSTKEY, 0, &bufsize, &payload_offset, -1);
+	buf = new_packet(srv, REQ_FIRSTKEY, 0, &bufsize, &payload_offset, -1,
+			&id);
 	if (buf == NULL)
 		return -2;
 
-	t = srv_send(srv, buf, payload_offset);
+	t = send_packet(db, srv, buf, payload_offset);
 	if (t <= 0) {
 		rv = -2;
 		goto exit;
 	}
 
-	reply = get_rep(srv, buf, bufsize, &p, &psize);
+	reply = get_rep(db, srv, id, buf, bufsize, &p, &psize);
 
 	if (reply == REP_NOTIN) {
 		rv = -1;
@@ -717,26 +2180,27 @@ ssize_t nmdb_nextkey(nmdb_t *db, const unsigned char *key, size_t ksize,
 	ssize_t rv, t;
 	unsigned char *buf, *p;
 	size_t bufsize, reqsize, payload_offset, psize = 0;
-	uint32_t reply;
+	uint32_t id, reply;
 	struct nmdb_srv *srv;
 
 	if (db->nservers != 1)
 		return -2;
 	srv = &(db->servers[0]);
 
-	buf = new_packet(srv, REQ_NEXTKEY, 0, &bufsize, &payload_offset, -1);
+	buf = new_packet(srv, REQ_NEXTKEY, 0, &bufsize, &payload_offset, -1,
+			&id);
 	if (buf == NULL)
 		return -1;
 	reqsize = payload_offset;
 	reqsize += append_1v(buf + payload_offset, key, ksize);
 
-	t = srv_send(srv, buf, reqsize);
+	t = send_packet(db, srv, buf, reqsize);
 	if (t <= 0) {
 		rv = -2;
 		goto exit;
 	}
 
-	reply = get_rep(srv, buf, bufsize, &p, &psize);
+	reply = get_rep(db, srv, id, buf, bufsize, &p, &psize);
 
 	if (reply == REP_NOTIN) {
 		rv = -1;
@@ -767,9 +2231,341 @@ exit:
 }
 
 
-/* Request servers' statistics, return the aggregated results in buf, with the
- * number of servers in nservers and the number of stats per server in nstats.
- * Used in the "nmdb-stats" utility, matches the server version.
+/* Functions to perform a scan. */
+
+/* Gets the reply to a scan request, and calls cb for each key in it. Returns
+ * the number of keys, 0 if there were none, -2 on error, or -3 if the server
+ * didn't find the cursor. */
+static ssize_t scan_rep(nmdb_t *db, struct nmdb_srv *srv, uint32_t id,
+		unsigned char *buf, size_t bufsize, unsigned short flags,
+		nmdb_scan_cb_t cb, void *arg)
+{
+	unsigned char *p, *end, *val;
+	size_t psize = 0, hsize;
+	uint32_t reply, n, i, ksize, vsize;
+
+	reply = get_rep(db, srv, id, buf, bufsize, &p, &psize);
+
+	if (reply == REP_NOTIN)
+		return 0;
+	else if (reply == REP_NOMATCH)
+		return -3;
+	else if (reply != REP_OK || psize < 4 + 4)
+		return -2;
+
+	/* skip the 4 bytes of length */
+	end = p + psize;
+	n = ntohl(* (uint32_t *) (p + 4));
+	p += 8;
+
+	hsize = (flags & NMDB_VALUES) ? 4 + 4 : 4;
+	for (i = 0; i < n; i++) {
+		if ((size_t) (end - p) < hsize)
+			return -2;
+		ksize = ntohl(* (uint32_t *) p);
+		vsize = 0;
+		if (flags & NMDB_VALUES)
+			vsize = ntohl(* ((uint32_t *) p + 1));
+		p += hsize;
+
+		if (ksize > (size_t) (end - p))
+			return -2;
+
+		val = NULL;
+		if (vsize == MGET_TOOBIG) {
+			vsize = 0;
+		} else if (flags & NMDB_VALUES) {
+			if (vsize > (size_t) (end - p - ksize))
+				return -2;
+			val = p + ksize;
+		}
+
+		cb(p, ksize, val, vsize, arg);
+		p += ksize + vsize;
+	}
+
+	return n;
+}
+
+static ssize_t do_scan(nmdb_t *db, const unsigned char *start, size_t ssize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg,
+		unsigned short flags)
+{
+	ssize_t rv, t;
+	unsigned char *buf;
+	size_t bufsize, reqsize, payload_offset;
+	uint32_t id;
+	struct nmdb_srv *srv;
+
+	if (db->nservers != 1)
+		return -2;
+	srv = &(db->servers[0]);
+
+	if (4 + 4 + 4 + ssize > MULTI_MAX_PAYLOAD)
+		return -2;
+
+	buf = new_packet(srv, REQ_SCAN, flags, &bufsize, &payload_offset, -1,
+			&id);
+	if (buf == NULL)
+		return -2;
+
+	reqsize = payload_offset;
+	* (uint32_t *) (buf + reqsize) = htonl(nkeys);
+	* (uint32_t *) (buf + reqsize + 4) = htonl(maxbytes);
+	reqsize += 8;
+	reqsize += append_1v(buf + reqsize, start, ssize);
+
+	t = send_packet(db, srv, buf, reqsize);
+	if (t <= 0) {
+		rv = -2;
+		goto exit;
+	}
+
+	rv = scan_rep(db, srv, id, buf, bufsize, flags, cb, arg);
+	if (rv == -3)
+		rv = -2;
+
+exit:
+	free(buf);
+	return rv;
+}
+
+ssize_t nmdb_scan(nmdb_t *db, const unsigned char *start, size_t ssize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg)
+{
+	return do_scan(db, start, ssize, nkeys, maxbytes, cb, arg,
+			NMDB_VALUES);
+}
+
+ssize_t nmdb_scan_keys(nmdb_t *db, const unsigned char *start, size_t ssize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg)
+{
+	return do_scan(db, start, ssize, nkeys, maxbytes, cb, arg, 0);
+}
+
+
+/* Functions to perform prefix and range queries; their requests have the
+ * same format, with two keys. */
+static ssize_t do_range(nmdb_t *db, unsigned int request,
+		const unsigned char *k1, size_t ksize1,
+		const unsigned char *k2, size_t ksize2,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg,
+		unsigned short flags)
+{
+	ssize_t rv, t;
+	unsigned char *buf;
+	size_t bufsize, reqsize, payload_offset;
+	uint32_t id;
+	struct nmdb_srv *srv;
+
+	if (db->nservers != 1)
+		return -2;
+	srv = &(db->servers[0]);
+
+	if (4 + 4 + 4 + 4 + ksize1 + ksize2 > MULTI_MAX_PAYLOAD)
+		return -2;
+
+	buf = new_packet(srv, request, flags, &bufsize, &payload_offset, -1,
+			&id);
+	if (buf == NULL)
+		return -2;
+
+	reqsize = payload_offset;
+	* (uint32_t *) (buf + reqsize) = htonl(nkeys);
+	* (uint32_t *) (buf + reqsize + 4) = htonl(maxbytes);
+	reqsize += 8;
+	reqsize += append_2v(buf + reqsize, k1, ksize1, k2, ksize2);
+
+	t = send_packet(db, srv, buf, reqsize);
+	if (t <= 0) {
+		rv = -2;
+		goto exit;
+	}
+
+	rv = scan_rep(db, srv, id, buf, bufsize, flags, cb, arg);
+	if (rv == -3)
+		rv = -2;
+
+exit:
+	free(buf);
+	return rv;
+}
+
+ssize_t nmdb_prefix(nmdb_t *db, const unsigned char *prefix, size_t psize,
+		const unsigned char *start, size_t ssize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg)
+{
+	return do_range(db, REQ_PREFIX, prefix, psize, start, ssize,
+			nkeys, maxbytes, cb, arg, NMDB_VALUES);
+}
+
+ssize_t nmdb_prefix_keys(nmdb_t *db, const unsigned char *prefix,
+		size_t psize, const unsigned char *start, size_t ssize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg)
+{
+	return do_range(db, REQ_PREFIX, prefix, psize, start, ssize,
+			nkeys, maxbytes, cb, arg, 0);
+}
+
+ssize_t nmdb_range(nmdb_t *db, const unsigned char *start, size_t ssize,
+		const unsigned char *end, size_t esize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg)
+{
+	return do_range(db, REQ_RANGE, start, ssize, end, esize,
+			nkeys, maxbytes, cb, arg, NMDB_VALUES);
+}
+
+ssize_t nmdb_range_keys(nmdb_t *db, const unsigned char *start, size_t ssize,
+		const unsigned char *end, size_t esize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg)
+{
+	return do_range(db, REQ_RANGE, start, ssize, end, esize,
+			nkeys, maxbytes, cb, arg, 0);
+}
+
+/* Functions to use scan cursors. */
+int nmdb_scan_open(nmdb_t *db, const unsigned char *start, size_t ssize,
+		uint32_t *cursor)
+{
+	int rv;
+	ssize_t t;
+	unsigned char *buf, *p;
+	size_t bufsize, reqsize, payload_offset, psize = 0;
+	uint32_t id, reply;
+	struct nmdb_srv *srv;
+
+	if (db->nservers != 1)
+		return -2;
+	srv = &(db->servers[0]);
+
+	if (4 + ssize > MULTI_MAX_PAYLOAD)
+		return -2;
+
+	buf = new_packet(srv, REQ_SCAN_OPEN, 0, &bufsize, &payload_offset, -1,
+			&id);
+	if (buf == NULL)
+		return -2;
+
+	reqsize = payload_offset;
+	reqsize += append_1v(buf + reqsize, start, ssize);
+
+	t = send_packet(db, srv, buf, reqsize);
+	if (t <= 0) {
+		rv = -2;
+		goto exit;
+	}
+
+	reply = get_rep(db, srv, id, buf, bufsize, &p, &psize);
+	if (reply != REP_OK || psize < 4 + 4) {
+		rv = -2;
+		goto exit;
+	}
+
+	/* skip the 4 bytes of length */
+	*cursor = ntohl(* (uint32_t *) (p + 4));
+	rv = 1;
+
+exit:
+	free(buf);
+	return rv;
+}
+
+static ssize_t do_scan_next(nmdb_t *db, uint32_t cursor,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg,
+		unsigned short flags)
+{
+	ssize_t rv, t;
+	unsigned char *buf;
+	size_t bufsize, reqsize, payload_offset;
+	uint32_t id;
+	struct nmdb_srv *srv;
+
+	if (db->nservers != 1)
+		return -2;
+	srv = &(db->servers[0]);
+
+	buf = new_packet(srv, REQ_SCAN_NEXT, flags, &bufsize, &payload_offset,
+			-1, &id);
+	if (buf == NULL)
+		return -2;
+
+	reqsize = payload_offset;
+	* (uint32_t *) (buf + reqsize) = htonl(cursor);
+	* (uint32_t *) (buf + reqsize + 4) = htonl(nkeys);
+	* (uint32_t *) (buf + reqsize + 8) = htonl(maxbytes);
+	reqsize += 12;
+
+	t = send_packet(db, srv, buf, reqsize);
+	if (t <= 0) {
+		rv = -2;
+		goto exit;
+	}
+
+	rv = scan_rep(db, srv, id, buf, bufsize, flags, cb, arg);
+
+exit:
+	free(buf);
+	return rv;
+}
+
+ssize_t nmdb_scan_next(nmdb_t *db, uint32_t cursor,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg)
+{
+	return do_scan_next(db, cursor, nkeys, maxbytes, cb, arg,
+			NMDB_VALUES);
+}
+
+ssize_t nmdb_scan_next_keys(nmdb_t *db, uint32_t cursor,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg)
+{
+	return do_scan_next(db, cursor, nkeys, maxbytes, cb, arg, 0);
+}
+
+int nmdb_scan_close(nmdb_t *db, uint32_t cursor)
+{
+	int rv;
+	ssize_t t;
+	unsigned char *buf;
+	size_t bufsize, reqsize, payload_offset;
+	uint32_t id, reply;
+	struct nmdb_srv *srv;
+
+	if (db->nservers != 1)
+		return -2;
+	srv = &(db->servers[0]);
+
+	buf = new_packet(srv, REQ_SCAN_CLOSE, 0, &bufsize, &payload_offset,
+			-1, &id);
+	if (buf == NULL)
+		return -2;
+
+	reqsize = payload_offset;
+	* (uint32_t *) (buf + reqsize) = htonl(cursor);
+	reqsize += 4;
+
+	t = send_packet(db, srv, buf, reqsize);
+	if (t <= 0) {
+		rv = -2;
+		goto exit;
+	}
+
+	reply = get_rep(db, srv, id, buf, bufsize, NULL, NULL);
+	if (reply == REP_OK)
+		rv = 1;
+	else if (reply == REP_NOMATCH)
+		rv = 0;
+	else
+		rv = -2;
+
+exit:
+	free(buf);
+	return rv;
+}
+
+
+/* Request servers' statistics using the given request code (REQ_STATS or
+ * REQ_XSTATS), return the aggregated results in buf, with the number of
+ * servers in nservers and the number of stats per server in nstats.
  *
  * Return:
  *   1 if success
@@ -782,46 +2578,58 @@ exit:
  * TODO: The API could be improved by having nstats be provided by the caller,
  * and making sure its used by all servers. Also buf should be an uint64_t
  * *buf to make the typing more explicit. */
-int nmdb_stats(nmdb_t *db, unsigned char *buf, size_t bsize,
+static int do_stats(nmdb_t *db, unsigned int request,
+		unsigned char *buf, size_t bsize,
 		unsigned int *nservers, unsigned int *nstats)
 {
 	int i;
 	size_t reqsize;
 	ssize_t t, reply;
-	unsigned char *request;
+	uint32_t id;
+	unsigned char *request_buf;
 	struct nmdb_srv *srv;
 
-	/* This buffer is used for a single reply, must be big enough to
-	 * hold STATS_REPLY_SIZE. 32 elements is enough to allow future
-	 * improvements. */
-	unsigned char tmpbuf[32 * sizeof(uint64_t)];
-	size_t tmpbufsize = 32 * sizeof(uint64_t);
+	/* The reply buffer is used for a single reply; it's not the size of
+	 * the stats that matters, but the replies to pending requests that
+	 * may arrive before it */
+	unsigned char *rbuf;
 
 	unsigned char *payload;
 	size_t psize;
 
 	*nstats = 0;
 
+	rbuf = get_rbuf(db);
+	if (rbuf == NULL)
+		return -2;
+
 	for (i = 0; i < db->nservers; i++) {
 		srv = db->servers + i;
-		request = new_packet(srv, REQ_STATS, 0, &reqsize, NULL, 0);
+		request_buf = new_packet(srv, request, 0, &reqsize, NULL, 0,
+				&id);
+		if (request_buf == NULL)
+			return -2;
 
-		t = srv_send(srv, request, reqsize);
-		free(request);
+		t = send_packet(db, srv, request_buf, reqsize);
+		free(request_buf);
 		if (t <= 0)
 			return -2;
 
-		reply = get_rep(srv, tmpbuf, tmpbufsize, &payload, &psize);
+		reply = get_rep(db, srv, id, rbuf, REPLY_BUF_SIZE,
+				&payload, &psize);
 		if (reply != REP_OK)
 			return -1;
 
+		/* Skip the 4 bytes of length */
+		payload += 4;
+		psize -= 4;
+
 		/* Check if there is enough room for the copy */
 		if (bsize < psize)
 			return -3;
 
-		/* Now copy the reply in the buffer given to us, skipping the
-		 * 4 bytes of length */
-		memcpy(buf, payload + 4, psize);
+		/* Now copy the reply in the buffer given to us */
+		memcpy(buf, payload, psize);
 		buf += psize;
 		bsize -= psize;
 
@@ -840,4 +2648,67 @@ int nmdb_stats(nmdb_t *db, unsigned char *buf, size_t bsize,
 	return 1;
 }
 
+/* Used in the "nmdb-stats" utility, matches the server version. */
+int nmdb_stats(nmdb_t *db, unsigned char *buf, size_t bsize,
+		unsigned int *nservers, unsigned int *nstats)
+{
+	return do_stats(db, REQ_STATS, buf, bsize, nservers, nstats);
+}
+
+/* Like nmdb_stats(), but for the extended statistics. */
+int nmdb_xstats(nmdb_t *db, unsigned char *buf, size_t bsize,
+		unsigned int *nservers, unsigned int *nstats)
+{
+	return do_stats(db, REQ_XSTATS, buf, bsize, nservers, nstats);
+}
+
+
+/* Request the server's hot keys, see the documentation in nmdb.h for the
+ * format of the result. */
+ssize_t nmdb_hot_keys(nmdb_t *db, unsigned char *buf, size_t bsize)
+{
+	ssize_t rv, t;
+	unsigned char *rbuf, *p;
+	size_t bufsize, payload_offset, psize = 0;
+	uint32_t id, reply, len;
+	struct nmdb_srv *srv;
+
+	if (db->nservers != 1)
+		return -2;
+	srv = &(db->servers[0]);
+
+	rbuf = new_packet(srv, REQ_HOTKEYS, 0, &bufsize, &payload_offset, -1,
+			&id);
+	if (rbuf == NULL)
+		return -2;
+
+	t = send_packet(db, srv, rbuf, payload_offset);
+	if (t <= 0) {
+		rv = -2;
+		goto exit;
+	}
+
+	reply = get_rep(db, srv, id, rbuf, bufsize, &p, &psize);
+	if (reply != REP_OK) {
+		rv = -1;
+		goto exit;
+	}
+
+	len = * (uint32_t *) p;
+	len = ntohl(len);
+	if (len > (psize - 4)) {
+		rv = -2;
+		goto exit;
+	} else if (len > bsize) {
+		rv = -3;
+		goto exit;
+	}
+
+	memcpy(buf, p + 4, len);
+	rv = len;
+
+exit:
+	free(rbuf);
+	return rv;
+}
 
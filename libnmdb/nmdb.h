@@ -5,6 +5,7 @@
 #define _NMDB_H
 
 #include <stdlib.h>	/* size_t, ssize_t */
+#include <stdint.h>	/* int64_t, uint32_t */
 
 /** Opaque type representing a connection with one or more servers. */
 typedef struct nmdb_conn nmdb_t;
@@ -61,6 +62,32 @@ int nmdb_add_udp_server(nmdb_t *db, const char *addr, int port);
  */
 int nmdb_add_sctp_server(nmdb_t *db, const char *addr, int port);
 
+/** Add a Unix socket server, for servers running on the same host.
+ *
+ * Like TIPC and UDP, messages are limited to 64kb, so big values can't be
+ * used with it.
+ *
+ * @param db connection instance.
+ * @param path path of the server's socket (NULL means use the default).
+ * @returns 1 on success, 0 on failure.
+ * @ingroup connection
+ */
+int nmdb_add_unix_server(nmdb_t *db, const char *path);
+
+/** Add a shared memory server, for servers running on the same host.
+ *
+ * Requests and replies go through memory shared with the server, and the
+ * server's socket is only used to wake up the other side when it's idle.
+ * Like with Unix sockets, messages are limited to 64kb.
+ *
+ * @param db connection instance.
+ * @param path path of the server's shared memory socket (NULL means use the
+ * 	default).
+ * @returns 1 on success, 0 on failure.
+ * @ingroup connection
+ */
+int nmdb_add_shm_server(nmdb_t *db, const char *path);
+
 /** Free a nmdb_t structure created by nmdb_init().
  * It also closes all the connections opened to the servers.
  *
@@ -109,10 +136,91 @@ ssize_t nmdb_get(nmdb_t *db, const unsigned char *key, size_t ksize,
 ssize_t nmdb_cache_get(nmdb_t *db, const unsigned char *key, size_t ksize,
 		unsigned char *val, size_t vsize);
 
+/** Get the value associated with a key, and its version.
+ * This is just like nmdb_get(), but it also returns the version of the
+ * value, which can be given to nmdb_cas_version() to replace it only if it
+ * hasn't changed, without having to send it back.
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param[out] val buffer where the value will be stored.
+ * @param vsize size of the value buffer.
+ * @param[out] version pointer to an integer that will be set to the version
+ * 	of the value (can be NULL).
+ * @returns the size of the value written to the given buffer, -1 if the key
+ * 	is not in the database, or -2 if there was an error.
+ * @ingroup database
+ */
+ssize_t nmdb_gets(nmdb_t *db, const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize, uint64_t *version);
+
+/** Get the value associated with a key, and its version, from cache.
+ * This is just like nmdb_gets(), except it only queries the caches, and
+ * never the database.
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param[out] val buffer where the value will be stored.
+ * @param vsize size of the value buffer.
+ * @param[out] version pointer to an integer that will be set to the version
+ * 	of the value (can be NULL).
+ * @returns the size of the value written to the given buffer, -1 if the key
+ * 	is not in the cache, or -2 if there was an error.
+ * @ingroup cache
+ */
+ssize_t nmdb_cache_gets(nmdb_t *db, const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize, uint64_t *version);
+
+/** Get the values associated with many keys at once.
+ * This works like calling nmdb_get() for each key, but the keys are sent to
+ * each server in a single request, and the values found in the cache are
+ * returned in a single reply, which saves a lot of round trips.
+ *
+ * @param db connection instance.
+ * @param nkeys the number of keys.
+ * @param keys array with the keys.
+ * @param ksizes array with the key sizes.
+ * @param[out] vals array of buffers where the values will be stored.
+ * @param vsizes array with the sizes of the value buffers.
+ * @param[out] results array that will be set, for each key, to the size of
+ * 	the value written to its buffer, -1 if the key is not in the database,
+ * 	or -2 if there was an error or the value didn't fit in the buffer.
+ * @returns the number of keys found, or < 0 on error.
+ * @ingroup database
+ */
+int nmdb_mget(nmdb_t *db, size_t nkeys,
+		const unsigned char **keys, const size_t *ksizes,
+		unsigned char **vals, const size_t *vsizes,
+		ssize_t *results);
+
+/** Get the values associated with many keys at once, from cache.
+ * This is just like nmdb_mget(), except it only queries the caches, and
+ * never the database.
+ *
+ * @param db connection instance.
+ * @param nkeys the number of keys.
+ * @param keys array with the keys.
+ * @param ksizes array with the key sizes.
+ * @param[out] vals array of buffers where the values will be stored.
+ * @param vsizes array with the sizes of the value buffers.
+ * @param[out] results array that will be set, for each key, to the size of
+ * 	the value written to its buffer, -1 if the key is not in the cache, or
+ * 	-2 if there was an error or the value didn't fit in the buffer.
+ * @returns the number of keys found, or < 0 on error.
+ * @ingroup cache
+ */
+int nmdb_cache_mget(nmdb_t *db, size_t nkeys,
+		const unsigned char **keys, const size_t *ksizes,
+		unsigned char **vals, const size_t *vsizes,
+		ssize_t *results);
+
 /** Set the value associated with a key.
  * It returns after the command has been acknowledged by the server, but does
  * not wait for the database to confirm it. In any case, further GET requests
  * will return this value, even if this set has not reached the backend yet.
+ * Keys are limited to 64kb; the server rejects bigger ones.
  *
  * @param db connection instance.
  * @param key the key.
@@ -156,6 +264,60 @@ int nmdb_set_sync(nmdb_t *db, const unsigned char *key, size_t ksize,
 int nmdb_cache_set(nmdb_t *db, const unsigned char *key, size_t ksize,
 		const unsigned char *val, size_t vsize);
 
+/** Set the values associated with many keys at once.
+ * This works like calling nmdb_set() for each pair, but the pairs are sent to
+ * each server in a single request, which saves a lot of round trips; the
+ * server also queues them for the database as a single unit.
+ *
+ * @param db connection instance.
+ * @param npairs the number of (key, value) pairs.
+ * @param keys array with the keys.
+ * @param ksizes array with the key sizes.
+ * @param vals array with the values.
+ * @param vsizes array with the value sizes.
+ * @returns 1 on success, < 0 on error.
+ * @ingroup database
+ */
+int nmdb_mset(nmdb_t *db, size_t npairs,
+		const unsigned char **keys, const size_t *ksizes,
+		const unsigned char **vals, const size_t *vsizes);
+
+/** Set the values associated with many keys at once, synchronously.
+ * It works just like nmdb_mset(), except it returns only after the database
+ * confirms it has stored all the values.
+ *
+ * @param db connection instance.
+ * @param npairs the number of (key, value) pairs.
+ * @param keys array with the keys.
+ * @param ksizes array with the key sizes.
+ * @param vals array with the values.
+ * @param vsizes array with the value sizes.
+ * @returns 1 on success, < 0 on error.
+ * @ingroup database
+ */
+int nmdb_mset_sync(nmdb_t *db, size_t npairs,
+		const unsigned char **keys, const size_t *ksizes,
+		const unsigned char **vals, const size_t *vsizes);
+
+/** Set the values associated with many keys at once, but only in the cache.
+ * It works just like nmdb_mset(), except it only affects the cache, like
+ * nmdb_cache_set().
+ *
+ * @param db connection instance.
+ * @param npairs the number of (key, value) pairs.
+ * @param keys array with the keys.
+ * @param ksizes array with the key sizes.
+ * @param vals array with the values.
+ * @param vsizes array with the value sizes.
+ * @returns 1 on success, < 0 on error. If the server runs out of memory, the
+ * 	pairs it couldn't set are removed from the cache, and the rest are
+ * 	left set.
+ * @ingroup cache
+ */
+int nmdb_cache_mset(nmdb_t *db, size_t npairs,
+		const unsigned char **keys, const size_t *ksizes,
+		const unsigned char **vals, const size_t *vsizes);
+
 /** Delete a key.
  * It returns after the command has been acknowledged by the server, but does
  * not wait for the database to confirm it. In any case, further GET requests
@@ -239,6 +401,50 @@ int nmdb_cache_cas(nmdb_t *db, const unsigned char *key, size_t ksize,
 		const unsigned char *oldval, size_t ovsize,
 		const unsigned char *newval, size_t nvsize);
 
+/** Perform an atomic compare-and-swap using the version of the old value.
+ * This command works just like nmdb_cas(), but instead of the old value it
+ * takes its version, as returned by nmdb_gets(), so the old value doesn't
+ * have to be sent. The version changes every time the value does, but since
+ * the databases can't store it, for values that are not in the cache it's
+ * a hash of the value, which matches again if the value goes back to what
+ * it was. Versions don't survive a server restart, and the ones of cached
+ * values stop matching when the value leaves the cache.
+ * Equivalent to atomically doing:
+ *
+ * 	if version(get(key)) == version, then set(key, newval)
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param version the version of the expected value.
+ * @param newval the new value to set.
+ * @param nvsize size of the new value.
+ * @returns 2 on success, 1 if the version of the current value does not
+ * 	match, 0 if the key is not in the database, or < 0 on error.
+ * @ingroup database
+ */
+int nmdb_cas_version(nmdb_t *db, const unsigned char *key, size_t ksize,
+		uint64_t version, const unsigned char *newval, size_t nvsize);
+
+/** Perform an atomic compare-and-swap using the version of the old value,
+ * only on the cache.
+ * This command works just like nmdb_cas_version(), except it affects only
+ * the cache, and not the backend database.
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param version the version of the expected value.
+ * @param newval the new value to set.
+ * @param nvsize size of the new value.
+ * @returns 2 on success, 1 if the version of the current value does not
+ * 	match, 0 if the key is not in the cache, or < 0 on error.
+ * @ingroup cache
+ */
+int nmdb_cache_cas_version(nmdb_t *db, const unsigned char *key,
+		size_t ksize, uint64_t version,
+		const unsigned char *newval, size_t nvsize);
+
 /** Atomically increment the value associated with a key.
  * This command atomically increments the value associated with a key in the
  * given increment. However, there are requirements on the current value: it
@@ -277,6 +483,450 @@ int nmdb_incr(nmdb_t *db, const unsigned char *key, size_t ksize,
 int nmdb_cache_incr(nmdb_t *db, const unsigned char *key, size_t ksize,
                 int64_t increment, int64_t *newval);
 
+/** Atomically increment a binary counter.
+ * This command works just like nmdb_incr(), except the current value must be
+ * a binary counter: a signed 64-bit integer in network byte order, exactly 8
+ * bytes long. Counters can be created by setting such a value with
+ * nmdb_set(), and read with nmdb_get(). They are incremented in place, which
+ * is much faster than the text representation used by nmdb_incr().
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param increment the value to add to the current one (can be negative).
+ * @param[out] newval pointer to an integer that will be set to the new
+ * 	value.
+ * @returns 2 if the increment was successful, 1 if the current value was not
+ * 	a binary counter, 0 if the key is not in the database, or < 0 on
+ * 	error.
+ * @ingroup database
+ */
+int nmdb_incr_bin(nmdb_t *db, const unsigned char *key, size_t ksize,
+		int64_t increment, int64_t *newval);
+
+/** Atomically increment a binary counter only in the cache.
+ * This command works just like nmdb_incr_bin(), except it affects only the
+ * cache, and not the backend database.
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param increment the value to add to the current one (can be negative).
+ * @param[out] newval pointer to an integer that will be set to the new
+ * 	value.
+ * @returns 2 if the increment was successful, 1 if the current value was not
+ * 	a binary counter, 0 if the key is not in the database, or < 0 on
+ * 	error.
+ * @ingroup cache
+ */
+int nmdb_cache_incr_bin(nmdb_t *db, const unsigned char *key, size_t ksize,
+		int64_t increment, int64_t *newval);
+
+/** Asynchronously increment the value associated with a key.
+ * This command works just like nmdb_incr(), except the database is updated
+ * asynchronously, and the new value is not returned. Increments to the same
+ * key that are waiting to be written are added up on the server, so many of
+ * them result in a single database update; this makes it well suited for
+ * high-rate counters.
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param increment the value to add to the current one (can be negative).
+ * @returns 2 if the increment was queued, 1 if the cached value was not in an
+ * 	appropriate format, or < 0 on error. Errors found when updating the
+ * 	database (like the key not being there) are not reported.
+ * @ingroup database
+ */
+int nmdb_incr_async(nmdb_t *db, const unsigned char *key, size_t ksize,
+		int64_t increment);
+
+/** Asynchronously increment a binary counter.
+ * This command works just like nmdb_incr_async(), but on binary counters
+ * (see nmdb_incr_bin()).
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param increment the value to add to the current one (can be negative).
+ * @returns 2 if the increment was queued, 1 if the cached value was not a
+ * 	binary counter, or < 0 on error. Errors found when updating the
+ * 	database (like the key not being there) are not reported.
+ * @ingroup database
+ */
+int nmdb_incr_bin_async(nmdb_t *db, const unsigned char *key, size_t ksize,
+		int64_t increment);
+
+/** Atomically append data to the value associated with a key.
+ * This command adds the given data at the end of the current value, without
+ * having to get it and set it back, so only the new data is sent. It's well
+ * suited for values that grow over time, like logs or lists.
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param data the data to add.
+ * @param dsize the data size.
+ * @returns 2 if the data was appended, 1 if the resulting value would be
+ * 	bigger than the server's maximum value size, 0 if the key is not in
+ * 	the database, or < 0 on error.
+ * @ingroup database
+ */
+int nmdb_append(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize);
+
+/** Atomically append data to the value associated with a key only in the
+ * cache.
+ * This command works just like nmdb_append(), except it affects only the
+ * cache, and not the backend database.
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param data the data to add.
+ * @param dsize the data size.
+ * @returns 2 if the data was appended, 1 if the resulting value would be
+ * 	bigger than the server's maximum value size, 0 if the key is not in
+ * 	the cache, or < 0 on error.
+ * @ingroup cache
+ */
+int nmdb_cache_append(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize);
+
+/** Asynchronously append data to the value associated with a key.
+ * This command works just like nmdb_append(), except the database is updated
+ * asynchronously.
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param data the data to add.
+ * @param dsize the data size.
+ * @returns 2 if the append was queued, 1 if the cached value would grow
+ * 	bigger than the server's maximum value size, or < 0 on error. Errors
+ * 	found when updating the database (like the key not being there) are
+ * 	not reported.
+ * @ingroup database
+ */
+int nmdb_append_async(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize);
+
+/** Atomically prepend data to the value associated with a key.
+ * This command works just like nmdb_append(), except the data is added at
+ * the beginning of the current value.
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param data the data to add.
+ * @param dsize the data size.
+ * @returns 2 if the data was prepended, 1 if the resulting value would be
+ * 	bigger than the server's maximum value size, 0 if the key is not in
+ * 	the database, or < 0 on error.
+ * @ingroup database
+ */
+int nmdb_prepend(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize);
+
+/** Atomically prepend data to the value associated with a key only in the
+ * cache.
+ * This command works just like nmdb_prepend(), except it affects only the
+ * cache, and not the backend database.
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param data the data to add.
+ * @param dsize the data size.
+ * @returns 2 if the data was prepended, 1 if the resulting value would be
+ * 	bigger than the server's maximum value size, 0 if the key is not in
+ * 	the cache, or < 0 on error.
+ * @ingroup cache
+ */
+int nmdb_cache_prepend(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize);
+
+/** Asynchronously prepend data to the value associated with a key.
+ * This command works just like nmdb_prepend(), except the database is
+ * updated asynchronously (see nmdb_append_async()).
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param data the data to add.
+ * @param dsize the data size.
+ * @returns 2 if the prepend was queued, 1 if the cached value would grow
+ * 	bigger than the server's maximum value size, or < 0 on error. Errors
+ * 	found when updating the database (like the key not being there) are
+ * 	not reported.
+ * @ingroup database
+ */
+int nmdb_prepend_async(nmdb_t *db, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize);
+
+
+/**
+ * @addtogroup async Asynchronous API
+ * Functions to send requests without waiting for their replies, so many of
+ * them can be in flight at the same time. Each request is sent right away,
+ * and returns a nmdb_req_t that is completed when its reply arrives, which
+ * can be in any order. Replies are read by nmdb_poll(), nmdb_wait(), and by
+ * the synchronous functions while they wait for their own, so both APIs can
+ * be mixed on the same connection.
+ *
+ * The results of completed requests are the same as the ones of the
+ * equivalent synchronous functions. Buffers given to these functions (like
+ * the one for the value of a get) must remain valid until the request is
+ * completed or freed.
+ */
+
+/** Opaque type representing an asynchronous request. */
+typedef struct nmdb_req nmdb_req_t;
+
+/** Send a get request, like nmdb_get().
+ *
+ * @param db connection instance.
+ * @param key the key.
+ * @param ksize the key size.
+ * @param[out] val buffer where the value will be stored.
+ * @param vsize size of the value buffer.
+ * @returns a new request, or NULL if there was not enough memory. If it
+ * 	couldn't be sent, it is returned already completed with an error.
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_get(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize);
+
+/** Send a get request that only queries the cache, like nmdb_cache_get().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_cache_get(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize);
+
+/** Send a set request, like nmdb_set().
+ * The key and value are copied, so they don't need to remain valid.
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_set(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize);
+
+/** Send a synchronous set request, like nmdb_set_sync().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_set_sync(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize);
+
+/** Send a set request that only affects the cache, like nmdb_cache_set().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_cache_set(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize);
+
+/** Send a del request, like nmdb_del().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_del(nmdb_t *db,
+		const unsigned char *key, size_t ksize);
+
+/** Send a synchronous del request, like nmdb_del_sync().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_del_sync(nmdb_t *db,
+		const unsigned char *key, size_t ksize);
+
+/** Send a del request that only affects the cache, like nmdb_cache_del().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_cache_del(nmdb_t *db,
+		const unsigned char *key, size_t ksize);
+
+/** Send a compare-and-swap request, like nmdb_cas().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_cas(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *oldval, size_t ovsize,
+		const unsigned char *newval, size_t nvsize);
+
+/** Send a get request that also returns the value's version, like
+ * nmdb_gets().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_gets(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		unsigned char *val, size_t vsize, uint64_t *version);
+
+/** Send a compare-and-swap request using the old value's version, like
+ * nmdb_cas_version().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_cas_version(nmdb_t *db,
+		const unsigned char *key, size_t ksize, uint64_t version,
+		const unsigned char *newval, size_t nvsize);
+
+/** Send an increment request, like nmdb_incr().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_incr(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		int64_t increment, int64_t *newval);
+
+/** Send a binary counter increment request, like nmdb_incr_bin().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_incr_bin(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		int64_t increment, int64_t *newval);
+
+/** Send an append request, like nmdb_append().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_append(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize);
+
+/** Send a prepend request, like nmdb_prepend().
+ * @ingroup async
+ */
+nmdb_req_t *nmdb_submit_prepend(nmdb_t *db,
+		const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize);
+
+/** Process the replies that arrive within the given time.
+ * Waits up to timeout milliseconds for replies, and once some arrive, it
+ * processes all the available ones without waiting any further. In
+ * non-blocking mode, it also sends the queued requests.
+ *
+ * @param db connection instance.
+ * @param timeout how long to wait, in milliseconds; 0 means don't wait at
+ * 	all, and -1 means wait until at least one reply arrives.
+ * @returns the number of requests completed (which can be 0), or -1 on
+ * 	error. Requests to servers that can't be read from are completed with
+ * 	an error.
+ * @ingroup async
+ */
+int nmdb_poll(nmdb_t *db, int timeout);
+
+/** Wait until the given request is completed.
+ *
+ * @param db connection instance.
+ * @param req the request.
+ * @returns the result of the request, see nmdb_req_result().
+ * @ingroup async
+ */
+ssize_t nmdb_wait(nmdb_t *db, nmdb_req_t *req);
+
+/** Tell if the given request was completed.
+ *
+ * @param req the request.
+ * @returns 1 if it was completed, 0 otherwise.
+ * @ingroup async
+ */
+int nmdb_req_done(const nmdb_req_t *req);
+
+/** Get the result of a completed request.
+ *
+ * @param req the request.
+ * @returns the result, which is the same that the equivalent synchronous
+ * 	function would have returned.
+ * @ingroup async
+ */
+ssize_t nmdb_req_result(const nmdb_req_t *req);
+
+/** Free a request.
+ * It can be freed before it's completed, in which case its reply will be
+ * ignored.
+ *
+ * @param db connection instance the request was sent on.
+ * @param req the request.
+ * @ingroup async
+ */
+void nmdb_req_free(nmdb_t *db, nmdb_req_t *req);
+
+
+/**
+ * @addtogroup nonblock Non-blocking API
+ * Functions to drive the connection from an external event loop (like
+ * libevent, or a plain poll() loop) instead of letting the library wait.
+ *
+ * After nmdb_set_nonblock(), the library never blocks on the network while
+ * submitting or processing asynchronous requests: what can't be sent right
+ * away is queued, and the application is expected to watch the file
+ * descriptors returned by nmdb_fds() and call nmdb_handle_fd() when they are
+ * ready. Completions can be notified with callbacks, see
+ * nmdb_req_set_callback(). The synchronous functions and nmdb_wait() can
+ * still be used, they just wait until their request is completed.
+ *
+ * The events each descriptor has to be watched for change as requests are
+ * submitted and processed, so nmdb_fds() should be called again after doing
+ * so.
+ */
+
+/** Watch the file descriptor for reading. @ingroup nonblock */
+#define NMDB_EV_READ 1
+
+/** Watch the file descriptor for writing. @ingroup nonblock */
+#define NMDB_EV_WRITE 2
+
+/** Type of the functions called when a request is completed.
+ * @ingroup nonblock
+ */
+typedef void (*nmdb_callback_t)(nmdb_req_t *req, void *arg);
+
+/** Put the connection in non-blocking mode.
+ * Must be called after all the servers were added.
+ *
+ * @param db connection instance.
+ * @returns 1 on success, 0 on error.
+ * @ingroup nonblock
+ */
+int nmdb_set_nonblock(nmdb_t *db);
+
+/** Get the file descriptors to watch, and the events to watch them for.
+ *
+ * @param db connection instance.
+ * @param[out] fds array where the file descriptors will be stored.
+ * @param[out] events array where the events (a combination of NMDB_EV_READ
+ * 	and NMDB_EV_WRITE) for each file descriptor will be stored.
+ * @param n size of the arrays.
+ * @returns the number of file descriptors of the connection, which can be
+ * 	more than n, in which case only the first n are stored.
+ * @ingroup nonblock
+ */
+int nmdb_fds(nmdb_t *db, int *fds, int *events, int n);
+
+/** Handle the events of a file descriptor.
+ * Sends the queued requests if it is writable, and processes the available
+ * replies if it is readable.
+ *
+ * @param db connection instance.
+ * @param fd the file descriptor, as returned by nmdb_fds().
+ * @param events the events that happened (a combination of NMDB_EV_READ and
+ * 	NMDB_EV_WRITE).
+ * @returns the number of requests completed (which can be 0), or -1 on
+ * 	error, in which case the requests sent to that server are completed
+ * 	with an error.
+ * @ingroup nonblock
+ */
+int nmdb_handle_fd(nmdb_t *db, int fd, int events);
+
+/** Set the function to call when the given request is completed.
+ * If it already is, the function is called right away. The callback can
+ * submit new requests, and free the request it's given, unless something
+ * is waiting on it with nmdb_wait().
+ *
+ * @param req the request.
+ * @param cb the function to call, or NULL to remove it.
+ * @param arg argument to pass to the function.
+ * @ingroup nonblock
+ */
+void nmdb_req_set_callback(nmdb_req_t *req, nmdb_callback_t cb, void *arg);
+
 
 /**
  * @addtogroup utility Functions used in nmdb utilities
@@ -332,6 +982,225 @@ ssize_t nmdb_firstkey(nmdb_t *db, unsigned char *key, size_t ksize);
 ssize_t nmdb_nextkey(nmdb_t *db, const unsigned char *key, size_t ksize,
 		unsigned char *newkey, size_t nksize);
 
+/** Function called by nmdb_scan() and nmdb_scan_keys() for each key.
+ * The key and value are only valid until the function returns.
+ *
+ * @param key the key.
+ * @param ksize the key size.
+ * @param val the value, or NULL if the values were not requested or if it
+ * 	was too big to be sent along with the key (and must be retrieved with
+ * 	nmdb_get()).
+ * @param vsize the value size, or 0 if val is NULL.
+ * @param arg the argument given to nmdb_scan().
+ * @ingroup utility
+ */
+typedef void (*nmdb_scan_cb_t)(const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize, void *arg);
+
+/** Get many keys at once, along with their values.
+ * Gets the keys that follow the given one, in the same order as
+ * nmdb_nextkey(), and calls cb for each of them. Many keys are returned in a
+ * single round trip, so walking the database this way is much faster than
+ * with nmdb_nextkey(). To get the next batch, call it again with the last key
+ * of the previous one. The same caveats as nmdb_nextkey() apply, except that
+ * with the leveldb backend the keys are returned in order.
+ *
+ * @param db connection instance.
+ * @param start the key to start after; pass a size of 0 to start from the
+ * 	first key.
+ * @param ssize the start key size.
+ * @param nkeys the maximum number of keys to get, or 0 for no limit.
+ * @param maxbytes the maximum size of the batch, or 0 to use the largest
+ * 	possible one (about 64kb). The first key is returned even if it goes
+ * 	over the limit.
+ * @param cb the function to call for each key.
+ * @param arg argument to pass to the function.
+ * @returns -2 on error, 0 if there are no keys after the given one, or the
+ * 	number of keys returned.
+ * @ingroup utility
+ */
+ssize_t nmdb_scan(nmdb_t *db, const unsigned char *start, size_t ssize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg);
+
+/** Get many keys at once.
+ * Like nmdb_scan(), but only gets the keys, without their values.
+ *
+ * @param db connection instance.
+ * @param start the key to start after; pass a size of 0 to start from the
+ * 	first key.
+ * @param ssize the start key size.
+ * @param nkeys the maximum number of keys to get, or 0 for no limit.
+ * @param maxbytes the maximum size of the batch, or 0 to use the largest
+ * 	possible one (about 64kb).
+ * @param cb the function to call for each key.
+ * @param arg argument to pass to the function.
+ * @returns -2 on error, 0 if there are no keys after the given one, or the
+ * 	number of keys returned.
+ * @ingroup utility
+ */
+ssize_t nmdb_scan_keys(nmdb_t *db, const unsigned char *start, size_t ssize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg);
+
+/** Open a scan cursor.
+ * Cursors are used to walk the database in batches like nmdb_scan(), but the
+ * server keeps its place between them, which is faster for backends that
+ * support it (like leveldb, which also gives a consistent view of the
+ * database while the cursor is open). Cursors are read with
+ * nmdb_scan_next(), and must be closed with nmdb_scan_close(); the server
+ * closes them by itself if they are not used for a while.
+ *
+ * @param db connection instance.
+ * @param start the key to start after; pass a size of 0 to start from the
+ * 	first key.
+ * @param ssize the start key size.
+ * @param[out] cursor the ID of the new cursor.
+ * @returns 1 on success, or -2 on error (including when the server has too
+ * 	many cursors open).
+ * @ingroup utility
+ */
+int nmdb_scan_open(nmdb_t *db, const unsigned char *start, size_t ssize,
+		uint32_t *cursor);
+
+/** Get the next batch of keys from a scan cursor, along with their values.
+ * Works like nmdb_scan(), but continues where the previous call left off.
+ *
+ * @param db connection instance.
+ * @param cursor the cursor, from nmdb_scan_open().
+ * @param nkeys the maximum number of keys to get, or 0 for no limit.
+ * @param maxbytes the maximum size of the batch, or 0 to use the largest
+ * 	possible one (about 64kb). The first key is returned even if it goes
+ * 	over the limit.
+ * @param cb the function to call for each key.
+ * @param arg argument to pass to the function.
+ * @returns -3 if the cursor was closed or expired, -2 on error, 0 if there
+ * 	are no more keys, or the number of keys returned.
+ * @ingroup utility
+ */
+ssize_t nmdb_scan_next(nmdb_t *db, uint32_t cursor,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg);
+
+/** Get the next batch of keys from a scan cursor.
+ * Like nmdb_scan_next(), but only gets the keys, without their values.
+ *
+ * @param db connection instance.
+ * @param cursor the cursor, from nmdb_scan_open().
+ * @param nkeys the maximum number of keys to get, or 0 for no limit.
+ * @param maxbytes the maximum size of the batch, or 0 to use the largest
+ * 	possible one (about 64kb).
+ * @param cb the function to call for each key.
+ * @param arg argument to pass to the function.
+ * @returns -3 if the cursor was closed or expired, -2 on error, 0 if there
+ * 	are no more keys, or the number of keys returned.
+ * @ingroup utility
+ */
+ssize_t nmdb_scan_next_keys(nmdb_t *db, uint32_t cursor,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg);
+
+/** Close a scan cursor.
+ *
+ * @param db connection instance.
+ * @param cursor the cursor, from nmdb_scan_open().
+ * @returns 1 if the cursor was closed, 0 if it didn't exist (it was already
+ * 	closed, or it expired), or -2 on error.
+ * @ingroup utility
+ */
+int nmdb_scan_close(nmdb_t *db, uint32_t cursor);
+
+/** Get the keys that begin with the given prefix, along with their values.
+ * Only works with backends that keep the keys sorted (like leveldb); the
+ * keys are returned in order, and cb is called for each one. Like with
+ * nmdb_scan(), many keys are returned at once, but not necessarily all of
+ * them; to get the next batch, call it again passing as start the last key
+ * with a 0 byte appended, which is the smallest key that goes after it.
+ *
+ * @param db connection instance.
+ * @param prefix the prefix.
+ * @param psize the prefix size.
+ * @param start the key to start at, ignored if it comes before the first
+ * 	key with the prefix (so it can be empty, with a size of 0).
+ * @param ssize the start key size.
+ * @param nkeys the maximum number of keys to get, or 0 for no limit.
+ * @param maxbytes the maximum size of the batch, or 0 to use the largest
+ * 	possible one (about 64kb). The first key is returned even if it goes
+ * 	over the limit.
+ * @param cb the function to call for each key.
+ * @param arg argument to pass to the function.
+ * @returns -2 on error (including when the backend doesn't keep the keys
+ * 	sorted), 0 if there are no more keys, or the number of keys returned.
+ * @ingroup utility
+ */
+ssize_t nmdb_prefix(nmdb_t *db, const unsigned char *prefix, size_t psize,
+		const unsigned char *start, size_t ssize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg);
+
+/** Get the keys that begin with the given prefix.
+ * Like nmdb_prefix(), but only gets the keys, without their values.
+ *
+ * @param db connection instance.
+ * @param prefix the prefix.
+ * @param psize the prefix size.
+ * @param start the key to start at, ignored if it comes before the first
+ * 	key with the prefix.
+ * @param ssize the start key size.
+ * @param nkeys the maximum number of keys to get, or 0 for no limit.
+ * @param maxbytes the maximum size of the batch, or 0 to use the largest
+ * 	possible one (about 64kb).
+ * @param cb the function to call for each key.
+ * @param arg argument to pass to the function.
+ * @returns -2 on error (including when the backend doesn't keep the keys
+ * 	sorted), 0 if there are no more keys, or the number of keys returned.
+ * @ingroup utility
+ */
+ssize_t nmdb_prefix_keys(nmdb_t *db, const unsigned char *prefix,
+		size_t psize, const unsigned char *start, size_t ssize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg);
+
+/** Get the keys in the given range, along with their values.
+ * Works like nmdb_prefix(), but returns the keys from start (included) to
+ * end (not included), in the order of memcmp(3).
+ *
+ * @param db connection instance.
+ * @param start the first key of the range.
+ * @param ssize the start key size.
+ * @param end the key where the range ends; pass a size of 0 to go on until
+ * 	the last key.
+ * @param esize the end key size.
+ * @param nkeys the maximum number of keys to get, or 0 for no limit.
+ * @param maxbytes the maximum size of the batch, or 0 to use the largest
+ * 	possible one (about 64kb). The first key is returned even if it goes
+ * 	over the limit.
+ * @param cb the function to call for each key.
+ * @param arg argument to pass to the function.
+ * @returns -2 on error (including when the backend doesn't keep the keys
+ * 	sorted), 0 if there are no more keys, or the number of keys returned.
+ * @ingroup utility
+ */
+ssize_t nmdb_range(nmdb_t *db, const unsigned char *start, size_t ssize,
+		const unsigned char *end, size_t esize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg);
+
+/** Get the keys in the given range.
+ * Like nmdb_range(), but only gets the keys, without their values.
+ *
+ * @param db connection instance.
+ * @param start the first key of the range.
+ * @param ssize the start key size.
+ * @param end the key where the range ends; pass a size of 0 to go on until
+ * 	the last key.
+ * @param esize the end key size.
+ * @param nkeys the maximum number of keys to get, or 0 for no limit.
+ * @param maxbytes the maximum size of the batch, or 0 to use the largest
+ * 	possible one (about 64kb).
+ * @param cb the function to call for each key.
+ * @param arg argument to pass to the function.
+ * @returns -2 on error (including when the backend doesn't keep the keys
+ * 	sorted), 0 if there are no more keys, or the number of keys returned.
+ * @ingroup utility
+ */
+ssize_t nmdb_range_keys(nmdb_t *db, const unsigned char *start, size_t ssize,
+		const unsigned char *end, size_t esize,
+		size_t nkeys, size_t maxbytes, nmdb_scan_cb_t cb, void *arg);
+
 
 /** Request servers' statistics.
  * This API is used by nmdb-stats, and likely to change in the future. Do not
@@ -351,5 +1220,45 @@ ssize_t nmdb_nextkey(nmdb_t *db, const unsigned char *key, size_t ksize,
 int nmdb_stats(nmdb_t *db, unsigned char *buf, size_t bsize,
 		unsigned int *nservers, unsigned int *nstats);
 
+/** Request servers' extended statistics.
+ * Works like nmdb_stats(), but returns internal information useful for
+ * tuning the servers, like cache occupancy and chain lengths. The first
+ * value of each server is the version of the extended statistics, which
+ * tells which fields follow; see the server documentation for details.
+ * This API is used by nmdb-stats, and likely to change in the future. Do not
+ * rely on it.
+ *
+ * @param db connection instance.
+ * @param[out] buf buffer used to store the results.
+ * @param bsize size of the buffer.
+ * @param[out] nservers number of servers queried.
+ * @param [out] nstats number of stats per server.
+ * @returns the same values as nmdb_stats().
+ * @ingroup utility
+ */
+int nmdb_xstats(nmdb_t *db, unsigned char *buf, size_t bsize,
+		unsigned int *nservers, unsigned int *nstats);
+
+/** Request the server's hot keys.
+ * The server samples key accesses and keeps track of the most frequently
+ * read and written keys. This returns them in the raw network format: a
+ * 32-bit number of read entries, the entries, and then a 32-bit number of
+ * write entries and the entries. Each entry is a 64-bit estimated access
+ * count, a 32-bit key size and then the key; all integers are in network
+ * byte order. Entries are sorted from the most to the least accessed.
+ *
+ * Like nmdb_firstkey(), it will fail if db has more than one server.
+ * This API is used by nmdb-stats, and likely to change in the future.
+ *
+ * @param db connection instance.
+ * @param[out] buf buffer used to store the results.
+ * @param bsize size of the buffer.
+ * @returns the size of the data written to buf on success, -1 if there was
+ * 	an error in the server, -2 if there was a network error, or -3 if the
+ * 	buffer was too small.
+ * @ingroup utility
+ */
+ssize_t nmdb_hot_keys(nmdb_t *db, unsigned char *buf, size_t bsize);
+
 #endif
 
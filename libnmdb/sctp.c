@@ -8,6 +8,7 @@
 #include <arpa/inet.h>		/* htonls() and friends */
 #include <string.h>		/* memcpy() */
 #include <unistd.h>		/* close() */
+#include <errno.h>		/* errno */
 
 #include <netinet/sctp.h>	/* SCTP stuff */
 #include <netdb.h>		/* gethostbyname() */
@@ -52,6 +53,7 @@ static int add_sctp_server_addr(nmdb_t *db, in_addr_t *inetaddr, int port)
 	newsrv = &(db->servers[db->nservers - 1]);
 
 	newsrv->fd = fd;
+	init_srv_state(newsrv);
 	newsrv->info.in.srvsa.sin_family = AF_INET;
 	newsrv->info.in.srvsa.sin_port = htons(port);
 	newsrv->info.in.srvsa.sin_addr.s_addr = *inetaddr;
@@ -97,28 +99,100 @@ int sctp_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize)
 	return 1;
 }
 
+/* Receives the rest of a message that is being delivered in pieces, the
+ * first len bytes of which are in buf, into the server's big buffer. Returns
+ * the size of the message, or -1 on error. */
+static ssize_t recv_pieces(struct nmdb_srv *srv, unsigned char *buf,
+		size_t len)
+{
+	ssize_t rv;
+	unsigned char *newbuf;
+	struct msghdr msg;
+	struct iovec iov;
+	struct pollfd pfd;
+
+	if (srv_big_buf(srv, len * 2) == NULL)
+		return -1;
+	memcpy(srv->bigbuf, buf, len);
+
+	for (;;) {
+		if (len == srv->bigsize) {
+			newbuf = realloc(srv->bigbuf, srv->bigsize * 2);
+			if (newbuf == NULL)
+				return -1;
+			srv->bigbuf = newbuf;
+			srv->bigsize *= 2;
+		}
+
+		iov.iov_base = srv->bigbuf + len;
+		iov.iov_len = srv->bigsize - len;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		rv = recvmsg(srv->fd, &msg, 0);
+		if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* in non-blocking mode, the rest of the message may
+			 * not be here yet, but it's on its way */
+			pfd.fd = srv->fd;
+			pfd.events = POLLIN;
+			poll(&pfd, 1, -1);
+			continue;
+		} else if (rv <= 0) {
+			return -1;
+		}
+
+		len += rv;
+		if (msg.msg_flags & MSG_EOR)
+			return len;
+	}
+}
+
+/* Receives a message into *buf, which is bsize bytes long. Messages that
+ * don't fit (which carry big values) are delivered by the kernel in pieces,
+ * and are reassembled in the server's big buffer, in which case *buf is
+ * changed to point to it. */
+static ssize_t recv_msg(struct nmdb_srv *srv, unsigned char **buf,
+		size_t bsize)
+{
+	ssize_t rv;
+	struct msghdr msg;
+	struct iovec iov;
+
+	iov.iov_base = *buf;
+	iov.iov_len = bsize;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	rv = recvmsg(srv->fd, &msg, 0);
+	if (rv <= 0 || (msg.msg_flags & MSG_EOR))
+		return rv;
+
+	rv = recv_pieces(srv, *buf, rv);
+	if (rv > 0)
+		*buf = srv->bigbuf;
+	return rv;
+}
+
 /* Used internally to get and parse replies from the server. */
 uint32_t sctp_get_rep(struct nmdb_srv *srv,
-		unsigned char *buf, size_t bsize,
+		unsigned char *buf, size_t bsize, uint32_t *id,
 		unsigned char **payload, size_t *psize)
 {
 	ssize_t rv;
-	uint32_t id, reply;
+	uint32_t reply;
 
-	rv = recv(srv->fd, buf, bsize, 0);
+	rv = recv_msg(srv, &buf, bsize);
 	if (rv < 4 + 4) {
 		return -1;
 	}
 
-	id = * (uint32_t *) buf;
-	id = ntohl(id);
+	*id = * (uint32_t *) buf;
+	*id = ntohl(*id);
 	reply = * ((uint32_t *) buf + 1);
 	reply = ntohl(reply);
 
-	if (id != ID_CODE) {
-		return -1;
-	}
-
 	if (payload != NULL) {
 		*payload = buf + 4 + 4;
 		*psize = rv - 4 - 4;
@@ -144,7 +218,7 @@ int sctp_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize)
 }
 
 uint32_t sctp_get_rep(struct nmdb_srv *srv,
-		unsigned char *buf, size_t bsize,
+		unsigned char *buf, size_t bsize, uint32_t *id,
 		unsigned char **payload, size_t *psize)
 {
 	return -1;
@@ -0,0 +1 @@
+../nmdb/shm-ring.h
\ No newline at end of file
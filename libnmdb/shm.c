@@ -0,0 +1,375 @@
+
+#if ENABLE_SHM
+
+#include <sys/types.h>		/* socket defines */
+#include <sys/socket.h>		/* socket functions */
+#include <sys/un.h>		/* struct sockaddr_un */
+#include <sys/mman.h>		/* mmap() */
+#include <stdlib.h>		/* malloc() */
+#include <stdint.h>		/* uint32_t and friends */
+#include <arpa/inet.h>		/* htonls() and friends */
+#include <string.h>		/* memcpy() */
+#include <unistd.h>		/* close() */
+#include <errno.h>		/* errno */
+#include <poll.h>		/* poll() */
+#include <time.h>		/* clock_gettime() */
+
+#include "nmdb.h"
+#include "net-const.h"
+#include "internal.h"
+#include "shm-ring.h"
+#include "shm.h"
+
+
+/* When waiting for a reply, we keep looking at the ring for this many
+ * microseconds before going to sleep; replies from the cache usually come
+ * before that, and this way neither side has to wake the other up. With a
+ * single processor it would only get in the server's way, so we don't. */
+#define SHM_SPIN_USEC 50
+
+
+/* Receives the shared area from the server. Returns NULL on error. */
+static struct shm_area *get_area(int fd)
+{
+	int memfd = -1;
+	uint32_t hdr[2];
+	struct shm_area *area;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		unsigned char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(hdr);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	if (recvmsg(fd, &msg, 0) != sizeof(hdr))
+		return NULL;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+			|| cmsg->cmsg_type != SCM_RIGHTS)
+		return NULL;
+	memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+	/* check the server uses the same layout we do */
+	if (hdr[0] != SHM_MAGIC || hdr[1] != sizeof(struct shm_area)) {
+		close(memfd);
+		return NULL;
+	}
+
+	area = mmap(NULL, sizeof(struct shm_area), PROT_READ | PROT_WRITE,
+			MAP_SHARED, memfd, 0);
+	close(memfd);
+	if (area == MAP_FAILED)
+		return NULL;
+
+	return area;
+}
+
+/* Add a shared memory server to the db connection. */
+int nmdb_add_shm_server(nmdb_t *db, const char *path)
+{
+	int rv, fd;
+	struct nmdb_srv *newsrv, *newarray;
+
+	if (path == NULL)
+		path = SHM_SERVER_PATH;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0)
+		return 0;
+
+	newarray = realloc(db->servers,
+			sizeof(struct nmdb_srv) * (db->nservers + 1));
+	if (newarray == NULL) {
+		close(fd);
+		return 0;
+	}
+
+	db->servers = newarray;
+	db->nservers++;
+
+	newsrv = &(db->servers[db->nservers - 1]);
+
+	newsrv->fd = fd;
+	init_srv_state(newsrv);
+	if (strlen(path) >= sizeof(newsrv->info.shm.srvsa.sun_path))
+		goto error_exit;
+	newsrv->info.shm.srvsa.sun_family = AF_UNIX;
+	strcpy(newsrv->info.shm.srvsa.sun_path, path);
+
+	rv = connect(fd, (struct sockaddr *) &(newsrv->info.shm.srvsa),
+			sizeof(newsrv->info.shm.srvsa));
+	if (rv < 0)
+		goto error_exit;
+
+	newsrv->info.shm.area = get_area(fd);
+	if (newsrv->info.shm.area == NULL)
+		goto error_exit;
+
+	newsrv->info.shm.spin_usec = 0;
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+		newsrv->info.shm.spin_usec = SHM_SPIN_USEC;
+
+	newsrv->type = SHM_CONN;
+
+	/* keep the list sorted by path, so we can do a reliable selection */
+	qsort(db->servers, db->nservers, sizeof(struct nmdb_srv),
+			compare_servers);
+
+	return 1;
+
+error_exit:
+	close(fd);
+	newarray = realloc(db->servers,
+			sizeof(struct nmdb_srv) * (db->nservers - 1));
+	if (newarray == NULL) {
+		db->servers = NULL;
+		db->nservers = 0;
+		return 0;
+	}
+
+	db->servers = newarray;
+	db->nservers -= 1;
+
+	return 0;
+}
+
+void shm_srv_free(struct nmdb_srv *srv)
+{
+	munmap(srv->info.shm.area, sizeof(struct shm_area));
+}
+
+/* Tells the server to look at the rings. */
+static void wake(struct nmdb_srv *srv, unsigned char c)
+{
+	send(srv->fd, &c, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* Waits until the server wakes us up. Returns 0 if it went away. */
+static int wait_wake(struct nmdb_srv *srv)
+{
+	ssize_t rv;
+	unsigned char buf[16];
+	struct pollfd pfd;
+
+	pfd.fd = srv->fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		return 0;
+
+	rv = recv(srv->fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (rv == 0 || (rv < 0 && errno != EAGAIN && errno != EINTR))
+		return 0;
+	return 1;
+}
+
+/* Reads the wake ups we got, without waiting. Returns 0 if the server went
+ * away. */
+static int read_wakes(struct nmdb_srv *srv)
+{
+	ssize_t rv;
+	unsigned char buf[16];
+
+	for (;;) {
+		rv = recv(srv->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (rv < 0 && (errno == EAGAIN || errno == EINTR))
+			return 1;
+		else if (rv <= 0)
+			return 0;
+	}
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+int shm_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize)
+{
+	unsigned char *p;
+	struct shm_ring *ring = &(srv->info.shm.area->req);
+
+	if (bsize > SHM_MAX_MSG)
+		return 0;
+
+	for (;;) {
+		p = shm_ring_reserve(ring, bsize);
+		if (p != NULL)
+			break;
+
+		/* no room, wait for the server to make some */
+		shm_ring_set_full(ring);
+		p = shm_ring_reserve(ring, bsize);
+		if (p != NULL)
+			break;
+		if (!wait_wake(srv))
+			return 0;
+	}
+
+	memcpy(p, buf, bsize);
+	if (shm_ring_commit(ring, bsize))
+		wake(srv, SHM_WAKE);
+	return 1;
+}
+
+/* Takes the next message from the ring, copying it to buf so it's not
+ * overwritten by the server, and parses its header. */
+static uint32_t take_rep(struct nmdb_srv *srv, unsigned char *msg,
+		int64_t len, unsigned char *buf, size_t bsize, uint32_t *id,
+		unsigned char **payload, size_t *psize)
+{
+	uint32_t reply;
+	struct shm_ring *ring = &(srv->info.shm.area->rep);
+
+	if (len < 4 + 4 || len > bsize)
+		return -1;
+
+	memcpy(buf, msg, len);
+	if (shm_ring_pop(ring, len))
+		wake(srv, SHM_WAKE);
+
+	*id = * (uint32_t *) buf;
+	*id = ntohl(*id);
+	reply = * ((uint32_t *) buf + 1);
+	reply = ntohl(reply);
+
+	if (payload != NULL) {
+		*payload = buf + 4 + 4;
+		*psize = len - 4 - 4;
+	}
+	return reply;
+}
+
+/* Used internally to get and parse replies from the server. */
+uint32_t shm_get_rep(struct nmdb_srv *srv,
+		unsigned char *buf, size_t bsize, uint32_t *id,
+		unsigned char **payload, size_t *psize)
+{
+	int64_t len;
+	uint64_t start = 0;
+	unsigned char *msg;
+	struct shm_ring *ring = &(srv->info.shm.area->rep);
+
+	/* while we look at the ring ourselves, the server doesn't need to
+	 * wake us up */
+	__atomic_store_n(&(ring->sleeping), 0, __ATOMIC_SEQ_CST);
+
+	for (;;) {
+		len = shm_ring_peek(ring, &msg);
+		if (len != 0)
+			break;
+
+		if (start == 0) {
+			start = now_usec();
+		} else if (now_usec() - start < srv->info.shm.spin_usec) {
+			shm_cpu_relax();
+		} else if (!shm_ring_sleep(ring)) {
+			if (!wait_wake(srv))
+				return -1;
+			__atomic_store_n(&(ring->sleeping), 0,
+					__ATOMIC_SEQ_CST);
+			start = 0;
+		}
+	}
+
+	return take_rep(srv, msg, len, buf, bsize, id, payload, psize);
+}
+
+/* Like shm_get_rep(), but without waiting, using the server's reply buffer.
+ * Returns 0 if there is no reply available. */
+uint32_t shm_get_rep_nb(struct nmdb_srv *srv, uint32_t *id,
+		unsigned char **payload, size_t *psize)
+{
+	int64_t len;
+	unsigned char *msg;
+	struct shm_ring *ring = &(srv->info.shm.area->rep);
+
+	len = shm_ring_peek(ring, &msg);
+	if (len == 0) {
+		/* we're going to wait on the socket, so make sure the
+		 * server wakes us up */
+		if (!read_wakes(srv))
+			return -1;
+		if (!shm_ring_sleep(ring))
+			return 0;
+		len = shm_ring_peek(ring, &msg);
+	}
+
+	return take_rep(srv, msg, len, srv->rbuf, srv->rsize, id, payload,
+			psize);
+}
+
+/* Called before waiting for the server's socket to become readable, so the
+ * server wakes us up when a reply arrives. Returns 1 if there already are
+ * replies, and the socket may not become readable for them. */
+int shm_srv_sleep(struct nmdb_srv *srv)
+{
+	return shm_ring_sleep(&(srv->info.shm.area->rep));
+}
+
+/* Asks the server to wake us up, for when we're going to wait on the socket
+ * in a way we can't control, but there are replies already (see
+ * shm_srv_sleep()). */
+void shm_srv_kick(struct nmdb_srv *srv)
+{
+	wake(srv, SHM_KICK);
+}
+
+#else
+/* Stubs to use when shared memory is not enabled. */
+
+#include <stdint.h>
+#include "nmdb.h"
+#include "shm.h"
+
+int nmdb_add_shm_server(nmdb_t *db, const char *path)
+{
+	return 0;
+}
+
+void shm_srv_free(struct nmdb_srv *srv)
+{
+}
+
+int shm_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize)
+{
+	return 0;
+}
+
+uint32_t shm_get_rep(struct nmdb_srv *srv,
+		unsigned char *buf, size_t bsize, uint32_t *id,
+		unsigned char **payload, size_t *psize)
+{
+	return -1;
+}
+
+uint32_t shm_get_rep_nb(struct nmdb_srv *srv, uint32_t *id,
+		unsigned char **payload, size_t *psize)
+{
+	return -1;
+}
+
+int shm_srv_sleep(struct nmdb_srv *srv)
+{
+	return 0;
+}
+
+void shm_srv_kick(struct nmdb_srv *srv)
+{
+}
+
+#endif /* ENABLE_SHM */
+
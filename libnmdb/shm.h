@@ -0,0 +1,18 @@
+
+#ifndef _SHM_H
+#define _SHM_H
+
+#include "internal.h"
+
+void shm_srv_free(struct nmdb_srv *srv);
+int shm_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize);
+uint32_t shm_get_rep(struct nmdb_srv *srv,
+		unsigned char *buf, size_t bsize, uint32_t *id,
+		unsigned char **payload, size_t *psize);
+uint32_t shm_get_rep_nb(struct nmdb_srv *srv, uint32_t *id,
+		unsigned char **payload, size_t *psize);
+int shm_srv_sleep(struct nmdb_srv *srv);
+void shm_srv_kick(struct nmdb_srv *srv);
+
+#endif
+
@@ -8,6 +8,7 @@
 #include <arpa/inet.h>		/* htonls() and friends */
 #include <string.h>		/* memcpy() */
 #include <unistd.h>		/* close() */
+#include <errno.h>		/* errno */
 
 #include <netinet/tcp.h>	/* TCP stuff */
 #include <netdb.h>		/* gethostbyname() */
@@ -44,6 +45,7 @@ static int add_tcp_server_addr(nmdb_t *db, in_addr_t *inetaddr, int port)
 	newsrv = &(db->servers[db->nservers - 1]);
 
 	newsrv->fd = fd;
+	init_srv_state(newsrv);
 	newsrv->info.in.srvsa.sin_family = AF_INET;
 	newsrv->info.in.srvsa.sin_port = htons(port);
 	newsrv->info.in.srvsa.sin_addr.s_addr = *inetaddr;
@@ -117,69 +119,181 @@ int tcp_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize)
 	return 1;
 }
 
-static ssize_t recv_msg(int fd, unsigned char *buf, size_t bsize)
+/* Makes room in the server's reply buffer for a message of the given size,
+ * moving the unprocessed data to the beginning, and allocating the buffer if
+ * needed. Returns 0 if there was not enough memory. */
+static int make_room(struct nmdb_srv *srv, size_t msgsize)
 {
-	ssize_t rv, t;
-	uint32_t msgsize;
-
-	rv = recv(fd, buf, bsize, 0);
-	if (rv <= 0)
-		return rv;
+	unsigned char *newbuf;
+
+	if (msgsize < REPLY_BUF_SIZE)
+		msgsize = REPLY_BUF_SIZE;
+
+	/* We do it only when we need more data, so we move the partial
+	 * message once per read instead of once per reply */
+	if (srv->rstart > 0) {
+		memmove(srv->rbuf, srv->rbuf + srv->rstart,
+				srv->rlen - srv->rstart);
+		srv->rlen -= srv->rstart;
+		srv->rstart = 0;
+	}
 
-	if (rv < 4) {
-		t = srecv(fd, buf + rv, 4 - rv, 0);
-		if (t <= 0) {
-			return t;
+	if (msgsize > srv->rsize) {
+		/* a reply with a big value */
+		newbuf = realloc(srv->rbuf, msgsize);
+		if (newbuf == NULL)
+			return 0;
+		srv->rbuf = newbuf;
+		srv->rsize = msgsize;
+	} else if (srv->rsize > REPLY_BUF_SIZE && msgsize <= REPLY_BUF_SIZE
+			&& srv->rlen <= REPLY_BUF_SIZE) {
+		/* the big reply is gone, give the memory back */
+		newbuf = realloc(srv->rbuf, REPLY_BUF_SIZE);
+		if (newbuf != NULL) {
+			srv->rbuf = newbuf;
+			srv->rsize = REPLY_BUF_SIZE;
 		}
-
-		rv = rv + t;
 	}
 
-	msgsize = * ((uint32_t *) buf);
-	msgsize = ntohl(msgsize);
+	return 1;
+}
 
-	if (msgsize > bsize)
-		return -1;
+/* Takes a message from the server's reply buffer, reading from the network
+ * as needed, with the given recv() flags. We read as much as there is room
+ * for, so most replies take a single recv(), and what comes after the message
+ * (like the next reply of an MGET) is kept for the next call. On success,
+ * *msg points to the message, which is valid until the next call, and its
+ * size is returned. Returns 0 if the flags include MSG_DONTWAIT and there is
+ * no complete message yet, and -1 on error. */
+static ssize_t recv_msg(struct nmdb_srv *srv, unsigned char **msg, int flags)
+{
+	ssize_t rv;
+	uint32_t msgsize;
 
-	if (rv < msgsize) {
-		t = srecv(fd, buf + rv, msgsize - rv, 0);
-		if (t <= 0) {
-			return t;
+	for (;;) {
+		msgsize = 0;
+		if (srv->rlen - srv->rstart >= 4) {
+			msgsize = * (uint32_t *) (srv->rbuf + srv->rstart);
+			msgsize = ntohl(msgsize);
+			if (msgsize < 4 + 4 + 4)
+				return -1;
+			if (srv->rlen - srv->rstart >= msgsize)
+				break;
 		}
 
-		rv = rv + t;
+		/* We need more data */
+		if (!make_room(srv, msgsize))
+			return -1;
+
+		rv = recv(srv->fd, srv->rbuf + srv->rlen,
+				srv->rsize - srv->rlen, flags);
+		if (rv < 0 && (flags & MSG_DONTWAIT) &&
+				(errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		else if (rv <= 0)
+			return -1;
+
+		srv->rlen += rv;
 	}
 
-	return rv;
+	*msg = srv->rbuf + srv->rstart;
+	srv->rstart += msgsize;
+	return msgsize;
+}
+
+/* Returns 1 if there is a complete reply in the server's buffer, so it can be
+ * taken without reading from the network. */
+int tcp_has_rep(struct nmdb_srv *srv)
+{
+	uint32_t msgsize;
+
+	if (srv->rlen - srv->rstart < 4)
+		return 0;
+
+	msgsize = * (uint32_t *) (srv->rbuf + srv->rstart);
+	msgsize = ntohl(msgsize);
+	return srv->rlen - srv->rstart >= msgsize;
 }
 
+/* Parses the header of a reply message. */
+static uint32_t parse_rep(unsigned char *buf, size_t msgsize, uint32_t *id,
+		unsigned char **payload, size_t *psize)
+{
+	uint32_t reply;
+
+	*id = * ((uint32_t *) buf + 1);
+	*id = ntohl(*id);
+	reply = * ((uint32_t *) buf + 2);
+	reply = ntohl(reply);
 
-/* Used internally to get and parse replies from the server. */
+	if (payload != NULL) {
+		*payload = buf + 4 + 4 + 4;
+		*psize = msgsize - 4 - 4 - 4;
+	}
+	return reply;
+}
+
+/* Used internally to get and parse replies from the server. The reply is
+ * taken from the server's buffer (see recv_msg()), so buf is not used. */
 uint32_t tcp_get_rep(struct nmdb_srv *srv,
-		unsigned char *buf, size_t bsize,
+		unsigned char *buf, size_t bsize, uint32_t *id,
 		unsigned char **payload, size_t *psize)
 {
 	ssize_t rv;
-	uint32_t id, reply;
+	unsigned char *msg;
 
-	rv = recv_msg(srv->fd, buf, bsize);
+	rv = recv_msg(srv, &msg, 0);
 	if (rv <= 0)
 		return -1;
 
-	id = * ((uint32_t *) buf + 1);
-	id = ntohl(id);
-	reply = * ((uint32_t *) buf + 2);
-	reply = ntohl(reply);
+	return parse_rep(msg, rv, id, payload, psize);
+}
 
-	if (id != ID_CODE) {
-		return -1;
+/*
+ * Non-blocking versions of the functions above.
+ */
+
+/* Sends the rest of a message, of which sent bytes were already sent.
+ * Returns the number of bytes sent so far, or -1 on error. */
+ssize_t tcp_srv_send_nb(struct nmdb_srv *srv, unsigned char *buf,
+		size_t bsize, size_t sent)
+{
+	ssize_t rv;
+	uint32_t len;
+
+	if (sent == 0) {
+		len = htonl(bsize);
+		memcpy(buf, (const void *) &len, 4);
 	}
 
-	if (payload != NULL) {
-		*payload = buf + 4 + 4 + 4;
-		*psize = rv - 4 - 4 - 4;
+	while (sent < bsize) {
+		rv = send(srv->fd, buf + sent, bsize - sent, MSG_DONTWAIT);
+		if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		else if (rv <= 0)
+			return -1;
+
+		sent += rv;
 	}
-	return reply;
+
+	return sent;
+}
+
+/* Gets a reply from the server's buffer, reading what is available from the
+ * network. Returns 0 if there is no complete reply yet. */
+uint32_t tcp_get_rep_nb(struct nmdb_srv *srv, uint32_t *id,
+		unsigned char **payload, size_t *psize)
+{
+	ssize_t rv;
+	unsigned char *msg;
+
+	rv = recv_msg(srv, &msg, MSG_DONTWAIT);
+	if (rv < 0)
+		return -1;
+	else if (rv == 0)
+		return 0;
+
+	return parse_rep(msg, rv, id, payload, psize);
 }
 
 #else
@@ -200,11 +314,28 @@ int tcp_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize)
 }
 
 uint32_t tcp_get_rep(struct nmdb_srv *srv,
-		unsigned char *buf, size_t bsize,
+		unsigned char *buf, size_t bsize, uint32_t *id,
+		unsigned char **payload, size_t *psize)
+{
+	return -1;
+}
+
+ssize_t tcp_srv_send_nb(struct nmdb_srv *srv, unsigned char *buf,
+		size_t bsize, size_t sent)
+{
+	return -1;
+}
+
+uint32_t tcp_get_rep_nb(struct nmdb_srv *srv, uint32_t *id,
 		unsigned char **payload, size_t *psize)
 {
 	return -1;
 }
 
+int tcp_has_rep(struct nmdb_srv *srv)
+{
+	return 0;
+}
+
 #endif /* ENABLE_TCP */
 
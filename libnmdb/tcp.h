@@ -6,8 +6,13 @@
 
 int tcp_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize);
 uint32_t tcp_get_rep(struct nmdb_srv *srv,
-		unsigned char *buf, size_t bsize,
+		unsigned char *buf, size_t bsize, uint32_t *id,
 		unsigned char **payload, size_t *psize);
+ssize_t tcp_srv_send_nb(struct nmdb_srv *srv, unsigned char *buf,
+		size_t bsize, size_t sent);
+uint32_t tcp_get_rep_nb(struct nmdb_srv *srv, uint32_t *id,
+		unsigned char **payload, size_t *psize);
+int tcp_has_rep(struct nmdb_srv *srv);
 
 #endif
 
@@ -44,6 +44,7 @@ int nmdb_add_tipc_server(nmdb_t *db, int port)
 	newsrv = &(db->servers[db->nservers - 1]);
 
 	newsrv->fd = fd;
+	init_srv_state(newsrv);
 	newsrv->info.tipc.port = port;
 	newsrv->info.tipc.srvsa.family = AF_TIPC;
 	newsrv->info.tipc.srvsa.addrtype = TIPC_ADDR_NAMESEQ;
@@ -76,26 +77,22 @@ int tipc_srv_send(struct nmdb_srv *srv,
 
 /* Used internally to get and parse replies from the server. */
 uint32_t tipc_get_rep(struct nmdb_srv *srv,
-		unsigned char *buf, size_t bsize,
+		unsigned char *buf, size_t bsize, uint32_t *id,
 		unsigned char **payload, size_t *psize)
 {
 	ssize_t rv;
-	uint32_t id, reply;
+	uint32_t reply;
 
 	rv = recv(srv->fd, buf, bsize, 0);
 	if (rv < 4 + 4) {
 		return -1;
 	}
 
-	id = * (uint32_t *) buf;
-	id = ntohl(id);
+	*id = * (uint32_t *) buf;
+	*id = ntohl(*id);
 	reply = * ((uint32_t *) buf + 1);
 	reply = ntohl(reply);
 
-	if (id != ID_CODE) {
-		return -1;
-	}
-
 	if (payload != NULL) {
 		*payload = buf + 4 + 4;
 		*psize = rv - 4 - 4;
@@ -122,7 +119,7 @@ int tipc_srv_send(struct nmdb_srv *srv,
 }
 
 uint32_t tipc_get_rep(struct nmdb_srv *srv,
-		unsigned char *buf, size_t bsize,
+		unsigned char *buf, size_t bsize, uint32_t *id,
 		unsigned char **payload, size_t *psize)
 {
 	return -1;
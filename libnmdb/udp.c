@@ -44,6 +44,7 @@ static int add_udp_server_addr(nmdb_t *db, in_addr_t *inetaddr, int port)
 	newsrv = &(db->servers[db->nservers - 1]);
 
 	newsrv->fd = fd;
+	init_srv_state(newsrv);
 	newsrv->info.in.srvsa.sin_family = AF_INET;
 	newsrv->info.in.srvsa.sin_port = htons(port);
 	newsrv->info.in.srvsa.sin_addr.s_addr = *inetaddr;
@@ -91,26 +92,22 @@ int udp_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize)
 
 /* Used internally to get and parse replies from the server. */
 uint32_t udp_get_rep(struct nmdb_srv *srv,
-		unsigned char *buf, size_t bsize,
+		unsigned char *buf, size_t bsize, uint32_t *id,
 		unsigned char **payload, size_t *psize)
 {
 	ssize_t rv;
-	uint32_t id, reply;
+	uint32_t reply;
 
 	rv = recv(srv->fd, buf, bsize, 0);
 	if (rv < 4 + 4) {
 		return -1;
 	}
 
-	id = * (uint32_t *) buf;
-	id = ntohl(id);
+	*id = * (uint32_t *) buf;
+	*id = ntohl(*id);
 	reply = * ((uint32_t *) buf + 1);
 	reply = ntohl(reply);
 
-	if (id != ID_CODE) {
-		return -1;
-	}
-
 	if (payload != NULL) {
 		*payload = buf + 4 + 4;
 		*psize = rv - 4 - 4;
@@ -136,7 +133,7 @@ int udp_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize)
 }
 
 uint32_t udp_get_rep(struct nmdb_srv *srv,
-		unsigned char *buf, size_t bsize,
+		unsigned char *buf, size_t bsize, uint32_t *id,
 		unsigned char **payload, size_t *psize)
 {
 	return -1;
@@ -0,0 +1,139 @@
+
+#if ENABLE_UNIX
+
+#include <sys/types.h>		/* socket defines */
+#include <sys/socket.h>		/* socket functions */
+#include <sys/un.h>		/* struct sockaddr_un */
+#include <stdlib.h>		/* malloc() */
+#include <stdint.h>		/* uint32_t and friends */
+#include <arpa/inet.h>		/* htonls() and friends */
+#include <string.h>		/* memcpy() */
+#include <unistd.h>		/* close() */
+
+#include "nmdb.h"
+#include "net-const.h"
+#include "internal.h"
+#include "unix.h"
+
+
+/* Add a Unix socket server to the db connection. */
+int nmdb_add_unix_server(nmdb_t *db, const char *path)
+{
+	int rv, fd;
+	struct nmdb_srv *newsrv, *newarray;
+
+	if (path == NULL)
+		path = UNIX_SERVER_PATH;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0)
+		return 0;
+
+	newarray = realloc(db->servers,
+			sizeof(struct nmdb_srv) * (db->nservers + 1));
+	if (newarray == NULL) {
+		close(fd);
+		return 0;
+	}
+
+	db->servers = newarray;
+	db->nservers++;
+
+	newsrv = &(db->servers[db->nservers - 1]);
+
+	newsrv->fd = fd;
+	init_srv_state(newsrv);
+	if (strlen(path) >= sizeof(newsrv->info.un.srvsa.sun_path))
+		goto error_exit;
+	newsrv->info.un.srvsa.sun_family = AF_UNIX;
+	strcpy(newsrv->info.un.srvsa.sun_path, path);
+
+	rv = connect(fd, (struct sockaddr *) &(newsrv->info.un.srvsa),
+			sizeof(newsrv->info.un.srvsa));
+	if (rv < 0)
+		goto error_exit;
+
+	newsrv->type = UNIX_CONN;
+
+	/* keep the list sorted by path, so we can do a reliable selection */
+	qsort(db->servers, db->nservers, sizeof(struct nmdb_srv),
+			compare_servers);
+
+	return 1;
+
+error_exit:
+	close(fd);
+	newarray = realloc(db->servers,
+			sizeof(struct nmdb_srv) * (db->nservers - 1));
+	if (newarray == NULL) {
+		db->servers = NULL;
+		db->nservers = 0;
+		return 0;
+	}
+
+	db->servers = newarray;
+	db->nservers -= 1;
+
+	return 0;
+}
+
+int unix_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize)
+{
+	ssize_t rv;
+	rv = send(srv->fd, buf, bsize, MSG_NOSIGNAL);
+	if (rv <= 0)
+		return 0;
+	return 1;
+}
+
+/* Used internally to get and parse replies from the server. */
+uint32_t unix_get_rep(struct nmdb_srv *srv,
+		unsigned char *buf, size_t bsize, uint32_t *id,
+		unsigned char **payload, size_t *psize)
+{
+	ssize_t rv;
+	uint32_t reply;
+
+	rv = recv(srv->fd, buf, bsize, 0);
+	if (rv < 4 + 4) {
+		return -1;
+	}
+
+	*id = * (uint32_t *) buf;
+	*id = ntohl(*id);
+	reply = * ((uint32_t *) buf + 1);
+	reply = ntohl(reply);
+
+	if (payload != NULL) {
+		*payload = buf + 4 + 4;
+		*psize = rv - 4 - 4;
+	}
+	return reply;
+}
+
+#else
+/* Stubs to use when Unix sockets are not enabled. */
+
+#include <stdint.h>
+#include "nmdb.h"
+#include "unix.h"
+
+int nmdb_add_unix_server(nmdb_t *db, const char *path)
+{
+	return 0;
+}
+
+int unix_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize)
+{
+	return 0;
+}
+
+uint32_t unix_get_rep(struct nmdb_srv *srv,
+		unsigned char *buf, size_t bsize, uint32_t *id,
+		unsigned char **payload, size_t *psize)
+{
+	return -1;
+}
+
+#endif /* ENABLE_UNIX */
+
@@ -0,0 +1,13 @@
+
+#ifndef _UNIX_H
+#define _UNIX_H
+
+#include "internal.h"
+
+int unix_srv_send(struct nmdb_srv *srv, unsigned char *buf, size_t bsize);
+uint32_t unix_get_rep(struct nmdb_srv *srv,
+		unsigned char *buf, size_t bsize, uint32_t *id,
+		unsigned char **payload, size_t *psize);
+
+#endif
+
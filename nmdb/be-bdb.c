@@ -49,6 +49,11 @@ struct db_conn *bdb_open(const char *name, int flags)
 	db->del = bdb_del;
 	db->firstkey = NULL;
 	db->nextkey = NULL;
+	db->scan = NULL;
+	db->cursor_open = NULL;
+	db->cursor_next = NULL;
+	db->cursor_close = NULL;
+	db->range = NULL;
 	db->close = bdb_close;
 
 	return db;
@@ -18,6 +18,24 @@ int xleveldb_firstkey(struct db_conn *db, unsigned char *key, size_t *ksize);
 int xleveldb_nextkey(struct db_conn *db,
 		const unsigned char *key, size_t ksize,
 		unsigned char *nextkey, size_t *nksize);
+int xleveldb_scan(struct db_conn *db,
+		const unsigned char *key, size_t ksize, int getvals,
+		int (*fn)(void *arg, const unsigned char *key, size_t ksize,
+			const unsigned char *val, size_t vsize),
+		void *arg);
+void *xleveldb_cursor_open(struct db_conn *db,
+		const unsigned char *key, size_t ksize);
+int xleveldb_cursor_next(struct db_conn *db, void *cur, int getvals,
+		int (*fn)(void *arg, const unsigned char *key, size_t ksize,
+			const unsigned char *val, size_t vsize),
+		void *arg);
+void xleveldb_cursor_close(struct db_conn *db, void *cur);
+int xleveldb_range(struct db_conn *db,
+		const unsigned char *start, size_t ssize,
+		const unsigned char *end, size_t esize, int getvals,
+		int (*fn)(void *arg, const unsigned char *key, size_t ksize,
+			const unsigned char *val, size_t vsize),
+		void *arg);
 
 struct db_conn *xleveldb_open(const char *name, int flags)
 {
@@ -50,6 +68,11 @@ struct db_conn *xleveldb_open(const char *name, int flags)
 	db->del = xleveldb_del;
 	db->firstkey = xleveldb_firstkey;
 	db->nextkey = xleveldb_nextkey;
+	db->scan = xleveldb_scan;
+	db->cursor_open = xleveldb_cursor_open;
+	db->cursor_next = xleveldb_cursor_next;
+	db->cursor_close = xleveldb_cursor_close;
+	db->range = xleveldb_range;
 	db->close = xleveldb_close;
 
 	return db;
@@ -202,6 +225,143 @@ exit:
 	return rv;
 }
 
+
+/* Creates an iterator for scanning, placed after the given key (which may
+ * not exist anymore), or at the first key if ksize is 0. */
+static leveldb_iterator_t *scan_iterator(struct db_conn *db,
+		const unsigned char *key, size_t ksize)
+{
+	const char *db_key;
+	size_t db_ksize;
+	leveldb_iterator_t *it;
+	leveldb_readoptions_t *options = leveldb_readoptions_create();
+
+	/* scans can go over a lot of data that is not going to be read
+	 * again, don't let it push everything else out of leveldb's cache */
+	leveldb_readoptions_set_fill_cache(options, 0);
+	it = leveldb_create_iterator(db->conn, options);
+	leveldb_readoptions_destroy(options);
+
+	if (ksize == 0) {
+		leveldb_iter_seek_to_first(it);
+		return it;
+	}
+
+	leveldb_iter_seek(it, (const char *) key, ksize);
+	if (leveldb_iter_valid(it)) {
+		db_key = leveldb_iter_key(it, &db_ksize);
+		if (db_ksize == ksize && memcmp(db_key, key, ksize) == 0)
+			leveldb_iter_next(it);
+	}
+
+	return it;
+}
+
+/* Calls fn for the keys from the iterator's position on, and leaves the
+ * iterator on the key fn refused, if any. */
+static void scan_from(leveldb_iterator_t *it, int getvals,
+		int (*fn)(void *arg, const unsigned char *key, size_t ksize,
+			const unsigned char *val, size_t vsize),
+		void *arg)
+{
+	const char *db_key, *db_val = NULL;
+	size_t db_ksize, db_vsize = 0;
+
+	for (; leveldb_iter_valid(it); leveldb_iter_next(it)) {
+		db_key = leveldb_iter_key(it, &db_ksize);
+		if (getvals)
+			db_val = leveldb_iter_value(it, &db_vsize);
+
+		if (!fn(arg, (const unsigned char *) db_key, db_ksize,
+				(const unsigned char *) db_val, db_vsize))
+			break;
+	}
+}
+
+/* Unlike xleveldb_nextkey(), which has to create and seek an iterator for
+ * each key, this walks all the keys of the batch with a single one. */
+int xleveldb_scan(struct db_conn *db,
+		const unsigned char *key, size_t ksize, int getvals,
+		int (*fn)(void *arg, const unsigned char *key, size_t ksize,
+			const unsigned char *val, size_t vsize),
+		void *arg)
+{
+	leveldb_iterator_t *it;
+
+	it = scan_iterator(db, key, ksize);
+	scan_from(it, getvals, fn, arg);
+	leveldb_iter_destroy(it);
+	return 1;
+}
+
+/* Cursors are just iterators, which also give a consistent view of the
+ * database for as long as they're open. */
+void *xleveldb_cursor_open(struct db_conn *db,
+		const unsigned char *key, size_t ksize)
+{
+	return scan_iterator(db, key, ksize);
+}
+
+int xleveldb_cursor_next(struct db_conn *db, void *cur, int getvals,
+		int (*fn)(void *arg, const unsigned char *key, size_t ksize,
+			const unsigned char *val, size_t vsize),
+		void *arg)
+{
+	scan_from(cur, getvals, fn, arg);
+	return 1;
+}
+
+void xleveldb_cursor_close(struct db_conn *db, void *cur)
+{
+	leveldb_iter_destroy(cur);
+}
+
+/* Compares a key with the end of a range, like memcmp() would if they were
+ * the same size, which is the order leveldb uses by default. */
+static int keycmp(const char *key, size_t ksize,
+		const unsigned char *end, size_t esize)
+{
+	int c;
+
+	c = memcmp(key, end, ksize < esize ? ksize : esize);
+	if (c != 0)
+		return c;
+	return ksize < esize ? -1 : ksize > esize;
+}
+
+int xleveldb_range(struct db_conn *db,
+		const unsigned char *start, size_t ssize,
+		const unsigned char *end, size_t esize, int getvals,
+		int (*fn)(void *arg, const unsigned char *key, size_t ksize,
+			const unsigned char *val, size_t vsize),
+		void *arg)
+{
+	const char *db_key, *db_val = NULL;
+	size_t db_ksize, db_vsize = 0;
+
+	leveldb_readoptions_t *options = leveldb_readoptions_create();
+	leveldb_iterator_t *it = leveldb_create_iterator(db->conn, options);
+
+	leveldb_iter_seek(it, (const char *) start, ssize);
+
+	for (; leveldb_iter_valid(it); leveldb_iter_next(it)) {
+		db_key = leveldb_iter_key(it, &db_ksize);
+		if (end != NULL && keycmp(db_key, db_ksize, end, esize) >= 0)
+			break;
+
+		if (getvals)
+			db_val = leveldb_iter_value(it, &db_vsize);
+
+		if (!fn(arg, (const unsigned char *) db_key, db_ksize,
+				(const unsigned char *) db_val, db_vsize))
+			break;
+	}
+
+	leveldb_iter_destroy(it);
+	leveldb_readoptions_destroy(options);
+	return 1;
+}
+
 #else
 
 #include <stddef.h>	/* NULL */
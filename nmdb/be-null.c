@@ -28,6 +28,11 @@ struct db_conn *null_open(const char *name, int flags)
 	db->del = null_del;
 	db->firstkey = NULL;
 	db->nextkey = NULL;
+	db->scan = NULL;
+	db->cursor_open = NULL;
+	db->cursor_next = NULL;
+	db->cursor_close = NULL;
+	db->range = NULL;
 	db->close = null_close;
 
 	return db;
@@ -38,6 +38,11 @@ struct db_conn *qdbm_open(const char *name, int flags)
 	db->del = qdbm_del;
 	db->firstkey = NULL;
 	db->nextkey = NULL;
+	db->scan = NULL;
+	db->cursor_open = NULL;
+	db->cursor_next = NULL;
+	db->cursor_close = NULL;
+	db->range = NULL;
 	db->close = qdbm_close;
 
 	return db;
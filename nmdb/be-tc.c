@@ -36,6 +36,11 @@ struct db_conn *tc_open(const char *name, int flags)
 	db->del = tc_del;
 	db->firstkey = NULL;
 	db->nextkey = NULL;
+	db->scan = NULL;
+	db->cursor_open = NULL;
+	db->cursor_next = NULL;
+	db->cursor_close = NULL;
+	db->range = NULL;
 	db->close = tc_close;
 
 	return db;
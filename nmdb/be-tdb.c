@@ -49,6 +49,11 @@ struct db_conn *xtdb_open(const char *name, int flags)
 	db->del = xtdb_del;
 	db->firstkey = xtdb_firstkey;
 	db->nextkey = xtdb_nextkey;
+	db->scan = NULL;
+	db->cursor_open = NULL;
+	db->cursor_next = NULL;
+	db->cursor_close = NULL;
+	db->range = NULL;
 	db->close = xtdb_close;
 
 	return db;
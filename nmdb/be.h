@@ -19,6 +19,46 @@ struct db_conn {
 	int (*nextkey)(struct db_conn *db,
 			const unsigned char *key, size_t ksize,
 			unsigned char *nextkey, size_t *nksize);
+
+	/* Calls fn for each of the keys that follow the given one (or for
+	 * all of them if ksize is 0), in the same order as nextkey, until it
+	 * returns 0 or there are no more keys. val is NULL unless getvals is
+	 * set. Returns 0 on error. It's optional, backends that don't have it
+	 * are scanned using firstkey and nextkey. */
+	int (*scan)(struct db_conn *db,
+			const unsigned char *key, size_t ksize, int getvals,
+			int (*fn)(void *arg,
+				const unsigned char *key, size_t ksize,
+				const unsigned char *val, size_t vsize),
+			void *arg);
+
+	/* Cursors work like scan, but keep their place between calls. The
+	 * cursor starts after the given key (or at the first one, if ksize
+	 * is 0), and each call to cursor_next calls fn from where the
+	 * previous one stopped, including the key fn refused. cursor_open
+	 * returns NULL on error, and cursor_next returns 0 on error. They're
+	 * optional, either all three are set, or none. */
+	void *(*cursor_open)(struct db_conn *db,
+			const unsigned char *key, size_t ksize);
+	int (*cursor_next)(struct db_conn *db, void *cur, int getvals,
+			int (*fn)(void *arg,
+				const unsigned char *key, size_t ksize,
+				const unsigned char *val, size_t vsize),
+			void *arg);
+	void (*cursor_close)(struct db_conn *db, void *cur);
+
+	/* For backends that keep the keys sorted: calls fn for each key
+	 * between start (included) and end (not included), in order, until
+	 * it returns 0. If end is NULL, it goes on until the last key.
+	 * Returns 0 on error. It's optional. */
+	int (*range)(struct db_conn *db,
+			const unsigned char *start, size_t ssize,
+			const unsigned char *end, size_t esize, int getvals,
+			int (*fn)(void *arg,
+				const unsigned char *key, size_t ksize,
+				const unsigned char *val, size_t vsize),
+			void *arg);
+
 	int (*close)(struct db_conn *db);
 };
 
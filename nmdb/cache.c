@@ -3,6 +3,15 @@
  * It's a hash table with cache-style properties, keeping a (non-precise) size
  * and using a natural, per-chain LRU to do cleanups.
  * Cleanups are performed in place, when cache_set() gets called.
+ *
+ * Every entry also has a version, used for compare-and-swap without sending
+ * the old value (see cache_cas_version()). It's taken from a per-cache
+ * counter each time the value changes, so it's never reused, even if the
+ * value goes back to an old one. The counter starts at a random number, so
+ * versions from a previous run are unlikely to be taken as current.
+ *
+ * The databases don't store versions, so values that are not in the cache
+ * get a keyed hash of the value instead; see cache_hash_version().
  */
 
 #include <sys/types.h>		/* for size_t */
@@ -10,10 +19,37 @@
 #include <stdlib.h>		/* for malloc() */
 #include <string.h>		/* for memcpy()/memcmp() */
 #include <stdio.h>		/* snprintf() */
+#include <fcntl.h>		/* open() */
+#include <unistd.h>		/* read(), close(), getpid() */
+#include <time.h>		/* time() */
 #include "hash.h"		/* hash() */
+#include "netutils.h"		/* htonll() and ntohll() */
 #include "cache.h"
 
 
+/* Seed for cache_hash_version(), chosen at random by cache_create() */
+static uint64_t version_seed = 0;
+
+/* Returns a random 64 bit number. */
+static uint64_t random_u64(void)
+{
+	int fd;
+	uint64_t r = 0;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		if (read(fd, &r, sizeof(r)) != sizeof(r))
+			r = 0;
+		close(fd);
+	}
+
+	/* not really random, but better than a fixed number */
+	if (r == 0)
+		r = ((uint64_t) getpid() << 32) ^ (uint64_t) time(NULL);
+
+	return r;
+}
+
 struct cache *cache_create(size_t numobjs, unsigned int flags)
 {
 	size_t i, j;
@@ -26,6 +62,18 @@ struct cache *cache_create(size_t numobjs, unsigned int flags)
 
 	cd->flags = flags;
 
+	cd->nentries = 0;
+	cd->key_bytes = 0;
+	cd->val_bytes = 0;
+	cd->evictions = 0;
+	cd->replace_inplace = 0;
+	cd->replace_realloc = 0;
+
+	/* versions never get to VERSION_HASHED, see cache_hash_version() */
+	cd->version_clock = random_u64() >> 2;
+	if (version_seed == 0)
+		version_seed = random_u64();
+
 	/* We calculate the hash size so we have 4 objects per bucket; 4 being
 	 * an arbitrary number. It's long enough to make LRU useful, and small
 	 * enough to make lookups fast. */
@@ -39,6 +87,10 @@ struct cache *cache_create(size_t numobjs, unsigned int flags)
 		return NULL;
 	}
 
+	/* all the chains begin empty */
+	memset(cd->chainlen_hist, 0, sizeof(cd->chainlen_hist));
+	cd->chainlen_hist[0] = cd->hashlen;
+
 	for (i = 0; i < cd->hashlen; i++) {
 		c = cd->table + i;
 		c->len = 0;
@@ -103,6 +155,16 @@ static void free_entry(struct cache_entry *e)
 }
 
 
+/* Changes the length of the given chain, keeping the chain length histogram
+ * up to date. */
+static void chain_set_len(struct cache *cd, struct cache_chain *c, size_t len)
+{
+	cd->chainlen_hist[c->len]--;
+	cd->chainlen_hist[len]++;
+	c->len = len;
+}
+
+
 /* Looks up the given key in the chain. Returns NULL if not found, or a
  * pointer to the cache entry if it is. The chain can be empty. */
 static struct cache_entry *find_in_chain(struct cache_chain *c,
@@ -161,6 +223,27 @@ int cache_get(struct cache *cd, const unsigned char *key, size_t ksize,
 	return 1;
 }
 
+/* Like cache_get(), but also gets the version of the value. */
+int cache_gets(struct cache *cd, const unsigned char *key, size_t ksize,
+		unsigned char **val, size_t *vsize, uint64_t *version)
+{
+	struct cache_entry *e;
+
+	e = find_in_cache(cd, key, ksize);
+
+	if (e == NULL) {
+		*val = NULL;
+		*vsize = 0;
+		return 0;
+	}
+
+	*val = e->val;
+	*vsize = e->vsize;
+	*version = e->version;
+
+	return 1;
+}
+
 /* Creates a new cache entry, with the given key and value */
 static struct cache_entry *new_entry(struct cache_chain *c,
 		const unsigned char *key, size_t ksize,
@@ -196,7 +279,7 @@ static struct cache_entry *new_entry(struct cache_chain *c,
 	return new;
 }
 
-static int insert_in_full_chain(struct cache_chain *c,
+static int insert_in_full_chain(struct cache *cd, struct cache_chain *c,
 		const unsigned char *key, size_t ksize,
 		const unsigned char *val, size_t vsize)
 {
@@ -207,6 +290,10 @@ static int insert_in_full_chain(struct cache_chain *c,
 	 * last one, and when possible we reuse its key and value as well. */
 	struct cache_entry *e = c->last;
 
+	cd->evictions++;
+	cd->key_bytes -= e->ksize;
+	cd->val_bytes -= e->vsize;
+
 	if (ksize == e->ksize) {
 		memcpy(e->key, key, ksize);
 	} else {
@@ -221,6 +308,7 @@ static int insert_in_full_chain(struct cache_chain *c,
 
 	if (vsize == e->vsize) {
 		memcpy(e->val, val, vsize);
+		cd->replace_inplace++;
 	} else {
 		free(e->val);
 		e->val = malloc(vsize);
@@ -229,8 +317,13 @@ static int insert_in_full_chain(struct cache_chain *c,
 		}
 		e->vsize = vsize;
 		memcpy(e->val, val, vsize);
+		cd->replace_realloc++;
 	}
 
+	cd->key_bytes += ksize;
+	cd->val_bytes += vsize;
+	e->version = ++cd->version_clock;
+
 	/* move the entry from the last to the first position */
 	c->last = e->prev;
 	c->last->next = NULL;
@@ -251,6 +344,9 @@ error:
 	free(e->val);
 	free_entry(e);
 
+	cd->nentries--;
+	chain_set_len(cd, c, c->len - 1);
+
 	return -1;
 }
 
@@ -271,42 +367,50 @@ int cache_set(struct cache *cd, const unsigned char *key, size_t ksize,
 	if (e == NULL) {
 		if (c->len == CHAINLEN) {
 			/* chain is full */
-			if (insert_in_full_chain(c, key, ksize,
+			if (insert_in_full_chain(cd, c, key, ksize,
 					val, vsize) != 0)
 				return -1;
 		} else {
 			new = new_entry(c, key, ksize, val, vsize);
 			if (new == NULL)
 				return -1;
+			new->version = ++cd->version_clock;
 
 			if (c->len == 0) {
 				/* line is empty, just put it there */
 				c->first = new;
 				c->last = new;
-				c->len = 1;
 			} else if (c->len < CHAINLEN) {
 				/* slots are still available, put the entry
 				 * first */
 				new->next = c->first;
 				c->first->prev = new;
 				c->first = new;
-				c->len += 1;
 			}
+
+			chain_set_len(cd, c, c->len + 1);
+			cd->nentries++;
+			cd->key_bytes += ksize;
+			cd->val_bytes += vsize;
 		}
 	} else {
 		/* we've got a match, just replace the value in place */
 		if (vsize == e->vsize) {
 			memcpy(e->val, val, vsize);
+			cd->replace_inplace++;
 		} else {
 			v = malloc(vsize);
 			if (v == NULL)
 				return -1;
 
 			free(e->val);
+			cd->val_bytes += vsize - e->vsize;
 			e->val = v;
 			e->vsize = vsize;
 			memcpy(e->val, val, vsize);
+			cd->replace_realloc++;
 		}
+		e->version = ++cd->version_clock;
 
 		/* promote the entry to the top of the list if necessary */
 		if (c->first != e) {
@@ -359,17 +463,50 @@ int cache_del(struct cache *cd, const unsigned char *key, size_t ksize)
 		c->last = e->prev;
 	}
 
+	cd->nentries--;
+	cd->key_bytes -= e->ksize;
+	cd->val_bytes -= e->vsize;
+
 	free(e->key);
 	free(e->val);
 	free_entry(e);
 
-	c->len -= 1;
+	chain_set_len(cd, c, c->len - 1);
 
 exit:
 	return rv;
 }
 
 
+/* Replaces the value of an entry, for the compare-and-swap functions.
+ * Returns 0 on success, or -3 if there was an error. */
+static int swap_val(struct cache *cd, struct cache_entry *e,
+		const unsigned char *newval, size_t nvsize)
+{
+	unsigned char *buf;
+
+	if (e->vsize == nvsize) {
+		/* since they have the same size, avoid the malloc() and just
+		 * copy the new value */
+		memcpy(e->val, newval, nvsize);
+		cd->replace_inplace++;
+	} else {
+		buf = malloc(nvsize);
+		if (buf == NULL)
+			return -3;
+
+		memcpy(buf, newval, nvsize);
+		free(e->val);
+		cd->val_bytes += nvsize - e->vsize;
+		e->val = buf;
+		e->vsize = nvsize;
+		cd->replace_realloc++;
+	}
+	e->version = ++cd->version_clock;
+
+	return 0;
+}
+
 /* Performs a cache compare-and-swap.
  * Returns -3 if there was an error, -2 if the key is not in the cache, -1 if
  * the old value does not match, and 0 if the CAS was successful. */
@@ -378,7 +515,6 @@ int cache_cas(struct cache *cd, const unsigned char *key, size_t ksize,
 		const unsigned char *newval, size_t nvsize)
 {
 	struct cache_entry *e;
-	unsigned char *buf;
 
 	e = find_in_cache(cd, key, ksize);
 
@@ -391,39 +527,47 @@ int cache_cas(struct cache *cd, const unsigned char *key, size_t ksize,
 	if (memcmp(e->val, oldval, ovsize) != 0)
 		return -1;
 
-	if (ovsize == nvsize) {
-		/* since they have the same size, avoid the malloc() and just
-		 * copy the new value */
-		memcpy(e->val, newval, nvsize);
-	} else {
-		buf = malloc(nvsize);
-		if (buf == NULL)
-			return -3;
+	return swap_val(cd, e, newval, nvsize);
+}
 
-		memcpy(buf, newval, nvsize);
-		free(e->val);
-		e->val = buf;
-		e->vsize = nvsize;
-	}
+/* Like cache_cas(), but compares the version of the current value instead of
+ * the value itself. Hashed versions (see cache_hash_version()) never match
+ * an entry in the cache: they are only given for values that weren't in it,
+ * so if it's there now, it was set since. Returns the same as cache_cas(). */
+int cache_cas_version(struct cache *cd, const unsigned char *key,
+		size_t ksize, uint64_t version,
+		const unsigned char *newval, size_t nvsize)
+{
+	struct cache_entry *e;
 
-	return 0;
+	e = find_in_cache(cd, key, ksize);
+
+	if (e == NULL)
+		return -2;
+
+	if (e->version != version)
+		return -1;
+
+	return swap_val(cd, e, newval, nvsize);
 }
 
 
 /* Increment the value associated with the given key by the given increment.
- * The increment is a signed 64 bit value, and the value size must be >= 8
- * bytes.
+ * The increment is a signed 64 bit value. If binary is set, the value must be
+ * a 64 bit signed integer in network byte order (8 bytes exactly), which is
+ * updated in place; otherwise it must be a null terminated string with the
+ * number in base 10.
  * Returns:
  *    0 if the increment succeeded.
  *   -1 if the value was not in the cache.
- *   -2 if the value was not null terminated.
+ *   -2 if the value was not in the expected format.
  *   -3 if there was a memory error.
  *
  * The new value will be set in the newval parameter if the increment was
  * successful.
  */
 int cache_incr(struct cache *cd, const unsigned char *key, size_t ksize,
-		int64_t increment, int64_t *newval)
+		int64_t increment, int binary, int64_t *newval)
 {
 	unsigned char *val;
 	int64_t intval;
@@ -438,6 +582,22 @@ int cache_incr(struct cache *cd, const unsigned char *key, size_t ksize,
 	val = e->val;
 	vsize = e->vsize;
 
+	if (binary) {
+		if (val == NULL || vsize != sizeof(intval))
+			return -2;
+
+		memcpy(&intval, val, sizeof(intval));
+		intval = ntohll(intval) + increment;
+		*newval = intval;
+
+		intval = htonll(intval);
+		memcpy(val, &intval, sizeof(intval));
+		e->version = ++cd->version_clock;
+		cd->replace_inplace++;
+
+		return 0;
+	}
+
 	/* The value must be a 0-terminated string, otherwise strtoll might
 	 * cause a segmentation fault. Note that val should never be NULL, but
 	 * it doesn't hurt to check just in case */
@@ -455,14 +615,121 @@ int cache_incr(struct cache *cd, const unsigned char *key, size_t ksize,
 		if (nv == NULL)
 			return -3;
 		free(val);
+		cd->val_bytes += 24 - vsize;
 		e->val = val = nv;
 		e->vsize = vsize = 24;
+		cd->replace_realloc++;
+	} else {
+		cd->replace_inplace++;
 	}
 
 	snprintf((char *) val, vsize, "%23lld", (long long int) intval);
+	e->version = ++cd->version_clock;
 	*newval = intval;
 
 	return 0;
 }
 
 
+/* Adds the given data at the end of the value associated with the given key,
+ * or at the beginning if prepend is set. The value is grown with realloc(),
+ * which can often extend it without moving it.
+ * Returns:
+ *    0 if the data was added.
+ *   -1 if the value was not in the cache.
+ *   -2 if the new value would be bigger than max.
+ *   -3 if there was a memory error.
+ */
+int cache_append(struct cache *cd, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize, int prepend,
+		size_t max)
+{
+	unsigned char *val;
+	struct cache_entry *e;
+
+	e = find_in_cache(cd, key, ksize);
+
+	if (e == NULL)
+		return -1;
+
+	if (e->vsize + dsize > max)
+		return -2;
+
+	if (dsize == 0)
+		return 0;
+
+	val = realloc(e->val, e->vsize + dsize);
+	if (val == NULL)
+		return -3;
+
+	if (prepend) {
+		memmove(val + dsize, val, e->vsize);
+		memcpy(val, data, dsize);
+	} else {
+		memcpy(val + e->vsize, data, dsize);
+	}
+
+	cd->val_bytes += dsize;
+	e->val = val;
+	e->vsize += dsize;
+	e->version = ++cd->version_clock;
+	cd->replace_realloc++;
+
+	return 0;
+}
+
+
+/* MurmurHash64A, by Austin Appleby, adapted like murmurhash2() in hash.h.
+ * The author placed it in the public domain too. */
+static uint64_t murmurhash64a(const unsigned char *key, size_t len,
+		uint64_t seed)
+{
+	const uint64_t m = 0xc6a4a7935bd1e995ull;
+	const int r = 47;
+	uint64_t h = seed ^ (len * m);
+	uint64_t k;
+
+	while (len >= 8) {
+		memcpy(&k, key, sizeof(k));
+
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+
+		h ^= k;
+		h *= m;
+
+		key += 8;
+		len -= 8;
+	}
+
+	switch (len) {
+		case 7: h ^= (uint64_t) key[6] << 48;
+		case 6: h ^= (uint64_t) key[5] << 40;
+		case 5: h ^= (uint64_t) key[4] << 32;
+		case 4: h ^= (uint64_t) key[3] << 24;
+		case 3: h ^= (uint64_t) key[2] << 16;
+		case 2: h ^= (uint64_t) key[1] << 8;
+		case 1: h ^= (uint64_t) key[0];
+			h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+
+	return h;
+}
+
+/* Returns the version of a value that is not in the cache, for the database
+ * side of GETS and CAS by version. The databases can't store a version
+ * counter, so it's a 64 bit hash of the value, keyed with a seed chosen at
+ * random on startup so it can't be predicted. It has VERSION_HASHED set,
+ * which the cache versions never have, so the two never match each other.
+ * Unlike the cache versions it only tells values apart: if a value changes
+ * and then goes back to what it was, its hash matches again. Hashes don't
+ * survive a restart. */
+uint64_t cache_hash_version(const unsigned char *val, size_t vsize)
+{
+	return murmurhash64a(val, vsize, version_seed) | VERSION_HASHED;
+}
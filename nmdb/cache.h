@@ -10,6 +10,9 @@
 
 #define CHAINLEN 4
 
+/* Set in the versions made by cache_hash_version() */
+#define VERSION_HASHED (1ull << 63)
+
 struct cache {
 	/* set directly by initialization */
 	size_t numobjs;
@@ -20,6 +23,20 @@ struct cache {
 
 	/* the cache data itself */
 	struct cache_chain *table;
+
+	/* occupancy and usage counters, reported in the extended stats */
+	size_t nentries;
+	size_t key_bytes;
+	size_t val_bytes;
+	unsigned long evictions;
+	unsigned long replace_inplace;
+	unsigned long replace_realloc;
+
+	/* chainlen_hist[i] is the number of chains with i entries */
+	size_t chainlen_hist[CHAINLEN + 1];
+
+	/* last version given to an entry, see cache.c */
+	uint64_t version_clock;
 };
 
 struct cache_entry {
@@ -28,6 +45,9 @@ struct cache_entry {
 	size_t ksize;
 	size_t vsize;
 
+	/* version of the value, changed every time the value is */
+	uint64_t version;
+
 	struct cache_entry *prev;
 	struct cache_entry *next;
 };
@@ -49,14 +69,23 @@ struct cache *cache_create(size_t numobjs, unsigned int flags);
 int cache_free(struct cache *cd);
 int cache_get(struct cache *cd, const unsigned char *key, size_t ksize,
 		unsigned char **val, size_t *vsize);
+int cache_gets(struct cache *cd, const unsigned char *key, size_t ksize,
+		unsigned char **val, size_t *vsize, uint64_t *version);
 int cache_set(struct cache *cd, const unsigned char *k, size_t ksize,
 		const unsigned char *v, size_t vsize);
 int cache_del(struct cache *cd, const unsigned char *key, size_t ksize);
 int cache_cas(struct cache *cd, const unsigned char *key, size_t ksize,
 		const unsigned char *oldval, size_t ovsize,
 		const unsigned char *newval, size_t nvsize);
+int cache_cas_version(struct cache *cd, const unsigned char *key,
+		size_t ksize, uint64_t version,
+		const unsigned char *newval, size_t nvsize);
 int cache_incr(struct cache *cd, const unsigned char *key, size_t ksize,
-		int64_t increment, int64_t *newval);
+		int64_t increment, int binary, int64_t *newval);
+int cache_append(struct cache *cd, const unsigned char *key, size_t ksize,
+		const unsigned char *data, size_t dsize, int prepend,
+		size_t max);
+uint64_t cache_hash_version(const unsigned char *val, size_t vsize);
 
 #endif
 
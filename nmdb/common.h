@@ -12,6 +12,15 @@ extern struct cache *cache_table;
 #include "queue.h"
 extern struct queue *op_queue;
 
+/* Hot key trackers, NULL if disabled */
+#include "hotkeys.h"
+extern struct hotkeys *hot_reads;
+extern struct hotkeys *hot_writes;
+
+/* Miss ratio curve estimation, NULL if disabled */
+#include "mrc.h"
+extern struct mrc *cache_mrc;
+
 /* Settings */
 #include "be.h"
 struct settings {
@@ -19,21 +28,39 @@ struct settings {
 	int tipc_upper;
 	char *tcp_addr;
 	int tcp_port;
+	int tcp_idle_timeout;
 	char *udp_addr;
 	int udp_port;
 	char *sctp_addr;
 	int sctp_port;
+	char *unix_path;
+	char *shm_path;
 	int numobjs;
+	size_t max_vsize;
+	int hotkeys_rate;
+	int mrc_rate;
 	int foreground;
 	int passive;
 	int read_only;
 	char *dbname;
+	int cursor_timeout;
 	char *logfname;
 	enum backend_type backend;
 	char *pidfile;
 };
 extern struct settings settings;
 
+/* Max. size of the messages we accept on the transports that support big
+ * values (TCP and SCTP): the biggest value, plus room for the key and the
+ * headers. Other transports (including Unix sockets and shared memory) are
+ * limited to 64kb. */
+#define MAX_MSG_SIZE (settings.max_vsize + 64 * 1024)
+
+/* Max. size of the keys. Unlike the values, they're limited to 64kb on all
+ * transports, because scans and database walks return them whole in replies
+ * of that size. */
+#define MAX_KSIZE (64 * 1024)
+
 /* Statistics */
 #include "stats.h"
 extern struct stats stats;
@@ -0,0 +1,148 @@
+
+/* Scan cursors.
+ * They let clients walk the database in batches without having to find
+ * their place again for each one: the backend's cursor (for example, a
+ * leveldb iterator) is kept open between batches. They're only used by the
+ * database thread, so there's no locking.
+ * Cursors are kept in a fixed table; their IDs have the position in the
+ * table in the lower bits and a generation number in the upper ones, so a
+ * stale ID is not mistaken for a cursor opened later in the same slot.
+ * Cursors not used for settings.cursor_timeout seconds are closed.
+ */
+
+#include <stdlib.h>		/* for malloc() */
+#include <string.h>		/* for memcpy() */
+#include "common.h"
+#include "cursor.h"
+
+
+/* Bits of the ID used for the position in the table */
+#define SLOT_BITS 10
+#define SLOT_MASK ((1 << SLOT_BITS) - 1)
+
+#if CURSOR_MAX > (1 << SLOT_BITS)
+  #error "CURSOR_MAX does not fit in SLOT_BITS"
+#endif
+
+static struct cursor *table[CURSOR_MAX];
+static uint32_t generation[CURSOR_MAX];
+static time_t last_sweep = 0;
+
+
+struct cursor *cursor_open(struct db_conn *db,
+		const unsigned char *key, size_t ksize)
+{
+	int i;
+	struct cursor *c;
+
+	for (i = 0; i < CURSOR_MAX; i++) {
+		if (table[i] == NULL)
+			break;
+	}
+	if (i == CURSOR_MAX)
+		return NULL;
+
+	c = malloc(sizeof(struct cursor));
+	if (c == NULL)
+		return NULL;
+
+	c->last_used = time(NULL);
+	c->becur = NULL;
+	c->lastkey = NULL;
+	c->lksize = 0;
+
+	if (db->cursor_open != NULL) {
+		c->becur = db->cursor_open(db, key, ksize);
+		if (c->becur == NULL) {
+			free(c);
+			return NULL;
+		}
+	} else if (!cursor_set_lastkey(c, key, ksize)) {
+		free(c);
+		return NULL;
+	}
+
+	/* the generation is never 0, so neither is the ID */
+	generation[i]++;
+	if ((generation[i] << SLOT_BITS) == 0)
+		generation[i] = 1;
+	c->id = (generation[i] << SLOT_BITS) | i;
+
+	table[i] = c;
+	stats.cursors_open++;
+	return c;
+}
+
+/* Returns the cursor with the given ID, or NULL if there is none (because
+ * it was closed, or expired). */
+struct cursor *cursor_find(uint32_t id)
+{
+	struct cursor *c;
+
+	c = table[id & SLOT_MASK];
+	if (c == NULL || c->id != id)
+		return NULL;
+
+	c->last_used = time(NULL);
+	return c;
+}
+
+/* Remembers the last key returned, for cursors that don't have one in the
+ * backend. Returns 0 on error. */
+int cursor_set_lastkey(struct cursor *c,
+		const unsigned char *key, size_t ksize)
+{
+	unsigned char *k;
+
+	k = malloc(ksize > 0 ? ksize : 1);
+	if (k == NULL)
+		return 0;
+	memcpy(k, key, ksize);
+
+	free(c->lastkey);
+	c->lastkey = k;
+	c->lksize = ksize;
+	return 1;
+}
+
+void cursor_close(struct db_conn *db, struct cursor *c)
+{
+	table[c->id & SLOT_MASK] = NULL;
+	if (c->becur != NULL)
+		db->cursor_close(db, c->becur);
+	free(c->lastkey);
+	free(c);
+	stats.cursors_open--;
+}
+
+/* Closes the cursors that haven't been used in a while. It's cheap to call
+ * often, because it only looks at the table once per second. */
+void cursor_expire(struct db_conn *db, time_t now)
+{
+	int i;
+
+	if (now == last_sweep || settings.cursor_timeout <= 0)
+		return;
+	last_sweep = now;
+
+	for (i = 0; i < CURSOR_MAX; i++) {
+		if (table[i] != NULL &&
+				now - table[i]->last_used
+					>= settings.cursor_timeout) {
+			cursor_close(db, table[i]);
+			stats.cursors_expired++;
+		}
+	}
+}
+
+/* Closes all the cursors, must be called before closing the database. */
+void cursor_close_all(struct db_conn *db)
+{
+	int i;
+
+	for (i = 0; i < CURSOR_MAX; i++) {
+		if (table[i] != NULL)
+			cursor_close(db, table[i]);
+	}
+}
+
@@ -0,0 +1,37 @@
+
+#ifndef _CURSOR_H
+#define _CURSOR_H
+
+/* Scan cursors. See cursor.c for more information. */
+
+#include <sys/types.h>		/* for size_t */
+#include <stdint.h>		/* for uint32_t */
+#include <time.h>		/* for time_t */
+#include "be.h"			/* for struct db_conn */
+
+
+/* Max. number of cursors open at the same time */
+#define CURSOR_MAX 1024
+
+struct cursor {
+	uint32_t id;
+	time_t last_used;
+
+	/* the backend's cursor; if the backend doesn't have them, it's NULL
+	 * and we keep the last key returned instead, to scan from there */
+	void *becur;
+	unsigned char *lastkey;
+	size_t lksize;
+};
+
+struct cursor *cursor_open(struct db_conn *db,
+		const unsigned char *key, size_t ksize);
+struct cursor *cursor_find(uint32_t id);
+int cursor_set_lastkey(struct cursor *c,
+		const unsigned char *key, size_t ksize);
+void cursor_close(struct db_conn *db, struct cursor *c);
+void cursor_expire(struct db_conn *db, time_t now);
+void cursor_close_all(struct db_conn *db);
+
+#endif
+
@@ -5,20 +5,33 @@
 #include <string.h>		/* memcmp() */
 #include <stdlib.h>		/* malloc()/free() */
 #include <stdio.h>		/* snprintf() */
+#include <arpa/inet.h>		/* ntohl() */
 
 #include "common.h"
 #include "dbloop.h"
 #include "be.h"
 #include "queue.h"
+#include "replyq.h"
 #include "net-const.h"
 #include "req.h"
 #include "log.h"
 #include "netutils.h"
+#include "mget.h"
+#include "cursor.h"
+#include "cache.h"
 #include "sparse.h"
 
 
 static void *db_loop(void *arg);
 static void process_op(struct db_conn *db, struct queue_entry *e);
+static void process_mget(struct db_conn *db, struct queue_entry *e);
+static void process_mset(struct db_conn *db, struct queue_entry *e);
+static void process_scan(struct db_conn *db, struct queue_entry *e);
+static void process_scan_open(struct db_conn *db, struct queue_entry *e);
+static void process_scan_next(struct db_conn *db, struct queue_entry *e);
+static void process_scan_close(struct db_conn *db, struct queue_entry *e);
+static void process_range(struct db_conn *db, struct queue_entry *e);
+static void process_append(struct db_conn *db, struct queue_entry *e);
 
 
 /* Used to signal the loop that it should exit when the queue becomes empty.
@@ -84,6 +97,8 @@ static void *db_loop(void *arg)
 		e = queue_get(op_queue);
 		queue_unlock(op_queue);
 
+		cursor_expire(db, time(NULL));
+
 		if (e == NULL) {
 			if (loop_should_stop) {
 				break;
@@ -92,13 +107,16 @@ static void *db_loop(void *arg)
 			}
 		}
 
+		/* The replies are sent by the network thread, which also
+		 * frees the entry that was allocated when it queued the
+		 * operation; see replyq.c */
+		replyq_defer(e);
 		process_op(db, e);
-
-		/* Free the entry that was allocated when tipc queued the
-		 * operation. This also frees it's components. */
-		queue_entry_free(e);
+		replyq_put(e);
 	}
 
+	cursor_close_all(db);
+
 	return NULL;
 }
 
@@ -118,7 +136,7 @@ static void process_op(struct db_conn *db, struct queue_entry *e)
 
 	} else if (e->operation == REQ_GET) {
 		unsigned char *val;
-		size_t vsize = 64 * 1024;
+		size_t vsize = settings.max_vsize;
 
 		val = malloc(vsize);
 		if (val == NULL) {
@@ -134,6 +152,30 @@ static void process_op(struct db_conn *db, struct queue_entry *e)
 		e->req->reply_long(e->req, REP_OK, val, vsize);
 		free(val);
 
+	} else if (e->operation == REQ_GETS) {
+		unsigned char *val;
+		size_t vsize = settings.max_vsize;
+		uint64_t version;
+
+		val = malloc(vsize);
+		if (val == NULL) {
+			e->req->reply_err(e->req, ERR_MEM);
+			return;
+		}
+		rv = db->get(db, e->key, e->ksize, val, &vsize);
+		if (rv == 0) {
+			e->req->reply_mini(e->req, REP_NOTIN);
+			free(val);
+			return;
+		}
+
+		/* the database has no versions, see cache_hash_version() */
+		version = htonll(cache_hash_version(val, vsize));
+		e->req->reply_long2(e->req, REP_OK,
+				(unsigned char *) &version, sizeof(version),
+				val, vsize);
+		free(val);
+
 	} else if (e->operation == REQ_DEL) {
 		rv = db->del(db, e->key, e->ksize);
 		if (!(e->req->flags & FLAGS_SYNC))
@@ -147,7 +189,7 @@ static void process_op(struct db_conn *db, struct queue_entry *e)
 
 	} else if (e->operation == REQ_CAS) {
 		unsigned char *dbval;
-		size_t dbvsize = 64 * 1024;
+		size_t dbvsize = settings.max_vsize;
 
 		/* Compare */
 		dbval = malloc(dbvsize);
@@ -180,43 +222,111 @@ static void process_op(struct db_conn *db, struct queue_entry *e)
 		e->req->reply_mini(e->req, REP_NOMATCH);
 		free(dbval);
 
+	} else if (e->operation == REQ_CAS_VERSION) {
+		unsigned char *dbval;
+		size_t dbvsize = settings.max_vsize;
+		uint64_t version;
+
+		/* the version is in e->val, see parse_cas_version(); if
+		 * there's none, the cache has already checked it and we just
+		 * store the new value */
+		if (e->vsize != 0) {
+			dbval = malloc(dbvsize);
+			if (dbval == NULL) {
+				e->req->reply_err(e->req, ERR_MEM);
+				return;
+			}
+			rv = db->get(db, e->key, e->ksize, dbval, &dbvsize);
+			if (rv == 0) {
+				e->req->reply_mini(e->req, REP_NOTIN);
+				free(dbval);
+				return;
+			}
+
+			memcpy(&version, e->val, sizeof(version));
+			if (cache_hash_version(dbval, dbvsize) != version) {
+				e->req->reply_mini(e->req, REP_NOMATCH);
+				free(dbval);
+				return;
+			}
+			free(dbval);
+		}
+
+		rv = db->set(db, e->key, e->ksize, e->newval, e->nvsize);
+		if (!rv) {
+			e->req->reply_err(e->req, ERR_DB);
+			return;
+		}
+		e->req->reply_mini(e->req, REP_OK);
+
 	} else if (e->operation == REQ_INCR) {
 		unsigned char *dbval;
 		size_t dbvsize = 64 * 1024;
-		int64_t intval;
+		int64_t intval, netval;
+		int async;
+
+		/* asynchronous increments were already replied to by
+		 * parse_incr(), so we don't reply at all */
+		async = e->req->flags & FLAGS_ASYNC;
 
 		dbval = malloc(dbvsize);
 		if (dbval == NULL) {
-			e->req->reply_err(e->req, ERR_MEM);
+			if (!async)
+				e->req->reply_err(e->req, ERR_MEM);
 			return;
 		}
 		rv = db->get(db, e->key, e->ksize, dbval, &dbvsize);
 		if (rv == 0) {
-			e->req->reply_mini(e->req, REP_NOTIN);
+			if (!async)
+				e->req->reply_mini(e->req, REP_NOTIN);
 			free(dbval);
 			return;
 		}
 
-		/* val must be NULL terminated; see cache_incr() */
-		if (dbval && dbval[dbvsize - 1] != '\0') {
-			e->req->reply_mini(e->req, REP_NOMATCH);
-			free(dbval);
-			return;
-		}
+		if (e->req->flags & FLAGS_BINARY) {
+			/* binary counters are 8 bytes in network byte order,
+			 * see cache_incr() */
+			if (dbvsize != sizeof(intval)) {
+				if (!async)
+					e->req->reply_mini(e->req,
+							REP_NOMATCH);
+				free(dbval);
+				return;
+			}
 
-		intval = strtoll((char *) dbval, NULL, 10);
-		intval = intval + * (int64_t *) e->val;
+			memcpy(&intval, dbval, sizeof(intval));
+			intval = ntohll(intval) + * (int64_t *) e->val;
+
+			netval = htonll(intval);
+			memcpy(dbval, &netval, sizeof(netval));
+		} else {
+			/* val must be NULL terminated; see cache_incr() */
+			if (dbval && dbval[dbvsize - 1] != '\0') {
+				if (!async)
+					e->req->reply_mini(e->req,
+							REP_NOMATCH);
+				free(dbval);
+				return;
+			}
 
-		if (dbvsize < 24) {
-			/* We know dbval is long enough because we've
-			 * allocated it, so we only change dbvsize */
-			dbvsize = 24;
-		}
+			intval = strtoll((char *) dbval, NULL, 10);
+			intval = intval + * (int64_t *) e->val;
+
+			if (dbvsize < 24) {
+				/* We know dbval is long enough because we've
+				 * allocated it, so we only change dbvsize */
+				dbvsize = 24;
+			}
 
-		snprintf((char *) dbval, dbvsize, "%23lld",
-				(long long int) intval);
+			snprintf((char *) dbval, dbvsize, "%23lld",
+					(long long int) intval);
+		}
 
 		rv = db->set(db, e->key, e->ksize, dbval, dbvsize);
+		free(dbval);
+		if (async)
+			return;
+
 		if (!rv) {
 			e->req->reply_err(e->req, ERR_DB);
 			return;
@@ -226,11 +336,9 @@ static void process_op(struct db_conn *db, struct queue_entry *e)
 		e->req->reply_long(e->req, REP_OK,
 				(unsigned char *) &intval, sizeof(intval));
 
-		free(dbval);
-
 	} else if (e->operation == REQ_FIRSTKEY) {
 		unsigned char *key;
-		size_t ksize = 64 * 1024;
+		size_t ksize = MAX_KSIZE;
 
 		if (db->firstkey == NULL) {
 			e->req->reply_err(e->req, ERR_DB);
@@ -253,7 +361,7 @@ static void process_op(struct db_conn *db, struct queue_entry *e)
 
 	} else if (e->operation == REQ_NEXTKEY) {
 		unsigned char *newkey;
-		size_t nksize = 64 * 1024;
+		size_t nksize = MAX_KSIZE;
 
 		if (db->nextkey == NULL) {
 			e->req->reply_err(e->req, ERR_DB);
@@ -273,8 +381,450 @@ static void process_op(struct db_conn *db, struct queue_entry *e)
 		}
 		e->req->reply_long(e->req, REP_OK, newkey, nksize);
 		free(newkey);
+
+	} else if (e->operation == REQ_MGET) {
+		process_mget(db, e);
+
+	} else if (e->operation == REQ_MSET) {
+		process_mset(db, e);
+
+	} else if (e->operation == REQ_SCAN) {
+		process_scan(db, e);
+
+	} else if (e->operation == REQ_SCAN_OPEN) {
+		process_scan_open(db, e);
+
+	} else if (e->operation == REQ_SCAN_NEXT) {
+		process_scan_next(db, e);
+
+	} else if (e->operation == REQ_SCAN_CLOSE) {
+		process_scan_close(db, e);
+
+	} else if (e->operation == REQ_RANGE) {
+		process_range(db, e);
+
+	} else if (e->operation == REQ_APPEND ||
+			e->operation == REQ_PREPEND) {
+		process_append(db, e);
+
 	} else {
 		wlog("Unknown op 0x%x\n", e->operation);
 	}
 }
 
+/* Looks up the keys of a multi-get that were not in the cache; see
+ * parse_mget() for the format of e->key. */
+static void process_mget(struct db_conn *db, struct queue_entry *e)
+{
+	int rv;
+	uint32_t idx, ksize;
+	unsigned char *p, *val;
+	size_t vsize;
+	struct mget_reply r;
+
+	val = malloc(settings.max_vsize);
+	if (val == NULL) {
+		e->req->reply_err(e->req, ERR_MEM);
+		return;
+	}
+
+	if (!mget_reply_init(&r, e->req)) {
+		e->req->reply_err(e->req, ERR_MEM);
+		free(val);
+		return;
+	}
+
+	for (p = e->key; p < e->key + e->ksize; p += 8 + ksize) {
+		memcpy(&idx, p, 4);
+		memcpy(&ksize, p + 4, 4);
+
+		vsize = settings.max_vsize;
+		rv = db->get(db, p + 8, ksize, val, &vsize);
+		mget_reply_add(&r, idx, rv ? val : NULL, vsize);
+	}
+
+	mget_reply_send(&r);
+	mget_reply_free(&r);
+	free(val);
+}
+
+/* Stores the pairs of a multi-set, which are in e->key in the same format
+ * as in the request; see parse_mset(). */
+static void process_mset(struct db_conn *db, struct queue_entry *e)
+{
+	int rv, failed = 0;
+	uint32_t ksize, vsize;
+	unsigned char *p;
+
+	for (p = e->key; p < e->key + e->ksize; p += 8 + ksize + vsize) {
+		memcpy(&ksize, p, 4);
+		memcpy(&vsize, p + 4, 4);
+		ksize = ntohl(ksize);
+		vsize = ntohl(vsize);
+
+		rv = db->set(db, p + 8, ksize, p + 8 + ksize, vsize);
+		if (!rv)
+			failed = 1;
+	}
+
+	if (!(e->req->flags & FLAGS_SYNC))
+		return;
+
+	if (failed) {
+		e->req->reply_err(e->req, ERR_DB);
+		return;
+	}
+	e->req->reply_mini(e->req, REP_OK);
+}
+
+
+/* Scan replies are built in a single buffer, limited by the number of keys
+ * and the size the client asked for; see scan_add() */
+struct scan_reply {
+	unsigned char *buf;
+	size_t len;
+	size_t max;
+	uint32_t nkeys;
+	uint32_t maxkeys;
+	int getvals;
+	int toobig;
+
+	/* position and size of the last key in buf */
+	size_t lastkey;
+	size_t lksize;
+};
+
+/* Called by the backend for each key found by a scan. Returns 0 once the
+ * reply is full, to stop the scan. */
+static int scan_add(void *arg, const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize)
+{
+	uint32_t t;
+	size_t hsize;
+	int toobig = 0;
+	struct scan_reply *r = arg;
+
+	if (r->maxkeys && r->nkeys >= r->maxkeys)
+		return 0;
+
+	hsize = r->getvals ? 4 + 4 : 4;
+	if (!r->getvals)
+		vsize = 0;
+
+	if (r->len + hsize + ksize + vsize > r->max) {
+		if (r->nkeys > 0)
+			return 0;
+
+		/* the first key is always sent, even if it goes over the size
+		 * the client asked for, as long as it fits in a message */
+		r->max = MGET_REPLY_MAX;
+		if (r->len + hsize + ksize > r->max) {
+			r->toobig = 1;
+			return 0;
+		}
+
+		/* like in multi-get replies, values that don't fit are sent
+		 * without data, and the client has to get them by itself */
+		if (r->len + hsize + ksize + vsize > r->max)
+			toobig = 1;
+	}
+
+	t = htonl(ksize);
+	memcpy(r->buf + r->len, &t, 4);
+	if (r->getvals) {
+		t = htonl(toobig ? MGET_TOOBIG : vsize);
+		memcpy(r->buf + r->len + 4, &t, 4);
+	}
+	memcpy(r->buf + r->len + hsize, key, ksize);
+	r->lastkey = r->len + hsize;
+	r->lksize = ksize;
+	r->len += hsize + ksize;
+
+	if (r->getvals && !toobig) {
+		memcpy(r->buf + r->len, val, vsize);
+		r->len += vsize;
+	}
+
+	r->nkeys++;
+	return 1;
+}
+
+/* Scans using firstkey and nextkey, for the backends that don't implement
+ * scan. */
+static int scan_by_key(struct db_conn *db,
+		const unsigned char *key, size_t ksize, int getvals,
+		struct scan_reply *r)
+{
+	int rv;
+	unsigned char *curkey, *nkey, *val = NULL, *t;
+	size_t cksize, nksize, vsize = 0;
+
+	if (db->firstkey == NULL || db->nextkey == NULL)
+		return 0;
+
+	curkey = malloc(MAX_KSIZE);
+	nkey = malloc(MAX_KSIZE);
+	if (getvals)
+		val = malloc(settings.max_vsize);
+	if (curkey == NULL || nkey == NULL || (getvals && val == NULL)) {
+		rv = 0;
+		goto exit;
+	}
+
+	nksize = MAX_KSIZE;
+	if (ksize == 0)
+		rv = db->firstkey(db, nkey, &nksize);
+	else
+		rv = db->nextkey(db, key, ksize, nkey, &nksize);
+
+	while (rv) {
+		if (getvals) {
+			vsize = settings.max_vsize;
+			/* skip the keys that go away in the meantime */
+			rv = db->get(db, nkey, nksize, val, &vsize);
+		}
+		if (rv && !scan_add(r, nkey, nksize, val, vsize))
+			break;
+
+		t = curkey;
+		curkey = nkey;
+		nkey = t;
+		cksize = nksize;
+
+		nksize = MAX_KSIZE;
+		rv = db->nextkey(db, curkey, cksize, nkey, &nksize);
+	}
+
+	rv = 1;
+
+exit:
+	free(curkey);
+	free(nkey);
+	free(val);
+	return rv;
+}
+
+static int scan_reply_init(struct scan_reply *r,
+		uint32_t maxkeys, uint32_t maxbytes, int getvals)
+{
+	r->len = 4;
+	r->nkeys = 0;
+	r->maxkeys = maxkeys;
+	r->max = maxbytes;
+	if (r->max == 0 || r->max > MGET_REPLY_MAX)
+		r->max = MGET_REPLY_MAX;
+	r->getvals = getvals;
+	r->toobig = 0;
+	r->lastkey = 0;
+	r->lksize = 0;
+
+	r->buf = malloc(MGET_REPLY_MAX);
+	if (r->buf == NULL)
+		return 0;
+
+	return 1;
+}
+
+/* Sends the reply to a scan, rv is what the scan returned. */
+static void scan_reply_send(struct scan_reply *r, const struct req_info *req,
+		int rv)
+{
+	uint32_t t;
+
+	if (!rv || r->toobig) {
+		req->reply_err(req, ERR_DB);
+	} else if (r->nkeys == 0) {
+		req->reply_mini(req, REP_NOTIN);
+	} else {
+		t = htonl(r->nkeys);
+		memcpy(r->buf, &t, 4);
+		req->reply_long(req, REP_OK, r->buf, r->len);
+	}
+}
+
+/* Fills the reply with the keys that follow the given one. */
+static int scan_batch(struct db_conn *db,
+		const unsigned char *key, size_t ksize, struct scan_reply *r)
+{
+	if (db->scan != NULL)
+		return db->scan(db, key, ksize, r->getvals, scan_add, r);
+	return scan_by_key(db, key, ksize, r->getvals, r);
+}
+
+/* Replies with the keys that follow e->key, with their values if the client
+ * asked for them; see parse_scan(). The reply has the number of keys, and
+ * then for each one, its size, the value size (if there are values), the key
+ * and the value. */
+static void process_scan(struct db_conn *db, struct queue_entry *e)
+{
+	int rv;
+	uint32_t limits[2];
+	struct scan_reply r;
+
+	memcpy(limits, e->val, sizeof(limits));
+
+	if (!scan_reply_init(&r, limits[0], limits[1],
+				e->req->flags & FLAGS_VALUES)) {
+		e->req->reply_err(e->req, ERR_MEM);
+		return;
+	}
+
+	rv = scan_batch(db, e->key, e->ksize, &r);
+	scan_reply_send(&r, e->req, rv);
+	free(r.buf);
+}
+
+/* Opens a cursor that starts after e->key, and replies with its ID. */
+static void process_scan_open(struct db_conn *db, struct queue_entry *e)
+{
+	uint32_t id;
+	struct cursor *c;
+
+	c = cursor_open(db, e->key, e->ksize);
+	if (c == NULL) {
+		e->req->reply_err(e->req, ERR_MEM);
+		return;
+	}
+
+	id = htonl(c->id);
+	e->req->reply_long(e->req, REP_OK, (unsigned char *) &id,
+			sizeof(id));
+}
+
+/* Replies with the next batch of keys from a cursor, in the same format as
+ * process_scan(); e->val has the cursor ID and the limits. */
+static void process_scan_next(struct db_conn *db, struct queue_entry *e)
+{
+	int rv;
+	uint32_t args[3];
+	struct cursor *c;
+	struct scan_reply r;
+
+	memcpy(args, e->val, sizeof(args));
+
+	c = cursor_find(args[0]);
+	if (c == NULL) {
+		e->req->reply_mini(e->req, REP_NOMATCH);
+		return;
+	}
+
+	if (!scan_reply_init(&r, args[1], args[2],
+				e->req->flags & FLAGS_VALUES)) {
+		e->req->reply_err(e->req, ERR_MEM);
+		return;
+	}
+
+	if (c->becur != NULL) {
+		rv = db->cursor_next(db, c->becur, r.getvals, scan_add, &r);
+	} else {
+		rv = scan_batch(db, c->lastkey, c->lksize, &r);
+		if (rv && r.nkeys > 0)
+			rv = cursor_set_lastkey(c, r.buf + r.lastkey,
+					r.lksize);
+	}
+
+	scan_reply_send(&r, e->req, rv);
+	free(r.buf);
+}
+
+static void process_scan_close(struct db_conn *db, struct queue_entry *e)
+{
+	uint32_t id;
+	struct cursor *c;
+
+	memcpy(&id, e->val, sizeof(id));
+
+	c = cursor_find(id);
+	if (c == NULL) {
+		e->req->reply_mini(e->req, REP_NOMATCH);
+		return;
+	}
+
+	cursor_close(db, c);
+	e->req->reply_mini(e->req, REP_OK);
+}
+
+/* Replies with the keys between e->key and e->val (if there's an end), in
+ * the same format as process_scan(); see queue_range() for the rest of the
+ * parameters. Only the backends that keep the keys sorted can do it. */
+static void process_range(struct db_conn *db, struct queue_entry *e)
+{
+	int rv;
+	uint32_t args[3];
+	struct scan_reply r;
+
+	if (db->range == NULL) {
+		e->req->reply_err(e->req, ERR_UNKREQ);
+		return;
+	}
+
+	memcpy(args, e->newval, sizeof(args));
+
+	if (!scan_reply_init(&r, args[0], args[1],
+				e->req->flags & FLAGS_VALUES)) {
+		e->req->reply_err(e->req, ERR_MEM);
+		return;
+	}
+
+	rv = db->range(db, e->key, e->ksize,
+			args[2] ? e->val : NULL, e->vsize,
+			r.getvals, scan_add, &r);
+	scan_reply_send(&r, e->req, rv);
+	free(r.buf);
+}
+
+/* Appends or prepends e->val to the value in the database, with a single
+ * read-modify-write. The value is read directly into its final place in the
+ * buffer, so for prepends we only need to copy the new data in front. */
+static void process_append(struct db_conn *db, struct queue_entry *e)
+{
+	int rv, async;
+	unsigned char *buf, *dbval;
+	size_t vsize = settings.max_vsize;
+
+	/* asynchronous requests were already replied to by parse_append(),
+	 * so we don't reply at all */
+	async = e->req->flags & FLAGS_ASYNC;
+
+	buf = malloc(vsize + e->vsize);
+	if (buf == NULL) {
+		if (!async)
+			e->req->reply_err(e->req, ERR_MEM);
+		return;
+	}
+
+	dbval = buf;
+	if (e->operation == REQ_PREPEND)
+		dbval = buf + e->vsize;
+
+	rv = db->get(db, e->key, e->ksize, dbval, &vsize);
+	if (rv == 0) {
+		if (!async)
+			e->req->reply_mini(e->req, REP_NOTIN);
+		free(buf);
+		return;
+	}
+
+	if (vsize + e->vsize > settings.max_vsize) {
+		if (!async)
+			e->req->reply_mini(e->req, REP_NOMATCH);
+		free(buf);
+		return;
+	}
+
+	if (e->operation == REQ_PREPEND)
+		memcpy(buf, e->val, e->vsize);
+	else
+		memcpy(buf + vsize, e->val, e->vsize);
+
+	rv = db->set(db, e->key, e->ksize, buf, vsize + e->vsize);
+	free(buf);
+	if (async)
+		return;
+
+	if (!rv) {
+		e->req->reply_err(e->req, ERR_DB);
+		return;
+	}
+	e->req->reply_mini(e->req, REP_OK);
+}
@@ -0,0 +1,263 @@
+
+/* Hot key detection.
+ * We keep a Count-Min sketch of the key access frequencies, and a small
+ * min-heap with the keys that have the highest estimated counts (the "heavy
+ * hitters"). Only a fraction of the accesses are sampled, to keep the
+ * per-operation overhead low; counts are scaled back when reported.
+ * To let the ranking follow changes in the workload, all the counters are
+ * halved periodically.
+ */
+
+#include <sys/types.h>		/* for size_t */
+#include <stdint.h>		/* for [u]int*_t */
+#include <stdlib.h>		/* for malloc() and qsort() */
+#include <string.h>		/* for memcpy()/memcmp() */
+#include <arpa/inet.h>		/* htonl() */
+#include "hash.h"		/* hash() */
+#include "netutils.h"		/* htonll() */
+#include "hotkeys.h"
+
+
+/* Halve all the counters once we've sampled this many accesses */
+#define HK_DECAY_PERIOD (HK_WIDTH * 4)
+
+
+struct hotkeys *hotkeys_create(unsigned int rate)
+{
+	struct hotkeys *hk;
+
+	hk = malloc(sizeof(struct hotkeys));
+	if (hk == NULL)
+		return NULL;
+
+	memset(hk, 0, sizeof(struct hotkeys));
+	hk->rate = rate > 0 ? rate : 1;
+
+	return hk;
+}
+
+void hotkeys_free(struct hotkeys *hk)
+{
+	size_t i;
+
+	if (hk == NULL)
+		return;
+
+	for (i = 0; i < hk->nheap; i++)
+		free(hk->heap[i].key);
+	free(hk);
+}
+
+
+/* Updates the sketch and returns the new estimated count for the key. We use
+ * double hashing to get the HK_DEPTH indexes out of a single hash. */
+static uint32_t sketch_update(struct hotkeys *hk, uint32_t h)
+{
+	int i;
+	uint32_t idx, est, h2;
+
+	h2 = (h >> 16) | (h << 16);
+	h2 = h2 * 0x5bd1e995 | 1;
+
+	est = UINT32_MAX;
+	for (i = 0; i < HK_DEPTH; i++) {
+		idx = (h + i * h2) & (HK_WIDTH - 1);
+		if (hk->sketch[i][idx] < UINT32_MAX)
+			hk->sketch[i][idx]++;
+		if (hk->sketch[i][idx] < est)
+			est = hk->sketch[i][idx];
+	}
+
+	return est;
+}
+
+static void heap_swap(struct hotkeys *hk, size_t a, size_t b)
+{
+	struct hk_entry t;
+
+	t = hk->heap[a];
+	hk->heap[a] = hk->heap[b];
+	hk->heap[b] = t;
+}
+
+/* Moves the entry at position i down until the heap property is restored;
+ * used after an entry's count is increased. */
+static void heap_sift_down(struct hotkeys *hk, size_t i)
+{
+	size_t l, r, min;
+
+	for (;;) {
+		l = 2 * i + 1;
+		r = 2 * i + 2;
+		min = i;
+
+		if (l < hk->nheap && hk->heap[l].count < hk->heap[min].count)
+			min = l;
+		if (r < hk->nheap && hk->heap[r].count < hk->heap[min].count)
+			min = r;
+		if (min == i)
+			break;
+
+		heap_swap(hk, i, min);
+		i = min;
+	}
+}
+
+static void heap_sift_up(struct hotkeys *hk, size_t i)
+{
+	size_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (hk->heap[parent].count <= hk->heap[i].count)
+			break;
+		heap_swap(hk, i, parent);
+		i = parent;
+	}
+}
+
+static void decay(struct hotkeys *hk)
+{
+	int i, j;
+
+	for (i = 0; i < HK_DEPTH; i++)
+		for (j = 0; j < HK_WIDTH; j++)
+			hk->sketch[i][j] /= 2;
+
+	/* halving keeps the heap ordering, no need to fix it up */
+	for (i = 0; i < hk->nheap; i++)
+		hk->heap[i].count /= 2;
+
+	hk->nsampled = 0;
+}
+
+/* Records a sampled access to the given key. */
+void hotkeys_record(struct hotkeys *hk,
+		const unsigned char *key, size_t ksize)
+{
+	size_t i;
+	uint32_t h, est;
+	unsigned char *kcopy;
+	struct hk_entry *e;
+
+	if (ksize > HK_MAX_KSIZE)
+		return;
+
+	h = hash(key, ksize);
+	est = sketch_update(hk, h);
+
+	hk->nsampled++;
+	if (hk->nsampled >= HK_DECAY_PERIOD)
+		decay(hk);
+
+	/* The heap is small, so a linear lookup is cheaper than keeping an
+	 * index */
+	for (i = 0; i < hk->nheap; i++) {
+		e = hk->heap + i;
+		if (e->h == h && e->ksize == ksize
+				&& memcmp(e->key, key, ksize) == 0) {
+			e->count = est;
+			heap_sift_down(hk, i);
+			return;
+		}
+	}
+
+	if (hk->nheap < HK_TOPK) {
+		kcopy = malloc(ksize);
+		if (kcopy == NULL)
+			return;
+
+		e = hk->heap + hk->nheap;
+		hk->nheap++;
+	} else if (est > hk->heap[0].count) {
+		/* evict the lightest key, reusing its buffer if possible */
+		e = hk->heap;
+		if (e->ksize == ksize) {
+			kcopy = e->key;
+		} else {
+			kcopy = malloc(ksize);
+			if (kcopy == NULL)
+				return;
+			free(e->key);
+		}
+	} else {
+		return;
+	}
+
+	memcpy(kcopy, key, ksize);
+	e->key = kcopy;
+	e->ksize = ksize;
+	e->h = h;
+	e->count = est;
+
+	if (e == hk->heap)
+		heap_sift_down(hk, 0);
+	else
+		heap_sift_up(hk, hk->nheap - 1);
+}
+
+
+static int compare_entries(const void *p1, const void *p2)
+{
+	const struct hk_entry *e1 = * (const struct hk_entry **) p1;
+	const struct hk_entry *e2 = * (const struct hk_entry **) p2;
+
+	/* descending order */
+	if (e1->count > e2->count)
+		return -1;
+	else if (e1->count < e2->count)
+		return 1;
+	return 0;
+}
+
+/* Writes the heaviest keys to the given buffer, from the heaviest to the
+ * lightest, in network format:
+ * 4		number of entries
+ * and then, for each entry:
+ * 8		estimated count
+ * 4		ksize
+ * ksize	key
+ *
+ * Returns the number of bytes written. Entries that do not fit in the buffer
+ * are left out. */
+size_t hotkeys_dump(struct hotkeys *hk, unsigned char *buf, size_t bsize)
+{
+	size_t i, n, pos;
+	uint32_t t;
+	uint64_t count;
+	struct hk_entry *sorted[HK_TOPK];
+
+	if (bsize < 4)
+		return 0;
+
+	n = 0;
+	pos = 4;
+
+	if (hk != NULL) {
+		for (i = 0; i < hk->nheap; i++)
+			sorted[i] = hk->heap + i;
+		qsort(sorted, hk->nheap, sizeof(struct hk_entry *),
+				compare_entries);
+
+		for (i = 0; i < hk->nheap; i++) {
+			if (pos + 8 + 4 + sorted[i]->ksize > bsize)
+				break;
+
+			count = htonll((uint64_t) sorted[i]->count * hk->rate);
+			memcpy(buf + pos, &count, 8);
+			t = htonl(sorted[i]->ksize);
+			memcpy(buf + pos + 8, &t, 4);
+			memcpy(buf + pos + 12, sorted[i]->key,
+					sorted[i]->ksize);
+
+			pos += 8 + 4 + sorted[i]->ksize;
+			n++;
+		}
+	}
+
+	t = htonl(n);
+	memcpy(buf, &t, 4);
+
+	return pos;
+}
+
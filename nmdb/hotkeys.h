@@ -0,0 +1,61 @@
+
+#ifndef _HOTKEYS_H
+#define _HOTKEYS_H
+
+/* Hot key detection. See hotkeys.c for more information. */
+
+#include <sys/types.h>		/* for size_t */
+#include <stdint.h>		/* for uint32_t */
+
+
+/* Count-Min sketch dimensions; the width must be a power of 2 */
+#define HK_DEPTH 4
+#define HK_WIDTH 4096
+
+/* How many of the heaviest keys we keep track of */
+#define HK_TOPK 16
+
+/* Keys longer than this are not tracked */
+#define HK_MAX_KSIZE 256
+
+struct hk_entry {
+	unsigned char *key;
+	size_t ksize;
+	uint32_t h;
+	uint32_t count;
+};
+
+struct hotkeys {
+	/* sample one out of every rate accesses */
+	unsigned int rate;
+	unsigned int tick;
+
+	/* number of sampled accesses since the last decay */
+	unsigned long nsampled;
+
+	uint32_t sketch[HK_DEPTH][HK_WIDTH];
+
+	/* min-heap of the heaviest keys, ordered by count */
+	size_t nheap;
+	struct hk_entry heap[HK_TOPK];
+};
+
+
+struct hotkeys *hotkeys_create(unsigned int rate);
+void hotkeys_free(struct hotkeys *hk);
+void hotkeys_record(struct hotkeys *hk,
+		const unsigned char *key, size_t ksize);
+size_t hotkeys_dump(struct hotkeys *hk, unsigned char *buf, size_t bsize);
+
+/* Accounts an access to the given key. Most of the accesses are not sampled,
+ * so we avoid the function call for them. */
+#define hotkeys_access(hk, key, ksize) \
+	do { \
+		if ((hk) != NULL && ++(hk)->tick >= (hk)->rate) { \
+			(hk)->tick = 0; \
+			hotkeys_record(hk, key, ksize); \
+		} \
+	} while (0)
+
+#endif
+
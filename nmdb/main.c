@@ -9,6 +9,7 @@
 #include "cache.h"
 #include "net.h"
 #include "dbloop.h"
+#include "replyq.h"
 #include "common.h"
 #include "net-const.h"
 #include "log.h"
@@ -23,6 +24,9 @@ struct settings settings;
 struct stats stats;
 struct cache *cache_table;
 struct queue *op_queue;
+struct hotkeys *hot_reads;
+struct hotkeys *hot_writes;
+struct mrc *cache_mrc;
 
 
 static void help(void) {
@@ -31,15 +35,22 @@ static void help(void) {
 	  "\n"
 	  "  -b backend	backend to use (" DEFAULT_BE_NAME ")\n"
 	  "  -d dbpath	database path ('database' by default)\n"
+	  "  -C secs	close scan cursors unused for this long (60)\n"
 	  "  -l lower	TIPC lower port number (10)\n"
 	  "  -L upper	TIPC upper port number (= lower)\n"
 	  "  -t port	TCP listening port (26010)\n"
 	  "  -T addr	TCP listening address (all local addresses)\n"
+	  "  -I secs	close TCP connections idle for this long, 0 disables it (0)\n"
 	  "  -u port	UDP listening port (26010)\n"
 	  "  -U addr	UDP listening address (all local addresses)\n"
 	  "  -s port	SCTP listening port (26010)\n"
 	  "  -S addr	SCTP listening address (all local addresses)\n"
+	  "  -x path	Unix socket path (" UNIX_SERVER_PATH ")\n"
+	  "  -X path	shared memory socket path (" SHM_SERVER_PATH ")\n"
 	  "  -c nobj	max. number of objects to be cached, in thousands (128)\n"
+	  "  -M size	max. value size, in kilobytes (1024)\n"
+	  "  -k rate	hot key sampling rate, 0 disables it (1 in 100)\n"
+	  "  -m rate	miss ratio curve sampling rate, 0 disables it (1 in 100)\n"
 	  "  -o fname	log to the given file (stdout).\n"
 	  "  -i pidfile file to write the PID to (none).\n"
 	  "  -f		don't fork and stay in the foreground\n"
@@ -63,14 +74,21 @@ static int load_settings(int argc, char **argv)
 	settings.tipc_upper = -1;
 	settings.tcp_addr = NULL;
 	settings.tcp_port = -1;
+	settings.tcp_idle_timeout = 0;
 	settings.udp_addr = NULL;
 	settings.udp_port = -1;
 	settings.sctp_addr = NULL;
 	settings.sctp_port = -1;
+	settings.unix_path = NULL;
+	settings.shm_path = NULL;
 	settings.numobjs = -1;
+	settings.max_vsize = 0;
+	settings.hotkeys_rate = -1;
+	settings.mrc_rate = -1;
 	settings.foreground = 0;
 	settings.passive = 0;
 	settings.read_only = 0;
+	settings.cursor_timeout = 60;
 	settings.logfname = NULL;
 	settings.pidfile = NULL;
 	settings.backend = DEFAULT_BE;
@@ -79,7 +97,7 @@ static int load_settings(int argc, char **argv)
 	settings.logfname = strdup("-");
 
 	while ((c = getopt(argc, argv,
-				"b:d:l:L:t:T:u:U:s:S:c:o:i:fprh?")) != -1) {
+				"b:d:C:l:L:t:T:I:u:U:s:S:x:X:c:M:k:m:o:i:fprh?")) != -1) {
 		switch(c) {
 		case 'b':
 			settings.backend = be_type_from_str(optarg);
@@ -88,6 +106,9 @@ static int load_settings(int argc, char **argv)
 			free(settings.dbname);
 			settings.dbname = strdup(optarg);
 			break;
+		case 'C':
+			settings.cursor_timeout = atoi(optarg);
+			break;
 
 		case 'l':
 			settings.tipc_lower = atoi(optarg);
@@ -102,6 +123,9 @@ static int load_settings(int argc, char **argv)
 		case 'T':
 			settings.tcp_addr = optarg;
 			break;
+		case 'I':
+			settings.tcp_idle_timeout = atoi(optarg);
+			break;
 
 		case 'u':
 			settings.udp_port = atoi(optarg);
@@ -117,10 +141,29 @@ static int load_settings(int argc, char **argv)
 			settings.sctp_addr = optarg;
 			break;
 
+		case 'x':
+			settings.unix_path = optarg;
+			break;
+		case 'X':
+			settings.shm_path = optarg;
+			break;
+
 		case 'c':
 			settings.numobjs = atoi(optarg) * 1024;
 			break;
 
+		case 'M':
+			settings.max_vsize = atoi(optarg) * 1024;
+			break;
+
+		case 'k':
+			settings.hotkeys_rate = atoi(optarg);
+			break;
+
+		case 'm':
+			settings.mrc_rate = atoi(optarg);
+			break;
+
 		case 'o':
 			free(settings.logfname);
 			settings.logfname = strdup(optarg);
@@ -167,8 +210,20 @@ static int load_settings(int argc, char **argv)
 		settings.sctp_addr = SCTP_SERVER_ADDR;
 	if (settings.sctp_port == -1)
 		settings.sctp_port = SCTP_SERVER_PORT;
+	if (settings.unix_path == NULL)
+		settings.unix_path = UNIX_SERVER_PATH;
+	if (settings.shm_path == NULL)
+		settings.shm_path = SHM_SERVER_PATH;
 	if (settings.numobjs == -1)
 		settings.numobjs = 128 * 1024;
+	if (settings.max_vsize == 0)
+		settings.max_vsize = 1024 * 1024;
+	else if (settings.max_vsize < 64 * 1024)
+		settings.max_vsize = 64 * 1024;
+	if (settings.hotkeys_rate == -1)
+		settings.hotkeys_rate = 100;
+	if (settings.mrc_rate == -1)
+		settings.mrc_rate = 100;
 
 	if (settings.backend == BE_UNKNOWN) {
 		printf("Error: unknown backend\n");
@@ -215,6 +270,23 @@ int main(int argc, char **argv)
 	}
 	cache_table = cd;
 
+	if (settings.hotkeys_rate > 0) {
+		hot_reads = hotkeys_create(settings.hotkeys_rate);
+		hot_writes = hotkeys_create(settings.hotkeys_rate);
+		if (hot_reads == NULL || hot_writes == NULL) {
+			errlog("Error creating hot key trackers");
+			return 1;
+		}
+	}
+
+	if (settings.mrc_rate > 0) {
+		cache_mrc = mrc_create(settings.numobjs, settings.mrc_rate);
+		if (cache_mrc == NULL) {
+			errlog("Error creating miss ratio curve estimator");
+			return 1;
+		}
+	}
+
 	q = queue_create();
 	if (q == NULL) {
 		errlog("Error creating queue");
@@ -248,18 +320,29 @@ int main(int argc, char **argv)
 
 	write_pid();
 
+	if (!replyq_init()) {
+		errlog("Error creating reply queue");
+		return 1;
+	}
+
 	dbthread = db_loop_start(db);
 
 	net_loop();
 
 	db_loop_stop(dbthread);
 
+	replyq_free();
+
 	db->close(db);
 
 	queue_free(q);
 
 	cache_free(cd);
 
+	hotkeys_free(hot_reads);
+	hotkeys_free(hot_writes);
+	mrc_free(cache_mrc);
+
 	if (settings.pidfile)
 		unlink(settings.pidfile);
 
@@ -0,0 +1,89 @@
+
+/* Multi-get replies.
+ * The results of a REQ_MGET are sent in one or more replies, each one
+ * accounting for some of the requested keys: the cache hits are sent right
+ * away by the network thread, and the rest are sent by the database thread
+ * once it has looked them up. Replies are also split when they would not fit
+ * in a single message. See doc/network.rst for the format.
+ */
+
+#include <stdlib.h>		/* for malloc() */
+#include <string.h>		/* for memcpy() */
+#include <arpa/inet.h>		/* htonl() */
+#include "net-const.h"
+#include "mget.h"
+
+
+/* Size of the reply header, and of each value's header */
+#define HDR_SIZE (4 + 4)
+#define VAL_HDR_SIZE (4 + 4)
+
+
+int mget_reply_init(struct mget_reply *r, const struct req_info *req)
+{
+	r->req = req;
+	r->len = HDR_SIZE;
+	r->ndone = 0;
+	r->nvals = 0;
+
+	r->buf = malloc(MGET_REPLY_MAX);
+	if (r->buf == NULL)
+		return 0;
+
+	return 1;
+}
+
+void mget_reply_free(struct mget_reply *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+}
+
+/* Adds the result for the key in position idx of the request. A NULL val
+ * means the key was not found. */
+void mget_reply_add(struct mget_reply *r, uint32_t idx,
+		const unsigned char *val, size_t vsize)
+{
+	uint32_t t;
+
+	if (val != NULL && HDR_SIZE + VAL_HDR_SIZE + vsize > MGET_REPLY_MAX) {
+		/* it will never fit, the client must get it by itself */
+		vsize = 0;
+		t = htonl(MGET_TOOBIG);
+	} else {
+		t = htonl(vsize);
+	}
+
+	if (val != NULL && r->len + VAL_HDR_SIZE + vsize > MGET_REPLY_MAX)
+		mget_reply_send(r);
+
+	r->ndone++;
+	if (val == NULL)
+		return;
+
+	memcpy(r->buf + r->len + 4, &t, 4);
+	t = htonl(idx);
+	memcpy(r->buf + r->len, &t, 4);
+	memcpy(r->buf + r->len + VAL_HDR_SIZE, val, vsize);
+
+	r->len += VAL_HDR_SIZE + vsize;
+	r->nvals++;
+}
+
+/* Sends the results added so far. */
+void mget_reply_send(struct mget_reply *r)
+{
+	uint32_t t;
+
+	t = htonl(r->ndone);
+	memcpy(r->buf, &t, 4);
+	t = htonl(r->nvals);
+	memcpy(r->buf + 4, &t, 4);
+
+	r->req->reply_long(r->req, REP_OK, r->buf, r->len);
+
+	r->len = HDR_SIZE;
+	r->ndone = 0;
+	r->nvals = 0;
+}
+
@@ -0,0 +1,34 @@
+
+#ifndef _MGET_H
+#define _MGET_H
+
+/* Multi-get replies. See mget.c for more information. */
+
+#include <sys/types.h>		/* for size_t */
+#include <stdint.h>		/* for uint32_t */
+#include "req.h"		/* for req_info */
+
+
+/* Max. size of the value of a multi-get reply, so it fits in a single
+ * message for all the protocols */
+#define MGET_REPLY_MAX (64 * 1024 - 64)
+
+/* Value size used for values that are too big to fit in a reply */
+#define MGET_TOOBIG 0xFFFFFFFF
+
+struct mget_reply {
+	const struct req_info *req;
+	unsigned char *buf;
+	size_t len;
+	uint32_t ndone;
+	uint32_t nvals;
+};
+
+int mget_reply_init(struct mget_reply *r, const struct req_info *req);
+void mget_reply_free(struct mget_reply *r);
+void mget_reply_add(struct mget_reply *r, uint32_t idx,
+		const unsigned char *val, size_t vsize);
+void mget_reply_send(struct mget_reply *r);
+
+#endif
+
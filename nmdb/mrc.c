@@ -0,0 +1,279 @@
+
+/* Miss ratio curve estimation.
+ * To know how the cache would perform if it were bigger or smaller, we
+ * compute the LRU reuse distance of the accesses (how many different keys
+ * were accessed since the last time the same key was): an access is a hit in
+ * a cache of size S if its distance is below S.
+ * Doing that for every key would be too expensive, so we use spatial sampling
+ * as described in the SHARDS paper (Waldspurger et al., FAST '15): we only
+ * track the keys whose hash falls in 1/rate of the hash space, and scale the
+ * cache sizes down by the same factor.
+ * Distances are computed using a Fenwick tree over logical access times,
+ * which has a 1 for every time that is the last access of some key. When we
+ * run out of times or table space, we renumber the accesses and forget about
+ * the keys that are too far away to be a hit in any of the sizes we
+ * estimate.
+ */
+
+#include <sys/types.h>		/* for size_t */
+#include <stdint.h>		/* for [u]int*_t */
+#include <stdlib.h>		/* for malloc() and qsort() */
+#include <string.h>		/* for memset() */
+#include "hash.h"		/* hash() */
+#include "mrc.h"
+
+
+static const int mrc_sizes[MRC_NSIZES] = MRC_SIZES;
+
+
+/* Fenwick tree operations; times go from 1 to tmax */
+static void tree_add(struct mrc *m, uint32_t t, int v)
+{
+	for (; t <= m->tmax; t += t & -t)
+		m->tree[t] += v;
+}
+
+static uint32_t tree_sum(struct mrc *m, uint32_t t)
+{
+	uint32_t s = 0;
+
+	for (; t > 0; t -= t & -t)
+		s += m->tree[t];
+	return s;
+}
+
+
+struct mrc *mrc_create(size_t numobjs, unsigned int rate)
+{
+	int i;
+	struct mrc *m;
+
+	m = malloc(sizeof(struct mrc));
+	if (m == NULL)
+		return NULL;
+
+	memset(m, 0, sizeof(struct mrc));
+	m->rate = rate > 0 ? rate : 1;
+	m->threshold = UINT32_MAX / m->rate;
+
+	for (i = 0; i < MRC_NSIZES; i++) {
+		m->limits[i] = numobjs * mrc_sizes[i] / 2 / m->rate;
+		if (m->limits[i] == 0)
+			m->limits[i] = 1;
+	}
+	m->maxkeys = m->limits[MRC_NSIZES - 1];
+
+	/* we renumber when we have twice maxkeys keys, so keep the table
+	 * load below 1/2 */
+	m->tsize = 64;
+	while (m->tsize < m->maxkeys * 4)
+		m->tsize *= 2;
+
+	m->tmax = m->maxkeys * 4;
+	if (m->tmax < 1024)
+		m->tmax = 1024;
+
+	m->table = malloc(sizeof(struct mrc_slot) * m->tsize);
+	m->tree = malloc(sizeof(uint32_t) * (m->tmax + 1));
+	if (m->table == NULL || m->tree == NULL) {
+		mrc_free(m);
+		return NULL;
+	}
+
+	memset(m->table, 0, sizeof(struct mrc_slot) * m->tsize);
+	memset(m->tree, 0, sizeof(uint32_t) * (m->tmax + 1));
+
+	return m;
+}
+
+void mrc_free(struct mrc *m)
+{
+	if (m == NULL)
+		return;
+
+	free(m->table);
+	free(m->tree);
+	free(m);
+}
+
+
+/* Returns the slot for the given hash; if it's not in the table, it returns
+ * the free slot where it should go. */
+static struct mrc_slot *table_lookup(struct mrc *m, uint32_t h)
+{
+	size_t i, mask;
+
+	mask = m->tsize - 1;
+	for (i = h & mask; m->table[i].ts != 0; i = (i + 1) & mask) {
+		if (m->table[i].h == h)
+			break;
+	}
+
+	return m->table + i;
+}
+
+/* Removes the given slot from the table, moving back the ones that follow
+ * it so lookups don't stop early. */
+static void table_remove(struct mrc *m, struct mrc_slot *s)
+{
+	size_t i, j, k, mask;
+
+	mask = m->tsize - 1;
+	i = j = s - m->table;
+
+	for (;;) {
+		j = (j + 1) & mask;
+		if (m->table[j].ts == 0)
+			break;
+
+		/* leave it if its home is cyclically in (i, j] */
+		k = m->table[j].h & mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		m->table[i] = m->table[j];
+		i = j;
+	}
+
+	m->table[i].ts = 0;
+	m->nkeys--;
+}
+
+
+static int compare_slots(const void *p1, const void *p2)
+{
+	const struct mrc_slot *s1 = p1;
+	const struct mrc_slot *s2 = p2;
+
+	/* descending order */
+	if (s1->ts > s2->ts)
+		return -1;
+	else if (s1->ts < s2->ts)
+		return 1;
+	return 0;
+}
+
+/* Keeps only the most recently accessed maxkeys keys, and renumbers their
+ * access times from 1. */
+static void renumber(struct mrc *m)
+{
+	size_t i, n;
+	struct mrc_slot *live, *s;
+
+	live = malloc(sizeof(struct mrc_slot) * (m->nkeys + 1));
+
+	n = 0;
+	if (live != NULL) {
+		for (i = 0; i < m->tsize; i++)
+			if (m->table[i].ts != 0)
+				live[n++] = m->table[i];
+		qsort(live, n, sizeof(struct mrc_slot), compare_slots);
+	}
+
+	/* if we couldn't allocate, we just start over */
+	if (n > m->maxkeys)
+		n = m->maxkeys;
+
+	memset(m->table, 0, sizeof(struct mrc_slot) * m->tsize);
+	memset(m->tree, 0, sizeof(uint32_t) * (m->tmax + 1));
+
+	for (i = 0; i < n; i++) {
+		s = table_lookup(m, live[i].h);
+		s->h = live[i].h;
+		s->ts = n - i;
+		tree_add(m, s->ts, 1);
+	}
+
+	m->nkeys = n;
+	m->now = n;
+	free(live);
+}
+
+
+/* Returns the sampled hash of the key, or 0 if it's not sampled. */
+static uint32_t sample(struct mrc *m, const unsigned char *key, size_t ksize)
+{
+	uint32_t h;
+
+	h = hash(key, ksize);
+
+	/* the cache uses the low bits of the hash, mix them up a bit so the
+	 * sampled keys are not all in the same buckets */
+	if (h * 0x9e3779b1 > m->threshold)
+		return 0;
+
+	return h;
+}
+
+/* Accounts an access to the given key. */
+void mrc_access(struct mrc *m, const unsigned char *key, size_t ksize)
+{
+	int i;
+	uint32_t h, dist;
+	struct mrc_slot *s;
+
+	if (m == NULL)
+		return;
+
+	h = sample(m, key, ksize);
+	if (h == 0)
+		return;
+
+	if (m->now >= m->tmax || m->nkeys >= m->maxkeys * 2)
+		renumber(m);
+
+	m->accesses++;
+	m->now++;
+
+	s = table_lookup(m, h);
+	if (s->ts != 0) {
+		/* number of different keys accessed since the last time */
+		dist = tree_sum(m, m->now - 1) - tree_sum(m, s->ts);
+		for (i = 0; i < MRC_NSIZES; i++) {
+			if (dist < m->limits[i])
+				m->hits[i]++;
+		}
+
+		tree_add(m, s->ts, -1);
+	} else {
+		/* first access, a miss for every size */
+		s->h = h;
+		m->nkeys++;
+	}
+
+	s->ts = m->now;
+	tree_add(m, s->ts, 1);
+}
+
+/* Accounts the removal of the given key from the cache, so the next access to
+ * it is a miss. */
+void mrc_remove(struct mrc *m, const unsigned char *key, size_t ksize)
+{
+	uint32_t h;
+	struct mrc_slot *s;
+
+	if (m == NULL)
+		return;
+
+	h = sample(m, key, ksize);
+	if (h == 0)
+		return;
+
+	s = table_lookup(m, h);
+	if (s->ts == 0)
+		return;
+
+	tree_add(m, s->ts, -1);
+	table_remove(m, s);
+}
+
+/* Returns the estimated hit ratio for the given size index, in parts per
+ * million. */
+uint64_t mrc_hit_ratio(struct mrc *m, int size)
+{
+	if (m == NULL || m->accesses == 0)
+		return 0;
+
+	return (uint64_t) m->hits[size] * 1000000 / m->accesses;
+}
+
@@ -0,0 +1,58 @@
+
+#ifndef _MRC_H
+#define _MRC_H
+
+/* Miss ratio curve estimation. See mrc.c for more information. */
+
+#include <sys/types.h>		/* for size_t */
+#include <stdint.h>		/* for uint32_t */
+
+
+/* Number of cache sizes we estimate the hit ratio for, and their size
+ * relative to the current cache, in halves (so 1 means 0.5x) */
+#define MRC_NSIZES 5
+#define MRC_SIZES { 1, 2, 4, 8, 16 }
+
+struct mrc_slot {
+	uint32_t h;
+	uint32_t ts;
+};
+
+struct mrc {
+	/* we sample the keys whose hash falls below the threshold, which is
+	 * 1 in rate of the key space */
+	unsigned int rate;
+	uint32_t threshold;
+
+	/* max. number of sampled keys worth tracking: the ones further away
+	 * are a miss for all the sizes we estimate */
+	size_t maxkeys;
+
+	/* hash table of the sampled keys, with their last access time;
+	 * ts == 0 means the slot is free */
+	struct mrc_slot *table;
+	size_t tsize;
+	size_t nkeys;
+
+	/* Fenwick tree over the access times, with 1 for each time that is
+	 * the last access of a key, so we can count how many different keys
+	 * were accessed since a given time */
+	uint32_t *tree;
+	uint32_t tmax;
+	uint32_t now;
+
+	/* hits for each cache size, in sampled key distances */
+	size_t limits[MRC_NSIZES];
+	unsigned long hits[MRC_NSIZES];
+	unsigned long accesses;
+};
+
+
+struct mrc *mrc_create(size_t numobjs, unsigned int rate);
+void mrc_free(struct mrc *m);
+void mrc_access(struct mrc *m, const unsigned char *key, size_t ksize);
+void mrc_remove(struct mrc *m, const unsigned char *key, size_t ksize);
+uint64_t mrc_hit_ratio(struct mrc *m, int size);
+
+#endif
+
@@ -23,6 +23,12 @@
 #define SCTP_SERVER_ADDR "0.0.0.0"
 #define SCTP_SERVER_PORT 26010
 
+/* Unix socket default path. */
+#define UNIX_SERVER_PATH "/tmp/nmdb.sock"
+
+/* Default path of the Unix socket used to set up shared memory. */
+#define SHM_SERVER_PATH "/tmp/nmdb-shm.sock"
+
 /* Protocol version, for checking in the network header. */
 #define PROTO_VER 1
 
@@ -35,10 +41,29 @@
 #define REQ_STATS		0x106
 #define REQ_FIRSTKEY		0x107
 #define REQ_NEXTKEY		0x108
+#define REQ_HOTKEYS		0x109
+#define REQ_XSTATS		0x10A
+#define REQ_MGET		0x10B
+#define REQ_MSET		0x10C
+#define REQ_SCAN		0x10D
+#define REQ_SCAN_OPEN		0x10E
+#define REQ_SCAN_NEXT		0x10F
+#define REQ_SCAN_CLOSE		0x110
+#define REQ_PREFIX		0x111
+#define REQ_RANGE		0x112
+#define REQ_APPEND		0x113
+#define REQ_PREPEND		0x114
+#define REQ_GETS		0x115
+#define REQ_CAS_VERSION		0x116
 
 /* Possible request flags (which can be applied to the documented requests) */
-#define FLAGS_CACHE_ONLY	1	/* get, set, del, cas, incr */
-#define FLAGS_SYNC		2	/* set, del */
+#define FLAGS_CACHE_ONLY	1	/* get, set, del, cas, incr, mget, mset,
+					   append, prepend, gets,
+					   cas_version */
+#define FLAGS_SYNC		2	/* set, del, mset */
+#define FLAGS_BINARY		4	/* incr */
+#define FLAGS_ASYNC		8	/* incr, append, prepend */
+#define FLAGS_VALUES		16	/* scan, scan_next, prefix, range */
 
 /* Network replies (different namespace from requests) */
 #define REP_ERR			0x800
@@ -13,7 +13,11 @@ typedef unsigned char u_char;
 #include "tcp.h"
 #include "udp.h"
 #include "sctp.h"
+#include "unix.h"
+#include "shm.h"
+#include "uring.h"
 #include "net.h"
+#include "replyq.h"
 #include "log.h"
 
 
@@ -51,7 +55,12 @@ void net_loop(void)
 	int tcp_fd = -1;
 	int udp_fd = -1;
 	int sctp_fd = -1;
-	struct event tipc_evt, tcp_evt, udp_evt, sctp_evt,
+	int unix_fd = -1;
+	int shm_fd = -1;
+	int use_uring = 0;
+	struct event tipc_evt, tcp_evt, udp_evt, sctp_evt, unix_evt, shm_evt,
+		     uring_evt,
+		     replyq_evt,
 		     sigterm_evt, sigint_evt,
 		     sighup_evt, sigusr1_evt, sigusr2_evt;
 
@@ -79,9 +88,19 @@ void net_loop(void)
 			exit(1);
 		}
 
-		event_set(&tcp_evt, tcp_fd, EV_READ | EV_PERSIST,
-				tcp_newconnection, &tcp_evt);
-		event_add(&tcp_evt, NULL);
+		/* TCP connections are handled with io_uring if we can (see
+		 * uring.c), and with libevent otherwise */
+		use_uring = uring_init() && tcp_uring_start(tcp_fd);
+		if (use_uring) {
+			event_set(&uring_evt, uring_fd(), EV_READ | EV_PERSIST,
+					uring_process, &uring_evt);
+			event_add(&uring_evt, NULL);
+		} else {
+			uring_free();
+			event_set(&tcp_evt, tcp_fd, EV_READ | EV_PERSIST,
+					tcp_newconnection, &tcp_evt);
+			event_add(&tcp_evt, NULL);
+		}
 	}
 
 	if (ENABLE_UDP) {
@@ -108,6 +127,35 @@ void net_loop(void)
 		event_add(&sctp_evt, NULL);
 	}
 
+	if (ENABLE_UNIX) {
+		unix_fd = unix_init();
+		if (unix_fd < 0) {
+			errlog("Error initializing Unix socket");
+			exit(1);
+		}
+
+		event_set(&unix_evt, unix_fd, EV_READ | EV_PERSIST,
+				unix_newconnection, &unix_evt);
+		event_add(&unix_evt, NULL);
+	}
+
+	if (ENABLE_SHM) {
+		shm_fd = shm_init();
+		if (shm_fd < 0) {
+			errlog("Error initializing shared memory");
+			exit(1);
+		}
+
+		event_set(&shm_evt, shm_fd, EV_READ | EV_PERSIST,
+				shm_newconnection, &shm_evt);
+		event_add(&shm_evt, NULL);
+	}
+
+	/* replies from the database thread, see replyq.c */
+	event_set(&replyq_evt, replyq_fd(), EV_READ | EV_PERSIST, replyq_recv,
+			&replyq_evt);
+	event_add(&replyq_evt, NULL);
+
 	signal_set(&sigterm_evt, SIGTERM, exit_sighandler, &sigterm_evt);
 	signal_add(&sigterm_evt, NULL);
 	signal_set(&sigint_evt, SIGINT, exit_sighandler, &sigint_evt);
@@ -126,12 +174,19 @@ void net_loop(void)
 
 	if (ENABLE_TIPC)
 		event_del(&tipc_evt);
-	if (ENABLE_TCP)
+	if (ENABLE_TCP && use_uring)
+		event_del(&uring_evt);
+	else if (ENABLE_TCP)
 		event_del(&tcp_evt);
 	if (ENABLE_UDP)
 		event_del(&udp_evt);
 	if (ENABLE_SCTP)
 		event_del(&sctp_evt);
+	if (ENABLE_UNIX)
+		event_del(&unix_evt);
+	if (ENABLE_SHM)
+		event_del(&shm_evt);
+	event_del(&replyq_evt);
 
 	signal_del(&sigterm_evt);
 	signal_del(&sigint_evt);
@@ -140,8 +195,11 @@ void net_loop(void)
 
 	tipc_close(tipc_fd);
 	tcp_close(tcp_fd);
+	uring_free();
 	udp_close(udp_fd);
 	sctp_close(sctp_fd);
+	unix_close(unix_fd);
+	shm_close(shm_fd);
 }
 
 
@@ -10,6 +10,7 @@
 #include "net-const.h"
 #include "common.h"
 #include "netutils.h"
+#include "mget.h"
 
 
 static void parse_get(const struct req_info *req);
@@ -20,6 +21,19 @@ static void parse_incr(struct req_info *req);
 static void parse_firstkey(struct req_info *req);
 static void parse_nextkey(struct req_info *req);
 static void parse_stats(struct req_info *req);
+static void parse_xstats(struct req_info *req);
+static void parse_hotkeys(struct req_info *req);
+static void parse_mget(struct req_info *req);
+static void parse_mset(struct req_info *req);
+static void parse_scan(struct req_info *req);
+static void parse_scan_open(struct req_info *req);
+static void parse_scan_next(struct req_info *req);
+static void parse_scan_close(struct req_info *req);
+static void parse_prefix(struct req_info *req);
+static void parse_range(struct req_info *req);
+static void parse_append(struct req_info *req);
+static void parse_gets(const struct req_info *req);
+static void parse_cas_version(struct req_info *req);
 
 
 /* Create a queue entry structure based on the parameters passed. Memory
@@ -76,6 +90,8 @@ static struct queue_entry *make_queue_long_entry(const struct req_info *req,
 		return NULL;
 	}
 	memcpy(e->req, req, sizeof(struct req_info));
+	if (e->req->conn != NULL)
+		e->req->conn_ref(e->req->conn);
 
 	e->req->clisa = malloc(req->clilen);
 	if (e->req->clisa == NULL) {
@@ -209,6 +225,32 @@ int parse_message(struct req_info *req,
 		parse_nextkey(req);
 	} else if (cmd == REQ_STATS) {
 		parse_stats(req);
+	} else if (cmd == REQ_XSTATS) {
+		parse_xstats(req);
+	} else if (cmd == REQ_HOTKEYS) {
+		parse_hotkeys(req);
+	} else if (cmd == REQ_MGET) {
+		parse_mget(req);
+	} else if (cmd == REQ_MSET) {
+		parse_mset(req);
+	} else if (cmd == REQ_SCAN) {
+		parse_scan(req);
+	} else if (cmd == REQ_SCAN_OPEN) {
+		parse_scan_open(req);
+	} else if (cmd == REQ_SCAN_NEXT) {
+		parse_scan_next(req);
+	} else if (cmd == REQ_SCAN_CLOSE) {
+		parse_scan_close(req);
+	} else if (cmd == REQ_PREFIX) {
+		parse_prefix(req);
+	} else if (cmd == REQ_RANGE) {
+		parse_range(req);
+	} else if (cmd == REQ_APPEND || cmd == REQ_PREPEND) {
+		parse_append(req);
+	} else if (cmd == REQ_GETS) {
+		parse_gets(req);
+	} else if (cmd == REQ_CAS_VERSION) {
+		parse_cas_version(req);
 	} else {
 		stats.net_unk_req++;
 		req->reply_err(req, ERR_UNKREQ);
@@ -240,9 +282,15 @@ static void parse_get(const struct req_info *req)
 	unsigned char *val = NULL;
 	size_t vsize = 0;
 
+	if (req->psize < sizeof(uint32_t)) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
 	ksize = * (uint32_t *) req->payload;
 	ksize = ntohl(ksize);
-	if (req->psize < ksize) {
+	if (req->psize - sizeof(uint32_t) < ksize) {
 		stats.net_broken_req++;
 		req->reply_err(req, ERR_BROKEN);
 		return;
@@ -251,6 +299,8 @@ static void parse_get(const struct req_info *req)
 	FILL_CACHE_FLAG(get);
 
 	key = req->payload + sizeof(uint32_t);
+	hotkeys_access(hot_reads, key, ksize);
+	mrc_access(cache_mrc, key, ksize);
 
 	hit = cache_get(cache_table, key, ksize, &val, &vsize);
 
@@ -272,12 +322,66 @@ static void parse_get(const struct req_info *req)
 	}
 }
 
+/* Like parse_get(), but the reply has the version of the value before the
+ * value itself; see cache.c. */
+static void parse_gets(const struct req_info *req)
+{
+	int hit, cache_only, rv;
+	const unsigned char *key;
+	uint32_t ksize;
+	unsigned char *val = NULL;
+	size_t vsize = 0;
+	uint64_t version;
+
+	if (req->psize < sizeof(uint32_t)) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	ksize = * (uint32_t *) req->payload;
+	ksize = ntohl(ksize);
+	if (req->psize - sizeof(uint32_t) < ksize) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	FILL_CACHE_FLAG(get);
+
+	key = req->payload + sizeof(uint32_t);
+	hotkeys_access(hot_reads, key, ksize);
+	mrc_access(cache_mrc, key, ksize);
+
+	hit = cache_gets(cache_table, key, ksize, &val, &vsize, &version);
+
+	if (cache_only && !hit) {
+		stats.cache_misses++;
+		req->reply_mini(req, REP_CACHE_MISS);
+		return;
+	} else if (!cache_only && !hit) {
+		rv = put_in_queue(req, REQ_GETS, 1, key, ksize, NULL, 0);
+		if (!rv) {
+			req->reply_err(req, ERR_MEM);
+			return;
+		}
+		return;
+	}
+
+	stats.cache_hits++;
+
+	/* the version goes before the value, which is sent from the cache */
+	version = htonll(version);
+	req->reply_long2(req, REP_CACHE_HIT, (unsigned char *) &version,
+			sizeof(version), val, vsize);
+}
+
 static void parse_set(struct req_info *req)
 {
 	int rv, cache_only, sync;
 	const unsigned char *key, *val;
 	uint32_t ksize, vsize;
-	const int max = 65536;
+	const size_t max = settings.max_vsize;
 
 	/* Request format:
 	 * 4		ksize
@@ -285,17 +389,27 @@ static void parse_set(struct req_info *req)
 	 * ksize	key
 	 * vsize	val
 	 */
+	if (req->psize < sizeof(uint32_t) * 2) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
 	ksize = * (uint32_t *) req->payload;
 	ksize = ntohl(ksize);
 	vsize = * ( ((uint32_t *) req->payload) + 1),
 	vsize = ntohl(vsize);
 
 	/* Sanity check on sizes:
-	 * - ksize and vsize must both be < req->psize
-	 * - ksize and vsize must both be < 2^16 = 64k
-	 * - ksize + vsize < 2^16 = 64k
-	 */
-	if ( (req->psize < ksize) || (req->psize < vsize) ||
+	 * - the key and the value must fit in the payload
+	 * - ksize must be <= MAX_KSIZE
+	 * - ksize and vsize must both be < the max. value size
+	 * - ksize + vsize < the max. value size
+	 * Note that transports other than TCP and SCTP don't let messages
+	 * over 64k through, so for them the limit is lower. */
+	if ( (req->psize - sizeof(uint32_t) * 2 < ksize) ||
+			(req->psize - sizeof(uint32_t) * 2 - ksize < vsize) ||
+			(ksize > MAX_KSIZE) ||
 			(ksize > max) || (vsize > max) ||
 			( (ksize + vsize) > max) ) {
 		stats.net_broken_req++;
@@ -313,6 +427,8 @@ static void parse_set(struct req_info *req)
 
 	key = req->payload + sizeof(uint32_t) * 2;
 	val = key + ksize;
+	hotkeys_access(hot_writes, key, ksize);
+	mrc_access(cache_mrc, key, ksize);
 
 	rv = cache_set(cache_table, key, ksize, val, vsize);
 	if (rv != 0) {
@@ -346,9 +462,15 @@ static void parse_del(struct req_info *req)
 	const unsigned char *key;
 	uint32_t ksize;
 
+	if (req->psize < sizeof(uint32_t)) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
 	ksize = * (uint32_t *) req->payload;
 	ksize = ntohl(ksize);
-	if (req->psize < ksize) {
+	if (req->psize - sizeof(uint32_t) < ksize) {
 		stats.net_broken_req++;
 		req->reply_err(req, ERR_BROKEN);
 		return;
@@ -363,6 +485,8 @@ static void parse_del(struct req_info *req)
 	FILL_SYNC_FLAG();
 
 	key = req->payload + sizeof(uint32_t);
+	hotkeys_access(hot_writes, key, ksize);
+	mrc_remove(cache_mrc, key, ksize);
 
 	hit = cache_del(cache_table, key, ksize);
 
@@ -392,7 +516,7 @@ static void parse_cas(struct req_info *req)
 	int rv, cache_only;
 	const unsigned char *key, *oldval, *newval;
 	uint32_t ksize, ovsize, nvsize;
-	const int max = 65536;
+	const size_t max = settings.max_vsize;
 
 	/* Request format:
 	 * 4		ksize
@@ -402,6 +526,12 @@ static void parse_cas(struct req_info *req)
 	 * ovsize	oldval
 	 * nvsize	newval
 	 */
+	if (req->psize < sizeof(uint32_t) * 3) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
 	ksize = * (uint32_t *) req->payload;
 	ksize = ntohl(ksize);
 	ovsize = * ( ((uint32_t *) req->payload) + 1);
@@ -410,12 +540,16 @@ static void parse_cas(struct req_info *req)
 	nvsize = ntohl(nvsize);
 
 	/* Sanity check on sizes:
-	 * - ksize, ovsize and nvsize must all be < req->psize
-	 * - ksize, ovsize and nvsize must all be < 2^16 = 64k
-	 * - ksize + ovsize + mvsize < 2^16 = 64k
+	 * - the key and both values must fit in the payload
+	 * - ksize must be <= MAX_KSIZE
+	 * - ksize, ovsize and nvsize must all be < the max. value size
+	 * - ksize + ovsize + mvsize < the max. value size
 	 */
-	if ( (req->psize < ksize) || (req->psize < ovsize) ||
-				(req->psize < nvsize) ||
+	if ( (req->psize - sizeof(uint32_t) * 3 < ksize) ||
+			(req->psize - sizeof(uint32_t) * 3 - ksize < ovsize) ||
+			(req->psize - sizeof(uint32_t) * 3 - ksize - ovsize
+				< nvsize) ||
+			(ksize > MAX_KSIZE) ||
 			(ksize > max) || (ovsize > max) ||
 				(nvsize > max) ||
 			( (ksize + ovsize + nvsize) > max) ) {
@@ -434,6 +568,8 @@ static void parse_cas(struct req_info *req)
 	key = req->payload + sizeof(uint32_t) * 3;
 	oldval = key + ksize;
 	newval = oldval + ovsize;
+	hotkeys_access(hot_writes, key, ksize);
+	mrc_access(cache_mrc, key, ksize);
 
 	rv = cache_cas(cache_table, key, ksize, oldval, ovsize,
 			newval, nvsize);
@@ -471,9 +607,147 @@ static void parse_cas(struct req_info *req)
 	return;
 }
 
+/* Like parse_cas(), but instead of the old value, the request has its
+ * version, as returned by REQ_GETS. */
+static void parse_cas_version(struct req_info *req)
+{
+	int rv, cache_only;
+	const unsigned char *key, *newval;
+	uint32_t ksize, nvsize;
+	uint64_t version;
+	const size_t max = settings.max_vsize;
+
+	/* Request format:
+	 * 4		ksize
+	 * 4		nvsize
+	 * 8		version (big endian uint64_t)
+	 * ksize	key
+	 * nvsize	newval
+	 */
+	if (req->psize < sizeof(uint32_t) * 2 + sizeof(version)) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	ksize = * (uint32_t *) req->payload;
+	ksize = ntohl(ksize);
+	nvsize = * ( ((uint32_t *) req->payload) + 1);
+	nvsize = ntohl(nvsize);
+	memcpy(&version, req->payload + sizeof(uint32_t) * 2,
+			sizeof(version));
+	version = ntohll(version);
+
+	if ( (ksize > MAX_KSIZE) || (ksize > max) || (nvsize > max) ||
+			( (ksize + nvsize) > max) ||
+			(req->psize < sizeof(uint32_t) * 2 + sizeof(version)
+				+ ksize + nvsize) ) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	if (settings.read_only) {
+		req->reply_err(req, ERR_RO);
+		return;
+	}
+
+	FILL_CACHE_FLAG(cas);
+
+	key = req->payload + sizeof(uint32_t) * 2 + sizeof(version);
+	newval = key + ksize;
+	hotkeys_access(hot_writes, key, ksize);
+	mrc_access(cache_mrc, key, ksize);
+
+	rv = cache_cas_version(cache_table, key, ksize, version,
+			newval, nvsize);
+	if (rv == -1) {
+		req->reply_mini(req, REP_NOMATCH);
+		return;
+	} else if (rv == -3) {
+		req->reply_err(req, ERR_MEM);
+		return;
+	}
+
+	if (cache_only) {
+		if (rv == 0)
+			req->reply_mini(req, REP_OK);
+		else
+			req->reply_mini(req, REP_NOTIN);
+		return;
+	}
+
+	if (rv == 0) {
+		/* the cache is always ahead of the database for the entries
+		 * it has, so the new value can be stored as it is */
+		rv = put_in_queue_long(req, REQ_CAS_VERSION, 1, key, ksize,
+				NULL, 0, newval, nvsize);
+	} else {
+		/* the database checks the version, which travels in the
+		 * entry's val; versions that came from the cache never match
+		 * there, see cache_hash_version() */
+		rv = put_in_queue_long(req, REQ_CAS_VERSION, 1, key, ksize,
+				(unsigned char *) &version, sizeof(version),
+				newval, nvsize);
+	}
+	if (!rv) {
+		req->reply_err(req, ERR_MEM);
+		return;
+	}
+}
+
+/* Merges an asynchronous increment into a queued one for the same key, if
+ * there is any. Returns 1 if it was merged, 0 otherwise. */
+static int merge_incr(const struct req_info *req,
+		const unsigned char *key, size_t ksize, int64_t increment)
+{
+	int merged = 0;
+	struct queue_entry *e;
+
+	queue_lock(op_queue);
+	e = queue_find_mergeable(op_queue, key, ksize);
+	if (e != NULL && (e->req->flags & FLAGS_BINARY) ==
+			(req->flags & FLAGS_BINARY)) {
+		* (int64_t *) e->val += increment;
+		merged = 1;
+	}
+	queue_unlock(op_queue);
+
+	return merged;
+}
+
+/* Queues an asynchronous increment, merging it with a pending one if
+ * possible so that a burst of increments to the same key results in a single
+ * database write. Returns 1 on success, 0 on memory errors. */
+static int queue_async_incr(const struct req_info *req,
+		const unsigned char *key, size_t ksize, int64_t increment)
+{
+	struct queue_entry *e;
+
+	if (merge_incr(req, key, ksize, increment)) {
+		stats.db_incr_merged++;
+		return 1;
+	}
+
+	e = make_queue_long_entry(req, REQ_INCR, key, ksize,
+			(unsigned char *) &increment, sizeof(increment),
+			NULL, 0);
+	if (e == NULL)
+		return 0;
+	e->mergeable = 1;
+
+	/* like other asynchronous operations, we don't signal the DB thread;
+	 * the longer the entry waits, the more increments get merged */
+	queue_lock(op_queue);
+	queue_put(op_queue, e);
+	queue_unlock(op_queue);
+
+	return 1;
+}
+
 static void parse_incr(struct req_info *req)
 {
-	int cres, cache_only, rv;
+	int cres, cache_only, async, rv;
 	const unsigned char *key;
 	uint32_t ksize;
 	int64_t increment, newval;
@@ -484,14 +758,21 @@ static void parse_incr(struct req_info *req)
 	 * ksize	key
 	 * 8		increment (big endian int64_t)
 	 */
+	if (req->psize < sizeof(uint32_t)) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
 	ksize = * (uint32_t *) req->payload;
 	ksize = ntohl(ksize);
 
 	/* Sanity check on sizes:
-	 * - ksize + 8 must be < req->psize
+	 * - the key and the increment must fit in the payload
 	 * - ksize + 8 must be < 2^16 = 64k
 	 */
-	if ( (req->psize < ksize + 8) || ((ksize + 8) > max)) {
+	if ( (ksize > max - 8) ||
+			(req->psize - sizeof(uint32_t) < ksize + 8) ) {
 		stats.net_broken_req++;
 		req->reply_err(req, ERR_BROKEN);
 		return;
@@ -506,18 +787,33 @@ static void parse_incr(struct req_info *req)
 
 	key = req->payload + sizeof(uint32_t);
 	increment = ntohll( * (int64_t *) (key + ksize) );
+	hotkeys_access(hot_writes, key, ksize);
+	mrc_access(cache_mrc, key, ksize);
 
-	cres = cache_incr(cache_table, key, ksize, increment, &newval);
+	cres = cache_incr(cache_table, key, ksize, increment,
+			req->flags & FLAGS_BINARY, &newval);
 	if (cres == -3) {
 		req->reply_err(req, ERR_MEM);
 		return;
 	} else if (cres == -2) {
-		/* the value was not NULL terminated */
+		/* the value was not NULL terminated, or not 8 bytes long
+		 * for binary counters */
 		req->reply_mini(req, REP_NOMATCH);
 		return;
 	}
 
-	if (!cache_only) {
+	async = req->flags & FLAGS_ASYNC;
+
+	if (!cache_only && async) {
+		/* we reply right away, without the new value; the database
+		 * is updated later */
+		rv = queue_async_incr(req, key, ksize, increment);
+		if (!rv) {
+			req->reply_err(req, ERR_MEM);
+			return;
+		}
+		req->reply_mini(req, REP_OK);
+	} else if (!cache_only) {
 		/* at this point, the cache_incr() was either successful or a
 		 * miss, but we don't really care */
 		rv = put_in_queue(req, REQ_INCR, 1, key, ksize,
@@ -542,6 +838,91 @@ static void parse_incr(struct req_info *req)
 }
 
 
+/* Used for both REQ_APPEND and REQ_PREPEND, which only differ in where the
+ * data goes. */
+static void parse_append(struct req_info *req)
+{
+	int cres, cache_only, async, rv;
+	const unsigned char *key, *data;
+	uint32_t ksize, dsize;
+	const size_t max = settings.max_vsize;
+
+	/* Request format:
+	 * 4		ksize
+	 * 4		dsize
+	 * ksize	key
+	 * dsize	data
+	 */
+	if (req->psize < sizeof(uint32_t) * 2) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	ksize = * (uint32_t *) req->payload;
+	ksize = ntohl(ksize);
+	dsize = * ( ((uint32_t *) req->payload) + 1);
+	dsize = ntohl(dsize);
+
+	/* Sanity check on sizes, like parse_set() */
+	if ( (req->psize - sizeof(uint32_t) * 2 < ksize) ||
+			(req->psize - sizeof(uint32_t) * 2 - ksize < dsize) ||
+			(ksize > MAX_KSIZE) ||
+			(ksize > max) || (dsize > max) ||
+			( (ksize + dsize) > max) ) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	if (settings.read_only) {
+		req->reply_err(req, ERR_RO);
+		return;
+	}
+
+	FILL_CACHE_FLAG(append);
+
+	key = req->payload + sizeof(uint32_t) * 2;
+	data = key + ksize;
+	hotkeys_access(hot_writes, key, ksize);
+	mrc_access(cache_mrc, key, ksize);
+
+	cres = cache_append(cache_table, key, ksize, data, dsize,
+			req->cmd == REQ_PREPEND, max);
+	if (cres == -3) {
+		req->reply_err(req, ERR_MEM);
+		return;
+	} else if (cres == -2) {
+		/* the value would grow over the maximum size */
+		req->reply_mini(req, REP_NOMATCH);
+		return;
+	}
+
+	async = req->flags & FLAGS_ASYNC;
+
+	if (cache_only) {
+		if (cres == -1)
+			req->reply_mini(req, REP_NOTIN);
+		else
+			req->reply_mini(req, REP_OK);
+		return;
+	}
+
+	/* the database does its own read-modify-write, whether the cache
+	 * had the key or not; only the data travels in the queue */
+	rv = put_in_queue(req, req->cmd, !async, key, ksize, data, dsize);
+	if (!rv) {
+		req->reply_err(req, ERR_MEM);
+		return;
+	}
+
+	if (async)
+		req->reply_mini(req, REP_OK);
+
+	return;
+}
+
+
 static void parse_firstkey(struct req_info *req)
 {
 	int rv;
@@ -561,9 +942,15 @@ static void parse_nextkey(struct req_info *req)
 	const unsigned char *key;
 	uint32_t ksize;
 
+	if (req->psize < sizeof(uint32_t)) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
 	ksize = * (uint32_t *) req->payload;
 	ksize = ntohl(ksize);
-	if (req->psize < ksize) {
+	if (req->psize - sizeof(uint32_t) < ksize) {
 		stats.net_broken_req++;
 		req->reply_err(req, ERR_BROKEN);
 		return;
@@ -580,6 +967,266 @@ static void parse_nextkey(struct req_info *req)
 	}
 }
 
+static void parse_scan(struct req_info *req)
+{
+	int rv;
+	uint32_t ksize, limits[2];
+	const unsigned char *key;
+
+	/* Request format:
+	 * 4		max. number of keys
+	 * 4		max. reply size
+	 * 4		ksize
+	 * ksize	key to start after
+	 * The limits are passed to the database thread as the value, in host
+	 * byte order; see process_scan(). */
+	if (req->psize < 4 + 4 + 4) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	limits[0] = ntohl(* (uint32_t *) req->payload);
+	limits[1] = ntohl(* ((uint32_t *) req->payload + 1));
+	ksize = ntohl(* ((uint32_t *) req->payload + 2));
+	if (req->psize - 4 - 4 - 4 < ksize) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	stats.db_scan++;
+
+	key = req->payload + 4 + 4 + 4;
+
+	rv = put_in_queue(req, REQ_SCAN, 1, key, ksize,
+			(unsigned char *) limits, sizeof(limits));
+	if (!rv) {
+		req->reply_err(req, ERR_MEM);
+		return;
+	}
+}
+
+static void parse_scan_open(struct req_info *req)
+{
+	int rv;
+	uint32_t ksize;
+	const unsigned char *key;
+
+	/* Request format:
+	 * 4		ksize
+	 * ksize	key to start after */
+	if (req->psize < 4) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	ksize = ntohl(* (uint32_t *) req->payload);
+	if (req->psize - 4 < ksize) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	key = req->payload + 4;
+
+	rv = put_in_queue(req, REQ_SCAN_OPEN, 1, key, ksize, NULL, 0);
+	if (!rv) {
+		req->reply_err(req, ERR_MEM);
+		return;
+	}
+}
+
+static void parse_scan_next(struct req_info *req)
+{
+	int rv;
+	uint32_t args[3];
+
+	/* Request format:
+	 * 4		cursor ID
+	 * 4		max. number of keys
+	 * 4		max. reply size
+	 * Like in parse_scan(), they're passed as the value, in host byte
+	 * order. */
+	if (req->psize < 4 + 4 + 4) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	args[0] = ntohl(* (uint32_t *) req->payload);
+	args[1] = ntohl(* ((uint32_t *) req->payload + 1));
+	args[2] = ntohl(* ((uint32_t *) req->payload + 2));
+
+	stats.db_scan++;
+
+	rv = put_in_queue(req, REQ_SCAN_NEXT, 1, NULL, 0,
+			(unsigned char *) args, sizeof(args));
+	if (!rv) {
+		req->reply_err(req, ERR_MEM);
+		return;
+	}
+}
+
+static void parse_scan_close(struct req_info *req)
+{
+	int rv;
+	uint32_t id;
+
+	/* Request format:
+	 * 4		cursor ID */
+	if (req->psize < 4) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	id = ntohl(* (uint32_t *) req->payload);
+
+	rv = put_in_queue(req, REQ_SCAN_CLOSE, 1, NULL, 0,
+			(unsigned char *) &id, sizeof(id));
+	if (!rv) {
+		req->reply_err(req, ERR_MEM);
+		return;
+	}
+}
+
+/* Compares two keys in the order of the ordered backends. */
+static int keycmp(const unsigned char *k1, size_t s1,
+		const unsigned char *k2, size_t s2)
+{
+	int c;
+
+	c = memcmp(k1, k2, s1 < s2 ? s1 : s2);
+	if (c != 0)
+		return c;
+	return s1 < s2 ? -1 : s1 > s2;
+}
+
+/* Queues a range query; both REQ_PREFIX and REQ_RANGE end up being one. The
+ * limits and whether there is an end key are passed to the database thread
+ * as the new value, in host byte order; see process_range(). */
+static void queue_range(struct req_info *req, const uint32_t *limits,
+		const unsigned char *start, size_t ssize,
+		const unsigned char *end, size_t esize)
+{
+	int rv;
+	uint32_t args[3];
+
+	args[0] = limits[0];
+	args[1] = limits[1];
+	args[2] = end != NULL;
+
+	stats.db_range++;
+
+	rv = put_in_queue_long(req, REQ_RANGE, 1, start, ssize, end, esize,
+			(unsigned char *) args, sizeof(args));
+	if (!rv) {
+		req->reply_err(req, ERR_MEM);
+		return;
+	}
+}
+
+static void parse_prefix(struct req_info *req)
+{
+	uint32_t limits[2], psize, ssize;
+	const unsigned char *prefix, *start;
+	unsigned char *end;
+	size_t esize;
+
+	/* Request format:
+	 * 4		max. number of keys
+	 * 4		max. reply size
+	 * 4		prefix size
+	 * 4		start size
+	 * psize	prefix
+	 * ssize	key to start at, if it's after the first key with the
+	 * 		prefix */
+	if (req->psize < 4 * 4) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	limits[0] = ntohl(* (uint32_t *) req->payload);
+	limits[1] = ntohl(* ((uint32_t *) req->payload + 1));
+	psize = ntohl(* ((uint32_t *) req->payload + 2));
+	ssize = ntohl(* ((uint32_t *) req->payload + 3));
+	if (req->psize - 4 * 4 < psize ||
+			req->psize - 4 * 4 - psize < ssize) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	prefix = req->payload + 4 * 4;
+	start = prefix + psize;
+	if (keycmp(start, ssize, prefix, psize) < 0) {
+		start = prefix;
+		ssize = psize;
+	}
+
+	/* The keys with the prefix are the ones before the prefix with its
+	 * last byte incremented; trailing 0xff bytes can't be incremented so
+	 * they're removed first. If there's nothing left, the range goes on
+	 * until the last key. */
+	end = malloc(psize > 0 ? psize : 1);
+	if (end == NULL) {
+		req->reply_err(req, ERR_MEM);
+		return;
+	}
+	memcpy(end, prefix, psize);
+	esize = psize;
+	while (esize > 0 && end[esize - 1] == 0xff)
+		esize--;
+
+	if (esize > 0) {
+		end[esize - 1]++;
+		queue_range(req, limits, start, ssize, end, esize);
+	} else {
+		queue_range(req, limits, start, ssize, NULL, 0);
+	}
+
+	free(end);
+}
+
+static void parse_range(struct req_info *req)
+{
+	uint32_t limits[2], ssize, esize;
+	const unsigned char *start, *end;
+
+	/* Request format:
+	 * 4		max. number of keys
+	 * 4		max. reply size
+	 * 4		start size
+	 * 4		end size
+	 * ssize	first key of the range
+	 * esize	key where the range ends (not included), or nothing
+	 * 		to go on until the last key */
+	if (req->psize < 4 * 4) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	limits[0] = ntohl(* (uint32_t *) req->payload);
+	limits[1] = ntohl(* ((uint32_t *) req->payload + 1));
+	ssize = ntohl(* ((uint32_t *) req->payload + 2));
+	esize = ntohl(* ((uint32_t *) req->payload + 3));
+	if (req->psize - 4 * 4 < ssize ||
+			req->psize - 4 * 4 - ssize < esize) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+
+	start = req->payload + 4 * 4;
+	end = start + ssize;
+
+	queue_range(req, limits, start, ssize, esize > 0 ? end : NULL, esize);
+}
+
 
 static void parse_stats(struct req_info *req)
 {
@@ -635,3 +1282,358 @@ static void parse_stats(struct req_info *req)
 }
 
 
+
+static void parse_xstats(struct req_info *req)
+{
+	int i, j;
+	uint64_t response[48];
+
+	/* Like parse_stats(), but with internal information that is useful
+	 * for tuning the server. The response begins with XSTATS_VERSION,
+	 * see stats.h for the rules on adding fields.
+	 * Version 1 fields, in order:
+	 *   cache capacity (in objects), cache buckets,
+	 *   cache entries, key bytes, value bytes,
+	 *   evictions, values replaced in place, values reallocated,
+	 *   and then CHAINLEN + 1 fields with the number of chains with 0, 1,
+	 *   ..., CHAINLEN entries.
+	 * Version 2 appends:
+	 *   miss ratio curve sampling rate (0 if disabled), sampled accesses,
+	 *   and the estimated hit ratio (in parts per million) for a cache
+	 *   0.5, 1, 2, 4 and 8 times the current size.
+	 * Version 3 appends:
+	 *   asynchronous increments merged into queued ones.
+	 * Version 4 appends:
+	 *   messages received over Unix sockets.
+	 * Version 5 appends:
+	 *   messages received over shared memory.
+	 * Version 6 appends:
+	 *   open TCP connections, memory used by them (their structures and
+	 *   buffers), and connections closed for being idle.
+	 * Version 7 appends:
+	 *   database scans (including the batches read from cursors).
+	 * Version 8 appends:
+	 *   open scan cursors, and cursors closed for being idle.
+	 * Version 9 appends:
+	 *   prefix and range queries.
+	 * Version 10 appends:
+	 *   appends and prepends in the cache, and in the database. */
+	i = 0;
+	#define xcpy(v) \
+		do { response[i] = htonll(v); i++; } while(0)
+
+	xcpy(XSTATS_VERSION);
+
+	xcpy(cache_table->numobjs);
+	xcpy(cache_table->hashlen);
+	xcpy(cache_table->nentries);
+	xcpy(cache_table->key_bytes);
+	xcpy(cache_table->val_bytes);
+	xcpy(cache_table->evictions);
+	xcpy(cache_table->replace_inplace);
+	xcpy(cache_table->replace_realloc);
+
+	for (j = 0; j <= CHAINLEN; j++)
+		xcpy(cache_table->chainlen_hist[j]);
+
+	xcpy(cache_mrc ? cache_mrc->rate : 0);
+	xcpy(cache_mrc ? cache_mrc->accesses : 0);
+	for (j = 0; j < MRC_NSIZES; j++)
+		xcpy(mrc_hit_ratio(cache_mrc, j));
+
+	xcpy(stats.db_incr_merged);
+
+	xcpy(stats.msg_unix);
+	xcpy(stats.msg_shm);
+
+	xcpy(stats.tcp_conns);
+	xcpy(stats.tcp_conn_bytes);
+	xcpy(stats.tcp_idle_closed);
+
+	xcpy(stats.db_scan);
+
+	xcpy(stats.cursors_open);
+	xcpy(stats.cursors_expired);
+
+	xcpy(stats.db_range);
+
+	xcpy(stats.cache_append);
+	xcpy(stats.db_append);
+
+	req->reply_long(req, REP_OK, (unsigned char *) response,
+			i * sizeof(uint64_t));
+
+	return;
+}
+
+static void parse_hotkeys(struct req_info *req)
+{
+	size_t len;
+	unsigned char *buf;
+
+	/* The request has no payload. The reply contains the heaviest keys
+	 * for reads and then for writes, in the format described in
+	 * hotkeys_dump(). There are at most HK_TOPK keys of up to
+	 * HK_MAX_KSIZE bytes each, so we know how much room we need. */
+	const size_t bsize = 2 * (4 + HK_TOPK * (8 + 4 + HK_MAX_KSIZE));
+
+	buf = malloc(bsize);
+	if (buf == NULL) {
+		req->reply_err(req, ERR_MEM);
+		return;
+	}
+
+	len = hotkeys_dump(hot_reads, buf, bsize);
+	len += hotkeys_dump(hot_writes, buf + len, bsize - len);
+
+	req->reply_long(req, REP_OK, buf, len);
+	free(buf);
+
+	return;
+}
+
+static void parse_mget(struct req_info *req)
+{
+	int hit, cache_only;
+	uint32_t nkeys, ksize, i, nmisses;
+	const unsigned char *p, *end, *key;
+	unsigned char *val, *misses, *mp;
+	size_t vsize;
+	struct mget_reply r;
+	struct queue_entry *e;
+
+	/* Request format:
+	 * 4		nkeys
+	 * and then, for each key:
+	 * 4		ksize
+	 * ksize	key
+	 */
+	if (req->psize < 4) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+	nkeys = ntohl(* (uint32_t *) req->payload);
+
+	/* Make sure all the keys are there before doing anything */
+	p = req->payload + 4;
+	end = req->payload + req->psize;
+	for (i = 0; i < nkeys; i++) {
+		if (end - p < 4) {
+			stats.net_broken_req++;
+			req->reply_err(req, ERR_BROKEN);
+			return;
+		}
+		ksize = ntohl(* (uint32_t *) p);
+		if (ksize > (size_t) (end - p - 4)) {
+			stats.net_broken_req++;
+			req->reply_err(req, ERR_BROKEN);
+			return;
+		}
+		p += 4 + ksize;
+	}
+
+	cache_only = req->flags & FLAGS_CACHE_ONLY;
+
+	/* The keys that are not in the cache are queued for the DB thread in
+	 * a single entry, which has them one after the other in host byte
+	 * order:
+	 * 4		index in the request
+	 * 4		ksize
+	 * ksize	key
+	 * That's never bigger than the request plus 4 bytes per key. */
+	misses = mp = NULL;
+	if (!cache_only) {
+		misses = mp = malloc(req->psize + 4 * nkeys);
+		if (misses == NULL) {
+			req->reply_err(req, ERR_MEM);
+			return;
+		}
+	}
+
+	if (!mget_reply_init(&r, req)) {
+		free(misses);
+		req->reply_err(req, ERR_MEM);
+		return;
+	}
+
+	nmisses = 0;
+	p = req->payload + 4;
+	for (i = 0; i < nkeys; i++) {
+		ksize = ntohl(* (uint32_t *) p);
+		key = p + 4;
+		p += 4 + ksize;
+
+		if (cache_only)
+			stats.cache_get++;
+		else
+			stats.db_get++;
+
+		hotkeys_access(hot_reads, key, ksize);
+		mrc_access(cache_mrc, key, ksize);
+
+		hit = cache_get(cache_table, key, ksize, &val, &vsize);
+		if (hit) {
+			stats.cache_hits++;
+			mget_reply_add(&r, i, val, vsize);
+		} else if (cache_only) {
+			stats.cache_misses++;
+			mget_reply_add(&r, i, NULL, 0);
+		} else {
+			stats.cache_misses++;
+			memcpy(mp, &i, 4);
+			memcpy(mp + 4, &ksize, 4);
+			memcpy(mp + 8, key, ksize);
+			mp += 8 + ksize;
+			nmisses++;
+		}
+	}
+
+	/* Send what we've got, unless there's nothing to tell */
+	if (r.ndone > 0 || nmisses == 0)
+		mget_reply_send(&r);
+	mget_reply_free(&r);
+
+	if (nmisses > 0) {
+		e = make_queue_long_entry(req, REQ_MGET, misses, mp - misses,
+				NULL, 0, NULL, 0);
+		if (e == NULL) {
+			req->reply_err(req, ERR_MEM);
+			free(misses);
+			return;
+		}
+
+		/* The entry's key is the packed misses, so queue_put() can't
+		 * keep the keys from being merged into; we do it like
+		 * parse_mset(), otherwise a later asynchronous increment
+		 * could be merged into one queued before us, and we would
+		 * read its result */
+		queue_lock(op_queue);
+		for (mp = misses; mp < misses + e->ksize; mp += 8 + ksize) {
+			memcpy(&ksize, mp + 4, 4);
+			queue_unmerge(op_queue, mp + 8, ksize);
+		}
+		queue_put(op_queue, e);
+		queue_unlock(op_queue);
+		queue_signal(op_queue);
+	}
+
+	free(misses);
+	return;
+}
+
+static void parse_mset(struct req_info *req)
+{
+	int rv, cache_only, sync, failed;
+	uint32_t npairs, ksize, vsize, i;
+	const unsigned char *p, *end, *pairs, *key, *val;
+	struct queue_entry *e;
+
+	/* Request format:
+	 * 4		npairs
+	 * and then, for each pair:
+	 * 4		ksize
+	 * 4		vsize
+	 * ksize	key
+	 * vsize	val
+	 */
+	if (req->psize < 4) {
+		stats.net_broken_req++;
+		req->reply_err(req, ERR_BROKEN);
+		return;
+	}
+	npairs = ntohl(* (uint32_t *) req->payload);
+
+	/* Make sure all the pairs are there before doing anything */
+	pairs = p = req->payload + 4;
+	end = req->payload + req->psize;
+	for (i = 0; i < npairs; i++) {
+		if (end - p < 8) {
+			stats.net_broken_req++;
+			req->reply_err(req, ERR_BROKEN);
+			return;
+		}
+		ksize = ntohl(* (uint32_t *) p);
+		vsize = ntohl(* ((uint32_t *) p + 1));
+		if (ksize > MAX_KSIZE ||
+				ksize > (size_t) (end - p - 8) ||
+				vsize > (size_t) (end - p - 8 - ksize)) {
+			stats.net_broken_req++;
+			req->reply_err(req, ERR_BROKEN);
+			return;
+		}
+		p += 8 + ksize + vsize;
+	}
+	end = p;
+
+	if (settings.read_only) {
+		req->reply_err(req, ERR_RO);
+		return;
+	}
+
+	cache_only = req->flags & FLAGS_CACHE_ONLY;
+	FILL_SYNC_FLAG();
+
+	/* All the pairs go to the DB thread in a single entry, in the same
+	 * format they came in. We create it before touching the cache, so
+	 * that once we do, the database is always updated too. */
+	e = NULL;
+	if (!cache_only) {
+		e = make_queue_long_entry(req, REQ_MSET, pairs, end - pairs,
+				NULL, 0, NULL, 0);
+		if (e == NULL) {
+			req->reply_err(req, ERR_MEM);
+			return;
+		}
+	}
+
+	failed = 0;
+	for (p = pairs; p < end; p += 8 + ksize + vsize) {
+		ksize = ntohl(* (uint32_t *) p);
+		vsize = ntohl(* ((uint32_t *) p + 1));
+		key = p + 8;
+		val = key + ksize;
+
+		if (cache_only)
+			stats.cache_set++;
+		else
+			stats.db_set++;
+
+		hotkeys_access(hot_writes, key, ksize);
+		mrc_access(cache_mrc, key, ksize);
+
+		/* If we can't set a pair, we drop the key from the cache, so
+		 * it doesn't keep the old value while the database gets the
+		 * new one, and go on with the rest */
+		rv = cache_set(cache_table, key, ksize, val, vsize);
+		if (rv != 0) {
+			cache_del(cache_table, key, ksize);
+			failed = 1;
+		}
+	}
+
+	if (cache_only) {
+		if (failed)
+			req->reply_err(req, ERR_MEM);
+		else
+			req->reply_mini(req, REP_OK);
+		return;
+	}
+
+	queue_lock(op_queue);
+	for (p = pairs; p < end; p += 8 + ksize + vsize) {
+		ksize = ntohl(* (uint32_t *) p);
+		vsize = ntohl(* ((uint32_t *) p + 1));
+		queue_unmerge(op_queue, p + 8, ksize);
+	}
+	queue_put(op_queue, e);
+	queue_unlock(op_queue);
+
+	if (sync)
+		queue_signal(op_queue);
+	else
+		req->reply_mini(req, REP_OK);
+
+	return;
+}
+
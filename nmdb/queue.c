@@ -1,8 +1,10 @@
 
 #include <stdlib.h>		/* for malloc() */
+#include <string.h>		/* for memset() and memcmp() */
 #include <pthread.h>		/* for mutexes */
 
 #include "queue.h"
+#include "hash.h"		/* hash() */
 
 
 struct queue *queue_create(void)
@@ -18,6 +20,9 @@ struct queue *queue_create(void)
 	q->top = NULL;
 	q->bottom = NULL;
 
+	q->nmergeable = 0;
+	memset(q->merge, 0, sizeof(q->merge));
+
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
 	pthread_mutex_init(&(q->lock), &attr);
@@ -88,6 +93,9 @@ struct queue_entry *queue_entry_create(void)
 	e->ksize = 0;
 	e->vsize = 0;
 	e->nvsize = 0;
+	e->mergeable = 0;
+	e->replies = NULL;
+	e->reply_lost = 0;
 	e->prev = NULL;
 
 	return e;
@@ -95,6 +103,8 @@ struct queue_entry *queue_entry_create(void)
 
 void queue_entry_free(struct queue_entry *e) {
 	if (e->req) {
+		if (e->req->conn != NULL)
+			e->req->conn_unref(e->req->conn);
 		free(e->req->clisa);
 		free(e->req);
 	}
@@ -109,8 +119,32 @@ void queue_entry_free(struct queue_entry *e) {
 }
 
 
+/* Keeps the table of mergeable entries up to date when e is put in the
+ * queue. Mergeable entries are added to it, and the others make the queued
+ * entry for the same key (if any) non-mergeable, so that operations on a key
+ * are never reordered. */
+static void merge_put(struct queue *q, struct queue_entry *e)
+{
+	struct queue_entry **slot;
+
+	if (e->key == NULL)
+		return;
+
+	if (!e->mergeable) {
+		queue_unmerge(q, e->key, e->ksize);
+		return;
+	}
+
+	slot = q->merge + hash(e->key, e->ksize) % QUEUE_MERGE_SLOTS;
+	if (*slot == NULL)
+		q->nmergeable++;
+	*slot = e;
+}
+
 void queue_put(struct queue *q, struct queue_entry *e)
 {
+	merge_put(q, e);
+
 	if (q->top == NULL) {
 		q->top = q->bottom = e;
 	} else {
@@ -136,6 +170,18 @@ struct queue_entry *queue_get(struct queue *q)
 		q->top = NULL;
 	}
 	q->size -= 1;
+
+	/* once taken out of the queue it can't be merged into anymore */
+	if (e->mergeable && q->nmergeable > 0) {
+		struct queue_entry **slot;
+
+		slot = q->merge + hash(e->key, e->ksize) % QUEUE_MERGE_SLOTS;
+		if (*slot == e) {
+			*slot = NULL;
+			q->nmergeable--;
+		}
+	}
+
 	return e;
 }
 
@@ -144,3 +190,39 @@ int queue_isempty(struct queue *q)
 	return (q->size == 0);
 }
 
+/* Makes the mergeable entry for the given key (if any) non-mergeable. This is
+ * done automatically by queue_put(), but entries that operate on many keys
+ * must do it by hand for each of them. */
+void queue_unmerge(struct queue *q, const unsigned char *key, size_t ksize)
+{
+	struct queue_entry **slot;
+
+	if (q->nmergeable == 0)
+		return;
+
+	slot = q->merge + hash(key, ksize) % QUEUE_MERGE_SLOTS;
+	if (*slot != NULL && (*slot)->ksize == ksize &&
+			memcmp((*slot)->key, key, ksize) == 0) {
+		*slot = NULL;
+		q->nmergeable--;
+	}
+}
+
+/* Returns the mergeable entry for the given key that is still in the queue,
+ * or NULL if there is none. The entry can be modified while the lock is
+ * held. */
+struct queue_entry *queue_find_mergeable(struct queue *q,
+		const unsigned char *key, size_t ksize)
+{
+	struct queue_entry *e;
+
+	if (q->nmergeable == 0)
+		return NULL;
+
+	e = q->merge[hash(key, ksize) % QUEUE_MERGE_SLOTS];
+	if (e != NULL && e->ksize == ksize && memcmp(e->key, key, ksize) == 0)
+		return e;
+
+	return NULL;
+}
+
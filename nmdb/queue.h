@@ -7,12 +7,21 @@
 #include "req.h"		/* for req_info */
 #include "sparse.h"
 
+struct reply;
+
+/* Size of the table of mergeable entries, see queue_find_mergeable() */
+#define QUEUE_MERGE_SLOTS 1024
+
 struct queue {
 	pthread_mutex_t lock;
 	pthread_cond_t cond;
 
 	size_t size;
 	struct queue_entry *top, *bottom;
+
+	/* mergeable entries still in the queue, indexed by key hash */
+	size_t nmergeable;
+	struct queue_entry *merge[QUEUE_MERGE_SLOTS];
 };
 
 struct queue_entry {
@@ -26,10 +35,24 @@ struct queue_entry {
 	size_t vsize;
 	size_t nvsize;
 
-	struct queue_entry *prev;
-	/* A pointer to the next element on the list is actually not
+	/* if set, later operations on the same key can be merged into this
+	 * entry while it's still in the queue */
+	int mergeable;
+
+	/* replies made by the database thread, to be sent by the network
+	 * thread; see replyq.c */
+	struct reply *replies;
+
+	/* set if a reply couldn't be recorded; replyq.c sends ERR_MEM in
+	 * its place */
+	int reply_lost;
+
+	/* Once the entry is out of the queue, prev is used to link the
+	 * entries in replyq.c's list.
+	 * A pointer to the next element on the list is actually not
 	 * necessary, because it's not needed for put and get.
 	 */
+	struct queue_entry *prev;
 };
 
 
@@ -53,6 +76,11 @@ struct queue_entry *queue_get(struct queue *q)
 	__with_lock_acquired(q->lock);
 int queue_isempty(struct queue *q)
 	__with_lock_acquired(q->lock);
+struct queue_entry *queue_find_mergeable(struct queue *q,
+		const unsigned char *key, size_t ksize)
+	__with_lock_acquired(q->lock);
+void queue_unmerge(struct queue *q, const unsigned char *key, size_t ksize)
+	__with_lock_acquired(q->lock);
 
 #endif
 
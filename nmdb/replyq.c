@@ -0,0 +1,255 @@
+
+/* Reply queue.
+ * The database thread doesn't send replies by itself: while it processes an
+ * entry, the replies are recorded in it, and when it's done the entry is
+ * handed back to the network thread, which sends them and frees the entry.
+ * This way only the network thread writes to the sockets, so replies to the
+ * same connection can't get mixed up, and they can be buffered.
+ *
+ * The entries are passed in a lock-free list, and the network thread is
+ * woken up with an eventfd, which is only written to when the list was
+ * empty.
+ */
+
+#include <stdlib.h>		/* malloc() */
+#include <string.h>		/* memcpy() */
+#include <stdint.h>		/* uint64_t */
+#include <unistd.h>		/* read(), write(), close() */
+#include <sys/eventfd.h>	/* eventfd() */
+
+#include "replyq.h"
+#include "queue.h"
+#include "req.h"
+#include "log.h"
+#include "net-const.h"	/* ERR_MEM */
+#include "tcp.h"		/* tcp_cork() */
+#include "udp.h"		/* udp_cork() */
+
+
+/* Reply types */
+#define REPLY_MINI 1
+#define REPLY_ERR 2
+#define REPLY_LONG 3
+
+struct reply {
+	int type;
+	uint32_t code;
+	size_t vsize;
+	struct reply *next;
+	unsigned char val[];
+};
+
+/* The eventfd used to wake up the network thread */
+static int evfd = -1;
+
+/* Entries done by the database thread, linked by their prev field, in
+ * reverse order */
+static struct queue_entry *done = NULL;
+
+/* The entry the database thread is processing, the last reply recorded in
+ * it, and its original reply functions. Only used by the database thread. */
+static struct queue_entry *cur = NULL;
+static struct reply *cur_last = NULL;
+static struct req_info cur_orig;
+
+
+int replyq_init(void)
+{
+	evfd = eventfd(0, EFD_NONBLOCK);
+	if (evfd < 0)
+		return 0;
+	return 1;
+}
+
+int replyq_fd(void)
+{
+	return evfd;
+}
+
+
+/* Records a reply for the entry being processed. If there's no memory for
+ * it, the entry is marked so an ERR_MEM is sent instead, and the replies
+ * after it are dropped, as the client can't tell them apart anymore. */
+static void record(int type, uint32_t code, const unsigned char *pre,
+		size_t psize, const unsigned char *val, size_t vsize)
+{
+	struct reply *r;
+
+	if (cur->reply_lost)
+		return;
+
+	r = malloc(sizeof(struct reply) + psize + vsize);
+	if (r == NULL) {
+		errlog("Can't allocate memory for a reply");
+		cur->reply_lost = 1;
+		return;
+	}
+
+	r->type = type;
+	r->code = code;
+	r->vsize = psize + vsize;
+	r->next = NULL;
+	if (psize)
+		memcpy(r->val, pre, psize);
+	if (vsize)
+		memcpy(r->val + psize, val, vsize);
+
+	if (cur_last == NULL)
+		cur->replies = r;
+	else
+		cur_last->next = r;
+	cur_last = r;
+}
+
+static void defer_mini(const struct req_info *req, uint32_t reply)
+{
+	record(REPLY_MINI, reply, NULL, 0, NULL, 0);
+}
+
+static void defer_err(const struct req_info *req, uint32_t reply)
+{
+	record(REPLY_ERR, reply, NULL, 0, NULL, 0);
+}
+
+static void defer_long(const struct req_info *req, uint32_t reply,
+		unsigned char *val, size_t vsize)
+{
+	record(REPLY_LONG, reply, NULL, 0, val, vsize);
+}
+
+static void defer_long2(const struct req_info *req, uint32_t reply,
+		const unsigned char *pre, size_t psize,
+		unsigned char *val, size_t vsize)
+{
+	record(REPLY_LONG, reply, pre, psize, val, vsize);
+}
+
+/* Makes the replies to the entry be recorded instead of sent, until
+ * replyq_put() is called. Used by the database thread before processing an
+ * entry. */
+void replyq_defer(struct queue_entry *e)
+{
+	cur = e;
+	cur_last = NULL;
+	e->replies = NULL;
+	e->reply_lost = 0;
+
+	if (e->req == NULL)
+		return;
+
+	cur_orig = *(e->req);
+	e->req->reply_mini = defer_mini;
+	e->req->reply_err = defer_err;
+	e->req->reply_long = defer_long;
+	e->req->reply_long2 = defer_long2;
+}
+
+/* Hands the entry, which must have been passed to replyq_defer(), to the
+ * network thread for it to send the replies and free it. Entries without
+ * replies or connection are freed right away. */
+void replyq_put(struct queue_entry *e)
+{
+	struct queue_entry *old;
+	uint64_t one = 1;
+
+	cur = NULL;
+	cur_last = NULL;
+
+	if (e->req == NULL
+			|| (e->replies == NULL && !e->reply_lost
+				&& e->req->conn == NULL)) {
+		queue_entry_free(e);
+		return;
+	}
+
+	e->req->reply_mini = cur_orig.reply_mini;
+	e->req->reply_err = cur_orig.reply_err;
+	e->req->reply_long = cur_orig.reply_long;
+	e->req->reply_long2 = cur_orig.reply_long2;
+
+	old = __atomic_load_n(&done, __ATOMIC_RELAXED);
+	do {
+		e->prev = old;
+	} while (!__atomic_compare_exchange_n(&done, &old, e, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* if the list wasn't empty, the network thread was already woken
+	 * up, and will see the entry when it takes the list */
+	if (old == NULL) {
+		if (write(evfd, &one, sizeof(one)) != sizeof(one))
+			errlog("Error writing to the reply eventfd");
+	}
+}
+
+
+/* Sends the replies of the entries done by the database thread, and frees
+ * them. */
+static void send_done(void)
+{
+	struct queue_entry *list, *e, *prev;
+	struct reply *r, *next;
+
+	list = __atomic_exchange_n(&done, NULL, __ATOMIC_ACQUIRE);
+
+	/* the list is in reverse order, turn it around */
+	prev = NULL;
+	while (list != NULL) {
+		e = list->prev;
+		list->prev = prev;
+		prev = list;
+		list = e;
+	}
+
+	/* replies are sent together, see tcp_cork() and udp_cork() */
+	tcp_cork();
+	udp_cork();
+
+	for (e = prev; e != NULL; e = prev) {
+		prev = e->prev;
+
+		for (r = e->replies; r != NULL; r = next) {
+			next = r->next;
+
+			if (r->type == REPLY_MINI)
+				e->req->reply_mini(e->req, r->code);
+			else if (r->type == REPLY_ERR)
+				e->req->reply_err(e->req, r->code);
+			else
+				e->req->reply_long(e->req, r->code,
+						r->val, r->vsize);
+			free(r);
+		}
+		e->replies = NULL;
+
+		if (e->reply_lost)
+			e->req->reply_err(e->req, ERR_MEM);
+
+		queue_entry_free(e);
+	}
+
+	udp_uncork();
+	tcp_uncork();
+}
+
+/* Called by libevent when the database thread has done some entries. */
+void replyq_recv(int fd, short event, void *arg)
+{
+	uint64_t n;
+
+	/* We must read before taking the list, or we could miss a wake up
+	 * for an entry put after we took it */
+	if (read(fd, &n, sizeof(n)) < 0)
+		return;
+
+	send_done();
+}
+
+/* Sends the replies still pending. Must be called after the database thread
+ * has stopped. */
+void replyq_free(void)
+{
+	send_done();
+	close(evfd);
+	evfd = -1;
+}
+
@@ -0,0 +1,17 @@
+
+#ifndef _REPLYQ_H
+#define _REPLYQ_H
+
+#include "queue.h"		/* struct queue_entry */
+
+int replyq_init(void);
+int replyq_fd(void);
+void replyq_free(void);
+
+void replyq_defer(struct queue_entry *e);
+void replyq_put(struct queue_entry *e);
+
+void replyq_recv(int fd, short event, void *arg);
+
+#endif
+
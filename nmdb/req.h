@@ -12,6 +12,8 @@
 #define REQTYPE_TCP 2
 #define REQTYPE_UDP 3
 #define REQTYPE_SCTP 4
+#define REQTYPE_UNIX 5
+#define REQTYPE_SHM 6
 
 
 struct req_info {
@@ -29,11 +31,24 @@ struct req_info {
 	const unsigned char *payload;
 	size_t psize;
 
+	/* connection the request came from, for connection oriented
+	 * protocols (NULL otherwise); requests in the database queue hold a
+	 * reference to it, see make_queue_long_entry() */
+	void *conn;
+	void (*conn_ref)(void *conn);
+	void (*conn_unref)(void *conn);
+
 	/* operations */
 	void (*reply_mini)(const struct req_info *req, uint32_t reply);
 	void (*reply_err)(const struct req_info *req, uint32_t reply);
 	void (*reply_long)(const struct req_info *req, uint32_t reply,
 			unsigned char *val, size_t vsize);
+
+	/* like reply_long, but the value is sent as pre followed by val,
+	 * which saves copying them together */
+	void (*reply_long2)(const struct req_info *req, uint32_t reply,
+			const unsigned char *pre, size_t psize,
+			unsigned char *val, size_t vsize);
 };
 
 #endif
@@ -1,6 +1,7 @@
 
 #include <sys/types.h>		/* socket defines */
 #include <sys/socket.h>		/* socket functions */
+#include <sys/uio.h>		/* struct iovec */
 #include <stdlib.h>		/* malloc() */
 #include <stdint.h>		/* uint32_t and friends */
 #include <arpa/inet.h>		/* htonls() and friends */
@@ -45,15 +46,23 @@ static void rep_send_error(const struct req_info *req, const unsigned int code)
 }
 
 
-static int rep_send(const struct req_info *req, const unsigned char *buf,
-		const size_t size)
+/* Sends a reply made of many pieces, without copying them together. */
+static int rep_sendv(const struct req_info *req, struct iovec *iov,
+		int iovcnt)
 {
 	int rv;
+	struct msghdr msg;
 
 	if (settings.passive)
 		return 1;
 
-	rv = sendto(req->fd, buf, size, 0, req->clisa, req->clilen);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = req->clisa;
+	msg.msg_namelen = req->clilen;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	rv = sendmsg(req->fd, &msg, 0);
 	if (rv < 0) {
 		rep_send_error(req, ERR_SEND);
 		return 0;
@@ -61,6 +70,16 @@ static int rep_send(const struct req_info *req, const unsigned char *buf,
 	return 1;
 }
 
+static int rep_send(const struct req_info *req, const unsigned char *buf,
+		const size_t size)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *) buf;
+	iov.iov_len = size;
+	return rep_sendv(req, &iov, 1);
+}
+
 
 /* Send small replies, consisting in only a value. */
 static void sctp_reply_mini(const struct req_info *req, uint32_t reply)
@@ -88,42 +107,54 @@ static void sctp_reply_err(const struct req_info *req, uint32_t reply)
 	rep_send_error(req, reply);
 }
 
-static void sctp_reply_long(const struct req_info *req, uint32_t reply,
+static void sctp_reply_long2(const struct req_info *req, uint32_t reply,
+			const unsigned char *pre, size_t psize,
 			unsigned char *val, size_t vsize)
 {
 	if (val == NULL) {
 		/* miss */
 		sctp_reply_mini(req, reply);
 	} else {
-		unsigned char *buf;
-		size_t bsize;
+		unsigned char hdr[4 + 4 + 4];
+		struct iovec iov[3];
 		uint32_t t;
 
 		reply = htonl(reply);
 
-		/* The reply length is:
+		/* The reply is:
 		 * 4		id
 		 * 4		reply code
-		 * 4		vsize
+		 * 4		psize + vsize
+		 * psize	pre
 		 * vsize	val
-		 */
-		bsize = 4 + 4 + 4 + vsize;
-		buf = malloc(bsize);
-
-		t = htonl(vsize);
-
-		memcpy(buf, &(req->id), 4);
-		memcpy(buf + 4, &reply, 4);
-		memcpy(buf + 8, &t, 4);
-		memcpy(buf + 12, val, vsize);
-
-		rep_send(req, buf, bsize);
-		free(buf);
+		 *
+		 * The value is sent from where it is (usually the cache),
+		 * to avoid copying it. */
+		t = htonl(psize + vsize);
+
+		memcpy(hdr, &(req->id), 4);
+		memcpy(hdr + 4, &reply, 4);
+		memcpy(hdr + 8, &t, 4);
+
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = (void *) pre;
+		iov[1].iov_len = psize;
+		iov[2].iov_base = val;
+		iov[2].iov_len = vsize;
+
+		rep_sendv(req, iov, 3);
 	}
 	return;
 
 }
 
+static void sctp_reply_long(const struct req_info *req, uint32_t reply,
+			unsigned char *val, size_t vsize)
+{
+	sctp_reply_long2(req, reply, NULL, 0, val, vsize);
+}
+
 
 /*
  * Main functions for receiving and parsing
@@ -190,25 +221,88 @@ void sctp_close(int fd)
 #define SBSIZE (68 * 1024)
 static unsigned char static_buf[SBSIZE];
 
+/* Messages bigger than the receive buffer (which are used to carry big
+ * values) are delivered by the kernel in pieces, and only the last one has
+ * MSG_EOR set. The pieces are reassembled here. While a message is being
+ * delivered like this no other message can be received on the socket, so we
+ * only need to handle one at a time. If it's too big, it's discarded. */
+static unsigned char *partial_buf = NULL;
+static size_t partial_len = 0;
+static int partial_discard = 0;
+
+/* Appends a piece of a message to the partial buffer. Returns 1 on success,
+ * or 0 if the message has to be discarded. */
+static int partial_append(const unsigned char *buf, size_t len)
+{
+	unsigned char *newbuf;
+
+	if (partial_discard || partial_len + len > MAX_MSG_SIZE)
+		return 0;
+
+	newbuf = realloc(partial_buf, partial_len + len);
+	if (newbuf == NULL)
+		return 0;
+
+	partial_buf = newbuf;
+	memcpy(partial_buf + partial_len, buf, len);
+	partial_len += len;
+	return 1;
+}
+
+static void partial_reset(void)
+{
+	free(partial_buf);
+	partial_buf = NULL;
+	partial_len = 0;
+	partial_discard = 0;
+}
+
 /* Called by libevent for each receive event */
 void sctp_recv(int fd, short event, void *arg)
 {
 	int rv;
 	struct req_info req;
 	struct sockaddr_in clisa;
-	socklen_t clilen;
+	struct msghdr msg;
+	struct iovec iov;
+	unsigned char *buf;
+
+	iov.iov_base = static_buf;
+	iov.iov_len = SBSIZE;
 
-	clilen = sizeof(clisa);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &clisa;
+	msg.msg_namelen = sizeof(clisa);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
 
-	rv = recvfrom(fd, static_buf, SBSIZE, 0, (struct sockaddr *) &clisa,
-			&clilen);
+	rv = recvmsg(fd, &msg, 0);
 	if (rv < 0) {
 		goto exit;
 	}
 
+	buf = static_buf;
+	if (!(msg.msg_flags & MSG_EOR) || partial_len || partial_discard) {
+		/* a piece of a big message */
+		if (!partial_append(static_buf, rv))
+			partial_discard = 1;
+
+		if (!(msg.msg_flags & MSG_EOR))
+			goto exit;
+
+		if (partial_discard) {
+			stats.net_broken_req++;
+			partial_reset();
+			goto exit;
+		}
+
+		buf = partial_buf;
+		rv = partial_len;
+	}
+
 	if (rv < 8) {
 		stats.net_broken_req++;
-		goto exit;
+		goto done;
 	}
 
 	stats.msg_sctp++;
@@ -216,13 +310,19 @@ void sctp_recv(int fd, short event, void *arg)
 	req.fd = fd;
 	req.type = REQTYPE_SCTP;
 	req.clisa = (struct sockaddr *) &clisa;
-	req.clilen = clilen;
+	req.clilen = msg.msg_namelen;
+	req.conn = NULL;
 	req.reply_mini = sctp_reply_mini;
 	req.reply_err = sctp_reply_err;
 	req.reply_long = sctp_reply_long;
+	req.reply_long2 = sctp_reply_long2;
 
 	/* parse the message */
-	parse_message(&req, static_buf, rv);
+	parse_message(&req, buf, rv);
+
+done:
+	if (buf == partial_buf)
+		partial_reset();
 
 exit:
 	return;
@@ -0,0 +1,175 @@
+
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+/*
+ * Shared memory rings, used by the shared memory transport.
+ * Isolated so it's shared between the server and the library code.
+ *
+ * The server and each client share an area with two single producer, single
+ * consumer rings: one for the requests and one for the replies. Messages are
+ * the same as the ones sent over Unix sockets, each preceded by its length
+ * (in host byte order, 4 bytes) and padded to a multiple of 4 bytes. They
+ * never wrap around the end of the ring; when one doesn't fit, a SHM_PAD
+ * length is written and the message goes at the beginning.
+ *
+ * head and tail are free running counters, only written by the producer and
+ * the consumer respectively. The consumer sets "sleeping" before waiting on
+ * the control socket, and the producer sets "full" when there's no room for
+ * its message; whoever clears them has to wake the other side up by sending
+ * a byte over the socket. Both sides must check everything they read from the
+ * rings, because the other side can't be trusted to play nice.
+ */
+
+#include <stdint.h>		/* uint32_t */
+#include <string.h>		/* memcpy() */
+
+#define SHM_MAGIC 0x6e6d6462
+#define SHM_RING_SIZE (256 * 1024)
+#define SHM_MAX_MSG (68 * 1024)
+#define SHM_PAD 0xFFFFFFFF
+
+/* Bytes sent over the control socket: SHM_WAKE tells the other side to look
+ * at the rings, and SHM_KICK asks the server for a SHM_WAKE back. */
+#define SHM_WAKE 'w'
+#define SHM_KICK 'k'
+
+struct shm_ring {
+	/* written by the producer */
+	uint32_t head;
+	uint32_t full;
+	unsigned char pad1[56];
+
+	/* written by the consumer */
+	uint32_t tail;
+	uint32_t sleeping;
+	unsigned char pad2[56];
+
+	unsigned char data[SHM_RING_SIZE];
+};
+
+struct shm_area {
+	uint32_t magic;
+	uint32_t size;
+	unsigned char pad[56];
+
+	struct shm_ring req;
+	struct shm_ring rep;
+};
+
+
+/* Size a message of the given length takes in the ring. */
+#define SHM_SPACE(len) (4 + (((len) + 3) & ~3))
+
+/* Busy wait hint for the processor. */
+static inline void shm_cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ __volatile__("pause" ::: "memory");
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* Returns where to write a message of the given length, or NULL if there's no
+ * room for it yet. Only for the producer. */
+static inline unsigned char *shm_ring_reserve(struct shm_ring *r,
+		uint32_t len)
+{
+	uint32_t head, tail, used, pos, waste = 0, pad = SHM_PAD;
+
+	head = r->head;
+	tail = __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE);
+	pos = head % SHM_RING_SIZE;
+
+	if (pos + SHM_SPACE(len) > SHM_RING_SIZE)
+		waste = SHM_RING_SIZE - pos;
+
+	/* the first check is for a consumer that messed up the tail */
+	used = head - tail;
+	if (used > SHM_RING_SIZE
+			|| SHM_RING_SIZE - used < waste + SHM_SPACE(len))
+		return NULL;
+
+	if (waste) {
+		memcpy(r->data + pos, &pad, 4);
+		head += waste;
+		__atomic_store_n(&(r->head), head, __ATOMIC_RELEASE);
+		pos = 0;
+	}
+
+	memcpy(r->data + pos, &len, 4);
+	return r->data + pos + 4;
+}
+
+/* Publishes the message written where shm_ring_reserve() said. Returns 1 if
+ * the consumer is sleeping and has to be woken up. */
+static inline int shm_ring_commit(struct shm_ring *r, uint32_t len)
+{
+	__atomic_store_n(&(r->head), r->head + SHM_SPACE(len),
+			__ATOMIC_SEQ_CST);
+	return __atomic_exchange_n(&(r->sleeping), 0, __ATOMIC_SEQ_CST);
+}
+
+/* Marks the ring as full, for when shm_ring_reserve() failed. The producer
+ * must try again afterwards, because the consumer could have made room in
+ * the meantime; if it didn't, it will wake us up when it does. */
+static inline void shm_ring_set_full(struct shm_ring *r)
+{
+	__atomic_store_n(&(r->full), 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Gets the next message. Returns its length, leaving in *msg where it is, 0
+ * if there is none, or -1 if the ring is corrupted. Only for the consumer. */
+static inline int64_t shm_ring_peek(struct shm_ring *r, unsigned char **msg)
+{
+	uint32_t head, tail, pos, len;
+
+	tail = r->tail;
+	head = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return 0;
+
+	pos = tail % SHM_RING_SIZE;
+	memcpy(&len, r->data + pos, 4);
+	if (len == SHM_PAD) {
+		/* a pad at the beginning makes no sense */
+		if (pos == 0)
+			return -1;
+		tail += SHM_RING_SIZE - pos;
+		__atomic_store_n(&(r->tail), tail, __ATOMIC_RELEASE);
+		if (head == tail)
+			return 0;
+		pos = 0;
+		memcpy(&len, r->data, 4);
+	}
+
+	if (len == 0 || len > SHM_MAX_MSG || head - tail < SHM_SPACE(len)
+			|| pos + SHM_SPACE(len) > SHM_RING_SIZE)
+		return -1;
+
+	*msg = r->data + pos + 4;
+	return len;
+}
+
+/* Releases the message returned by shm_ring_peek(). Returns 1 if the producer
+ * is waiting for room and has to be woken up. */
+static inline int shm_ring_pop(struct shm_ring *r, uint32_t len)
+{
+	__atomic_store_n(&(r->tail), r->tail + SHM_SPACE(len),
+			__ATOMIC_SEQ_CST);
+	return __atomic_exchange_n(&(r->full), 0, __ATOMIC_SEQ_CST);
+}
+
+/* Marks the consumer as sleeping and checks again. Returns 1 if there are
+ * messages, in which case the consumer shouldn't sleep; otherwise the producer
+ * will wake us up when it puts one. */
+static inline int shm_ring_sleep(struct shm_ring *r)
+{
+	__atomic_store_n(&(r->sleeping), 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&(r->head), __ATOMIC_SEQ_CST) != r->tail;
+}
+
+#endif
+
@@ -0,0 +1,18 @@
+
+/* Shared memory stub file, used when shared memory is not compiled in. */
+
+int shm_init(void)
+{
+	return -1;
+}
+
+void shm_close(int fd)
+{
+	return;
+}
+
+void shm_newconnection(int fd, short event, void *arg)
+{
+	return;
+}
+
@@ -0,0 +1,568 @@
+
+/* memfd_create() is Linux-specific */
+#define _GNU_SOURCE
+
+#include <sys/types.h>		/* socket defines */
+#include <sys/socket.h>		/* socket functions */
+#include <sys/un.h>		/* struct sockaddr_un */
+#include <sys/mman.h>		/* mmap(), memfd_create() */
+#include <stdlib.h>		/* malloc() */
+#include <stdint.h>		/* uint32_t and friends */
+#include <arpa/inet.h>		/* htonls() and friends */
+#include <string.h>		/* memcpy() */
+#include <unistd.h>		/* close() */
+#include <errno.h>		/* errno */
+#include <time.h>		/* clock_gettime() */
+
+/* Workaround for libevent 1.1a: the header assumes u_char is typedef'ed to an
+ * unsigned char, and that "struct timeval" is in scope. */
+typedef unsigned char u_char;
+#include <sys/time.h>
+#include <event.h>		/* libevent stuff */
+
+#include "shm.h"
+#include "shm-ring.h"
+#include "common.h"
+#include "net-const.h"
+#include "req.h"
+#include "parse.h"
+#include "log.h"
+
+
+/* After the last request of a client, we keep looking at its ring for this
+ * many microseconds before going to sleep, so a client doing requests one
+ * after the other doesn't have to wake us up each time. With a single
+ * processor it would only get in the client's way, so we don't. */
+#define SHM_SPIN_USEC 50
+static unsigned int spin_usec = 0;
+
+/* Maximum time we spend on a client before letting the others run */
+#define SHM_BUDGET_USEC 1000
+
+/* When the replies the client hasn't made room for go over this size, we stop
+ * processing its requests until it does */
+#define OVERFLOW_HIGH (256 * 1024)
+
+/* A reply that didn't fit in the ring */
+struct shm_overflow {
+	size_t len;
+	struct shm_overflow *next;
+	unsigned char buf[];
+};
+
+/* Shared memory connection. The messages go through the rings in the shared
+ * area (see shm-ring.h), and the Unix socket used to set it up is kept to
+ * wake up the other side, and to know when the client goes away. Like the
+ * TCP connections, they're referenced by the queued requests. */
+struct shm_conn {
+	int fd;
+	struct sockaddr_un clisa;
+	socklen_t clilen;
+	struct event evt;
+	struct shm_area *area;
+
+	/* replies waiting for room in the ring */
+	struct shm_overflow *ovfirst, *ovlast;
+	size_t ovsize;
+
+	/* set when the connection was closed, but we can't free the
+	 * structure yet because queued requests refer to it */
+	int closed;
+
+	/* one reference for the open connection, and one for each request
+	 * in the database queue */
+	int refcount;
+};
+
+static void shm_recv(int fd, short event, void *arg);
+
+
+/*
+ * Miscelaneous helper functions
+ */
+
+/* Reference counting, used by queued requests via req_info. */
+static void shm_conn_ref(void *conn)
+{
+	struct shm_conn *sconn = conn;
+
+	sconn->refcount++;
+}
+
+static void shm_conn_unref(void *conn)
+{
+	struct shm_overflow *ov;
+	struct shm_conn *sconn = conn;
+
+	if (--sconn->refcount > 0)
+		return;
+
+	while (sconn->ovfirst != NULL) {
+		ov = sconn->ovfirst;
+		sconn->ovfirst = ov->next;
+		free(ov);
+	}
+	munmap(sconn->area, sizeof(struct shm_area));
+	free(sconn);
+}
+
+/* Closes the connection, and drops its reference. */
+static void shm_conn_close(struct shm_conn *sconn)
+{
+	event_del(&(sconn->evt));
+	close(sconn->fd);
+	sconn->closed = 1;
+
+	shm_conn_unref(sconn);
+}
+
+/* Wakes the client up. If the socket is full, there are wake ups it hasn't
+ * seen yet, so it doesn't matter if this one is lost. */
+static void wake(struct shm_conn *sconn)
+{
+	unsigned char c = SHM_WAKE;
+
+	send(sconn->fd, &c, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+/* Moves the replies that didn't fit to the ring, as long as there's room. */
+static void flush_overflow(struct shm_conn *sconn)
+{
+	unsigned char *p;
+	struct shm_overflow *ov;
+	struct shm_ring *ring = &(sconn->area->rep);
+
+	while (sconn->ovfirst != NULL) {
+		ov = sconn->ovfirst;
+
+		p = shm_ring_reserve(ring, ov->len);
+		if (p == NULL) {
+			shm_ring_set_full(ring);
+			p = shm_ring_reserve(ring, ov->len);
+			if (p == NULL)
+				return;
+		}
+
+		memcpy(p, ov->buf, ov->len);
+		if (shm_ring_commit(ring, ov->len))
+			wake(sconn);
+
+		sconn->ovfirst = ov->next;
+		if (sconn->ovfirst == NULL)
+			sconn->ovlast = NULL;
+		sconn->ovsize -= ov->len;
+		free(ov);
+	}
+}
+
+/* Puts a reply made of a header, a prefix and a value in the ring; if there's
+ * no room, it's kept until the client makes some. */
+static void rep_put(const struct req_info *req,
+		const unsigned char *hdr, size_t hsize,
+		const unsigned char *pre, size_t psize,
+		const unsigned char *val, size_t vsize)
+{
+	unsigned char *p;
+	size_t len = hsize + psize + vsize;
+	struct shm_overflow *ov;
+	struct shm_conn *sconn = req->conn;
+	struct shm_ring *ring = &(sconn->area->rep);
+
+	if (settings.passive || sconn->closed)
+		return;
+
+	/* if there are replies waiting, this one has to wait its turn */
+	if (sconn->ovfirst == NULL) {
+		p = shm_ring_reserve(ring, len);
+		if (p == NULL) {
+			shm_ring_set_full(ring);
+			p = shm_ring_reserve(ring, len);
+		}
+
+		if (p != NULL) {
+			memcpy(p, hdr, hsize);
+			if (psize)
+				memcpy(p + hsize, pre, psize);
+			if (vsize)
+				memcpy(p + hsize + psize, val, vsize);
+			if (shm_ring_commit(ring, len))
+				wake(sconn);
+			return;
+		}
+	}
+
+	ov = malloc(sizeof(struct shm_overflow) + len);
+	if (ov == NULL) {
+		errlog("Can't allocate memory for a shm reply");
+		return;
+	}
+
+	ov->len = len;
+	ov->next = NULL;
+	memcpy(ov->buf, hdr, hsize);
+	if (psize)
+		memcpy(ov->buf + hsize, pre, psize);
+	if (vsize)
+		memcpy(ov->buf + hsize + psize, val, vsize);
+
+	if (sconn->ovlast == NULL)
+		sconn->ovfirst = ov;
+	else
+		sconn->ovlast->next = ov;
+	sconn->ovlast = ov;
+	sconn->ovsize += ov->len;
+}
+
+static void rep_send_error(const struct req_info *req, const unsigned int code)
+{
+	uint32_t r, c;
+	unsigned char minibuf[3 * 4];
+
+	/* Network format: ID (4), REP_ERR (4), error code (4) */
+	r = htonl(REP_ERR);
+	c = htonl(code);
+	memcpy(minibuf, &(req->id), 4);
+	memcpy(minibuf + 4, &r, 4);
+	memcpy(minibuf + 8, &c, 4);
+
+	rep_put(req, minibuf, 3 * 4, NULL, 0, NULL, 0);
+}
+
+
+/* The shm_reply_* functions are used by the db code to send the network
+ * replies. */
+
+static void shm_reply_mini(const struct req_info *req, uint32_t reply)
+{
+	unsigned char minibuf[8];
+
+	reply = htonl(reply);
+	memcpy(minibuf, &(req->id), 4);
+	memcpy(minibuf + 4, &reply, 4);
+	rep_put(req, minibuf, 8, NULL, 0, NULL, 0);
+}
+
+static void shm_reply_err(const struct req_info *req, uint32_t reply)
+{
+	rep_send_error(req, reply);
+}
+
+static void shm_reply_long2(const struct req_info *req, uint32_t reply,
+			const unsigned char *pre, size_t psize,
+			unsigned char *val, size_t vsize)
+{
+	if (val == NULL) {
+		/* miss */
+		shm_reply_mini(req, reply);
+	} else if (4 + 4 + 4 + psize + vsize > SHM_MAX_MSG) {
+		/* big values can only be sent over TCP and SCTP */
+		rep_send_error(req, ERR_SEND);
+	} else {
+		unsigned char hdr[4 + 4 + 4];
+		uint32_t t;
+
+		/* The reply is:
+		 * 4		id
+		 * 4		reply code
+		 * 4		psize + vsize
+		 * psize	pre
+		 * vsize	val
+		 */
+		reply = htonl(reply);
+		t = htonl(psize + vsize);
+
+		memcpy(hdr, &(req->id), 4);
+		memcpy(hdr + 4, &reply, 4);
+		memcpy(hdr + 8, &t, 4);
+
+		rep_put(req, hdr, sizeof(hdr), pre, psize, val, vsize);
+	}
+}
+
+static void shm_reply_long(const struct req_info *req, uint32_t reply,
+			unsigned char *val, size_t vsize)
+{
+	shm_reply_long2(req, reply, NULL, 0, val, vsize);
+}
+
+
+/*
+ * Main functions for receiving and parsing
+ */
+
+int shm_init(void)
+{
+	int fd, rv;
+	struct sockaddr_un srvsa;
+
+	if (strlen(settings.shm_path) >= sizeof(srvsa.sun_path))
+		return -1;
+
+	if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+		spin_usec = SHM_SPIN_USEC;
+
+	srvsa.sun_family = AF_UNIX;
+	strcpy(srvsa.sun_path, settings.shm_path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0)
+		return -1;
+
+	/* remove the socket left behind by a previous run, if any */
+	unlink(settings.shm_path);
+
+	rv = bind(fd, (struct sockaddr *) &srvsa, sizeof(srvsa));
+	if (rv < 0) {
+		close(fd);
+		return -1;
+	}
+
+	rv = listen(fd, 1024);
+	if (rv < 0) {
+		close(fd);
+		unlink(settings.shm_path);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+void shm_close(int fd)
+{
+	close(fd);
+	unlink(settings.shm_path);
+}
+
+
+/* Creates the shared area for a new connection, and passes it to the
+ * client. Returns NULL on error. */
+static struct shm_area *new_area(int fd)
+{
+	int memfd;
+	uint32_t hdr[2];
+	struct shm_area *area;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		unsigned char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+
+	memfd = memfd_create("nmdb-shm", MFD_CLOEXEC);
+	if (memfd < 0)
+		return NULL;
+
+	if (ftruncate(memfd, sizeof(struct shm_area)) < 0) {
+		close(memfd);
+		return NULL;
+	}
+
+	area = mmap(NULL, sizeof(struct shm_area), PROT_READ | PROT_WRITE,
+			MAP_SHARED, memfd, 0);
+	if (area == MAP_FAILED) {
+		close(memfd);
+		return NULL;
+	}
+
+	/* the memory comes zeroed; both sides begin asleep, so the first
+	 * message wakes the other up */
+	area->magic = SHM_MAGIC;
+	area->size = sizeof(struct shm_area);
+	area->req.sleeping = 1;
+	area->rep.sleeping = 1;
+
+	/* Send the file descriptor, along with the magic and the size so the
+	 * client can check it knows the layout */
+	hdr[0] = SHM_MAGIC;
+	hdr[1] = sizeof(struct shm_area);
+	iov.iov_base = hdr;
+	iov.iov_len = sizeof(hdr);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+	if (sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		munmap(area, sizeof(struct shm_area));
+		close(memfd);
+		return NULL;
+	}
+
+	/* the mapping stays after closing it */
+	close(memfd);
+	return area;
+}
+
+/* Called by libevent for each new connection */
+void shm_newconnection(int fd, short event, void *arg)
+{
+	int newfd;
+	struct shm_conn *sconn;
+
+	sconn = malloc(sizeof(struct shm_conn));
+	if (sconn == NULL)
+		return;
+	sconn->clilen = sizeof(sconn->clisa);
+
+	newfd = accept(fd, (struct sockaddr *) &(sconn->clisa),
+			&(sconn->clilen));
+	if (newfd < 0) {
+		free(sconn);
+		return;
+	}
+
+	sconn->area = new_area(newfd);
+	if (sconn->area == NULL) {
+		errlog("Error setting up shared memory");
+		close(newfd);
+		free(sconn);
+		return;
+	}
+
+	sconn->fd = newfd;
+	sconn->ovfirst = sconn->ovlast = NULL;
+	sconn->ovsize = 0;
+	sconn->closed = 0;
+	sconn->refcount = 1;
+
+	event_set(&(sconn->evt), newfd, EV_READ | EV_PERSIST, shm_recv,
+			(void *) sconn);
+	event_add(&(sconn->evt), NULL);
+}
+
+
+/* Reads what the client sent over the socket, which are only wake ups.
+ * Returns 0 if the connection was closed. */
+static int read_socket(struct shm_conn *sconn)
+{
+	int i, kick = 0;
+	ssize_t rv;
+	unsigned char buf[16];
+
+	for (i = 0; i < 64; i++) {
+		rv = recv(sconn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (rv < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		else if (rv <= 0)
+			return 0;
+
+		if (buf[0] == SHM_KICK)
+			kick = 1;
+	}
+
+	if (kick)
+		wake(sconn);
+	return 1;
+}
+
+/* Static common buffer to avoid unnecessary allocations. See the comments on
+ * this same variable in tipc.c. */
+static unsigned char static_buf[SHM_MAX_MSG];
+
+/* Called by libevent when the client wakes us up, and by ourselves when we
+ * ran out of time with requests still coming (see below) */
+static void shm_recv(int fd, short event, void *arg)
+{
+	int64_t len;
+	uint64_t start, last, now;
+	unsigned char *msg;
+	struct req_info req;
+	struct shm_conn *sconn;
+	struct shm_ring *ring;
+
+	sconn = (struct shm_conn *) arg;
+	ring = &(sconn->area->req);
+
+	if ((event & EV_READ) && !read_socket(sconn)) {
+		/* Orderly shutdown or error; close the connection in
+		 * either case. */
+		shm_conn_close(sconn);
+		return;
+	}
+
+	flush_overflow(sconn);
+
+	__atomic_store_n(&(ring->sleeping), 0, __ATOMIC_SEQ_CST);
+	start = last = now_usec();
+
+	for (;;) {
+		/* if the client doesn't take its replies, we wait until it
+		 * does; it will wake us up then */
+		if (sconn->ovsize > OVERFLOW_HIGH)
+			return;
+
+		len = shm_ring_peek(ring, &msg);
+		if (len < 0) {
+			stats.net_broken_req++;
+			shm_conn_close(sconn);
+			return;
+		}
+
+		if (len > 0) {
+			/* the client could change the message while we
+			 * parse it, so we work on a copy */
+			memcpy(static_buf, msg, len);
+			if (shm_ring_pop(ring, len))
+				wake(sconn);
+
+			if (len < 8) {
+				stats.net_broken_req++;
+			} else {
+				stats.msg_shm++;
+
+				req.fd = fd;
+				req.type = REQTYPE_SHM;
+				req.clisa = (struct sockaddr *) &(sconn->clisa);
+				req.clilen = sconn->clilen;
+				req.conn = sconn;
+				req.conn_ref = shm_conn_ref;
+				req.conn_unref = shm_conn_unref;
+				req.reply_mini = shm_reply_mini;
+				req.reply_err = shm_reply_err;
+				req.reply_long = shm_reply_long;
+				req.reply_long2 = shm_reply_long2;
+
+				/* parse the message */
+				parse_message(&req, static_buf, len);
+			}
+		}
+
+		now = now_usec();
+		if (len > 0)
+			last = now;
+
+		if (now - start > SHM_BUDGET_USEC) {
+			/* come back after the other events had their turn */
+			event_active(&(sconn->evt), EV_TIMEOUT, 1);
+			return;
+		}
+
+		if (len == 0 && now - last >= spin_usec) {
+			if (!shm_ring_sleep(ring))
+				return;
+			__atomic_store_n(&(ring->sleeping), 0,
+					__ATOMIC_SEQ_CST);
+		} else if (len == 0) {
+			shm_cpu_relax();
+		}
+	}
+}
+
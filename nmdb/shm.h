@@ -0,0 +1,10 @@
+
+#ifndef _SHM_H
+#define _SHM_H
+
+int shm_init(void);
+void shm_close(int fd);
+void shm_newconnection(int fd, short event, void *arg);
+
+#endif
+
@@ -0,0 +1,98 @@
+
+/* Slab allocator.
+ * Objects are carved out of big chunks, and kept in a free list when
+ * released, to be reused by the next allocation. This avoids the malloc()
+ * overhead of each object, which is significant for small ones that are
+ * allocated in large numbers (like the TCP connections), and the
+ * fragmentation that comes from them being freed in a different order than
+ * allocated. Chunks are never given back, so the memory used is that of the
+ * peak number of objects. */
+
+#include <stdlib.h>		/* malloc() */
+
+#include "slab.h"
+
+
+/* Objects and the chunk header are aligned to this */
+#define SLAB_ALIGN 16
+
+#define ALIGN_UP(n) (((n) + SLAB_ALIGN - 1) & ~((size_t) SLAB_ALIGN - 1))
+
+void slab_init(struct slab *s, size_t objsize, unsigned int perchunk)
+{
+	/* each free object holds a pointer to the next one */
+	if (objsize < sizeof(void *))
+		objsize = sizeof(void *);
+
+	s->objsize = ALIGN_UP(objsize);
+	s->perchunk = perchunk;
+	s->free = NULL;
+	s->chunks = NULL;
+	s->bytes = 0;
+	s->used = 0;
+}
+
+void slab_destroy(struct slab *s)
+{
+	void *chunk;
+
+	while (s->chunks != NULL) {
+		chunk = s->chunks;
+		s->chunks = *(void **) chunk;
+		free(chunk);
+	}
+
+	s->free = NULL;
+	s->bytes = 0;
+	s->used = 0;
+}
+
+/* Allocates a new chunk, and puts its objects in the free list. Returns 0
+ * if there was not enough memory. */
+static int grow(struct slab *s)
+{
+	unsigned int i;
+	size_t size;
+	unsigned char *chunk, *obj;
+
+	size = ALIGN_UP(sizeof(void *)) + s->objsize * s->perchunk;
+	chunk = malloc(size);
+	if (chunk == NULL)
+		return 0;
+
+	*(void **) chunk = s->chunks;
+	s->chunks = chunk;
+	s->bytes += size;
+
+	/* in reverse, so they're handed out in order */
+	obj = chunk + ALIGN_UP(sizeof(void *)) + s->objsize * s->perchunk;
+	for (i = 0; i < s->perchunk; i++) {
+		obj -= s->objsize;
+		*(void **) obj = s->free;
+		s->free = obj;
+	}
+
+	return 1;
+}
+
+/* Returns a new object, or NULL if there was not enough memory. */
+void *slab_alloc(struct slab *s)
+{
+	void *obj;
+
+	if (s->free == NULL && !grow(s))
+		return NULL;
+
+	obj = s->free;
+	s->free = *(void **) obj;
+	s->used++;
+	return obj;
+}
+
+void slab_free(struct slab *s, void *obj)
+{
+	*(void **) obj = s->free;
+	s->free = obj;
+	s->used--;
+}
+
@@ -0,0 +1,32 @@
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+/* Slab allocator for small objects of a fixed size. See slab.c for more
+ * information. */
+
+#include <sys/types.h>		/* for size_t */
+
+struct slab {
+	/* size of each object, rounded up to keep them aligned, and how
+	 * many fit in each chunk */
+	size_t objsize;
+	unsigned int perchunk;
+
+	/* free objects, and the allocated chunks; both lists are linked
+	 * through the first bytes of their elements */
+	void *free;
+	void *chunks;
+
+	/* memory taken by the chunks, and objects in use */
+	size_t bytes;
+	unsigned long used;
+};
+
+void slab_init(struct slab *s, size_t objsize, unsigned int perchunk);
+void slab_destroy(struct slab *s);
+void *slab_alloc(struct slab *s);
+void slab_free(struct slab *s, void *obj);
+
+#endif
+
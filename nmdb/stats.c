@@ -29,6 +29,19 @@ void stats_init(struct stats *s)
 
 	s->db_firstkey = 0;
 	s->db_nextkey = 0;
+
+	s->db_incr_merged = 0;
+	s->msg_unix = 0;
+	s->msg_shm = 0;
+	s->tcp_conns = 0;
+	s->tcp_conn_bytes = 0;
+	s->tcp_idle_closed = 0;
+	s->db_scan = 0;
+	s->cursors_open = 0;
+	s->cursors_expired = 0;
+	s->db_range = 0;
+	s->cache_append = 0;
+	s->db_append = 0;
 }
 
 
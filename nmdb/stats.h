@@ -33,10 +33,29 @@ struct stats {
 	unsigned long net_unk_req;
 	unsigned long db_firstkey;
 	unsigned long db_nextkey;
+
+	/* only in the extended stats */
+	unsigned long db_incr_merged;
+	unsigned long msg_unix;
+	unsigned long msg_shm;
+	unsigned long tcp_conns;
+	unsigned long tcp_conn_bytes;
+	unsigned long tcp_idle_closed;
+	unsigned long db_scan;
+	unsigned long cursors_open;
+	unsigned long cursors_expired;
+	unsigned long db_range;
+	unsigned long cache_append;	/* appends and prepends */
+	unsigned long db_append;
 };
 
 #define STATS_REPLY_SIZE 23
 
+/* The extended stats reply begins with its version, followed by the fields.
+ * New fields are always appended, and the version is increased when that
+ * happens, so clients can tell which fields are present. */
+#define XSTATS_VERSION 10
+
 void stats_init(struct stats *s);
 
 #endif
@@ -16,3 +16,18 @@ void tcp_recv(int fd, short event, void *arg)
 	return;
 }
 
+void tcp_cork(void)
+{
+	return;
+}
+
+void tcp_uncork(void)
+{
+	return;
+}
+
+int tcp_uring_start(int fd)
+{
+	return 0;
+}
+
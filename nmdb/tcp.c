@@ -1,6 +1,7 @@
 
 #include <sys/types.h>		/* socket defines */
 #include <sys/socket.h>		/* socket functions */
+#include <sys/uio.h>		/* struct iovec */
 #include <stdlib.h>		/* malloc() */
 #include <stdint.h>		/* uint32_t and friends */
 #include <arpa/inet.h>		/* htonls() and friends */
@@ -10,6 +11,7 @@
 #include <unistd.h>		/* fcntl() */
 #include <fcntl.h>		/* fcntl() */
 #include <errno.h>		/* errno */
+#include <time.h>		/* time() */
 
 /* Workaround for libevent 1.1a: the header assumes u_char is typedef'ed to an
  * unsigned char, and that "struct timeval" is in scope. */
@@ -23,126 +25,619 @@ typedef unsigned char u_char;
 #include "req.h"
 #include "parse.h"
 #include "log.h"
+#include "uring.h"
+#include "slab.h"
 
 
-/* TCP socket structure. Used mainly to hold buffers from incomplete
- * recv()s. */
+/* When the output buffer of a connection goes over OUTBUF_HIGH bytes we stop
+ * reading requests from it, until it gets below OUTBUF_LOW. This way a client
+ * that doesn't read its replies can't make us use an unbounded amount of
+ * memory. */
+#define OUTBUF_HIGH (256 * 1024)
+#define OUTBUF_LOW (64 * 1024)
+
+/* Usual size of the input buffers, which can hold many messages; they grow
+ * temporarily for messages carrying big values */
+#define INBUF_SIZE (64 * 1024)
+
+/* Released input buffers of the usual size are kept for reuse, up to this
+ * many; see inbuf_get() */
+#define INBUF_POOL_MAX 64
+
+/* Connections are allocated in chunks of this many, see slab.c */
+#define CONNS_PER_CHUNK 256
+
+/* While corked, replies are only appended to the output buffer, to be sent
+ * together by tcp_uncork(), as long as it doesn't hold more than this; see
+ * rep_sendv(). */
+#define CORK_MAX (16 * 1024)
+
+/* TCP socket structure. Used mainly to hold the data received but not
+ * processed yet, and the replies that couldn't be sent yet. It's kept small,
+ * and allocated from a slab, because there can be lots of connections. */
 struct tcp_socket {
 	int fd;
-	struct sockaddr_in clisa;
-	socklen_t clilen;
-	struct event *evt;
-
-	unsigned char *buf;
-	size_t pktsize;
-	size_t len;
-	struct req_info req;
-	size_t excess;
+	struct event evt;
+
+	/* Input buffer, with the data received but not processed yet between
+	 * instart and inend. Connections only have one while they have an
+	 * incomplete message; otherwise, data is received into a shared
+	 * buffer and parsed from there (see tcp_recv()). Messages are parsed
+	 * in place, and only an incomplete one is moved to the beginning,
+	 * when there's no room for the rest of it; see make_room(). */
+	unsigned char *inbuf;
+	size_t insize, instart, inend;
+
+	/* Output buffer, with outlen bytes pending to be sent starting at
+	 * outstart. It's sent by tcp_send_pending() when the socket becomes
+	 * writable, which is watched with wevt only while there's something
+	 * to send (and then writing is set). */
+	unsigned char *outbuf;
+	size_t outsize, outstart, outlen;
+	struct event wevt;
+	int writing;
+
+	/* set when we stopped reading because of a full output buffer */
+	int paused;
+
+	/* set when the connection was closed, but we can't free the
+	 * structure yet because queued requests refer to it */
+	int closed;
+
+	/* one reference for the open connection, one for each request in the
+	 * database queue, and one while in the corked list */
+	int refcount;
+
+	/* next in the corked list, and whether it's in it */
+	struct tcp_socket *corked_next;
+	int in_corked;
+
+	/* when there was last traffic on the connection, and the neighbours
+	 * in the idle list; see idle_sweep() */
+	time_t last_active;
+	struct tcp_socket *idle_prev, *idle_next;
+
+	/* With io_uring (see tcp_uring_start()), the operations in flight:
+	 * the multishot receive, while receiving is set, and the send of
+	 * sendbuf, while writing is set. sendbuf is what the output buffer
+	 * (of sendsize bytes) had when it was sent, of which the bytes
+	 * between sendoff and sendlen are still pending. Each operation
+	 * holds a reference. */
+	struct uring_op rop, sop;
+	int receiving;
+	unsigned char *sendbuf;
+	size_t sendsize, sendlen, sendoff;
 };
 
 static void tcp_recv(int fd, short event, void *arg);
-static void process_buf(struct tcp_socket *tcpsock,
-		unsigned char *buf, size_t len);
+static void tcp_send_pending(int fd, short event, void *arg);
+static void idle_sweep(int fd, short event, void *arg);
+static void tcp_uring_recv(struct uring_op *op, int res, int more,
+		unsigned char *buf);
+static void tcp_uring_sent(struct uring_op *op, int res, int more,
+		unsigned char *buf);
+static int process_buf(struct tcp_socket *tcpsock);
+static int process_data(struct tcp_socket *tcpsock, unsigned char *buf,
+		size_t len);
 
 static void tcp_reply_mini(const struct req_info *req, uint32_t reply);
 static void tcp_reply_err(const struct req_info *req, uint32_t reply);
 static void tcp_reply_long(const struct req_info *req, uint32_t reply,
 		unsigned char *val, size_t vsize);
+static void tcp_reply_long2(const struct req_info *req, uint32_t reply,
+		const unsigned char *pre, size_t psize,
+		unsigned char *val, size_t vsize);
+
+/* Corking depth, and the connections with replies held because of it; see
+ * tcp_cork() */
+static int corked = 0;
+static struct tcp_socket *corked_list = NULL;
+
+/* Set when the connections are handled with io_uring, and the listening
+ * socket it accepts them from; see tcp_uring_start() */
+static int use_uring = 0;
+static int uring_listen_fd = -1;
+static struct uring_op accept_op;
+
+/* Connection structures */
+static struct slab conn_slab;
+
+/* Input buffers not in use, linked through their first bytes; see
+ * inbuf_get() */
+static unsigned char *inbuf_pool = NULL;
+static int inbuf_pool_len = 0;
+
+/* Where connections without an input buffer receive, see tcp_recv() */
+static unsigned char recv_buf[INBUF_SIZE];
+
+/* Open connections in order of activity, the oldest first, and the timer
+ * that closes the idle ones; only used if there's an idle timeout, see
+ * idle_sweep() */
+static struct tcp_socket *idle_first = NULL, *idle_last = NULL;
+static struct event idle_evt;
 
 
 /*
  * Miscelaneous helper functions
  */
 
+/* Frees one of the connections' buffers, of the given size. Their memory is
+ * accounted in stats.tcp_conn_bytes. */
+static void buf_free(unsigned char *buf, size_t size)
+{
+	free(buf);
+	stats.tcp_conn_bytes -= size;
+}
+
+/* Gives the connection an input buffer for a message of msgsize bytes,
+ * taking it from the pool if possible. Returns 0 if there was not enough
+ * memory. */
+static int inbuf_get(struct tcp_socket *tcpsock, size_t msgsize)
+{
+	unsigned char *buf;
+	size_t size = INBUF_SIZE;
+
+	if (msgsize <= INBUF_SIZE && inbuf_pool != NULL) {
+		buf = inbuf_pool;
+		inbuf_pool = *(unsigned char **) buf;
+		inbuf_pool_len--;
+	} else {
+		if (msgsize > size)
+			size = msgsize;
+		buf = malloc(size);
+		if (buf == NULL)
+			return 0;
+		stats.tcp_conn_bytes += size;
+	}
+
+	tcpsock->inbuf = buf;
+	tcpsock->insize = size;
+	tcpsock->instart = tcpsock->inend = 0;
+	return 1;
+}
+
+/* Releases the connection's input buffer, keeping it in the pool if it's of
+ * the usual size and the pool is not full. */
+static void inbuf_put(struct tcp_socket *tcpsock)
+{
+	if (tcpsock->insize == INBUF_SIZE && inbuf_pool_len < INBUF_POOL_MAX) {
+		*(unsigned char **) tcpsock->inbuf = inbuf_pool;
+		inbuf_pool = tcpsock->inbuf;
+		inbuf_pool_len++;
+	} else {
+		buf_free(tcpsock->inbuf, tcpsock->insize);
+	}
+
+	tcpsock->inbuf = NULL;
+	tcpsock->insize = tcpsock->instart = tcpsock->inend = 0;
+}
+
 static void tcp_socket_free(struct tcp_socket *tcpsock)
 {
-	if (tcpsock->evt)
-		free(tcpsock->evt);
-	if (tcpsock->buf)
-		free(tcpsock->buf);
-	free(tcpsock);
+	if (tcpsock->inbuf)
+		inbuf_put(tcpsock);
+	if (tcpsock->outbuf)
+		buf_free(tcpsock->outbuf, tcpsock->outsize);
+	if (tcpsock->sendbuf)
+		buf_free(tcpsock->sendbuf, tcpsock->sendsize);
+	slab_free(&conn_slab, tcpsock);
 }
 
-static void init_req(struct tcp_socket *tcpsock)
+/* Removes the connection from the idle list, if it's in it. */
+static void idle_remove(struct tcp_socket *tcpsock)
 {
-	tcpsock->req.fd = tcpsock->fd;
-	tcpsock->req.type = REQTYPE_TCP;
-	tcpsock->req.clisa = (struct sockaddr *) &tcpsock->clisa;
-	tcpsock->req.clilen = tcpsock->clilen;
-	tcpsock->req.reply_mini = tcp_reply_mini;
-	tcpsock->req.reply_err = tcp_reply_err;
-	tcpsock->req.reply_long = tcp_reply_long;
+	if (tcpsock->idle_prev == NULL && idle_first != tcpsock)
+		return;
+
+	if (tcpsock->idle_prev)
+		tcpsock->idle_prev->idle_next = tcpsock->idle_next;
+	else
+		idle_first = tcpsock->idle_next;
+
+	if (tcpsock->idle_next)
+		tcpsock->idle_next->idle_prev = tcpsock->idle_prev;
+	else
+		idle_last = tcpsock->idle_prev;
+
+	tcpsock->idle_prev = tcpsock->idle_next = NULL;
 }
 
-static void rep_send_error(const struct req_info *req, const unsigned int code)
+/* Records activity on the connection, moving it to the end of the idle
+ * list. */
+static void idle_touch(struct tcp_socket *tcpsock)
+{
+	if (settings.tcp_idle_timeout <= 0)
+		return;
+
+	tcpsock->last_active = time(NULL);
+	if (tcpsock == idle_last)
+		return;
+
+	idle_remove(tcpsock);
+	tcpsock->idle_prev = idle_last;
+	if (idle_last)
+		idle_last->idle_next = tcpsock;
+	else
+		idle_first = tcpsock;
+	idle_last = tcpsock;
+}
+
+/* Reference counting, used by queued requests via req_info. */
+static void tcp_socket_ref(void *conn)
+{
+	struct tcp_socket *tcpsock = conn;
+
+	tcpsock->refcount++;
+}
+
+static void tcp_socket_unref(void *conn)
+{
+	struct tcp_socket *tcpsock = conn;
+
+	if (--tcpsock->refcount == 0)
+		tcp_socket_free(tcpsock);
+}
+
+/* Closes the connection, and drops its reference. */
+static void tcp_socket_close(struct tcp_socket *tcpsock)
+{
+	if (use_uring) {
+		/* the shutdown ends the operations in flight, which drop
+		 * their references when they complete */
+		shutdown(tcpsock->fd, SHUT_RDWR);
+		close(tcpsock->fd);
+		tcpsock->closed = 1;
+		idle_remove(tcpsock);
+		stats.tcp_conns--;
+		tcp_socket_unref(tcpsock);
+		return;
+	}
+
+	close(tcpsock->fd);
+	tcpsock->closed = 1;
+	idle_remove(tcpsock);
+	stats.tcp_conns--;
+	if (!tcpsock->paused)
+		event_del(&(tcpsock->evt));
+	if (tcpsock->writing)
+		event_del(&(tcpsock->wevt));
+	tcpsock->writing = 0;
+
+	tcp_socket_unref(tcpsock);
+}
+
+static void init_req(struct tcp_socket *tcpsock, struct req_info *req)
+{
+	/* we reply through the connection, so we don't keep the client's
+	 * address */
+	static struct sockaddr_in noaddr;
+
+	req->fd = tcpsock->fd;
+	req->type = REQTYPE_TCP;
+	req->clisa = (struct sockaddr *) &noaddr;
+	req->clilen = sizeof(noaddr);
+	req->conn = tcpsock;
+	req->conn_ref = tcp_socket_ref;
+	req->conn_unref = tcp_socket_unref;
+	req->reply_mini = tcp_reply_mini;
+	req->reply_err = tcp_reply_err;
+	req->reply_long = tcp_reply_long;
+	req->reply_long2 = tcp_reply_long2;
+}
+
+/* Sends as much as possible of the given iovec array without blocking, and
+ * adjusts it to skip what was sent. Returns 0 on success (even if not
+ * everything could be sent), or -1 on error. */
+static int sendv_nb(int fd, struct iovec **iov, int *iovcnt)
 {
-	uint32_t l, r, c;
 	ssize_t rv;
-	unsigned char minibuf[4 * 4];
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+
+	while (*iovcnt > 0) {
+		msg.msg_iov = *iov;
+		msg.msg_iovlen = *iovcnt;
+		rv = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		else if (rv < 0 && errno == EINTR)
+			continue;
+		else if (rv <= 0)
+			return -1;
+
+		/* skip what was sent, which can end in the middle of a
+		 * piece */
+		while (*iovcnt > 0 && rv >= (*iov)->iov_len) {
+			rv -= (*iov)->iov_len;
+			(*iov)++;
+			(*iovcnt)--;
+		}
+		if (*iovcnt > 0) {
+			(*iov)->iov_base = (unsigned char *) (*iov)->iov_base
+				+ rv;
+			(*iov)->iov_len -= rv;
+		}
+	}
 
-	if (settings.passive)
+	return 0;
+}
+
+/* Appends the given iovec array to the output buffer. Returns 1 on success,
+ * 0 if there was not enough memory. */
+static int outbuf_append(struct tcp_socket *tcpsock,
+		const struct iovec *iov, int iovcnt)
+{
+	int i;
+	size_t size = 0, newsize;
+	unsigned char *newbuf;
+
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+
+	if (tcpsock->outstart > 0 &&
+			tcpsock->outstart + tcpsock->outlen + size >
+				tcpsock->outsize) {
+		/* move the pending data to the beginning first, and grow the
+		 * buffer only if it's still not enough */
+		memmove(tcpsock->outbuf,
+				tcpsock->outbuf + tcpsock->outstart,
+				tcpsock->outlen);
+		tcpsock->outstart = 0;
+	}
+
+	if (tcpsock->outlen + size > tcpsock->outsize) {
+		newsize = tcpsock->outsize * 2;
+		if (newsize < tcpsock->outlen + size)
+			newsize = tcpsock->outlen + size;
+
+		newbuf = realloc(tcpsock->outbuf, newsize);
+		if (newbuf == NULL)
+			return 0;
+		stats.tcp_conn_bytes += newsize - tcpsock->outsize;
+		tcpsock->outbuf = newbuf;
+		tcpsock->outsize = newsize;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(tcpsock->outbuf + tcpsock->outstart + tcpsock->outlen,
+				iov[i].iov_base, iov[i].iov_len);
+		tcpsock->outlen += iov[i].iov_len;
+	}
+
+	return 1;
+}
+
+/* Sends the output buffer, as much as possible without blocking. Returns 0
+ * on success, -1 on error. */
+static int outbuf_send(struct tcp_socket *tcpsock)
+{
+	int iovcnt = 1;
+	size_t remaining;
+	struct iovec iov, *piov = &iov;
+
+	iov.iov_base = tcpsock->outbuf + tcpsock->outstart;
+	iov.iov_len = tcpsock->outlen;
+	if (sendv_nb(tcpsock->fd, &piov, &iovcnt) < 0)
+		return -1;
+
+	remaining = iovcnt ? iov.iov_len : 0;
+	tcpsock->outstart += tcpsock->outlen - remaining;
+	tcpsock->outlen = remaining;
+
+	if (tcpsock->outlen == 0) {
+		/* we don't keep the memory of idle connections */
+		buf_free(tcpsock->outbuf, tcpsock->outsize);
+		tcpsock->outbuf = NULL;
+		tcpsock->outsize = tcpsock->outstart = 0;
+	}
+
+	return 0;
+}
+
+/* Bytes of replies waiting to be sent. */
+static size_t pending_out(struct tcp_socket *tcpsock)
+{
+	return tcpsock->outlen + tcpsock->sendlen - tcpsock->sendoff;
+}
+
+/* With io_uring, submits the send of what's left of sendbuf. If it can't,
+ * the connection is shut down, so it gets closed by tcp_uring_recv(). */
+static void send_more(struct tcp_socket *tcpsock)
+{
+	if (!uring_send(tcpsock->fd, tcpsock->sendbuf + tcpsock->sendoff,
+				tcpsock->sendlen - tcpsock->sendoff,
+				&(tcpsock->sop))) {
+		shutdown(tcpsock->fd, SHUT_RDWR);
 		return;
+	}
 
-	/* Network format: length (4), ID (4), REP_ERR (4), error code (4) */
-	l = htonl(4 + 4 + 4 + 4);
-	r = htonl(REP_ERR);
-	c = htonl(code);
-	memcpy(minibuf, &l, 4);
-	memcpy(minibuf + 4, &(req->id), 4);
-	memcpy(minibuf + 8, &r, 4);
-	memcpy(minibuf + 12, &c, 4);
+	tcpsock->writing = 1;
+	tcp_socket_ref(tcpsock);
+}
 
-	/* If this send fails, there's nothing to be done */
-	rv = send(req->fd, minibuf, 4 * 4, 0);
+/* With io_uring, hands the output buffer over to a send operation, which
+ * needs it untouched until it completes; the replies that come in the
+ * meantime go to a new one. */
+static void uring_send_outbuf(struct tcp_socket *tcpsock)
+{
+	tcpsock->sendbuf = tcpsock->outbuf;
+	tcpsock->sendsize = tcpsock->outsize;
+	tcpsock->sendoff = tcpsock->outstart;
+	tcpsock->sendlen = tcpsock->outstart + tcpsock->outlen;
 
-	if (rv < 0) {
-		errlog("rep_send_error() failed");
+	tcpsock->outbuf = NULL;
+	tcpsock->outsize = tcpsock->outstart = tcpsock->outlen = 0;
+
+	send_more(tcpsock);
+}
+
+/* Sends what's in the output buffer, and if something is left, waits for the
+ * socket to become writable to send the rest. Errors are also left to
+ * tcp_send_pending(), so the connection is not closed under our callers. */
+static void outbuf_flush(struct tcp_socket *tcpsock)
+{
+	if (tcpsock->closed || tcpsock->writing || tcpsock->outlen == 0)
+		return;
+
+	if (use_uring) {
+		uring_send_outbuf(tcpsock);
+		return;
+	}
+
+	if (outbuf_send(tcpsock) < 0 || tcpsock->outlen > 0) {
+		event_add(&(tcpsock->wevt), NULL);
+		tcpsock->writing = 1;
 	}
 }
 
+/* Adds the connection to the corked list, if it's not already in it. */
+static void add_corked(struct tcp_socket *tcpsock)
+{
+	if (tcpsock->in_corked)
+		return;
 
-static int rep_send(const struct req_info *req, const unsigned char *buf,
-		const size_t size)
+	tcp_socket_ref(tcpsock);
+	tcpsock->in_corked = 1;
+	tcpsock->corked_next = corked_list;
+	corked_list = tcpsock;
+}
+
+/* Corking: between tcp_cork() and tcp_uncork(), small replies are held in
+ * the connections' output buffers, and sent when uncorking, so pipelined
+ * requests that are processed together get their replies in a single
+ * send(). They can be nested. */
+void tcp_cork(void)
 {
-	ssize_t rv, c;
+	corked++;
+}
+
+void tcp_uncork(void)
+{
+	struct tcp_socket *tcpsock;
+
+	if (--corked > 0)
+		return;
+
+	while (corked_list != NULL) {
+		tcpsock = corked_list;
+		corked_list = tcpsock->corked_next;
+		tcpsock->corked_next = NULL;
+		tcpsock->in_corked = 0;
+
+		outbuf_flush(tcpsock);
+		tcp_socket_unref(tcpsock);
+	}
+
+	/* with io_uring, all the sends go together */
+	if (use_uring)
+		uring_submit();
+}
+
+/* Sends a reply made of many pieces, without copying them together. The
+ * iovec array is modified to keep track of what was sent.
+ *
+ * Replies are sent right away if possible, and what can't be sent is left in
+ * the output buffer, to be sent by tcp_send_pending() when the socket becomes
+ * writable, so the event loop never waits for slow clients. */
+static int rep_sendv(const struct req_info *req, struct iovec *iov,
+		int iovcnt)
+{
+	int i;
+	size_t size = 0;
+	struct tcp_socket *tcpsock = req->conn;
 
 	if (settings.passive)
 		return 1;
 
-	c = 0;
-	while (c < size) {
-		rv = send(req->fd, buf + c, size - c, 0);
+	if (tcpsock->closed)
+		return 0;
 
-		if (rv == size) {
-			return 1;
-		} else if (rv < 0) {
-			if (errno != EAGAIN || errno != EWOULDBLOCK) {
-				rep_send_error(req, ERR_SEND);
-				return 0;
-			} else {
-				/* With big packets, the receiver window might
-				 * get exhausted and send() would block, but
-				 * as the fd is set in non-blocking mode, it
-				 * returns EAGAIN. This makes us to retry when
-				 * send() fails in this way.
-				 *
-				 * The proper way to fix this would be to add
-				 * an event so we get notified when the fd is
-				 * available for writing, and retry the send;
-				 * but this is complex so leave it for when
-				 * it's really needed. */
-				continue;
-			}
-		} else if (rv == 0) {
-			return 1;
+	if (use_uring) {
+		/* everything goes through the output buffer, which is sent
+		 * when uncorking, or right away if we're not corked */
+		if (!outbuf_append(tcpsock, iov, iovcnt))
+			return 0;
+
+		if (corked) {
+			add_corked(tcpsock);
+		} else {
+			outbuf_flush(tcpsock);
+			uring_submit();
 		}
+		return 1;
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+
+	if (corked && !tcpsock->writing &&
+			tcpsock->outlen + size < CORK_MAX) {
+		if (!outbuf_append(tcpsock, iov, iovcnt))
+			return 0;
+
+		add_corked(tcpsock);
+		return 1;
+	}
+
+	/* big replies go right away, after the ones held by corking; this
+	 * also keeps a long pipeline from holding too many replies */
+	if (tcpsock->outlen > 0 && !tcpsock->writing) {
+		if (outbuf_send(tcpsock) < 0)
+			return 0;
+	}
 
-		c += rv;
+	/* if there's something pending, we must go after it */
+	if (tcpsock->outlen == 0) {
+		if (sendv_nb(tcpsock->fd, &iov, &iovcnt) < 0)
+			return 0;
+		if (iovcnt == 0)
+			return 1;
+	}
+
+	if (!outbuf_append(tcpsock, iov, iovcnt))
+		return 0;
+
+	if (!tcpsock->writing) {
+		event_add(&(tcpsock->wevt), NULL);
+		tcpsock->writing = 1;
 	}
 
 	return 1;
 }
 
+static int rep_send(const struct req_info *req, const unsigned char *buf,
+		const size_t size)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *) buf;
+	iov.iov_len = size;
+	return rep_sendv(req, &iov, 1);
+}
+
+static void rep_send_error(const struct req_info *req, const unsigned int code)
+{
+	uint32_t l, r, c;
+	unsigned char minibuf[4 * 4];
+
+	if (settings.passive)
+		return;
+
+	/* Network format: length (4), ID (4), REP_ERR (4), error code (4) */
+	l = htonl(4 + 4 + 4 + 4);
+	r = htonl(REP_ERR);
+	c = htonl(code);
+	memcpy(minibuf, &l, 4);
+	memcpy(minibuf + 4, &(req->id), 4);
+	memcpy(minibuf + 8, &r, 4);
+	memcpy(minibuf + 12, &c, 4);
+
+	/* If this send fails, there's nothing to be done */
+	if (!rep_send(req, minibuf, 4 * 4))
+		errlog("rep_send_error() failed");
+}
+
 
 /* Send small replies, consisting in only a value. */
 static void tcp_reply_mini(const struct req_info *req, uint32_t reply)
@@ -170,46 +665,58 @@ static void tcp_reply_err(const struct req_info *req, uint32_t reply)
 	rep_send_error(req, reply);
 }
 
-static void tcp_reply_long(const struct req_info *req, uint32_t reply,
+static void tcp_reply_long2(const struct req_info *req, uint32_t reply,
+			const unsigned char *pre, size_t psize,
 			unsigned char *val, size_t vsize)
 {
 	if (val == NULL) {
 		/* miss */
 		tcp_reply_mini(req, reply);
 	} else {
-		unsigned char *buf;
-		size_t bsize;
+		unsigned char hdr[4 + 4 + 4 + 4];
+		struct iovec iov[3];
 		uint32_t t;
 
 		reply = htonl(reply);
 
-		/* The reply length is:
+		/* The reply is:
 		 * 4		total length
 		 * 4		id
 		 * 4		reply code
-		 * 4		vsize
+		 * 4		psize + vsize
+		 * psize	pre
 		 * vsize	val
-		 */
-		bsize = 4 + 4 + 4 + 4 + vsize;
-		buf = malloc(bsize);
-
-		t = htonl(bsize);
-		memcpy(buf, &t, 4);
-
-		memcpy(buf + 4, &(req->id), 4);
-		memcpy(buf + 8, &reply, 4);
-
-		t = htonl(vsize);
-		memcpy(buf + 12, &t, 4);
-		memcpy(buf + 16, val, vsize);
-
-		rep_send(req, buf, bsize);
-		free(buf);
+		 *
+		 * The value is sent from where it is (usually the cache),
+		 * to avoid copying it. */
+		t = htonl(sizeof(hdr) + psize + vsize);
+		memcpy(hdr, &t, 4);
+
+		memcpy(hdr + 4, &(req->id), 4);
+		memcpy(hdr + 8, &reply, 4);
+
+		t = htonl(psize + vsize);
+		memcpy(hdr + 12, &t, 4);
+
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = (void *) pre;
+		iov[1].iov_len = psize;
+		iov[2].iov_base = val;
+		iov[2].iov_len = vsize;
+
+		rep_sendv(req, iov, 3);
 	}
 	return;
 
 }
 
+static void tcp_reply_long(const struct req_info *req, uint32_t reply,
+			unsigned char *val, size_t vsize)
+{
+	tcp_reply_long2(req, reply, NULL, 0, val, vsize);
+}
+
 
 /*
  * Main functions for receiving and parsing
@@ -220,6 +727,9 @@ int tcp_init(void)
 	int fd, rv;
 	struct sockaddr_in srvsa;
 	struct in_addr ia;
+	struct timeval tv;
+
+	slab_init(&conn_slab, sizeof(struct tcp_socket), CONNS_PER_CHUNK);
 
 	rv = inet_pton(AF_INET, settings.tcp_addr, &ia);
 	if (rv <= 0)
@@ -260,215 +770,533 @@ int tcp_init(void)
 		return -1;
 	}
 
+	if (settings.tcp_idle_timeout > 0) {
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		evtimer_set(&idle_evt, idle_sweep, NULL);
+		evtimer_add(&idle_evt, &tv);
+	}
+
 	return fd;
 }
 
 
 void tcp_close(int fd)
 {
+	unsigned char *buf;
+
 	close(fd);
+
+	if (settings.tcp_idle_timeout > 0)
+		evtimer_del(&idle_evt);
+
+	while (inbuf_pool != NULL) {
+		buf = inbuf_pool;
+		inbuf_pool = *(unsigned char **) buf;
+		buf_free(buf, INBUF_SIZE);
+	}
+	inbuf_pool_len = 0;
 }
 
 
+/* Called every second when there's an idle timeout, to close the
+ * connections that have been idle for longer than that. */
+static void idle_sweep(int fd, short event, void *arg)
+{
+	time_t limit;
+	struct timeval tv;
+	struct tcp_socket *tcpsock;
+
+	limit = time(NULL) - settings.tcp_idle_timeout;
+	while (idle_first != NULL && idle_first->last_active < limit) {
+		tcpsock = idle_first;
+
+		/* connections waiting for the database or with replies
+		 * pending are not idle */
+		if (tcpsock->writing
+				|| tcpsock->refcount > 1 + tcpsock->receiving) {
+			idle_touch(tcpsock);
+			continue;
+		}
+
+		stats.tcp_idle_closed++;
+		tcp_socket_close(tcpsock);
+	}
+
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	evtimer_add(&idle_evt, &tv);
+}
+
+/* Allocates the structure for a new connection. Returns NULL if there was
+ * not enough memory. */
+static struct tcp_socket *tcp_socket_new(int fd)
+{
+	size_t slab_bytes = conn_slab.bytes;
+	struct tcp_socket *tcpsock;
+
+	tcpsock = slab_alloc(&conn_slab);
+	if (tcpsock == NULL)
+		return NULL;
+	stats.tcp_conn_bytes += conn_slab.bytes - slab_bytes;
+
+	tcpsock->fd = fd;
+	tcpsock->inbuf = NULL;
+	tcpsock->insize = tcpsock->instart = tcpsock->inend = 0;
+
+	tcpsock->outbuf = NULL;
+	tcpsock->outsize = tcpsock->outstart = tcpsock->outlen = 0;
+	tcpsock->writing = 0;
+	tcpsock->paused = 0;
+	tcpsock->closed = 0;
+	tcpsock->refcount = 1;
+	tcpsock->corked_next = NULL;
+	tcpsock->in_corked = 0;
+
+	tcpsock->idle_prev = tcpsock->idle_next = NULL;
+	idle_touch(tcpsock);
+
+	tcpsock->rop.cb = tcp_uring_recv;
+	tcpsock->rop.arg = tcpsock;
+	tcpsock->sop.cb = tcp_uring_sent;
+	tcpsock->sop.arg = tcpsock;
+	tcpsock->receiving = 0;
+	tcpsock->sendbuf = NULL;
+	tcpsock->sendsize = tcpsock->sendlen = tcpsock->sendoff = 0;
+
+	stats.tcp_conns++;
+	return tcpsock;
+}
+
 /* Called by libevent for each receive event on our listen fd */
 void tcp_newconnection(int fd, short event, void *arg)
 {
 	int newfd;
 	struct tcp_socket *tcpsock;
-	struct event *new_event;
 
-	tcpsock = malloc(sizeof(struct tcp_socket));
-	if (tcpsock == NULL) {
+	newfd = accept(fd, NULL, NULL);
+	if (newfd < 0)
 		return;
-	}
-	tcpsock->clilen = sizeof(tcpsock->clisa);
 
-	new_event = malloc(sizeof(struct event));
-	if (new_event == NULL) {
-		free(tcpsock);
+	if (fcntl(newfd, F_SETFL, O_NONBLOCK) != 0) {
+		close(newfd);
 		return;
 	}
 
-	newfd = accept(fd,
-			(struct sockaddr *) &(tcpsock->clisa),
-			&(tcpsock->clilen));
-
-	if (fcntl(newfd, F_SETFL, O_NONBLOCK) != 0) {
+	tcpsock = tcp_socket_new(newfd);
+	if (tcpsock == NULL) {
 		close(newfd);
-		free(new_event);
-		free(tcpsock);
 		return;
 	}
 
-	tcpsock->fd = newfd;
-	tcpsock->evt = new_event;
-	tcpsock->buf = NULL;
-	tcpsock->pktsize = 0;
-	tcpsock->len = 0;
-	tcpsock->excess = 0;
+	event_set(&(tcpsock->wevt), newfd, EV_WRITE | EV_PERSIST,
+			tcp_send_pending, (void *) tcpsock);
 
-	event_set(new_event, newfd, EV_READ | EV_PERSIST, tcp_recv,
+	event_set(&(tcpsock->evt), newfd, EV_READ | EV_PERSIST, tcp_recv,
 			(void *) tcpsock);
-	event_add(new_event, NULL);
+	event_add(&(tcpsock->evt), NULL);
 
 	return;
 }
 
 
-/* Static common buffer to avoid unnecessary allocation on the common case
- * where we get an entire single message on each recv().
- * Allocate a little bit more over the max. message size, which is 64kb. */
-#define SBSIZE (68 * 1024)
-static unsigned char static_buf[SBSIZE];
-
 /* Called by libevent for each receive event */
 static void tcp_recv(int fd, short event, void *arg)
 {
 	int rv;
+	ssize_t n;
+	unsigned char *buf;
+	size_t size;
 	struct tcp_socket *tcpsock;
 
 	tcpsock = (struct tcp_socket *) arg;
 
-	if (tcpsock->buf == NULL) {
-		/* New incoming message */
-		rv = recv(fd, static_buf, SBSIZE, 0);
-		if (rv < 0 && errno == EAGAIN) {
-			/* We were awoken but have no data to read, so we do
-			 * nothing */
-			return;
-		} else if (rv <= 0) {
-			/* Orderly shutdown or error; close the file
-			 * descriptor in either case. */
-			goto error_exit;
-		}
-
-		init_req(tcpsock);
-		process_buf(tcpsock, static_buf, rv);
-
+	if (tcpsock->inbuf == NULL) {
+		/* We have nothing pending, so we receive into a buffer
+		 * shared by all the connections, and only take one for
+		 * ourselves if an incomplete message is left; this way idle
+		 * connections don't need any. */
+		buf = recv_buf;
+		size = sizeof(recv_buf);
 	} else {
-		/* We already got a partial message, complete it. */
-		size_t maxtoread = tcpsock->pktsize - tcpsock->len;
+		/* There's always room after inend, see make_room() */
+		buf = tcpsock->inbuf + tcpsock->inend;
+		size = tcpsock->insize - tcpsock->inend;
+	}
 
-		rv = recv(fd, tcpsock->buf + tcpsock->len, maxtoread, 0);
-		if (rv < 0 && errno == EAGAIN) {
-			return;
-		} else if (rv <= 0) {
-			goto error_exit;
-		}
+	n = recv(fd, buf, size, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		/* We were awoken but have no data to read, so we do
+		 * nothing */
+		return;
+	} else if (n <= 0) {
+		/* Orderly shutdown or error; close the file descriptor in
+		 * either case. */
+		goto error_exit;
+	}
 
-		tcpsock->len += rv;
+	idle_touch(tcpsock);
+
+	/* The replies to the requests we got are sent together when we're
+	 * done with them */
+	tcp_cork();
+	if (tcpsock->inbuf == NULL) {
+		rv = process_data(tcpsock, buf, n);
+	} else {
+		tcpsock->inend += n;
+		rv = process_buf(tcpsock);
+	}
+	tcp_uncork();
+	if (!rv)
+		return;
 
-		process_buf(tcpsock,tcpsock->buf, tcpsock->len);
+	/* If the client is not reading its replies, stop reading its
+	 * requests until it catches up; see tcp_send_pending() */
+	if (tcpsock->outlen > OUTBUF_HIGH) {
+		event_del(&(tcpsock->evt));
+		tcpsock->paused = 1;
 	}
 
 	return;
 
 error_exit:
-	close(fd);
-	event_del(tcpsock->evt);
-	tcp_socket_free(tcpsock);
+	tcp_socket_close(tcpsock);
 	return;
 }
 
+/* Called by libevent when a socket with pending output becomes writable */
+static void tcp_send_pending(int fd, short event, void *arg)
+{
+	int rv;
+	struct tcp_socket *tcpsock;
+
+	tcpsock = (struct tcp_socket *) arg;
+
+	rv = outbuf_send(tcpsock);
+	if (rv == 0)
+		idle_touch(tcpsock);
+
+	if (rv == 0 && tcpsock->outlen == 0) {
+		event_del(&(tcpsock->wevt));
+		tcpsock->writing = 0;
+	}
 
-/* Main message unwrapping */
-static void process_buf(struct tcp_socket *tcpsock,
-		unsigned char *buf, size_t len)
+	if (rv == 0 && tcpsock->paused && tcpsock->outlen < OUTBUF_LOW) {
+		event_add(&(tcpsock->evt), NULL);
+		tcpsock->paused = 0;
+	}
+
+	if (rv < 0)
+		tcp_socket_close(tcpsock);
+}
+
+
+/*
+ * io_uring versions of the functions above
+ */
+
+/* Submits the connection's multishot receive. Returns 0 on error. */
+static int start_receiving(struct tcp_socket *tcpsock)
 {
-	uint32_t totaltoget = 0;
+	if (!uring_recv(tcpsock->fd, &(tcpsock->rop)))
+		return 0;
 
-	if (len >= 4) {
-		totaltoget = * (uint32_t *) buf;
-		totaltoget = ntohl(totaltoget);
-		if (totaltoget > (64 * 1024) || totaltoget <= 8) {
-			/* Message too big or too small, close the connection. */
-			goto error_exit;
+	tcpsock->receiving = 1;
+	tcp_socket_ref(tcpsock);
+	return 1;
+}
+
+/* Called for each connection accepted by the multishot accept */
+static void tcp_uring_accept(struct uring_op *op, int res, int more,
+		unsigned char *buf)
+{
+	struct tcp_socket *tcpsock;
+
+	/* with a multishot accept we don't get the client's address, but
+	 * we don't need it to reply */
+	if (res >= 0) {
+		tcpsock = tcp_socket_new(res);
+		if (tcpsock == NULL)
+			close(res);
+		else if (!start_receiving(tcpsock))
+			tcp_socket_close(tcpsock);
+	}
+
+	if (!more && !uring_accept(uring_listen_fd, op))
+		errlog("Error accepting TCP connections");
+}
+
+/* Processes data received in a provided buffer, which must be given back
+ * when we're done; if the connection has an incomplete message, the data is
+ * appended to its input buffer, in pieces if there's not enough room for
+ * all of it. Returns 0 if the connection was closed. */
+static int uring_got_data(struct tcp_socket *tcpsock, unsigned char *buf,
+		size_t len)
+{
+	int rv = 1;
+	size_t n;
+
+	tcp_cork();
+	while (len > 0 && rv) {
+		if (tcpsock->inbuf == NULL) {
+			/* nothing pending, so we can parse it from where it
+			 * is */
+			rv = process_data(tcpsock, buf, len);
+			break;
 		}
 
-	} else {
-		/* If we didn't even read 4 bytes, we try to read 4 first and
-		 * then care about the rest. */
-		totaltoget = 4;
+		/* There's always room after inend, see make_room() */
+		n = tcpsock->insize - tcpsock->inend;
+		if (n > len)
+			n = len;
+
+		memcpy(tcpsock->inbuf + tcpsock->inend, buf, n);
+		tcpsock->inend += n;
+		buf += n;
+		len -= n;
+
+		rv = process_buf(tcpsock);
 	}
+	tcp_uncork();
 
-	if (totaltoget > len) {
-		if (tcpsock->buf == NULL) {
-			/* The first incomplete recv().
-			 * Create a temporary buffer and copy the contents of
-			 * our current one (which is static_buf, otherwise
-			 * tcpsock->buf wouldn't be NULL) to it. */
-			tcpsock->buf = malloc(SBSIZE);
-			if (tcpsock->buf == NULL)
-				goto error_exit;
+	return rv;
+}
 
-			memcpy(tcpsock->buf, buf, len);
-			tcpsock->len = len;
-			tcpsock->pktsize = totaltoget;
+/* Called for each completion of a connection's multishot receive */
+static void tcp_uring_recv(struct uring_op *op, int res, int more,
+		unsigned char *buf)
+{
+	struct tcp_socket *tcpsock = op->arg;
 
-		} else {
-			/* We already had an incomplete recv() and this is
-			 * just another one. */
-			tcpsock->len = len;
-			tcpsock->pktsize = totaltoget;
-		}
-		return;
+	if (!more)
+		tcpsock->receiving = 0;
+
+	if (tcpsock->closed)
+		goto exit;
+
+	if (res > 0 && buf != NULL) {
+		idle_touch(tcpsock);
+		if (!uring_got_data(tcpsock, buf, res))
+			goto exit;
+	} else if (res != -ENOBUFS && res != -ECANCELED) {
+		/* Orderly shutdown or error; close the file descriptor in
+		 * either case. */
+		tcp_socket_close(tcpsock);
+		goto exit;
 	}
 
-	if (totaltoget < len) {
-		/* Got more than one message in the same recv(); save the
-		 * amount of bytes exceeding so we can process it later. */
-		tcpsock->excess = len - totaltoget;
-		len = totaltoget;
+	/* If the client is not reading its replies, stop reading its
+	 * requests until it catches up; see tcp_uring_sent() */
+	if (!tcpsock->paused && pending_out(tcpsock) > OUTBUF_HIGH) {
+		tcpsock->paused = 1;
+		if (tcpsock->receiving)
+			uring_cancel(&(tcpsock->rop));
 	}
 
-	/* The buffer is complete, parse it as usual. */
-	stats.msg_tcp++;
-	if (parse_message(&(tcpsock->req), buf + 4, len - 4)) {
+	/* the receive stops when the kernel runs out of provided buffers
+	 * (-ENOBUFS), and then it has to be submitted again */
+	if (!tcpsock->receiving && !tcpsock->paused
+			&& !start_receiving(tcpsock))
+		tcp_socket_close(tcpsock);
+
+exit:
+	if (!more)
+		tcp_socket_unref(tcpsock);
+}
+
+/* Called when a send submitted by send_more() completes */
+static void tcp_uring_sent(struct uring_op *op, int res, int more,
+		unsigned char *buf)
+{
+	struct tcp_socket *tcpsock = op->arg;
+
+	tcpsock->writing = 0;
+
+	if (tcpsock->closed || res <= 0) {
+		buf_free(tcpsock->sendbuf, tcpsock->sendsize);
+		tcpsock->sendbuf = NULL;
+		tcpsock->sendsize = tcpsock->sendlen = tcpsock->sendoff = 0;
+		if (!tcpsock->closed)
+			tcp_socket_close(tcpsock);
 		goto exit;
-	} else {
-		goto error_exit;
 	}
 
+	idle_touch(tcpsock);
+	tcpsock->sendoff += res;
+	if (tcpsock->sendoff < tcpsock->sendlen) {
+		/* a partial send, what's left must go before anything else */
+		send_more(tcpsock);
+		goto exit;
+	}
+
+	buf_free(tcpsock->sendbuf, tcpsock->sendsize);
+	tcpsock->sendbuf = NULL;
+	tcpsock->sendsize = tcpsock->sendlen = tcpsock->sendoff = 0;
+
+	/* send what came in the meantime */
+	outbuf_flush(tcpsock);
+
+	if (tcpsock->paused && pending_out(tcpsock) < OUTBUF_LOW) {
+		tcpsock->paused = 0;
+		if (!tcpsock->receiving && !start_receiving(tcpsock))
+			tcp_socket_close(tcpsock);
+	}
 
 exit:
-	if (tcpsock->excess) {
-		/* If there are buffer leftovers (because there was more than
-		 * one message on a recv()), leave the buffer, move the
-		 * leftovers to the beginning, adjust the numbers and parse
-		 * recursively.
-		 * The buffer can be the static one or the one in tcpsock (if
-		 * we had a short recv()); we don't care because we know it
-		 * will be big enough to hold an entire message anyway. */
-		memmove(buf, buf + len, tcpsock->excess);
-		tcpsock->len = tcpsock->excess;
-		tcpsock->excess = 0;
-
-		/* Build a new req just like when we first recv(). */
-		init_req(tcpsock);
-		process_buf(tcpsock, buf, len);
-		return;
+	tcp_socket_unref(tcpsock);
+}
+
+/* Makes TCP use io_uring instead of libevent for the connections accepted
+ * from the given listening socket. uring_init() must have been called
+ * successfully, and uring_process() must be called when the ring's fd is
+ * readable. Returns 1 on success, 0 on error. */
+int tcp_uring_start(int fd)
+{
+	accept_op.cb = tcp_uring_accept;
+	accept_op.arg = NULL;
+	if (!uring_accept(fd, &accept_op))
+		return 0;
+
+	uring_listen_fd = fd;
+	use_uring = 1;
+	uring_submit();
+	return 1;
+}
 
+
+/* Makes room in the input buffer for the rest of an incomplete message of
+ * msgsize bytes. Returns 0 if there was not enough memory. */
+static int make_room(struct tcp_socket *tcpsock, size_t msgsize)
+{
+	int shrink;
+	size_t len;
+	unsigned char *newbuf;
+
+	shrink = tcpsock->insize > INBUF_SIZE && msgsize <= INBUF_SIZE;
+
+	len = tcpsock->inend - tcpsock->instart;
+	if (len == 0) {
+		tcpsock->instart = tcpsock->inend = 0;
+	} else if (tcpsock->instart + msgsize > tcpsock->insize || shrink) {
+		/* We move the incomplete message only when it doesn't fit
+		 * where it is, or when we're about to shrink the buffer */
+		memmove(tcpsock->inbuf, tcpsock->inbuf + tcpsock->instart,
+				len);
+		tcpsock->instart = 0;
+		tcpsock->inend = len;
 	}
 
-	if (tcpsock->buf) {
-		/* We had an incomplete read somewhere along the processing of
-		 * this message, and had to malloc() a temporary space. free()
-		 * it and reset the associated information. */
-		free(tcpsock->buf);
-		tcpsock->buf = NULL;
-		tcpsock->len = 0;
-		tcpsock->pktsize = 0;
-		tcpsock->excess = 0;
+	if (msgsize > tcpsock->insize) {
+		/* a message with a big value */
+		newbuf = realloc(tcpsock->inbuf, msgsize);
+		if (newbuf == NULL)
+			return 0;
+		stats.tcp_conn_bytes += msgsize - tcpsock->insize;
+		tcpsock->inbuf = newbuf;
+		tcpsock->insize = msgsize;
+	} else if (shrink) {
+		/* the big message is gone, give the memory back */
+		newbuf = realloc(tcpsock->inbuf, INBUF_SIZE);
+		if (newbuf != NULL) {
+			stats.tcp_conn_bytes -= tcpsock->insize - INBUF_SIZE;
+			tcpsock->inbuf = newbuf;
+			tcpsock->insize = INBUF_SIZE;
+		}
 	}
 
-	return;
+	return 1;
+}
 
-error_exit:
-	close(tcpsock->fd);
-	event_del(tcpsock->evt);
-	tcp_socket_free(tcpsock);
-	return;
+/* Main message unwrapping: parses all the complete messages in the given
+ * buffer. Returns how many bytes they took, leaving in *msgsize how much is
+ * needed for the incomplete one that follows (if any), or -1 if the
+ * connection must be closed. */
+static ssize_t parse_msgs(struct tcp_socket *tcpsock, unsigned char *buf,
+		size_t len, uint32_t *msgsize)
+{
+	size_t used = 0;
+	struct req_info req;
+
+	for (;;) {
+		if (len - used < 4) {
+			/* we need at least the length to know how much more
+			 * we need */
+			*msgsize = 4;
+			break;
+		}
+
+		memcpy(msgsize, buf + used, 4);
+		*msgsize = ntohl(*msgsize);
+		if (*msgsize > MAX_MSG_SIZE || *msgsize <= 8) {
+			/* Message too big or too small, close the
+			 * connection. */
+			return -1;
+		}
+
+		if (*msgsize > len - used)
+			break;
+
+		stats.msg_tcp++;
+		init_req(tcpsock, &req);
+		if (!parse_message(&req, buf + used + 4, *msgsize - 4))
+			return -1;
+
+		used += *msgsize;
+	}
+
+	return used;
+}
+
+/* Processes the messages in the connection's input buffer, and leaves room
+ * for the rest of the incomplete one; if there is none, the buffer is
+ * released. Returns 1 on success, or 0 if the connection was closed. */
+static int process_buf(struct tcp_socket *tcpsock)
+{
+	ssize_t used;
+	uint32_t msgsize;
 
+	used = parse_msgs(tcpsock, tcpsock->inbuf + tcpsock->instart,
+			tcpsock->inend - tcpsock->instart, &msgsize);
+	if (used < 0)
+		goto error_exit;
+	tcpsock->instart += used;
+
+	if (tcpsock->instart == tcpsock->inend)
+		inbuf_put(tcpsock);
+	else if (!make_room(tcpsock, msgsize))
+		goto error_exit;
+
+	return 1;
+
+error_exit:
+	tcp_socket_close(tcpsock);
+	return 0;
 }
 
+/* Like process_buf(), for data received somewhere else when the connection
+ * has no input buffer; it only gets one for the incomplete message, if
+ * there's one left. */
+static int process_data(struct tcp_socket *tcpsock, unsigned char *buf,
+		size_t len)
+{
+	ssize_t used;
+	uint32_t msgsize;
+
+	used = parse_msgs(tcpsock, buf, len, &msgsize);
+	if (used < 0)
+		goto error_exit;
+
+	if (used < len) {
+		if (!inbuf_get(tcpsock, msgsize))
+			goto error_exit;
+		memcpy(tcpsock->inbuf, buf + used, len - used);
+		tcpsock->inend = len - used;
+	}
+
+	return 1;
+
+error_exit:
+	tcp_socket_close(tcpsock);
+	return 0;
+}
 
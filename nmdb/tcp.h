@@ -5,6 +5,9 @@
 int tcp_init(void);
 void tcp_close(int fd);
 void tcp_newconnection(int fd, short event, void *arg);
+void tcp_cork(void);
+void tcp_uncork(void);
+int tcp_uring_start(int fd);
 
 #endif
 
@@ -1,6 +1,7 @@
 
 #include <sys/types.h>		/* socket defines */
 #include <sys/socket.h>		/* socket functions */
+#include <sys/uio.h>		/* struct iovec */
 #include <stdlib.h>		/* malloc() */
 #include <linux/tipc.h>		/* tipc stuff */
 #include <stdint.h>		/* uint32_t and friends */
@@ -44,15 +45,23 @@ static void rep_send_error(const struct req_info *req, const unsigned int code)
 }
 
 
-static int rep_send(const struct req_info *req, const unsigned char *buf,
-		const size_t size)
+/* Sends a reply made of many pieces, without copying them together. */
+static int rep_sendv(const struct req_info *req, struct iovec *iov,
+		int iovcnt)
 {
 	int rv;
+	struct msghdr msg;
 
 	if (settings.passive)
 		return 1;
 
-	rv = sendto(req->fd, buf, size, 0, req->clisa, req->clilen);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = req->clisa;
+	msg.msg_namelen = req->clilen;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	rv = sendmsg(req->fd, &msg, 0);
 	if (rv < 0) {
 		rep_send_error(req, ERR_SEND);
 		return 0;
@@ -60,6 +69,16 @@ static int rep_send(const struct req_info *req, const unsigned char *buf,
 	return 1;
 }
 
+static int rep_send(const struct req_info *req, const unsigned char *buf,
+		const size_t size)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *) buf;
+	iov.iov_len = size;
+	return rep_sendv(req, &iov, 1);
+}
+
 
 /* Send small replies, consisting in only a value. */
 static void tipc_reply_mini(const struct req_info *req, uint32_t reply)
@@ -87,42 +106,54 @@ static void tipc_reply_err(const struct req_info *req, uint32_t reply)
 	rep_send_error(req, reply);
 }
 
-static void tipc_reply_long(const struct req_info *req, uint32_t reply,
+static void tipc_reply_long2(const struct req_info *req, uint32_t reply,
+			const unsigned char *pre, size_t psize,
 			unsigned char *val, size_t vsize)
 {
 	if (val == NULL) {
 		/* miss */
 		tipc_reply_mini(req, reply);
 	} else {
-		unsigned char *buf;
-		size_t bsize;
+		unsigned char hdr[4 + 4 + 4];
+		struct iovec iov[3];
 		uint32_t t;
 
 		reply = htonl(reply);
 
-		/* The reply length is:
+		/* The reply is:
 		 * 4		id
 		 * 4		reply code
-		 * 4		vsize
+		 * 4		psize + vsize
+		 * psize	pre
 		 * vsize	val
-		 */
-		bsize = 4 + 4 + 4 + vsize;
-		buf = malloc(bsize);
-
-		t = htonl(vsize);
-
-		memcpy(buf, &(req->id), 4);
-		memcpy(buf + 4, &reply, 4);
-		memcpy(buf + 8, &t, 4);
-		memcpy(buf + 12, val, vsize);
-
-		rep_send(req, buf, bsize);
-		free(buf);
+		 *
+		 * The value is sent from where it is (usually the cache),
+		 * to avoid copying it. */
+		t = htonl(psize + vsize);
+
+		memcpy(hdr, &(req->id), 4);
+		memcpy(hdr + 4, &reply, 4);
+		memcpy(hdr + 8, &t, 4);
+
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = (void *) pre;
+		iov[1].iov_len = psize;
+		iov[2].iov_base = val;
+		iov[2].iov_len = vsize;
+
+		rep_sendv(req, iov, 3);
 	}
 	return;
 
 }
 
+static void tipc_reply_long(const struct req_info *req, uint32_t reply,
+			unsigned char *val, size_t vsize)
+{
+	tipc_reply_long2(req, reply, NULL, 0, val, vsize);
+}
+
 
 /*
  * Main functions for receiving and parsing
@@ -201,9 +232,11 @@ void tipc_recv(int fd, short event, void *arg)
 	req.type = REQTYPE_TIPC;
 	req.clisa = (struct sockaddr *) &clisa;
 	req.clilen = clilen;
+	req.conn = NULL;
 	req.reply_mini = tipc_reply_mini;
 	req.reply_err = tipc_reply_err;
 	req.reply_long = tipc_reply_long;
+	req.reply_long2 = tipc_reply_long2;
 
 	/* parse the message */
 	parse_message(&req, static_buf, rv);
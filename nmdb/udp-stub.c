@@ -16,3 +16,13 @@ void udp_recv(int fd, short event, void *arg)
 	return;
 }
 
+void udp_cork(void)
+{
+	return;
+}
+
+void udp_uncork(void)
+{
+	return;
+}
+
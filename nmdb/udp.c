@@ -1,6 +1,10 @@
 
+/* recvmmsg() and sendmmsg() are Linux-specific */
+#define _GNU_SOURCE
+
 #include <sys/types.h>		/* socket defines */
 #include <sys/socket.h>		/* socket functions */
+#include <sys/uio.h>		/* struct iovec */
 #include <stdlib.h>		/* malloc() */
 #include <stdint.h>		/* uint32_t and friends */
 #include <arpa/inet.h>		/* htonls() and friends */
@@ -17,6 +21,27 @@
 #include "log.h"
 
 
+/* Maximum number of datagrams received, and of replies sent, with a single
+ * system call */
+#define UDP_BATCH 32
+
+/* Size of the buffer for the replies held while corked; replies bigger than a
+ * quarter of it are sent right away */
+#define OUTBUF_SIZE (64 * 1024)
+
+/* Replies held while corked, see udp_cork(). Their contents are copied to
+ * outbuf, because values may not outlive the request (for example, a later
+ * set in the same batch can replace a cached value). */
+static int corked = 0;
+static int outfd = -1;
+static unsigned int outn = 0;
+static size_t outlen = 0;
+static unsigned char outbuf[OUTBUF_SIZE];
+static struct mmsghdr outmsgs[UDP_BATCH];
+static struct iovec outiovs[UDP_BATCH];
+static struct sockaddr_storage outaddrs[UDP_BATCH];
+
+
 /*
  * Miscelaneous helper functions
  */
@@ -45,15 +70,108 @@ static void rep_send_error(const struct req_info *req, const unsigned int code)
 }
 
 
-static int rep_send(const struct req_info *req, const unsigned char *buf,
-		const size_t size)
+/* Sends the held replies. */
+static void outbuf_flush(void)
 {
 	int rv;
+	unsigned int i = 0;
+
+	while (i < outn) {
+		rv = sendmmsg(outfd, outmsgs + i, outn - i, 0);
+		if (rv < 0) {
+			/* skip the one that failed, there's nothing to be
+			 * done about it */
+			errlog("sendmmsg() failed");
+			rv = 1;
+		}
+		i += rv;
+	}
+
+	outn = 0;
+	outlen = 0;
+}
+
+/* Corking: between udp_cork() and udp_uncork(), replies are held and then
+ * sent together, using a single system call for many of them. They can be
+ * nested. */
+void udp_cork(void)
+{
+	corked++;
+}
+
+void udp_uncork(void)
+{
+	if (--corked > 0)
+		return;
+
+	if (outn > 0)
+		outbuf_flush();
+}
+
+/* Holds a reply to be sent by outbuf_flush(). */
+static void outbuf_add(const struct req_info *req, const struct iovec *iov,
+		int iovcnt, size_t size)
+{
+	int i;
+	struct msghdr *msg;
+
+	if (outn == UDP_BATCH || outlen + size > OUTBUF_SIZE
+			|| (outn > 0 && outfd != req->fd))
+		outbuf_flush();
+
+	outfd = req->fd;
+
+	outiovs[outn].iov_base = outbuf + outlen;
+	outiovs[outn].iov_len = size;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(outbuf + outlen, iov[i].iov_base, iov[i].iov_len);
+		outlen += iov[i].iov_len;
+	}
+
+	memcpy(&(outaddrs[outn]), req->clisa, req->clilen);
+
+	msg = &(outmsgs[outn].msg_hdr);
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_name = &(outaddrs[outn]);
+	msg->msg_namelen = req->clilen;
+	msg->msg_iov = &(outiovs[outn]);
+	msg->msg_iovlen = 1;
+
+	outn++;
+}
+
+/* Sends a reply made of many pieces, without copying them together (unless
+ * we're corked, see outbuf_add()). */
+static int rep_sendv(const struct req_info *req, struct iovec *iov,
+		int iovcnt)
+{
+	int i, rv;
+	size_t size = 0;
+	struct msghdr msg;
 
 	if (settings.passive)
 		return 1;
 
-	rv = sendto(req->fd, buf, size, 0, req->clisa, req->clilen);
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+
+	if (corked && size <= OUTBUF_SIZE / 4
+			&& req->clilen <= sizeof(struct sockaddr_storage)) {
+		outbuf_add(req, iov, iovcnt, size);
+		return 1;
+	}
+
+	/* keep the order with the held replies */
+	if (outn > 0)
+		outbuf_flush();
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = req->clisa;
+	msg.msg_namelen = req->clilen;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	rv = sendmsg(req->fd, &msg, 0);
 	if (rv < 0) {
 		rep_send_error(req, ERR_SEND);
 		return 0;
@@ -61,6 +179,16 @@ static int rep_send(const struct req_info *req, const unsigned char *buf,
 	return 1;
 }
 
+static int rep_send(const struct req_info *req, const unsigned char *buf,
+		const size_t size)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *) buf;
+	iov.iov_len = size;
+	return rep_sendv(req, &iov, 1);
+}
+
 
 /* Send small replies, consisting in only a value. */
 static void udp_reply_mini(const struct req_info *req, uint32_t reply)
@@ -88,42 +216,54 @@ static void udp_reply_err(const struct req_info *req, uint32_t reply)
 	rep_send_error(req, reply);
 }
 
-static void udp_reply_long(const struct req_info *req, uint32_t reply,
+static void udp_reply_long2(const struct req_info *req, uint32_t reply,
+			const unsigned char *pre, size_t psize,
 			unsigned char *val, size_t vsize)
 {
 	if (val == NULL) {
 		/* miss */
 		udp_reply_mini(req, reply);
 	} else {
-		unsigned char *buf;
-		size_t bsize;
+		unsigned char hdr[4 + 4 + 4];
+		struct iovec iov[3];
 		uint32_t t;
 
 		reply = htonl(reply);
 
-		/* The reply length is:
+		/* The reply is:
 		 * 4		id
 		 * 4		reply code
-		 * 4		vsize
+		 * 4		psize + vsize
+		 * psize	pre
 		 * vsize	val
-		 */
-		bsize = 4 + 4 + 4 + vsize;
-		buf = malloc(bsize);
-
-		t = htonl(vsize);
-
-		memcpy(buf, &(req->id), 4);
-		memcpy(buf + 4, &reply, 4);
-		memcpy(buf + 8, &t, 4);
-		memcpy(buf + 12, val, vsize);
-
-		rep_send(req, buf, bsize);
-		free(buf);
+		 *
+		 * The value is sent from where it is (usually the cache),
+		 * to avoid copying it. */
+		t = htonl(psize + vsize);
+
+		memcpy(hdr, &(req->id), 4);
+		memcpy(hdr + 4, &reply, 4);
+		memcpy(hdr + 8, &t, 4);
+
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = (void *) pre;
+		iov[1].iov_len = psize;
+		iov[2].iov_base = val;
+		iov[2].iov_len = vsize;
+
+		rep_sendv(req, iov, 3);
 	}
 	return;
 
 }
 
+static void udp_reply_long(const struct req_info *req, uint32_t reply,
+			unsigned char *val, size_t vsize)
+{
+	udp_reply_long2(req, reply, NULL, 0, val, vsize);
+}
+
 
 /*
  * Main functions for receiving and parsing
@@ -169,47 +309,61 @@ void udp_close(int fd)
 }
 
 
-/* Static common buffer to avoid unnecessary allocations. See the comments on
- * this same variable in tipc.c. */
+/* Static common buffers to avoid unnecessary allocations. See the comments on
+ * this same variable in tipc.c. We have one per datagram we receive at once;
+ * their memory is only used as they're filled. */
 #define SBSIZE (68 * 1024)
-static unsigned char static_buf[SBSIZE];
+static unsigned char static_bufs[UDP_BATCH][SBSIZE];
 
-/* Called by libevent for each receive event */
+/* Called by libevent for each receive event. Up to UDP_BATCH datagrams are
+ * received at once, and the replies to them are sent together at the end. */
 void udp_recv(int fd, short event, void *arg)
 {
-	int rv;
+	int i, n;
 	struct req_info req;
-	struct sockaddr_in clisa;
-	socklen_t clilen;
-
-	clilen = sizeof(clisa);
-
-	rv = recvfrom(fd, static_buf, SBSIZE, 0, (struct sockaddr *) &clisa,
-			&clilen);
-	if (rv < 0) {
-		goto exit;
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	struct sockaddr_in clisas[UDP_BATCH];
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < UDP_BATCH; i++) {
+		iovs[i].iov_base = static_bufs[i];
+		iovs[i].iov_len = SBSIZE;
+		msgs[i].msg_hdr.msg_name = &(clisas[i]);
+		msgs[i].msg_hdr.msg_namelen = sizeof(clisas[i]);
+		msgs[i].msg_hdr.msg_iov = &(iovs[i]);
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	}
 
-	if (rv < 8) {
-		stats.net_broken_req++;
-		goto exit;
-	}
-
-	stats.msg_udp++;
-
-	req.fd = fd;
-	req.type = REQTYPE_UDP;
-	req.clisa = (struct sockaddr *) &clisa;
-	req.clilen = clilen;
-	req.reply_mini = udp_reply_mini;
-	req.reply_err = udp_reply_err;
-	req.reply_long = udp_reply_long;
+	n = recvmmsg(fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+	if (n <= 0)
+		return;
 
-	/* parse the message */
-	parse_message(&req, static_buf, rv);
+	udp_cork();
+
+	for (i = 0; i < n; i++) {
+		if (msgs[i].msg_len < 8) {
+			stats.net_broken_req++;
+			continue;
+		}
+
+		stats.msg_udp++;
+
+		req.fd = fd;
+		req.type = REQTYPE_UDP;
+		req.clisa = (struct sockaddr *) &(clisas[i]);
+		req.clilen = msgs[i].msg_hdr.msg_namelen;
+		req.conn = NULL;
+		req.reply_mini = udp_reply_mini;
+		req.reply_err = udp_reply_err;
+		req.reply_long = udp_reply_long;
+		req.reply_long2 = udp_reply_long2;
+	req.reply_long2 = udp_reply_long2;
+
+		/* parse the message */
+		parse_message(&req, static_bufs[i], msgs[i].msg_len);
+	}
 
-exit:
-	return;
+	udp_uncork();
 }
 
-
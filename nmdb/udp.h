@@ -5,6 +5,8 @@
 int udp_init(void);
 void udp_close(int fd);
 void udp_recv(int fd, short event, void *arg);
+void udp_cork(void);
+void udp_uncork(void);
 
 #endif
 
@@ -0,0 +1,18 @@
+
+/* Unix sockets stub file, used when Unix sockets are not compiled in. */
+
+int unix_init(void)
+{
+	return -1;
+}
+
+void unix_close(int fd)
+{
+	return;
+}
+
+void unix_newconnection(int fd, short event, void *arg)
+{
+	return;
+}
+
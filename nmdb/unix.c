@@ -0,0 +1,354 @@
+
+#include <sys/types.h>		/* socket defines */
+#include <sys/socket.h>		/* socket functions */
+#include <sys/un.h>		/* struct sockaddr_un */
+#include <sys/uio.h>		/* struct iovec */
+#include <stdlib.h>		/* malloc() */
+#include <stdint.h>		/* uint32_t and friends */
+#include <arpa/inet.h>		/* htonls() and friends */
+#include <string.h>		/* memcpy() */
+#include <unistd.h>		/* close() */
+#include <errno.h>		/* errno */
+
+/* Workaround for libevent 1.1a: the header assumes u_char is typedef'ed to an
+ * unsigned char, and that "struct timeval" is in scope. */
+typedef unsigned char u_char;
+#include <sys/time.h>
+#include <event.h>		/* libevent stuff */
+
+#include "unix.h"
+#include "common.h"
+#include "net-const.h"
+#include "req.h"
+#include "parse.h"
+#include "log.h"
+
+
+/* Maximum number of messages we process from a connection on each receive
+ * event, so a busy client doesn't starve the others */
+#define UNIX_BATCH 16
+
+/* Unix socket connection. SOCK_SEQPACKET sockets keep the message
+ * boundaries, so unlike TCP we don't need to buffer anything; but like TCP
+ * we need to know if the connection is still open when the replies to
+ * queued requests are sent, because the file descriptor could have been
+ * reused. */
+struct unix_conn {
+	int fd;
+	struct sockaddr_un clisa;
+	socklen_t clilen;
+	struct event evt;
+
+	/* set when the connection was closed, but we can't free the
+	 * structure yet because queued requests refer to it */
+	int closed;
+
+	/* one reference for the open connection, and one for each request
+	 * in the database queue */
+	int refcount;
+};
+
+static void unix_recv(int fd, short event, void *arg);
+
+
+/*
+ * Miscelaneous helper functions
+ */
+
+/* Reference counting, used by queued requests via req_info. */
+static void unix_conn_ref(void *conn)
+{
+	struct unix_conn *uconn = conn;
+
+	uconn->refcount++;
+}
+
+static void unix_conn_unref(void *conn)
+{
+	struct unix_conn *uconn = conn;
+
+	if (--uconn->refcount == 0)
+		free(uconn);
+}
+
+/* Closes the connection, and drops its reference. */
+static void unix_conn_close(struct unix_conn *uconn)
+{
+	event_del(&(uconn->evt));
+	close(uconn->fd);
+	uconn->closed = 1;
+
+	unix_conn_unref(uconn);
+}
+
+static void rep_send_error(const struct req_info *req, const unsigned int code)
+{
+	int r, c;
+	unsigned char minibuf[3 * 4];
+	struct unix_conn *uconn = req->conn;
+
+	if (settings.passive || uconn->closed)
+		return;
+
+	/* Network format: ID (4), REP_ERR (4), error code (4) */
+	r = htonl(REP_ERR);
+	c = htonl(code);
+	memcpy(minibuf, &(req->id), 4);
+	memcpy(minibuf + 4, &r, 4);
+	memcpy(minibuf + 8, &c, 4);
+
+	/* If this send fails, there's nothing to be done */
+	r = send(req->fd, minibuf, 3 * 4, MSG_NOSIGNAL);
+
+	if (r < 0) {
+		errlog("rep_send_error() failed");
+	}
+}
+
+
+/* Sends a reply made of many pieces, without copying them together. */
+static int rep_sendv(const struct req_info *req, struct iovec *iov,
+		int iovcnt)
+{
+	int rv;
+	struct msghdr msg;
+	struct unix_conn *uconn = req->conn;
+
+	if (settings.passive)
+		return 1;
+
+	if (uconn->closed)
+		return 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	rv = sendmsg(req->fd, &msg, MSG_NOSIGNAL);
+	if (rv < 0) {
+		rep_send_error(req, ERR_SEND);
+		return 0;
+	}
+	return 1;
+}
+
+static int rep_send(const struct req_info *req, const unsigned char *buf,
+		const size_t size)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *) buf;
+	iov.iov_len = size;
+	return rep_sendv(req, &iov, 1);
+}
+
+
+/* Send small replies, consisting in only a value. */
+static void unix_reply_mini(const struct req_info *req, uint32_t reply)
+{
+	/* We use a mini buffer to speedup the small replies, to avoid the
+	 * malloc() overhead. */
+	unsigned char minibuf[8];
+
+	if (settings.passive)
+		return;
+
+	reply = htonl(reply);
+	memcpy(minibuf, &(req->id), 4);
+	memcpy(minibuf + 4, &reply, 4);
+	rep_send(req, minibuf, 8);
+	return;
+}
+
+
+/* The unix_reply_* functions are used by the db code to send the network
+ * replies. */
+
+static void unix_reply_err(const struct req_info *req, uint32_t reply)
+{
+	rep_send_error(req, reply);
+}
+
+static void unix_reply_long2(const struct req_info *req, uint32_t reply,
+			const unsigned char *pre, size_t psize,
+			unsigned char *val, size_t vsize)
+{
+	if (val == NULL) {
+		/* miss */
+		unix_reply_mini(req, reply);
+	} else {
+		unsigned char hdr[4 + 4 + 4];
+		struct iovec iov[3];
+		uint32_t t;
+
+		reply = htonl(reply);
+
+		/* The reply is:
+		 * 4		id
+		 * 4		reply code
+		 * 4		psize + vsize
+		 * psize	pre
+		 * vsize	val
+		 *
+		 * The value is sent from where it is (usually the cache),
+		 * to avoid copying it. */
+		t = htonl(psize + vsize);
+
+		memcpy(hdr, &(req->id), 4);
+		memcpy(hdr + 4, &reply, 4);
+		memcpy(hdr + 8, &t, 4);
+
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = (void *) pre;
+		iov[1].iov_len = psize;
+		iov[2].iov_base = val;
+		iov[2].iov_len = vsize;
+
+		rep_sendv(req, iov, 3);
+	}
+	return;
+
+}
+
+static void unix_reply_long(const struct req_info *req, uint32_t reply,
+			unsigned char *val, size_t vsize)
+{
+	unix_reply_long2(req, reply, NULL, 0, val, vsize);
+}
+
+
+/*
+ * Main functions for receiving and parsing
+ */
+
+int unix_init(void)
+{
+	int fd, rv;
+	struct sockaddr_un srvsa;
+
+	if (strlen(settings.unix_path) >= sizeof(srvsa.sun_path))
+		return -1;
+
+	srvsa.sun_family = AF_UNIX;
+	strcpy(srvsa.sun_path, settings.unix_path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0)
+		return -1;
+
+	/* remove the socket left behind by a previous run, if any */
+	unlink(settings.unix_path);
+
+	rv = bind(fd, (struct sockaddr *) &srvsa, sizeof(srvsa));
+	if (rv < 0) {
+		close(fd);
+		return -1;
+	}
+
+	rv = listen(fd, 1024);
+	if (rv < 0) {
+		close(fd);
+		unlink(settings.unix_path);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+void unix_close(int fd)
+{
+	close(fd);
+	unlink(settings.unix_path);
+}
+
+
+/* Called by libevent for each new connection */
+void unix_newconnection(int fd, short event, void *arg)
+{
+	int newfd;
+	struct unix_conn *uconn;
+
+	uconn = malloc(sizeof(struct unix_conn));
+	if (uconn == NULL)
+		return;
+	uconn->clilen = sizeof(uconn->clisa);
+
+	newfd = accept(fd, (struct sockaddr *) &(uconn->clisa),
+			&(uconn->clilen));
+	if (newfd < 0) {
+		free(uconn);
+		return;
+	}
+
+	uconn->fd = newfd;
+	uconn->closed = 0;
+	uconn->refcount = 1;
+
+	event_set(&(uconn->evt), newfd, EV_READ | EV_PERSIST, unix_recv,
+			(void *) uconn);
+	event_add(&(uconn->evt), NULL);
+}
+
+
+/* Static common buffer to avoid unnecessary allocations. See the comments on
+ * this same variable in tipc.c. */
+#define SBSIZE (68 * 1024)
+static unsigned char static_buf[SBSIZE];
+
+/* Called by libevent for each receive event */
+static void unix_recv(int fd, short event, void *arg)
+{
+	int i;
+	ssize_t rv;
+	struct req_info req;
+	struct unix_conn *uconn;
+	struct msghdr msg;
+	struct iovec iov;
+
+	uconn = (struct unix_conn *) arg;
+
+	for (i = 0; i < UNIX_BATCH; i++) {
+		iov.iov_base = static_buf;
+		iov.iov_len = SBSIZE;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		rv = recvmsg(fd, &msg, MSG_DONTWAIT);
+		if (rv < 0 && (errno == EAGAIN || errno == EINTR)) {
+			/* no more messages for now */
+			return;
+		} else if (rv <= 0) {
+			/* Orderly shutdown or error; close the file
+			 * descriptor in either case. */
+			unix_conn_close(uconn);
+			return;
+		}
+
+		if (rv < 8 || (msg.msg_flags & MSG_TRUNC)) {
+			stats.net_broken_req++;
+			continue;
+		}
+
+		stats.msg_unix++;
+
+		req.fd = fd;
+		req.type = REQTYPE_UNIX;
+		req.clisa = (struct sockaddr *) &(uconn->clisa);
+		req.clilen = uconn->clilen;
+		req.conn = uconn;
+		req.conn_ref = unix_conn_ref;
+		req.conn_unref = unix_conn_unref;
+		req.reply_mini = unix_reply_mini;
+		req.reply_err = unix_reply_err;
+		req.reply_long = unix_reply_long;
+		req.reply_long2 = unix_reply_long2;
+	req.reply_long2 = unix_reply_long2;
+
+		/* parse the message */
+		parse_message(&req, static_buf, rv);
+	}
+}
+
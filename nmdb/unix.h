@@ -0,0 +1,10 @@
+
+#ifndef _UNIX_H
+#define _UNIX_H
+
+int unix_init(void);
+void unix_close(int fd);
+void unix_newconnection(int fd, short event, void *arg);
+
+#endif
+
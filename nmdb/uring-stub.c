@@ -0,0 +1,53 @@
+
+/* io_uring stub file, used when io_uring is not compiled in; TCP is then
+ * handled using libevent. */
+
+#include <stddef.h>		/* size_t */
+#include "uring.h"
+
+int uring_init(void)
+{
+	return 0;
+}
+
+int uring_fd(void)
+{
+	return -1;
+}
+
+void uring_free(void)
+{
+	return;
+}
+
+int uring_accept(int fd, struct uring_op *op)
+{
+	return 0;
+}
+
+int uring_recv(int fd, struct uring_op *op)
+{
+	return 0;
+}
+
+int uring_send(int fd, const unsigned char *buf, size_t len,
+		struct uring_op *op)
+{
+	return 0;
+}
+
+int uring_cancel(struct uring_op *op)
+{
+	return 0;
+}
+
+void uring_submit(void)
+{
+	return;
+}
+
+void uring_process(int fd, short event, void *arg)
+{
+	return;
+}
+
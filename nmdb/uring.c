@@ -0,0 +1,449 @@
+
+/*
+ * io_uring network engine, used by TCP.
+ *
+ * Instead of waiting for readiness and then doing a recv() or send() for
+ * each connection, the operations are put in a ring shared with the kernel,
+ * which does them and leaves the results in another ring. Accepting and
+ * receiving use multishot operations, which keep producing results without
+ * being submitted again, and data is received in buffers taken from a ring
+ * we provide, so there's no need to have a buffer set aside for each idle
+ * connection. Submissions are batched, and done with a single system call
+ * each time we go through the completions, so the system calls per request
+ * are a small fraction of the ones of the libevent path.
+ *
+ * The ring's file descriptor becomes readable when there are completions, so
+ * libevent still drives everything; see uring_process().
+ *
+ * We talk to the kernel directly, to avoid depending on liburing; it's not
+ * much code, and we only need a few operations.
+ */
+
+#define _GNU_SOURCE		/* syscall(), MAP_ANONYMOUS */
+
+#include <sys/types.h>
+#include <sys/syscall.h>	/* __NR_io_uring_* */
+#include <sys/mman.h>		/* mmap() */
+#include <sys/socket.h>		/* MSG_NOSIGNAL */
+#include <linux/io_uring.h>	/* io_uring definitions */
+#include <stdlib.h>		/* malloc() */
+#include <stdint.h>		/* uintptr_t */
+#include <string.h>		/* memset() */
+#include <unistd.h>		/* syscall(), close() */
+#include <errno.h>		/* errno */
+
+#include "uring.h"
+#include "log.h"
+
+
+/* Headers from 6.0 to 6.2 have what we use, but not this; see uring_init() */
+#ifndef IORING_FEAT_REG_REG_RING
+#define IORING_FEAT_REG_REG_RING (1U << 13)
+#endif
+
+/* Entries in the submission and completion rings. With many connections
+ * the completions can outnumber the submissions by far, and the ones that
+ * don't fit are held by the kernel until we ask for them; see
+ * uring_process() */
+#define SQ_ENTRIES 1024
+#define CQ_ENTRIES 8192
+
+/* Number and size of the buffers we provide for receiving; the number must
+ * be a power of 2 */
+#define NBUFS 256
+#define BUFSIZE (8 * 1024)
+
+/* Buffer group ID of our buffers */
+#define BGID 0
+
+/* Submission ring */
+static unsigned int *sq_head, *sq_tail, *sq_mask, *sq_flags;
+static unsigned int sq_entries;
+static struct io_uring_sqe *sqes;
+
+/* Tail of the submission ring, including the entries we filled but didn't
+ * hand to the kernel yet */
+static unsigned int sq_local_tail;
+
+/* Completion ring */
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+/* Provided buffers */
+static struct io_uring_buf_ring *br = NULL;
+static unsigned short br_tail;
+static unsigned char *bufs = NULL;
+
+/* Set while uring_process() runs the callbacks */
+static int processing = 0;
+
+static int ring_fd = -1;
+static void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+static size_t sq_ptr_size, cq_ptr_size, sqes_size;
+
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int to_submit, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned int opcode, void *arg,
+		unsigned int nr)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+
+/* Gives a provided buffer back to the kernel. */
+static void buf_put(unsigned int bid)
+{
+	struct io_uring_buf *b;
+
+	b = &(br->bufs[br_tail & (NBUFS - 1)]);
+	b->addr = (uintptr_t) (bufs + bid * BUFSIZE);
+	b->len = BUFSIZE;
+	b->bid = bid;
+	br_tail++;
+	__atomic_store_n(&(br->tail), br_tail, __ATOMIC_RELEASE);
+}
+
+static int setup_bufs(void)
+{
+	unsigned int i;
+	struct io_uring_buf_reg reg;
+
+	br = mmap(NULL, NBUFS * sizeof(struct io_uring_buf),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			-1, 0);
+	if (br == MAP_FAILED) {
+		br = NULL;
+		return 0;
+	}
+
+	bufs = malloc(NBUFS * BUFSIZE);
+	if (bufs == NULL)
+		return 0;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) br;
+	reg.ring_entries = NBUFS;
+	reg.bgid = BGID;
+	if (sys_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return 0;
+
+	br_tail = 0;
+	for (i = 0; i < NBUFS; i++)
+		buf_put(i);
+
+	return 1;
+}
+
+/* Sets the ring up. Returns 1 on success, or 0 if io_uring can't be used
+ * (for instance, because the kernel is too old or it's forbidden by a
+ * seccomp policy), in which case the libevent path must be used. */
+int uring_init(void)
+{
+	unsigned int i, *sq_array;
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = CQ_ENTRIES;
+	ring_fd = sys_setup(SQ_ENTRIES, &p);
+	if (ring_fd < 0)
+		return 0;
+
+	/* Multishot receive came with 6.0, and there is no feature flag
+	 * for it, so we use the next one that appeared */
+	if (!(p.features & IORING_FEAT_REG_REG_RING))
+		goto error_exit;
+
+	sq_ptr_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_ptr_size = p.cq_off.cqes
+		+ p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_ptr_size > sq_ptr_size)
+			sq_ptr_size = cq_ptr_size;
+		cq_ptr_size = sq_ptr_size;
+	}
+
+	sq_ptr = mmap(NULL, sq_ptr_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+		goto error_exit;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ptr = sq_ptr;
+	} else {
+		cq_ptr = mmap(NULL, cq_ptr_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring_fd,
+				IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED)
+			goto error_exit;
+	}
+
+	sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto error_exit;
+
+	sq_head = (unsigned int *) ((char *) sq_ptr + p.sq_off.head);
+	sq_tail = (unsigned int *) ((char *) sq_ptr + p.sq_off.tail);
+	sq_mask = (unsigned int *) ((char *) sq_ptr + p.sq_off.ring_mask);
+	sq_flags = (unsigned int *) ((char *) sq_ptr + p.sq_off.flags);
+	sq_array = (unsigned int *) ((char *) sq_ptr + p.sq_off.array);
+	sq_entries = p.sq_entries;
+	sq_local_tail = *sq_tail;
+
+	/* we always use the entries in order, so the indirection array is
+	 * set once and for all */
+	for (i = 0; i < sq_entries; i++)
+		sq_array[i] = i;
+
+	cq_head = (unsigned int *) ((char *) cq_ptr + p.cq_off.head);
+	cq_tail = (unsigned int *) ((char *) cq_ptr + p.cq_off.tail);
+	cq_mask = (unsigned int *) ((char *) cq_ptr + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *) ((char *) cq_ptr + p.cq_off.cqes);
+
+	if (!setup_bufs())
+		goto error_exit;
+
+	return 1;
+
+error_exit:
+	uring_free();
+	return 0;
+}
+
+int uring_fd(void)
+{
+	return ring_fd;
+}
+
+void uring_free(void)
+{
+	if (ring_fd < 0)
+		return;
+
+	/* closing the ring cancels everything that's in flight */
+	close(ring_fd);
+	ring_fd = -1;
+
+	if (sqes != NULL && sqes != MAP_FAILED)
+		munmap(sqes, sqes_size);
+	sqes = NULL;
+	if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+		munmap(cq_ptr, cq_ptr_size);
+	cq_ptr = MAP_FAILED;
+	if (sq_ptr != MAP_FAILED)
+		munmap(sq_ptr, sq_ptr_size);
+	sq_ptr = MAP_FAILED;
+
+	if (br != NULL)
+		munmap(br, NBUFS * sizeof(struct io_uring_buf));
+	br = NULL;
+	free(bufs);
+	bufs = NULL;
+}
+
+/* Hands the entries we filled to the kernel, all in a single system call. */
+static void submit(void)
+{
+	int rv;
+	unsigned int pending;
+
+	/* replies can still come after uring_free(), see main() */
+	if (ring_fd < 0)
+		return;
+
+	__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+	for (;;) {
+		pending = sq_local_tail
+			- __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		if (pending == 0)
+			return;
+
+		/* The kernel can refuse to take them while the completion
+		 * ring is full (EBUSY); they stay in the ring then, and will
+		 * be submitted after the next round of completions */
+		rv = sys_enter(ring_fd, pending, 0);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		return;
+	}
+}
+
+/* Submits the queued operations, unless we're going through the completions,
+ * in which case it's done once at the end; see uring_process(). */
+void uring_submit(void)
+{
+	if (!processing)
+		submit();
+}
+
+/* Returns a free submission entry, already cleared, or NULL if there are
+ * none even after submitting the pending ones, or the ring is gone. */
+static struct io_uring_sqe *get_sqe(struct uring_op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ring_fd < 0)
+		return NULL;
+
+	if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)
+			>= sq_entries) {
+		submit();
+		if (sq_local_tail - __atomic_load_n(sq_head,
+					__ATOMIC_ACQUIRE) >= sq_entries) {
+			errlog("io_uring submission ring is full");
+			return NULL;
+		}
+	}
+
+	sqe = &(sqes[sq_local_tail & *sq_mask]);
+	sq_local_tail++;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t) op;
+	return sqe;
+}
+
+/* The functions below queue an operation, which will be submitted by the
+ * next uring_submit(), and whose completions will be given to the op's
+ * callback. They return 1 on success, 0 on error. */
+
+/* Accepts connections on the given listening socket, until an error. The
+ * result is the new connection's fd. */
+int uring_accept(int fd, struct uring_op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(op);
+	if (sqe == NULL)
+		return 0;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	return 1;
+}
+
+/* Receives from the given socket into provided buffers, until the
+ * connection is closed, an error happens, or we run out of buffers
+ * (-ENOBUFS); then it has to be submitted again. */
+int uring_recv(int fd, struct uring_op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(op);
+	if (sqe == NULL)
+		return 0;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BGID;
+	return 1;
+}
+
+/* Sends the given buffer, which must be kept untouched until the
+ * completion. The result is how much was sent, which can be less than
+ * asked. */
+int uring_send(int fd, const unsigned char *buf, size_t len,
+		struct uring_op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(op);
+	if (sqe == NULL)
+		return 0;
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) buf;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	return 1;
+}
+
+/* Cancels the operation; its callback will get -ECANCELED. The cancellation
+ * itself has no callback. */
+int uring_cancel(struct uring_op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(NULL);
+	if (sqe == NULL)
+		return 0;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t) op;
+	return 1;
+}
+
+
+/* Called by libevent when the ring has completions. Goes through all of
+ * them, and then submits what their callbacks queued. */
+void uring_process(int fd, short event, void *arg)
+{
+	int res, more;
+	unsigned int head, tail, flags, bid, n = 0;
+	unsigned char *buf;
+	struct uring_op *op;
+	struct io_uring_cqe *cqe;
+
+	processing = 1;
+	head = *cq_head;
+	tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+	/* the limit is so the callbacks can't keep us here forever */
+	while (head != tail && n < 2 * SQ_ENTRIES) {
+		cqe = &(cqes[head & *cq_mask]);
+		op = (struct uring_op *) (uintptr_t) cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+
+		/* we copied what we need, so we can give the entry back
+		 * before running the callback */
+		head++;
+		n++;
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		buf = NULL;
+		bid = 0;
+		if (flags & IORING_CQE_F_BUFFER) {
+			bid = flags >> IORING_CQE_BUFFER_SHIFT;
+			if (bid < NBUFS)
+				buf = bufs + bid * BUFSIZE;
+		}
+
+		more = (flags & IORING_CQE_F_MORE) != 0;
+		if (op != NULL)
+			op->cb(op, res, more, buf);
+
+		if (buf != NULL)
+			buf_put(bid);
+
+		if (head == tail)
+			tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	}
+	processing = 0;
+
+	submit();
+
+	/* If the completion ring overflowed, the kernel keeps the rest until
+	 * we ask for them; meanwhile, the ring's fd is readable, but there's
+	 * nothing in it */
+	if (head == tail && (__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE)
+				& IORING_SQ_CQ_OVERFLOW))
+		sys_enter(ring_fd, 0, IORING_ENTER_GETEVENTS);
+}
+
@@ -0,0 +1,27 @@
+
+#ifndef _URING_H
+#define _URING_H
+
+/* An operation submitted to the ring. The callback gets the result of each
+ * completion; "more" is set when a multishot operation will keep producing
+ * them, and "buf" points to the data when a provided buffer was used, which
+ * goes back to the ring once the callback returns. */
+struct uring_op {
+	void (*cb)(struct uring_op *op, int res, int more,
+			unsigned char *buf);
+	void *arg;
+};
+
+int uring_init(void);
+int uring_fd(void);
+void uring_free(void);
+int uring_accept(int fd, struct uring_op *op);
+int uring_recv(int fd, struct uring_op *op);
+int uring_send(int fd, const unsigned char *buf, size_t len,
+		struct uring_op *op);
+int uring_cancel(struct uring_op *op);
+void uring_submit(void);
+void uring_process(int fd, short event, void *arg);
+
+#endif
+
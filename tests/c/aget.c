@@ -0,0 +1,106 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <stdlib.h>
+
+#include <nmdb.h>
+#include "timer.h"
+#include "prototypes.h"
+
+
+int main(int argc, char **argv)
+{
+	int i, j, times, inflight;
+	unsigned char *key, **vals;
+	size_t ksize, vsize;
+	ssize_t r;
+	unsigned long g_elapsed, misses = 0;
+	nmdb_req_t **reqs;
+	nmdb_t *db;
+
+	if (argc != 4) {
+		printf("Usage: aget-* TIMES KSIZE INFLIGHT\n");
+		return 1;
+	}
+
+	times = atoi(argv[1]);
+	ksize = atoi(argv[2]);
+	inflight = atoi(argv[3]);
+	if (times < 1) {
+		printf("Error: TIMES must be >= 1\n");
+		return 1;
+	}
+	if (ksize < sizeof(int)) {
+		printf("Error: KSIZE must be >= sizeof(int)\n");
+		return 1;
+	}
+	if (inflight < 1) {
+		printf("Error: INFLIGHT must be >= 1\n");
+		return 1;
+	}
+
+	key = malloc(ksize);
+	vals = malloc(sizeof(unsigned char *) * inflight);
+	reqs = malloc(sizeof(nmdb_req_t *) * inflight);
+	if (key == NULL || vals == NULL || reqs == NULL) {
+		perror("Error: malloc()");
+		return 1;
+	}
+	memset(key, 0, ksize);
+
+	vsize = 1024;
+	for (j = 0; j < inflight; j++) {
+		vals[j] = malloc(vsize);
+		if (vals[j] == NULL) {
+			perror("Error: malloc()");
+			return 1;
+		}
+	}
+
+	db = nmdb_init();
+	if (db == NULL) {
+		perror("nmdb_init() failed");
+		return 1;
+	}
+
+	NADDSRV(db);
+
+	/* keep up to INFLIGHT gets on the wire, and wait for them all
+	 * before sending the next ones */
+	timer_start();
+	for (i = 0; i < times; i += inflight) {
+		for (j = 0; j < inflight; j++) {
+			* (int *) key = i + j;
+			reqs[j] = NSUBMIT_GET(db, key, ksize, vals[j], vsize);
+			if (reqs[j] == NULL) {
+				perror("Submit");
+				return 1;
+			}
+		}
+
+		for (j = 0; j < inflight; j++) {
+			r = nmdb_wait(db, reqs[j]);
+			nmdb_req_free(db, reqs[j]);
+			if (r <= -2) {
+				perror("Get");
+				return 1;
+			} else if (r == -1) {
+				misses++;
+			}
+		}
+	}
+	g_elapsed = timer_stop();
+
+	printf("%lu m:%lu\n", g_elapsed, misses);
+
+	for (j = 0; j < inflight; j++)
+		free(vals[j]);
+	free(vals);
+	free(reqs);
+	free(key);
+	nmdb_free(db);
+
+	return 0;
+}
@@ -0,0 +1,82 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <stdlib.h>
+
+#include <nmdb.h>
+#include "timer.h"
+#include "prototypes.h"
+
+
+int main(int argc, char **argv)
+{
+	int i, r, times;
+	unsigned long s_elapsed;
+	char *key = "k";
+	unsigned char *data, *val;
+	size_t ksize, dsize, vsize;
+	ssize_t rv;
+	nmdb_t *db;
+
+	if (argc != 3) {
+		printf("Usage: append-* TIMES DSIZE\n");
+		return 1;
+	}
+
+	times = atoi(argv[1]);
+	dsize = atoi(argv[2]);
+	if (times < 1 || dsize < 1) {
+		printf("Error: TIMES and DSIZE must be >= 1\n");
+		return 1;
+	}
+
+	vsize = (times + 1) * dsize;
+	data = malloc(dsize);
+	val = malloc(vsize);
+	if (data == NULL || val == NULL) {
+		perror("Error in malloc()");
+		return 1;
+	}
+	memset(data, 'd', dsize);
+
+	db = nmdb_init();
+	if (db == NULL) {
+		perror("nmdb_init() failed");
+		return 1;
+	}
+
+	NADDSRV(db);
+
+	ksize = strlen(key) + 1;
+
+	/* initial set */
+	NSET(db, (unsigned char *) key, ksize, data, dsize);
+
+	timer_start();
+	for (i = 0; i < times; i++) {
+		r = NAPPEND(db, (unsigned char *) key, ksize, data, dsize);
+		if (r != 2) {
+			printf("result: %d\n", r);
+			perror("Append");
+			return 1;
+		}
+	}
+	s_elapsed = timer_stop();
+
+	rv = NGET(db, (unsigned char *) key, ksize, val, vsize);
+	if (rv != vsize) {
+		printf("Get: got %zd bytes, expected %zu\n", rv, vsize);
+		return 1;
+	}
+
+	printf("%lu\n", s_elapsed);
+
+	free(data);
+	free(val);
+	nmdb_free(db);
+
+	return 0;
+}
+
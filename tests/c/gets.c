@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <nmdb.h>
+#include "timer.h"
+#include "prototypes.h"
+
+
+int main(int argc, char **argv)
+{
+	int i, r, times;
+	unsigned long s_elapsed;
+	char *key = "k";
+	unsigned char *val, *newval, *buf;
+	size_t ksize, vsize;
+	ssize_t rv;
+	uint64_t version;
+	nmdb_t *db;
+
+	if (argc != 3) {
+		printf("Usage: gets-* TIMES VSIZE\n");
+		return 1;
+	}
+
+	times = atoi(argv[1]);
+	vsize = atoi(argv[2]);
+	if (times < 1 || vsize < sizeof(int)) {
+		printf("Error: TIMES must be >= 1, and VSIZE >= sizeof(int)\n");
+		return 1;
+	}
+
+	val = malloc(vsize);
+	newval = malloc(vsize);
+	buf = malloc(vsize);
+	if (val == NULL || newval == NULL || buf == NULL) {
+		perror("Error in malloc()");
+		return 1;
+	}
+	memset(val, 0, vsize);
+	memset(newval, 0, vsize);
+
+	db = nmdb_init();
+	if (db == NULL) {
+		perror("nmdb_init() failed");
+		return 1;
+	}
+
+	NADDSRV(db);
+
+	ksize = strlen(key) + 1;
+
+	/* initial set */
+	NSET(db, (unsigned char *) key, ksize, val, vsize);
+
+	timer_start();
+	for (i = 0; i < times; i++) {
+		* (int *) val = i;
+		* (int *) newval = -i;
+
+		rv = NGETS(db, (unsigned char *) key, ksize, buf, vsize,
+				&version);
+		if (rv != vsize) {
+			printf("Gets: got %zd bytes, expected %zu\n", rv,
+					vsize);
+			return 1;
+		}
+
+		/* nothing changed since the gets, so the swap must work */
+		r = NCASV(db, (unsigned char *) key, ksize, version,
+				newval, vsize);
+		if (r != 2) {
+			printf("CAS version: %d, expected 2\n", r);
+			return 1;
+		}
+
+		/* after a set, even of an old value, the version is stale */
+		NSET(db, (unsigned char *) key, ksize, val, vsize);
+		r = NCASV(db, (unsigned char *) key, ksize, version,
+				newval, vsize);
+		if (r != 1) {
+			printf("Stale CAS version: %d, expected 1\n", r);
+			return 1;
+		}
+	}
+	s_elapsed = timer_stop();
+
+	printf("%lu\n", s_elapsed);
+
+	free(val);
+	free(newval);
+	free(buf);
+	nmdb_free(db);
+
+	return 0;
+}
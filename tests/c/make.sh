@@ -32,13 +32,14 @@ case "$1" in
 esac;
 
 
-for p in TIPC TCP UDP SCTP MULT; do
+for p in TIPC TCP UDP SCTP UNIX SHM MULT; do
 	for v in NORMAL CACHE SYNC; do
 		OP=`echo $p-$v | tr '[A-Z]' '[a-z]'`
 		TF="-DUSE_$p=1 -DUSE_$v=1"
 
 		echo " * $OP:"
-		for t in 1 2 3 "set" "get" "del" "incr"; do
+		for t in 1 2 3 "set" "get" "del" "incr" "mget" \
+				"mset" "aget" "scan" "append" "gets"; do
 			echo "   * $t"
 			if [ "$CLEAN" == 1 ]; then
 				rm -f $t-$OP
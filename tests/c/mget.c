@@ -0,0 +1,105 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <stdlib.h>
+
+#include <nmdb.h>
+#include "timer.h"
+#include "prototypes.h"
+
+
+int main(int argc, char **argv)
+{
+	int i, j, r, times, batch;
+	unsigned char **keys, **vals;
+	size_t ksize, vsize, *ksizes, *vsizes;
+	ssize_t *results;
+	unsigned long g_elapsed, misses = 0;
+	nmdb_t *db;
+
+	if (argc != 4) {
+		printf("Usage: mget-* TIMES KSIZE BATCH\n");
+		return 1;
+	}
+
+	times = atoi(argv[1]);
+	ksize = atoi(argv[2]);
+	batch = atoi(argv[3]);
+	if (times < 1) {
+		printf("Error: TIMES must be >= 1\n");
+		return 1;
+	}
+	if (ksize < sizeof(int)) {
+		printf("Error: KSIZE must be >= sizeof(int)\n");
+		return 1;
+	}
+	if (batch < 1) {
+		printf("Error: BATCH must be >= 1\n");
+		return 1;
+	}
+
+	keys = malloc(sizeof(unsigned char *) * batch);
+	vals = malloc(sizeof(unsigned char *) * batch);
+	ksizes = malloc(sizeof(size_t) * batch);
+	vsizes = malloc(sizeof(size_t) * batch);
+	results = malloc(sizeof(ssize_t) * batch);
+	if (keys == NULL || vals == NULL || ksizes == NULL || vsizes == NULL
+			|| results == NULL) {
+		perror("Error: malloc()");
+		return 1;
+	}
+
+	vsize = 1024;
+	for (j = 0; j < batch; j++) {
+		keys[j] = malloc(ksize);
+		vals[j] = malloc(vsize);
+		if (keys[j] == NULL || vals[j] == NULL) {
+			perror("Error: malloc()");
+			return 1;
+		}
+		memset(keys[j], 0, ksize);
+		ksizes[j] = ksize;
+		vsizes[j] = vsize;
+	}
+
+	db = nmdb_init();
+	if (db == NULL) {
+		perror("nmdb_init() failed");
+		return 1;
+	}
+
+	NADDSRV(db);
+
+	timer_start();
+	for (i = 0; i < times; i += batch) {
+		for (j = 0; j < batch; j++)
+			* (int *) keys[j] = i + j;
+
+		r = NMGET(db, batch, (const unsigned char **) keys, ksizes,
+				vals, vsizes, results);
+		if (r < 0) {
+			perror("MGet");
+			return 1;
+		}
+		misses += batch - r;
+	}
+	g_elapsed = timer_stop();
+
+	printf("%lu m:%lu\n", g_elapsed, misses);
+
+	for (j = 0; j < batch; j++) {
+		free(keys[j]);
+		free(vals[j]);
+	}
+	free(keys);
+	free(vals);
+	free(ksizes);
+	free(vsizes);
+	free(results);
+	nmdb_free(db);
+
+	return 0;
+}
+
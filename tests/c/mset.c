@@ -0,0 +1,104 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <stdlib.h>
+
+#include <nmdb.h>
+#include "timer.h"
+#include "prototypes.h"
+
+
+int main(int argc, char **argv)
+{
+	int i, j, r, times, batch;
+	unsigned char **keys, **vals;
+	size_t ksize, vsize, *ksizes, *vsizes;
+	unsigned long s_elapsed;
+	nmdb_t *db;
+
+	if (argc != 5) {
+		printf("Usage: mset-* TIMES KSIZE VSIZE BATCH\n");
+		return 1;
+	}
+
+	times = atoi(argv[1]);
+	ksize = atoi(argv[2]);
+	vsize = atoi(argv[3]);
+	batch = atoi(argv[4]);
+	if (times < 1) {
+		printf("Error: TIMES must be >= 1\n");
+		return 1;
+	}
+	if (ksize < sizeof(int) || vsize < sizeof(int)) {
+		printf("Error: KSIZE and VSIZE must be >= sizeof(int)\n");
+		return 1;
+	}
+	if (batch < 1) {
+		printf("Error: BATCH must be >= 1\n");
+		return 1;
+	}
+
+	keys = malloc(sizeof(unsigned char *) * batch);
+	vals = malloc(sizeof(unsigned char *) * batch);
+	ksizes = malloc(sizeof(size_t) * batch);
+	vsizes = malloc(sizeof(size_t) * batch);
+	if (keys == NULL || vals == NULL || ksizes == NULL
+			|| vsizes == NULL) {
+		perror("Error: malloc()");
+		return 1;
+	}
+
+	for (j = 0; j < batch; j++) {
+		keys[j] = malloc(ksize);
+		vals[j] = malloc(vsize);
+		if (keys[j] == NULL || vals[j] == NULL) {
+			perror("Error: malloc()");
+			return 1;
+		}
+		memset(keys[j], 0, ksize);
+		memset(vals[j], 0, vsize);
+		ksizes[j] = ksize;
+		vsizes[j] = vsize;
+	}
+
+	db = nmdb_init();
+	if (db == NULL) {
+		perror("nmdb_init() failed");
+		return 1;
+	}
+
+	NADDSRV(db);
+
+	timer_start();
+	for (i = 0; i < times; i += batch) {
+		for (j = 0; j < batch; j++) {
+			* (int *) keys[j] = i + j;
+			* (int *) vals[j] = i + j;
+		}
+
+		r = NMSET(db, batch, (const unsigned char **) keys, ksizes,
+				(const unsigned char **) vals, vsizes);
+		if (r < 0) {
+			perror("MSet");
+			return 1;
+		}
+	}
+	s_elapsed = timer_stop();
+
+	printf("%lu\n", s_elapsed);
+
+	for (j = 0; j < batch; j++) {
+		free(keys[j]);
+		free(vals[j]);
+	}
+	free(keys);
+	free(vals);
+	free(ksizes);
+	free(vsizes);
+	nmdb_free(db);
+
+	return 0;
+}
+
@@ -5,22 +5,40 @@
 
 #if USE_NORMAL
   #define NGET(...) nmdb_get(__VA_ARGS__)
+  #define NGETS(...) nmdb_gets(__VA_ARGS__)
   #define NSET(...) nmdb_set(__VA_ARGS__)
   #define NDEL(...) nmdb_del(__VA_ARGS__)
   #define NCAS(...) nmdb_cas(__VA_ARGS__)
+  #define NCASV(...) nmdb_cas_version(__VA_ARGS__)
   #define NINCR(...) nmdb_incr(__VA_ARGS__)
+  #define NAPPEND(...) nmdb_append_async(__VA_ARGS__)
+  #define NMGET(...) nmdb_mget(__VA_ARGS__)
+  #define NMSET(...) nmdb_mset(__VA_ARGS__)
+  #define NSUBMIT_GET(...) nmdb_submit_get(__VA_ARGS__)
 #elif USE_CACHE
   #define NGET(...) nmdb_cache_get(__VA_ARGS__)
+  #define NGETS(...) nmdb_cache_gets(__VA_ARGS__)
   #define NSET(...) nmdb_cache_set(__VA_ARGS__)
   #define NDEL(...) nmdb_cache_del(__VA_ARGS__)
   #define NCAS(...) nmdb_cache_cas(__VA_ARGS__)
+  #define NCASV(...) nmdb_cache_cas_version(__VA_ARGS__)
   #define NINCR(...) nmdb_cache_incr(__VA_ARGS__)
+  #define NAPPEND(...) nmdb_cache_append(__VA_ARGS__)
+  #define NMGET(...) nmdb_cache_mget(__VA_ARGS__)
+  #define NMSET(...) nmdb_cache_mset(__VA_ARGS__)
+  #define NSUBMIT_GET(...) nmdb_submit_cache_get(__VA_ARGS__)
 #elif USE_SYNC
   #define NGET(...) nmdb_get(__VA_ARGS__)
+  #define NGETS(...) nmdb_gets(__VA_ARGS__)
   #define NSET(...) nmdb_set_sync(__VA_ARGS__)
   #define NDEL(...) nmdb_del_sync(__VA_ARGS__)
   #define NCAS(...) nmdb_cas(__VA_ARGS__)
+  #define NCASV(...) nmdb_cas_version(__VA_ARGS__)
   #define NINCR(...) nmdb_incr(__VA_ARGS__)
+  #define NAPPEND(...) nmdb_append(__VA_ARGS__)
+  #define NMGET(...) nmdb_mget(__VA_ARGS__)
+  #define NMSET(...) nmdb_mset_sync(__VA_ARGS__)
+  #define NSUBMIT_GET(...) nmdb_submit_get(__VA_ARGS__)
 #endif
 
 
@@ -30,6 +48,10 @@
   #define NADDSRV(db) nmdb_add_udp_server(db, "localhost", -1)
 #elif USE_SCTP
   #define NADDSRV(db) nmdb_add_sctp_server(db, "localhost", -1)
+#elif USE_UNIX
+  #define NADDSRV(db) nmdb_add_unix_server(db, NULL)
+#elif USE_SHM
+  #define NADDSRV(db) nmdb_add_shm_server(db, NULL)
 #elif USE_TIPC
   #define NADDSRV(db) nmdb_add_tipc_server(db, -1)
 #elif USE_MULT
@@ -0,0 +1,90 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <stdlib.h>
+
+#include <nmdb.h>
+#include "timer.h"
+#include "prototypes.h"
+
+
+/* State of the walk, updated for each key we get */
+struct walk {
+	unsigned long nkeys;
+	unsigned char last[64 * 1024];
+	size_t lsize;
+};
+
+static void scan_cb(const unsigned char *key, size_t ksize,
+		const unsigned char *val, size_t vsize, void *arg)
+{
+	struct walk *w = arg;
+
+	w->nkeys++;
+	memcpy(w->last, key, ksize);
+	w->lsize = ksize;
+}
+
+int main(int argc, char **argv)
+{
+	int times, batch;
+	ssize_t r;
+	unsigned long g_elapsed;
+	struct walk *w;
+	nmdb_t *db;
+
+	if (argc != 3) {
+		printf("Usage: scan-* TIMES BATCH\n");
+		return 1;
+	}
+
+	times = atoi(argv[1]);
+	batch = atoi(argv[2]);
+	if (times < 1) {
+		printf("Error: TIMES must be >= 1\n");
+		return 1;
+	}
+	if (batch < 1) {
+		printf("Error: BATCH must be >= 1\n");
+		return 1;
+	}
+
+	w = malloc(sizeof(struct walk));
+	if (w == NULL) {
+		perror("Error: malloc()");
+		return 1;
+	}
+	w->nkeys = 0;
+	w->lsize = 0;
+
+	db = nmdb_init();
+	if (db == NULL) {
+		perror("nmdb_init() failed");
+		return 1;
+	}
+
+	NADDSRV(db);
+
+	/* walk the database, with the values, until we get TIMES keys or
+	 * there are no more */
+	timer_start();
+	while (w->nkeys < times) {
+		r = nmdb_scan(db, w->last, w->lsize, batch, 0, scan_cb, w);
+		if (r < 0) {
+			perror("Scan");
+			return 1;
+		} else if (r == 0) {
+			break;
+		}
+	}
+	g_elapsed = timer_stop();
+
+	printf("%lu k:%lu\n", g_elapsed, w->nkeys);
+
+	free(w);
+	nmdb_free(db);
+
+	return 0;
+}
@@ -53,7 +53,7 @@ function run_test() {
 	lcount=$2
 	ltimes=$3
 
-	for t2 in mult tipc tcp udp sctp; do
+	for t2 in mult tipc tcp udp sctp unix shm; do
 		for t3 in cache; do
 			t="$t1-$t2-$t3"
 			techo "   " $t $@
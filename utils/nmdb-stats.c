@@ -41,10 +41,108 @@ static uint64_t ntohll(uint64_t x)
 }
 
 #define MAX_STATS_SIZE 64
+#define MAX_HOTKEYS_SIZE (64 * 1024)
+
+/* Names of the extended stats fields, in the order the server sends them
+ * (skipping the version, which comes first). Newer servers append fields at
+ * the end, see nmdb/stats.h. */
+static const char *xstats_names[] = {
+	/* version 1 */
+	"cache capacity",
+	"cache buckets",
+	"cache entries",
+	"cache key bytes",
+	"cache value bytes",
+	"cache evictions",
+	"values replaced in place",
+	"values reallocated",
+	"chains with 0 entries",
+	"chains with 1 entry",
+	"chains with 2 entries",
+	"chains with 3 entries",
+	"chains with 4 entries",
+
+	/* version 2 */
+	"mrc sampling rate",
+	"mrc sampled accesses",
+	"est. hit ppm at 0.5x cache",
+	"est. hit ppm at 1x cache",
+	"est. hit ppm at 2x cache",
+	"est. hit ppm at 4x cache",
+	"est. hit ppm at 8x cache",
+
+	/* version 3 */
+	"async increments merged",
+
+	/* version 4 */
+	"msg unix",
+
+	/* version 5 */
+	"msg shm",
+
+	/* version 6 */
+	"tcp connections",
+	"tcp connection bytes",
+	"tcp idle closes",
+
+	/* version 7 */
+	"db scan",
+
+	/* version 8 */
+	"scan cursors open",
+	"scan cursors expired",
+
+	/* version 9 */
+	"db range",
+
+	/* version 10 */
+	"cache append",
+	"db append",
+};
+#define XSTATS_NAMES_SIZE (sizeof(xstats_names) / sizeof(xstats_names[0]))
+
+/* Shows one of the hot key lists returned by nmdb_hot_keys(), returns the
+ * position right after it, or NULL if the data was inconsistent. */
+static unsigned char *show_hot_keys(const char *title,
+		unsigned char *p, unsigned char *end)
+{
+	uint32_t n, ksize, i, j;
+	uint64_t count;
+
+	if (p + 4 > end)
+		return NULL;
+	n = ntohl(* (uint32_t *) p);
+	p += 4;
+
+	printf("hot keys (%s):\n", title);
+	for (i = 0; i < n; i++) {
+		if (p + 12 > end)
+			return NULL;
+		memcpy(&count, p, 8);
+		ksize = ntohl(* (uint32_t *) (p + 8));
+		p += 12;
+		if (p + ksize > end)
+			return NULL;
+
+		printf("\t%ju\t", ntohll(count));
+		for (j = 0; j < ksize; j++) {
+			if (p[j] >= 0x20 && p[j] < 0x7f && p[j] != '\\')
+				putchar(p[j]);
+			else
+				printf("\\x%02x", p[j]);
+		}
+		printf("\n");
+		p += ksize;
+	}
+	printf("\n");
+
+	return p;
+}
 
 static void help(void)
 {
-	printf("Use: nmdb-stats [ tipc port | [tcp|udp|sctp] host port ]\n");
+	printf("Use: nmdb-stats [ tipc port | [unix|shm] path | "
+			"[tcp|udp|sctp] host port ]\n");
 }
 
 int main(int argc, char **argv)
@@ -53,6 +151,8 @@ int main(int argc, char **argv)
 	int rv;
 	uint64_t stats[MAX_STATS_SIZE];
 	unsigned int nservers = 0, nstats = 0;
+	unsigned char *hotkeys, *p;
+	ssize_t hklen;
 	nmdb_t *db;
 
 	db = nmdb_init();
@@ -64,6 +164,10 @@ int main(int argc, char **argv)
 
 	if (strcmp("tipc", argv[1]) == 0) {
 		rv = nmdb_add_tipc_server(db, atoi(argv[2]));
+	} else if (strcmp("unix", argv[1]) == 0) {
+		rv = nmdb_add_unix_server(db, argv[2]);
+	} else if (strcmp("shm", argv[1]) == 0) {
+		rv = nmdb_add_shm_server(db, argv[2]);
 	} else {
 		if (argc != 4) {
 			help();
@@ -146,6 +250,38 @@ int main(int argc, char **argv)
 		printf("\n");
 	}
 
+	/* Extended stats are reported only by newer servers, so don't
+	 * complain if we can't get them */
+	rv = nmdb_xstats(db, (unsigned char *) stats, sizeof(stats),
+			&nservers, &nstats);
+	for (i = 0; rv > 0 && i < nservers; i++) {
+		printf("extended stats for server %d (version %ju):\n", i,
+				ntohll(stats[nstats * i]));
+
+		j = nstats * i + 1;
+		for (k = 0; k < nstats - 1; k++) {
+			if (k < XSTATS_NAMES_SIZE)
+				shst(xstats_names[k], k);
+			else
+				shst("unknown field", k);
+		}
+
+		printf("\n");
+	}
+
+	/* Hot keys are reported only by newer servers, so don't complain if
+	 * we can't get them */
+	hotkeys = malloc(MAX_HOTKEYS_SIZE);
+	if (hotkeys != NULL) {
+		hklen = nmdb_hot_keys(db, hotkeys, MAX_HOTKEYS_SIZE);
+		if (hklen > 0) {
+			p = show_hot_keys("reads", hotkeys, hotkeys + hklen);
+			if (p != NULL)
+				show_hot_keys("writes", p, hotkeys + hklen);
+		}
+		free(hotkeys);
+	}
+
 	nmdb_free(db);
 
 	return 0;